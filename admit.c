@@ -0,0 +1,165 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Admission control. acceptconn() asks admit() about every new client
+ * before it gets a Conn, a thread or a fiber, and one that's turned away
+ * is refused right there on the accepting thread: a canned 503 on the
+ * plain listener, a reset on the SSL one. That costs an accept() and a
+ * close(), and no lookup, SOCKS handshake or TLS. Connections already
+ * relaying are never cut off to make room, so under a spike it's new
+ * clients that are told to come back, not everyone that slows down.
+ *
+ * A client is refused when maxconns clients are open already, when
+ * maxperclient of them are from its address, when more than shed queue
+ * connections are still waiting in the listener's accept queue behind it,
+ * or when it waited there longer than shed delay ms itself (its last
+ * packet is as old as that), since by then its client is about to give up
+ * or retry anyway. A client admitted but then left without a thread (or
+ * fiber) to run on is refused the same way. */
+
+#include "transockproxy.h"
+#include <errno.h>
+#include <netinet/tcp.h>
+
+/* Open connections from one address, while there are any. */
+struct ClientCount {
+	struct ClientCount* next;
+	struct in_addr addr;
+	int count;
+};
+
+struct AdmitShard {
+	pthread_mutex_t lock;
+	struct ClientCount* head;
+} __attribute__((aligned(64)));
+
+int maxconns = 0;
+int maxperclient = 0;
+int shedqueue = 0;
+int sheddelay = 0;
+int listenbacklog = LISTENBACKLOG;
+const char* refusalnames[REFUSALS] = { "", "maxconns", "maxperclient", "queue", "delay", "threads" };
+
+static const char unavailable[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static struct AdmitShard shards[ADMITSHARDS];
+static int admitted = 0;	/* Connections counted against maxconns */
+
+void admitinit() {
+	int x;
+
+	for (x = 0; x < ADMITSHARDS; x++) pthread_mutex_init(&shards[x].lock, NULL);
+}
+
+/* Counts one more connection from addr, unless it has maxperclient already. Returns 0 if it was counted. */
+static int clientadd(struct in_addr addr, int limit) {
+	struct AdmitShard* s = &shards[ntohl(addr.s_addr) % ADMITSHARDS];
+	struct ClientCount* cc;
+	int rc = 0;
+
+	pthread_mutex_lock(&s->lock);
+	for (cc = s->head; cc && cc->addr.s_addr != addr.s_addr; cc = cc->next);
+	if (!cc) {
+		cc = (struct ClientCount*)calloc(1, sizeof(struct ClientCount));
+		cc->addr = addr;
+		cc->next = s->head;
+		s->head = cc;
+	}
+	if (cc->count >= limit) rc = -1;
+	else cc->count++;
+	pthread_mutex_unlock(&s->lock);
+	return rc;
+}
+
+static void clientdel(struct in_addr addr) {
+	struct AdmitShard* s = &shards[ntohl(addr.s_addr) % ADMITSHARDS];
+	struct ClientCount** pcc;
+	struct ClientCount* cc;
+
+	pthread_mutex_lock(&s->lock);
+	for (pcc = &s->head; (cc = *pcc) && cc->addr.s_addr != addr.s_addr; pcc = &cc->next);
+	if (cc && --cc->count <= 0) {
+		*pcc = cc->next;
+		free(cc);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Decides whether csock, just accepted from caddr on lsock, may have a
+ * connection. Returns 0 and sets *counted to what it was counted against
+ * (for conn->admitted), or why it's refused. */
+int admit(int lsock, int csock, const struct sockaddr_in* caddr, int* counted) {
+	struct tcp_info ti;
+	socklen_t len;
+	int n;
+	int limit = __atomic_load_n(&maxconns, __ATOMIC_RELAXED);
+	int perclient = __atomic_load_n(&maxperclient, __ATOMIC_RELAXED);
+	int queue = __atomic_load_n(&shedqueue, __ATOMIC_RELAXED);
+	int delay = __atomic_load_n(&sheddelay, __ATOMIC_RELAXED);
+
+	*counted = 0;
+	/* For a listener, tcpi_unacked is how many are waiting to be accepted. */
+	len = sizeof(ti);
+	if (queue > 0 && !getsockopt(lsock, IPPROTO_TCP, TCP_INFO, &ti, &len) && (int)ti.tcpi_unacked > queue) return REFUSE_QUEUE;
+	len = sizeof(ti);
+	if (delay > 0 && !getsockopt(csock, IPPROTO_TCP, TCP_INFO, &ti, &len)
+			&& (int)(ti.tcpi_last_data_recv < ti.tcpi_last_ack_recv ? ti.tcpi_last_data_recv : ti.tcpi_last_ack_recv) > delay)
+		return REFUSE_DELAY;
+
+	n = __atomic_add_fetch(&admitted, 1, __ATOMIC_RELAXED);
+	if (limit > 0 && n > limit) {
+		__atomic_sub_fetch(&admitted, 1, __ATOMIC_RELAXED);
+		return REFUSE_MAXCONNS;
+	}
+	*counted = ADMIT_COUNTED;
+	if (perclient > 0) {
+		if (clientadd(caddr->sin_addr, perclient)) {
+			__atomic_sub_fetch(&admitted, 1, __ATOMIC_RELAXED);
+			*counted = 0;
+			return REFUSE_MAXPERCLIENT;
+		}
+		*counted |= ADMIT_CLIENT;
+	}
+	return ADMITTED;
+}
+
+/* From connfree(): gives back what c was counted against. */
+void admitrelease(struct Conn* c) {
+	if (c->admitted & ADMIT_COUNTED) __atomic_sub_fetch(&admitted, 1, __ATOMIC_RELAXED);
+	if (c->admitted & ADMIT_CLIENT) clientdel(c->caddr.sin_addr);
+	c->admitted = 0;
+}
+
+/* Turns csock away for reason, without blocking: a 503 if it came to the
+ * plain listener, a reset if to the SSL one. */
+void refuse(int csock, int ssl, const struct sockaddr_in* caddr, int reason) {
+	struct linger lg = { 1, 0 };
+	char buffer[4096];
+	int x;
+
+	statadd(STAT_REFUSED + reason, 1);
+	log("[%d] Refusing %sconnection from %s (%s).\n", csock, ssl ? "SSL " : "", inet_ntoa(caddr->sin_addr), refusalnames[reason]);
+	if (ssl) {
+		setsockopt(csock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	} else {
+		/* Whatever of the request is in already, so closing doesn't reset the 503 away. */
+		for (x = 0; x < 4 && recv(csock, buffer, sizeof(buffer), MSG_DONTWAIT) > 0; x++);
+		send(csock, unavailable, sizeof(unavailable) - 1, MSG_DONTWAIT | MSG_NOSIGNAL);
+		shutdown(csock, SHUT_WR);
+	}
+	close(csock);
+}
+
+
+
+/* EOF */
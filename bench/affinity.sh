@@ -0,0 +1,97 @@
+#!/bin/bash
+#
+# Runs transockproxy against the local origin with the main thread
+# accepting for everyone ("workers 0") and with an accept worker pinned to
+# each CPU ("workers auto"), under new-connection and bulk load, and appends
+# one JSON line per run to bench/results/ with the share of connections
+# whose packets were handled on another CPU, and another NUMA node, than
+# the one that accepted them. On one CPU there's nothing to cross; the
+# numbers mean something on multi-socket boxes with RSS or RPS spreading
+# receive work over the CPUs.
+# Needs no root and no network. Invoked by "make bench".
+#
+# Environment:
+#   BENCHTIME    seconds per run (default 3)
+#   BENCHCONC    concurrent clients (default 32)
+#   BENCHPORT    base port (default 31000)
+#   BENCHCPUS    cpus line for the workers run (default: all we may use)
+#   BENCHONLY    only run labels matching this shell pattern (default *)
+
+cd "$(dirname "$0")/.." || exit 1
+
+BENCHTIME=${BENCHTIME:-3}
+BENCHCONC=${BENCHCONC:-32}
+BENCHPORT=${BENCHPORT:-31000}
+BENCHCPUS=${BENCHCPUS:-}
+BENCHONLY=${BENCHONLY:-*}
+BENCH_COMMIT=${BENCH_COMMIT:-$(git rev-parse --short HEAD 2>/dev/null || echo unknown)}
+export BENCH_COMMIT
+
+ORIGINPORT=$((BENCHPORT + 80))
+PROXYPORT=$((BENCHPORT + 888))
+STATSPORT=$((BENCHPORT + 900))
+
+TOP=$(pwd)
+WORK=$(mktemp -d)
+RESULTS=$TOP/bench/results/$BENCH_COMMIT.jsonl
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do kill "$pid" 2>/dev/null; done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+waitport() {
+	for i in $(seq 300); do
+		(exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "Port $1 never came up." >&2
+	exit 1
+}
+
+# Prints the value of one counter from the stats socket.
+stat() {
+	exec 3<>/dev/tcp/127.0.0.1/$STATSPORT || return
+	printf 'GET /metrics HTTP/1.0\r\n\r\n' >&3
+	awk -v name="$1" '$1 == name { print $2 }' <&3 2>/dev/null
+	exec 3<&-
+}
+
+bench/origin -p $ORIGINPORT & PIDS="$PIDS $!"
+waitport $ORIGINPORT
+
+mkdir -p bench/results
+
+for workers in 0 auto; do
+	for mode in conn bulk; do
+		label="affinity/workers-$workers/$mode"
+		case "$label" in $BENCHONLY) ;; *) continue ;; esac
+
+		cat > "$WORK/transockproxy.conf" <<CONF
+listen $PROXYPORT
+stats 127.0.0.1:$STATSPORT
+loglevel none
+workers $workers
+$([ -n "$BENCHCPUS" ] && echo "cpus $BENCHCPUS")
+default direct
+CONF
+		(cd "$WORK" && exec "$TOP/transockproxy" > "$WORK/transockproxy.log" 2>&1) &
+		proxypid=$!
+		waitport $PROXYPORT
+		bench/loadgen -a 127.0.0.1:$PROXYPORT -H 127.0.0.1:$ORIGINPORT -m $mode -c $BENCHCONC -t $BENCHTIME \
+			-l "$label" > "$WORK/result"
+		accepts=$(stat tsproxy_accepts_total)
+		offcpu=$(stat 'tsproxy_accepts_off_cpu_total{scope="cpu"}')
+		offnode=$(stat 'tsproxy_accepts_off_cpu_total{scope="node"}')
+		shares=$(awk "BEGIN { a = ${accepts:-0}; printf \"\\\"off_cpu_share\\\":%.3f,\\\"off_node_share\\\":%.3f\", a ? ${offcpu:-0} / a : 0, a ? ${offnode:-0} / a : 0 }")
+		sed "s/}\$/,$shares}/" "$WORK/result" | tee -a "$RESULTS"
+		kill $proxypid
+		wait $proxypid 2>/dev/null
+	done
+done
+
+echo "Results appended to $RESULTS"
@@ -0,0 +1,124 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Shared bits for the load generator and the local stub servers. */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+static inline unsigned long benchus() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static inline void benchsleep(int ms) {
+	if (ms > 0) usleep(ms * 1000);
+}
+
+static inline int benchwrite(int fd, const void* buffer, int size) {
+	int pos = 0;
+	int rc;
+	while (pos < size) {
+		rc = write(fd, (const char*)buffer + pos, size - pos);
+		if (rc <= 0) return rc;
+		pos += rc;
+	}
+	return size;
+}
+
+static inline int benchread(int fd, void* buffer, int size) {
+	int pos = 0;
+	int rc;
+	while (pos < size) {
+		rc = read(fd, (char*)buffer + pos, size - pos);
+		if (rc <= 0) return rc;
+		pos += rc;
+	}
+	return size;
+}
+
+static inline int benchlisten(int port) {
+	struct sockaddr_in addr;
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+		fprintf(stderr, "Could not bind to port %d: %m\n", port);
+		exit(2);
+	}
+	listen(sock, 1024);
+	return sock;
+}
+
+/* Connects a socket of the given type (SOCK_STREAM or SOCK_DGRAM) to ip:port. */
+static inline int benchdial(const char* hostport, int type) {
+	struct sockaddr_in addr;
+	char host[256];
+	const char* colon = strrchr(hostport, ':');
+	int sock;
+
+	if (!colon || colon - hostport >= sizeof(host)) return -1;
+	memcpy(host, hostport, colon - hostport);
+	host[colon - hostport] = 0;
+
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(atoi(colon + 1));
+	if (!inet_aton(host, &addr.sin_addr)) return -1;
+
+	sock = socket(AF_INET, type, 0);
+	if (connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static inline int benchconnect(const char* hostport) {
+	return benchdial(hostport, SOCK_STREAM);
+}
+
+static inline void benchthread(void* (*func)(void*), void* arg) {
+	pthread_t tid;
+	pthread_attr_t attr;
+
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 256 * 1024);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	pthread_create(&tid, &attr, func, arg);
+	pthread_attr_destroy(&attr);
+}
+
+
+
+/* EOF */
@@ -0,0 +1,42 @@
+#!/bin/sh
+#
+# Compares two result files from bench/run.sh, scenario by scenario.
+#
+#   bench/compare.sh bench/results/OLD.jsonl bench/results/NEW.jsonl
+
+if [ $# -ne 2 ]; then
+	echo "Usage: $0 old.jsonl new.jsonl" >&2
+	exit 1
+fi
+
+awk '
+function field(line, key,   re, s) {
+	re = "\"" key "\":\"?[^,\"}]*"
+	if (!match(line, re)) return ""
+	s = substr(line, RSTART, RLENGTH)
+	sub("\"" key "\":\"?", "", s)
+	return s
+}
+function metric(line,   mode) {
+	mode = field(line, "mode")
+	if (mode == "conn") return "conns_per_sec"
+	if (mode == "keepalive" || mode == "browser") return "reqs_per_sec"
+	if (mode == "bulk") return "mbytes_per_sec"
+	if (mode == "micro") return "ns_per_op"
+	if (mode == "replay") return "p50_ms"
+	if (mode == "stall") return "p99_ms"
+	return "rss_per_conn_kb"
+}
+FNR == NR { old[field($0, "label")] = $0; next }
+{
+	label = field($0, "label")
+	if (!(label in old)) next
+	m = metric($0)
+	a = field(old[label], m); b = field($0, m)
+	printf "%-26s %-16s %12.2f -> %12.2f (%+6.1f%%)", label, m, a, b, a != 0 ? (b - a) * 100 / a : 0
+	if (m == "ns_per_op") {
+		printf "   allocs/op %.2f -> %.2f\n", field(old[label], "allocs_per_op"), field($0, "allocs_per_op")
+	} else {
+		printf "   p99 %8.3f -> %8.3f ms\n", field(old[label], "p99_ms"), field($0, "p99_ms")
+	}
+}' "$1" "$2"
@@ -0,0 +1,132 @@
+#!/bin/bash
+#
+# Runs transockproxys against the local TLS origin with "http2 on" and loads
+# pages of several objects through it, once over HTTP/1.1 the way browsers
+# do (up to six connections per page) and once over HTTP/2 (one connection,
+# a stream per object), and appends one JSON line per run to bench/results/
+# with the client and upstream TLS handshakes per second it took added.
+# Both open new client connections for every page, so compare the
+# handshakes: HTTP/2 should need one per page where HTTP/1.1 needs six, and
+# upstream handshakes should stay well below either since upstream
+# connections are pooled.
+# Then h2/mismatch posts bodies that don't come to their content-length,
+# some of them a second HTTP/1.1 request under a length of 0, and fails
+# unless the proxy resets every one of those streams instead of passing
+# it upstream.
+# Needs no root and no network. Invoked by "make bench".
+#
+# Environment:
+#   BENCHTIME    seconds per run (default 3)
+#   BENCHCONC    concurrent clients (default 8)
+#   BENCHPORT    base port (default 28000)
+#   BENCHREQS    objects per page (default 20)
+#   BENCHPATH    what to request (default /bytes/8192)
+#   BENCHONLY    only run labels matching this shell pattern (default *)
+
+cd "$(dirname "$0")/.." || exit 1
+
+BENCHTIME=${BENCHTIME:-3}
+BENCHCONC=${BENCHCONC:-8}
+BENCHPORT=${BENCHPORT:-28000}
+BENCHREQS=${BENCHREQS:-20}
+BENCHPATH=${BENCHPATH:-/bytes/8192}
+BENCHONLY=${BENCHONLY:-*}
+BENCH_COMMIT=${BENCH_COMMIT:-$(git rev-parse --short HEAD 2>/dev/null || echo unknown)}
+export BENCH_COMMIT
+
+TLSPORT=$((BENCHPORT + 443))
+SSLPORT=$((BENCHPORT + 889))
+STATSPORT=$((BENCHPORT + 900))
+
+TOP=$(pwd)
+WORK=$(mktemp -d)
+RESULTS=$TOP/bench/results/$BENCH_COMMIT.jsonl
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do kill "$pid" 2>/dev/null; done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+waitport() {
+	for i in $(seq 300); do
+		(exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "Port $1 never came up." >&2
+	exit 1
+}
+
+# Prints the value of one counter from the stats socket.
+stat() {
+	exec 3<>/dev/tcp/127.0.0.1/$STATSPORT || return
+	printf 'GET /metrics HTTP/1.0\r\n\r\n' >&3
+	awk -v name="$1" '$1 == name { print $2 }' <&3 2>/dev/null
+	exec 3<&-
+}
+
+bench/origin -g "$WORK/ca.pem" "$WORK/ca.key" || exit 1
+bench/origin -p $TLSPORT -s -c "$WORK/ca.pem" -k "$WORK/ca.key" & PIDS="$PIDS $!"
+waitport $TLSPORT
+
+cat > "$WORK/transockproxy.conf" <<CONF
+ssl $SSLPORT
+sslcert $WORK/ca.pem
+sslkey $WORK/ca.key
+ssltrust $WORK/ca.pem
+stats 127.0.0.1:$STATSPORT
+loglevel none
+http2 on
+default direct
+CONF
+
+mkdir -p bench/results
+
+for proto in http1 http2; do
+	label="h2/$proto/page"
+	case "$label" in $BENCHONLY) ;; *) continue ;; esac
+
+	(cd "$WORK" && exec "$TOP/transockproxys" > "$WORK/transockproxys.log" 2>&1) &
+	proxypid=$!
+	waitport $SSLPORT
+	clientbefore=$(stat 'tsproxy_tls_handshakes_total{side="client"}')
+	upstreambefore=$(stat 'tsproxy_tls_handshakes_total{side="upstream"}')
+	bench/loadgen -a 127.0.0.1:$SSLPORT -H 127.0.0.1:$TLSPORT -S $([ $proto = http2 ] && echo -2) -m page \
+		-r $BENCHREQS -u $BENCHPATH -c $BENCHCONC -t $BENCHTIME -l "$label" > "$WORK/result"
+	clientafter=$(stat 'tsproxy_tls_handshakes_total{side="client"}')
+	upstreamafter=$(stat 'tsproxy_tls_handshakes_total{side="upstream"}')
+	clientrate=$(awk "BEGIN { printf \"%.1f\", (${clientafter:-0} - ${clientbefore:-0}) / $BENCHTIME }")
+	upstreamrate=$(awk "BEGIN { printf \"%.1f\", (${upstreamafter:-0} - ${upstreambefore:-0}) / $BENCHTIME }")
+	sed "s/}\$/,\"client_handshakes_per_sec\":$clientrate,\"upstream_handshakes_per_sec\":$upstreamrate}/" "$WORK/result" | tee -a "$RESULTS"
+	kill $proxypid
+	wait $proxypid 2>/dev/null
+done
+
+FAILED=0
+label="h2/mismatch"
+case "$label" in $BENCHONLY)
+	(cd "$WORK" && exec "$TOP/transockproxys" > "$WORK/transockproxys.log" 2>&1) &
+	proxypid=$!
+	waitport $SSLPORT
+	bench/loadgen -a 127.0.0.1:$SSLPORT -H 127.0.0.1:$TLSPORT -S -2 -m mismatch \
+		-c $BENCHCONC -t $BENCHTIME -l "$label" | tee -a "$RESULTS" > "$WORK/result"
+	cat "$WORK/result"
+	kill $proxypid
+	wait $proxypid 2>/dev/null
+
+	ops=$(sed 's/.*"ops":\([0-9]*\).*/\1/' "$WORK/result")
+	errors=$(sed 's/.*"errors":\([0-9]*\).*/\1/' "$WORK/result")
+	if [ "$errors" != 0 ] || [ "${ops:-0}" = 0 ]; then
+		echo "FAIL: $errors of $((ops + errors)) mismatched bodies went upstream" >&2
+		FAILED=1
+	else
+		echo "PASS: all $ops mismatched bodies were reset"
+	fi
+	;;
+esac
+
+echo "Results appended to $RESULTS"
+exit $FAILED
@@ -0,0 +1,113 @@
+#!/bin/bash
+#
+# Runs transockproxy with "httpmode stream", "httpmode aware" and aware mode
+# with the response cache against the local origin, with a new connection per
+# request and with a few requests per connection the way browsers do, and
+# appends one JSON line per run to bench/results/, with the upstream
+# connections and origin requests per second it took added. In stream mode
+# there is an upstream connection per client connection; aware mode should
+# need next to none once its idle pool has warmed up, and with the cache the
+# origin should only see the first request.
+# Needs no root and no network. Invoked by "make bench".
+#
+# Environment:
+#   BENCHTIME    seconds per run (default 3)
+#   BENCHCONC    concurrent clients (default 8)
+#   BENCHPORT    base port (default 28000)
+#   BENCHREQS    requests per connection in browser mode (default 6)
+#   BENCHPATH    what to request (default /cached/16384, cacheable for an hour)
+#   BENCHONLY    only run labels matching this shell pattern (default *)
+
+cd "$(dirname "$0")/.." || exit 1
+
+BENCHTIME=${BENCHTIME:-3}
+BENCHCONC=${BENCHCONC:-8}
+BENCHPORT=${BENCHPORT:-28000}
+BENCHREQS=${BENCHREQS:-6}
+BENCHPATH=${BENCHPATH:-/cached/16384}
+BENCHONLY=${BENCHONLY:-*}
+BENCH_COMMIT=${BENCH_COMMIT:-$(git rev-parse --short HEAD 2>/dev/null || echo unknown)}
+export BENCH_COMMIT
+
+HTTPPORT=$((BENCHPORT + 80))
+PROXYPORT=$((BENCHPORT + 888))
+STATSPORT=$((BENCHPORT + 900))
+
+TOP=$(pwd)
+WORK=$(mktemp -d)
+RESULTS=$TOP/bench/results/$BENCH_COMMIT.jsonl
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do kill "$pid" 2>/dev/null; done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+waitport() {
+	for i in $(seq 300); do
+		(exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "Port $1 never came up." >&2
+	exit 1
+}
+
+# Prints the value of one counter from the stats socket.
+stat() {
+	exec 3<>/dev/tcp/127.0.0.1/$STATSPORT || return
+	printf 'GET /metrics HTTP/1.0\r\n\r\n' >&3
+	awk -v name="$1" '$1 == name { print $2 }' <&3 2>/dev/null
+	exec 3<&-
+}
+
+# Prints how many requests the origin has answered.
+originreqs() {
+	exec 3<>/dev/tcp/127.0.0.1/$HTTPPORT || return
+	printf 'GET /stats HTTP/1.0\r\n\r\n' >&3
+	sed -n 's/.*reqs=\([0-9]*\).*/\1/p' <&3 2>/dev/null
+	exec 3<&-
+}
+
+bench/origin -p $HTTPPORT & PIDS="$PIDS $!"
+waitport $HTTPPORT
+
+mkdir -p bench/results
+
+for httpmode in stream aware cache; do
+	for mode in conn browser; do
+		label="http/$httpmode/$mode"
+		case "$label" in $BENCHONLY) ;; *) continue ;; esac
+
+		cat > "$WORK/transockproxy.conf" <<CONF
+listen $PROXYPORT
+stats 127.0.0.1:$STATSPORT
+loglevel none
+httpmode ${httpmode/cache/aware}
+default direct
+CONF
+		if [ $httpmode = cache ]; then
+			mkdir -p "$WORK/cache"
+			echo "cache $WORK/cache 64" >> "$WORK/transockproxy.conf"
+		fi
+		(cd "$WORK" && exec "$TOP/transockproxy" > "$WORK/transockproxy.log" 2>&1) &
+		proxypid=$!
+		waitport $PROXYPORT
+		before=$(stat tsproxy_upstream_connects_total)
+		origin=$(originreqs)
+		bench/loadgen -a 127.0.0.1:$PROXYPORT -H 127.0.0.1:$HTTPPORT -m $mode -r $BENCHREQS -u $BENCHPATH \
+			-c $BENCHCONC -t $BENCHTIME -l "$label" > "$WORK/result"
+		after=$(stat tsproxy_upstream_connects_total)
+		# Less one for asking.
+		origin=$(( $(originreqs) - origin - 1 ))
+		rate=$(awk "BEGIN { printf \"%.1f\", (${after:-0} - ${before:-0}) / $BENCHTIME }")
+		originrate=$(awk "BEGIN { printf \"%.1f\", $origin / $BENCHTIME }")
+		sed "s/}\$/,\"upstream_connects_per_sec\":$rate,\"origin_reqs_per_sec\":$originrate}/" "$WORK/result" | tee -a "$RESULTS"
+		kill $proxypid
+		wait $proxypid 2>/dev/null
+	done
+done
+
+echo "Results appended to $RESULTS"
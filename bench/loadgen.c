@@ -0,0 +1,692 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Load generator. Talks to the proxy directly, addressing the origin
+ * through the Host: header (and SNI for TLS), and prints one JSON object
+ * with the results.
+ *
+ *   loadgen -a proxyaddr:port -H host:port -m conn|keepalive|browser|page|bulk|idle|stall|mismatch|udp
+ *           [-S] [-2] [-c concurrency] [-t seconds] [-b bulkbytes] [-n idleconns]
+ *           [-r requests] [-u path] [-P proxypid] [-l label]
+ *
+ * conn      a new connection per request, reports connections/sec
+ * keepalive sequential requests over persistent connections, requests/sec
+ * browser   -r keep-alive requests per connection, then a new one, requests/sec
+ * page      loads -r objects at once the way a browser loads a page: over up
+ *           to 6 new HTTP/1.1 connections, or with -2 (needs -S) as streams
+ *           on one new HTTP/2 connection. Reports pages/sec as requests/sec
+ * bulk      large downloads over persistent connections, MB/s
+ * idle      opens -n connections, does one request on each and holds them,
+ *           reports proxy RSS growth per connection (needs -P)
+ * stall     opens -n connections and stalls them: every other one sends
+ *           nothing, the rest half a request head (or with -S, half a TLS
+ *           ClientHello). Waits up to -t seconds for the proxy to close
+ *           them, and reports how long each took; those it didn't close
+ *           count as errors
+ * mismatch  (needs -S -2) POSTs over HTTP/2 whose DATA doesn't come to
+ *           their content-length, alternately a smuggled HTTP/1.1 request
+ *           under a length of 0 and a body half as long as declared. Each
+ *           the proxy resets with PROTOCOL_ERROR counts as a request; each
+ *           it passes on counts as an error
+ * udp       -r datagram round trips per UDP flow through the proxy's udp
+ *           listener (-a; -H isn't needed) to an echo, then a new flow,
+ *           round trips/sec
+ *
+ * -u asks for another path than / in the request/sec modes. */
+
+#include "bench.h"
+#include <gnutls/gnutls.h>
+
+#define BUFSIZE 65536
+#define PAGECONNS 6
+#define UDPSIZE 100
+
+struct Client {
+	int fd;
+	gnutls_session_t tls;
+	char buf[BUFSIZE + 1];
+	int len;
+	int pos;
+};
+
+struct Worker {
+	unsigned int* lat;
+	unsigned long nlat;
+	unsigned long maxlat;
+	unsigned long ops;
+	unsigned long conns;
+	unsigned long bytes;
+	unsigned long errors;
+};
+
+static const char* proxyaddr;
+static const char* hosthdr;
+static const char* mode = "conn";
+static const char* label = "";
+static char sni[256];
+static int tls = 0;
+static int http2 = 0;
+static int concurrency = 8;
+static int seconds = 5;
+static long bulkbytes = 16 * 1024 * 1024;
+static int idleconns = 1000;
+static int perconn = 6;
+static const char* urlpath = NULL;
+static int proxypid = 0;
+static volatile int stop = 0;
+static gnutls_certificate_credentials_t cred;
+static gnutls_datum_t h2proto = { (unsigned char*)"h2", 2 };
+
+static void record(struct Worker* w, unsigned long us) {
+	if (w->nlat == w->maxlat) {
+		w->maxlat = w->maxlat ? w->maxlat * 2 : 65536;
+		w->lat = realloc(w->lat, w->maxlat * sizeof(unsigned int));
+	}
+	w->lat[w->nlat++] = us;
+}
+
+static void clientclose(struct Client* c) {
+	if (c->tls) {
+		gnutls_deinit(c->tls);
+		c->tls = NULL;
+	}
+	if (c->fd >= 0) close(c->fd);
+	c->fd = -1;
+}
+
+static int clientopen(struct Client* c) {
+	struct timeval tv = { 5, 0 };
+	gnutls_datum_t proto;
+	int one = 1;
+	int rc;
+
+	c->len = c->pos = 0;
+	c->tls = NULL;
+	c->fd = benchconnect(proxyaddr);
+	if (c->fd < 0) return -1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	/* A stalled transfer counts as an error instead of hanging the run. */
+	setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (!tls) return 0;
+
+	gnutls_init(&c->tls, GNUTLS_CLIENT);
+	gnutls_credentials_set(c->tls, GNUTLS_CRD_CERTIFICATE, cred);
+	gnutls_set_default_priority(c->tls);
+	gnutls_server_name_set(c->tls, GNUTLS_NAME_DNS, sni, strlen(sni));
+	gnutls_transport_set_int(c->tls, c->fd);
+	if (http2) gnutls_alpn_set_protocols(c->tls, &h2proto, 1, 0);
+	do {
+		rc = gnutls_handshake(c->tls);
+	} while (rc < 0 && rc != GNUTLS_E_AGAIN && !gnutls_error_is_fatal(rc));
+	if (rc < 0 || (http2 && gnutls_alpn_get_selected_protocol(c->tls, &proto))) {
+		clientclose(c);
+		return -1;
+	}
+	return 0;
+}
+
+static int clientfill(struct Client* c) {
+	int rc;
+	if (c->pos == c->len) c->pos = c->len = 0;
+	if (c->len == BUFSIZE) {
+		memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+		c->len -= c->pos;
+		c->pos = 0;
+	}
+	if (c->tls) {
+		do {
+			rc = gnutls_record_recv(c->tls, c->buf + c->len, BUFSIZE - c->len);
+		} while (rc == GNUTLS_E_INTERRUPTED);
+		if (rc < 0) rc = -1;
+	} else {
+		rc = read(c->fd, c->buf + c->len, BUFSIZE - c->len);
+	}
+	if (rc > 0) c->len += rc;
+	return rc;
+}
+
+static int clientsend(struct Client* c, const char* data, int size) {
+	int pos = 0;
+	int rc;
+	if (!c->tls) return benchwrite(c->fd, data, size);
+	while (pos < size) {
+		rc = gnutls_record_send(c->tls, data + pos, size - pos);
+		if (rc <= 0) return -1;
+		pos += rc;
+	}
+	return size;
+}
+
+static int requestsend(struct Client* c, const char* path, int keepalive) {
+	char req[512];
+	int n;
+
+	n = snprintf(req, sizeof(req), "GET %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: tsproxy-loadgen\r\n%s\r\n",
+		path, hosthdr, keepalive ? "" : "Connection: close\r\n");
+	return clientsend(c, req, n) == n ? 0 : -1;
+}
+
+/* Reads a whole response. Returns body bytes, or -1. */
+static long response(struct Client* c) {
+	char* head;
+	char* end;
+	char* cl;
+	long length = -1;
+	long got;
+	int n;
+
+	while (1) {
+		head = c->buf + c->pos;
+		c->buf[c->len] = 0;
+		if ((end = strstr(head, "\r\n\r\n"))) break;
+		if (c->len - c->pos >= BUFSIZE - 1) return -1;
+		if (clientfill(c) <= 0) return -1;
+	}
+	if (strncmp(head, "HTTP/1.", 7) || head[9] != '2') return -1;
+	cl = strcasestr(head, "\r\nContent-Length:");
+	if (cl && cl < end) length = atol(cl + 17);
+	c->pos = end + 4 - c->buf;
+
+	got = 0;
+	while (length < 0 || got < length) {
+		n = c->len - c->pos;
+		if (length >= 0 && n > length - got) n = length - got;
+		got += n;
+		c->pos += n;
+		if (length >= 0 && got >= length) break;
+		n = clientfill(c);
+		if (n == 0 && length < 0) break;
+		if (n <= 0) return -1;
+	}
+	return got;
+}
+
+/* Sends a GET and reads the whole response. Returns body bytes, or -1. */
+static long request(struct Client* c, const char* path, int keepalive) {
+	if (requestsend(c, path, keepalive)) return -1;
+	return response(c);
+}
+
+/* Loads a page of perconn objects over up to PAGECONNS HTTP/1.1 connections,
+ * each with one request outstanding at a time. Returns body bytes, or -1. */
+static long pagehttp1(struct Worker* w, struct Client* conns, const char* path) {
+	int nconns = perconn < PAGECONNS ? perconn : PAGECONNS;
+	long bytes = 0;
+	long rc = 0;
+	int sent, x;
+
+	for (x = 0; x < nconns; x++) {
+		if (clientopen(&conns[x])) {
+			rc = -1;
+			break;
+		}
+		w->conns++;
+	}
+	for (sent = 0; sent < perconn && rc >= 0; ) {
+		for (x = 0; x < nconns && sent + x < perconn && rc >= 0; x++) rc = requestsend(&conns[x], path, 1);
+		for (x = 0; x < nconns && sent < perconn && rc >= 0; x++, sent++) {
+			rc = response(&conns[x]);
+			bytes += rc;
+		}
+	}
+	for (x = 0; x < nconns; x++) clientclose(&conns[x]);
+	return rc < 0 ? -1 : bytes;
+}
+
+static int h2frame(struct Client* c, int type, int flags, unsigned int id, const void* payload, int len) {
+	char frame[9 + 512];
+
+	frame[0] = len >> 16;
+	frame[1] = len >> 8;
+	frame[2] = len;
+	frame[3] = type;
+	frame[4] = flags;
+	frame[5] = id >> 24;
+	frame[6] = id >> 16;
+	frame[7] = id >> 8;
+	frame[8] = id;
+	memcpy(frame + 9, payload, len);
+	return clientsend(c, frame, 9 + len) == 9 + len ? 0 : -1;
+}
+
+/* HPACK literal without indexing; everything we send is short enough for one-byte lengths. */
+static int h2literal(unsigned char* out, const char* name, const char* value) {
+	int nlen = strlen(name);
+	int vlen = strlen(value);
+
+	out[0] = 0;
+	out[1] = nlen;
+	memcpy(out + 2, name, nlen);
+	out[2 + nlen] = vlen;
+	memcpy(out + 3 + nlen, value, vlen);
+	return 3 + nlen + vlen;
+}
+
+/* Reads the next frame. Returns its header, with the payload after it, or NULL. */
+static const unsigned char* h2next(struct Client* c) {
+	const unsigned char* hdr;
+
+	while (c->len - c->pos < 9 || c->len - c->pos < 9 + ((unsigned char)c->buf[c->pos] << 16
+		| (unsigned char)c->buf[c->pos + 1] << 8 | (unsigned char)c->buf[c->pos + 2])) {
+		if (clientfill(c) <= 0) return NULL;
+	}
+	hdr = (const unsigned char*)c->buf + c->pos;
+	c->pos += 9 + (hdr[0] << 16 | hdr[1] << 8 | hdr[2]);
+	return hdr;
+}
+
+/* Loads a page of perconn objects as streams on one HTTP/2 connection. Returns body bytes, or -1. */
+static long pagehttp2(struct Worker* w, struct Client* c, const char* path) {
+	unsigned char block[512];
+	unsigned char credit[4];
+	const unsigned char* hdr;
+	unsigned int id;
+	long bytes = 0;
+	int ended = 0;
+	int len, n, x;
+
+	if (strlen(path) > 120 || strlen(hosthdr) > 120 || clientopen(c)) return -1;
+	w->conns++;
+	n = h2literal(block, ":method", "GET");
+	n += h2literal(block + n, ":scheme", "https");
+	n += h2literal(block + n, ":path", path);
+	n += h2literal(block + n, ":authority", hosthdr);
+	n += h2literal(block + n, "user-agent", "tsproxy-loadgen");
+	if (clientsend(c, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24) != 24 || h2frame(c, 4, 0, 0, NULL, 0)) goto fail;
+	/* HEADERS with END_STREAM and END_HEADERS. */
+	for (x = 0; x < perconn; x++) if (h2frame(c, 1, 0x5, x * 2 + 1, block, n)) goto fail;
+
+	while (ended < perconn) {
+		if (!(hdr = h2next(c))) goto fail;
+		len = hdr[0] << 16 | hdr[1] << 8 | hdr[2];
+		id = (hdr[5] << 24 | hdr[6] << 16 | hdr[7] << 8 | hdr[8]) & 0x7fffffff;
+		switch (hdr[3]) {
+		case 0:	/* DATA: hand the window straight back */
+			bytes += len;
+			if (len) {
+				credit[0] = len >> 24;
+				credit[1] = len >> 16;
+				credit[2] = len >> 8;
+				credit[3] = len;
+				if (h2frame(c, 8, 0, 0, credit, 4) || h2frame(c, 8, 0, id, credit, 4)) goto fail;
+			}
+			if (hdr[4] & 0x1) ended++;
+			break;
+		case 1:	/* HEADERS */
+			if (hdr[4] & 0x1) ended++;
+			break;
+		case 3:	/* RST_STREAM */
+		case 7:	/* GOAWAY */
+			goto fail;
+		case 4:	/* SETTINGS */
+			if (!(hdr[4] & 0x1) && h2frame(c, 4, 0x1, 0, NULL, 0)) goto fail;
+			break;
+		}
+	}
+	clientclose(c);
+	return bytes;
+
+	fail:
+	clientclose(c);
+	return -1;
+}
+
+/* Posts a body on a new HTTP/2 connection that doesn't come to its
+ * content-length: a whole HTTP/1.1 request under a content-length of 0
+ * when smuggle is set, otherwise half of what it declares. Returns 0 if
+ * the proxy reset the stream with PROTOCOL_ERROR, or -1 if it passed it on
+ * (or anything else went wrong). */
+static long mismatchhttp2(struct Worker* w, struct Client* c, const char* path, int smuggle) {
+	static const char smuggled[] = "GET / HTTP/1.1\r\nHost: smuggled\r\n\r\n";
+	unsigned char block[512];
+	const unsigned char* hdr;
+	unsigned int id, code;
+	int n;
+
+	if (strlen(path) > 120 || strlen(hosthdr) > 120 || clientopen(c)) return -1;
+	w->conns++;
+	n = h2literal(block, ":method", "POST");
+	n += h2literal(block + n, ":scheme", "https");
+	n += h2literal(block + n, ":path", path);
+	n += h2literal(block + n, ":authority", hosthdr);
+	n += h2literal(block + n, "content-length", smuggle ? "0" : "64");
+	if (clientsend(c, "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n", 24) != 24 || h2frame(c, 4, 0, 0, NULL, 0)) goto fail;
+	/* HEADERS with just END_HEADERS, then the body with END_STREAM. */
+	if (h2frame(c, 1, 0x4, 1, block, n) || h2frame(c, 0, 0x1, 1, smuggled, smuggle ? sizeof(smuggled) - 1 : 32)) goto fail;
+
+	while ((hdr = h2next(c))) {
+		id = (hdr[5] << 24 | hdr[6] << 16 | hdr[7] << 8 | hdr[8]) & 0x7fffffff;
+		if (hdr[3] == 4 && !(hdr[4] & 0x1) && h2frame(c, 4, 0x1, 0, NULL, 0)) break;
+		/* GOAWAY, or an answer: it went upstream. */
+		if (hdr[3] == 7 || ((hdr[3] == 0 || hdr[3] == 1) && id == 1)) break;
+		if (hdr[3] == 3 && id == 1) {
+			code = hdr[9] << 24 | hdr[10] << 16 | hdr[11] << 8 | hdr[12];
+			clientclose(c);
+			return code == 1 ? 0 : -1;
+		}
+	}
+
+	fail:
+	clientclose(c);
+	return -1;
+}
+
+/* Sends one datagram and waits for its echo. Returns bytes, or -1. */
+static long udpround(int fd, unsigned long seq) {
+	char out[UDPSIZE];
+	char in[UDPSIZE];
+	int rc;
+
+	memset(out, 'u', sizeof(out));
+	memcpy(out, &seq, sizeof(seq));
+	if (send(fd, out, sizeof(out), 0) != sizeof(out)) return -1;
+	/* Anything left over from a round that timed out is skipped. */
+	do {
+		rc = recv(fd, in, sizeof(in), 0);
+	} while (rc == sizeof(in) && memcmp(in, out, sizeof(seq)));
+	if (rc != sizeof(in)) return -1;
+	return rc;
+}
+
+static void* udpworker(void* arg) {
+	struct Worker* w = (struct Worker*)arg;
+	struct timeval tv = { 1, 0 };
+	unsigned long start;
+	unsigned long seq = 0;
+	long rc;
+	int fd = -1;
+	int reqs = 0;
+
+	while (!stop) {
+		if (fd < 0) {
+			fd = benchdial(proxyaddr, SOCK_DGRAM);
+			if (fd < 0) {
+				w->errors++;
+				usleep(1000);
+				continue;
+			}
+			setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+			w->conns++;
+		}
+		start = benchus();
+		rc = udpround(fd, ++seq);
+		if (rc < 0) {
+			w->errors++;
+			continue;
+		}
+		w->ops++;
+		w->bytes += rc;
+		record(w, benchus() - start);
+		if (++reqs >= perconn) {
+			close(fd);
+			fd = -1;
+			reqs = 0;
+		}
+	}
+	if (fd >= 0) close(fd);
+	return NULL;
+}
+
+static void* worker(void* arg) {
+	struct Worker* w = (struct Worker*)arg;
+	struct Client* c = calloc(PAGECONNS, sizeof(struct Client));
+	char path[64];
+	unsigned long start;
+	long rc;
+	int reqs = 0;
+	int x;
+
+	for (x = 0; x < PAGECONNS; x++) c[x].fd = -1;
+	if (!strcmp(mode, "bulk")) snprintf(path, sizeof(path), "/bytes/%ld", bulkbytes);
+	else snprintf(path, sizeof(path), "%s", urlpath ? urlpath : "/");
+
+	while (!stop) {
+		start = benchus();
+		if (!strcmp(mode, "page") || !strcmp(mode, "mismatch")) {
+			if (!strcmp(mode, "mismatch")) rc = mismatchhttp2(w, c, path, (w->ops + w->errors) & 1);
+			else rc = http2 ? pagehttp2(w, c, path) : pagehttp1(w, c, path);
+			if (rc < 0) {
+				w->errors++;
+				continue;
+			}
+			w->ops++;
+			w->bytes += rc;
+			record(w, benchus() - start);
+			continue;
+		}
+		if (c->fd < 0) {
+			if (clientopen(c)) {
+				w->errors++;
+				usleep(1000);
+				continue;
+			}
+			w->conns++;
+		}
+		rc = request(c, path, strcmp(mode, "conn"));
+		if (rc < 0) {
+			w->errors++;
+			clientclose(c);
+			reqs = 0;
+			continue;
+		}
+		if (!strcmp(mode, "conn") || (!strcmp(mode, "browser") && ++reqs >= perconn)) {
+			clientclose(c);
+			reqs = 0;
+		}
+		w->ops++;
+		w->bytes += rc;
+		record(w, benchus() - start);
+	}
+	clientclose(c);
+	free(c);
+	return NULL;
+}
+
+static long proxyrss() {
+	char path[64];
+	char line[256];
+	long kb = -1;
+	FILE* fp;
+
+	snprintf(path, sizeof(path), "/proc/%d/status", proxypid);
+	fp = fopen(path, "r");
+	if (!fp) return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strncmp(line, "VmRSS:", 6)) kb = atol(line + 6);
+	}
+	fclose(fp);
+	return kb;
+}
+
+static int cmplat(const void* a, const void* b) {
+	unsigned int x = *(const unsigned int*)a;
+	unsigned int y = *(const unsigned int*)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(const unsigned int* lat, unsigned long n, double q) {
+	unsigned long idx;
+	if (!n) return 0;
+	idx = (unsigned long)(n * q);
+	if (idx >= n) idx = n - 1;
+	return lat[idx] / 1000.0;
+}
+
+static void report(struct Worker* total, double elapsed, double rsskb) {
+	const char* commit = getenv("BENCH_COMMIT");
+
+	qsort(total->lat, total->nlat, sizeof(unsigned int), cmplat);
+	printf("{\"commit\":\"%s\",\"label\":\"%s\",\"mode\":\"%s\",\"tls\":%d,\"concurrency\":%d,"
+		"\"seconds\":%.2f,\"ops\":%lu,\"errors\":%lu,\"conns_per_sec\":%.1f,\"reqs_per_sec\":%.1f,"
+		"\"mbytes_per_sec\":%.2f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"rss_per_conn_kb\":%.1f}\n",
+		commit ? commit : "", label, mode, tls, concurrency, elapsed, total->ops, total->errors,
+		total->conns / elapsed, total->ops / elapsed, total->bytes / elapsed / 1048576.0,
+		percentile(total->lat, total->nlat, 0.5), percentile(total->lat, total->nlat, 0.99),
+		percentile(total->lat, total->nlat, 0.999), rsskb);
+}
+
+static void runidle() {
+	struct Client* clients = calloc(idleconns, sizeof(struct Client));
+	struct Worker total;
+	unsigned long start;
+	long before, after;
+	int x;
+
+	memset(&total, 0, sizeof(total));
+	before = proxyrss();
+	start = benchus();
+	for (x = 0; x < idleconns; x++) {
+		clients[x].fd = -1;
+		if (clientopen(&clients[x]) || request(&clients[x], "/", 1) < 0) {
+			total.errors++;
+			continue;
+		}
+		total.conns++;
+		total.ops++;
+		record(&total, 0);
+	}
+	/* Let the proxy settle before measuring. */
+	usleep(500000);
+	after = proxyrss();
+	report(&total, (benchus() - start) / 1e6,
+		before >= 0 && after >= 0 && total.conns ? (double)(after - before) / total.conns : -1);
+	for (x = 0; x < idleconns; x++) clientclose(&clients[x]);
+	free(clients);
+}
+
+static void runstall() {
+	/* A TLS record header promising a 512-byte handshake message, and the first few bytes of it. */
+	static const char hello[] = "\x16\x03\x01\x02\x00\x01\x00\x01\xfc\x03\x03";
+	static const char head[] = "GET / HTTP/1.1\r\nUser-Agent: stall\r\n";
+	struct pollfd* pfds = calloc(idleconns, sizeof(struct pollfd));
+	unsigned long* opened = calloc(idleconns, sizeof(unsigned long));
+	struct Worker total;
+	unsigned long start, now;
+	char buf[256];
+	int left = 0;
+	int x, rc;
+
+	memset(&total, 0, sizeof(total));
+	start = benchus();
+	for (x = 0; x < idleconns; x++) {
+		pfds[x].fd = benchconnect(proxyaddr);
+		pfds[x].events = POLLIN;
+		if (pfds[x].fd < 0) {
+			total.errors++;
+			continue;
+		}
+		opened[x] = benchus();
+		total.conns++;
+		left++;
+		if (x % 2 && tls) send(pfds[x].fd, hello, sizeof(hello) - 1, MSG_NOSIGNAL);
+		else if (x % 2) send(pfds[x].fd, head, sizeof(head) - 1, MSG_NOSIGNAL);
+	}
+
+	/* The proxy closing a connection (or resetting it) is what we're waiting for. */
+	while (left && benchus() - start < seconds * 1000000UL) {
+		rc = poll(pfds, idleconns, 100);
+		if (rc <= 0) continue;
+		now = benchus();
+		for (x = 0; x < idleconns; x++) {
+			if (pfds[x].fd < 0 || !pfds[x].revents) continue;
+			if (recv(pfds[x].fd, buf, sizeof(buf), MSG_DONTWAIT) > 0) continue;
+			record(&total, now - opened[x]);
+			total.ops++;
+			close(pfds[x].fd);
+			pfds[x].fd = -1;
+			left--;
+		}
+	}
+	total.errors += left;
+	for (x = 0; x < idleconns; x++) if (pfds[x].fd >= 0) close(pfds[x].fd);
+	report(&total, (benchus() - start) / 1e6, -1);
+	free(pfds);
+	free(opened);
+}
+
+int main(int argc, char* argv[]) {
+	struct Worker* workers;
+	struct Worker total;
+	pthread_t* tids;
+	unsigned long start;
+	char* colon;
+	int opt;
+	int x;
+
+	signal(SIGPIPE, SIG_IGN);
+	while ((opt = getopt(argc, argv, "a:H:m:S2c:t:b:n:r:u:P:l:")) != -1) {
+		switch (opt) {
+		case '2': http2 = 1; break;
+		case 'a': proxyaddr = optarg; break;
+		case 'H': hosthdr = optarg; break;
+		case 'm': mode = optarg; break;
+		case 'S': tls = 1; break;
+		case 'c': concurrency = atoi(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		case 'b': bulkbytes = atol(optarg); break;
+		case 'n': idleconns = atoi(optarg); break;
+		case 'r': perconn = atoi(optarg); break;
+		case 'u': urlpath = optarg; break;
+		case 'P': proxypid = atoi(optarg); break;
+		case 'l': label = optarg; break;
+		}
+	}
+	if (!strcmp(mode, "udp") && !hosthdr) hosthdr = "";
+	if (!proxyaddr || !hosthdr || (http2 && !tls) || (!strcmp(mode, "mismatch") && !http2)) {
+		fprintf(stderr, "Usage: %s -a proxy:port -H host:port [-m conn|keepalive|browser|page|bulk|idle|stall|mismatch|udp] [-S] [-2] [-c n] [-t secs] [-b bytes] [-n conns] [-r reqs] [-u path] [-P pid] [-l label]\n", argv[0]);
+		return 1;
+	}
+
+	snprintf(sni, sizeof(sni), "%s", hosthdr);
+	colon = strrchr(sni, ':');
+	if (colon) *colon = 0;
+	if (tls) {
+		gnutls_global_init();
+		gnutls_certificate_allocate_credentials(&cred);
+	}
+
+	if (!strcmp(mode, "idle")) {
+		runidle();
+		return 0;
+	}
+	if (!strcmp(mode, "stall")) {
+		runstall();
+		return 0;
+	}
+
+	workers = calloc(concurrency, sizeof(struct Worker));
+	tids = calloc(concurrency, sizeof(pthread_t));
+	start = benchus();
+	for (x = 0; x < concurrency; x++) pthread_create(&tids[x], NULL, strcmp(mode, "udp") ? worker : udpworker, &workers[x]);
+	sleep(seconds);
+	stop = 1;
+	for (x = 0; x < concurrency; x++) pthread_join(tids[x], NULL);
+
+	memset(&total, 0, sizeof(total));
+	for (x = 0; x < concurrency; x++) {
+		total.ops += workers[x].ops;
+		total.conns += workers[x].conns;
+		total.bytes += workers[x].bytes;
+		total.errors += workers[x].errors;
+		total.lat = realloc(total.lat, (total.nlat + workers[x].nlat) * sizeof(unsigned int) + 1);
+		memcpy(total.lat + total.nlat, workers[x].lat, workers[x].nlat * sizeof(unsigned int));
+		total.nlat += workers[x].nlat;
+	}
+	report(&total, (benchus() - start) / 1e6, -1);
+	return 0;
+}
+
+
+
+/* EOF */
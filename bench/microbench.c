@@ -0,0 +1,350 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Micro-benchmarks for the per-connection hot functions, linked against the
+ * proxy's own sources (built with -DNOMAIN). Each benchmark is calibrated to
+ * run for about -t milliseconds per round; the median of -r rounds is
+ * reported along with the spread between the fastest and slowest round.
+ *
+ *   microbench [-t ms] [-r rounds] [-f substring] [-j] */
+
+#include "bench.h"
+#include "../transockproxy.h"
+#include <sched.h>
+
+/* Count allocations by interposing on glibc's malloc family. */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+
+static unsigned long allocs = 0;
+
+void* malloc(size_t size) {
+	allocs++;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size) {
+	allocs++;
+	return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size) {
+	allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+struct Bench {
+	const char* name;
+	void (*func)(unsigned long iters);
+};
+
+static volatile unsigned long sink;
+
+
+
+/* Header samples, roughly as real clients send them. */
+static const char* headers[] = {
+	"GET / HTTP/1.1\r\nHost: example.com\r\nUser-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n",
+
+	"GET /search?q=transparent+proxy&client=firefox-b-d HTTP/1.1\r\n"
+	"Host: www.google.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Connection: keep-alive\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n\r\n",
+
+	"GET /assets/app.4f2a91c3.js HTTP/1.1\r\n"
+	"Connection: keep-alive\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"126\", \"Google Chrome\";v=\"126\", \"Not-A.Brand\";v=\"99\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"User-Agent: Mozilla/5.0 (Windows NT 10.0; Win64; x64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/126.0.0.0 Safari/537.36\r\n"
+	"sec-ch-ua-platform: \"Windows\"\r\n"
+	"Accept: */*\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Dest: script\r\n"
+	"Referer: http://static.shop.example.net/cart\r\n"
+	"Accept-Encoding: gzip, deflate\r\n"
+	"Accept-Language: en-GB,en-US;q=0.9,en;q=0.8\r\n"
+	"Cookie: _ga=GA1.1.1893450712.1712345678; _gid=GA1.1.2044512346.1719876543; session=eyJ1c2VyIjoiYWxpY2UiLCJleHAiOjE3MTk5OTk5OTl9.abcdefghijklmnopqrstuvwxyz0123456789; cart=3f9a2c; consent=analytics%3Dtrue%26ads%3Dfalse\r\n"
+	"Host: static.shop.example.net\r\n\r\n",
+
+	"POST /api/v2/events HTTP/1.1\r\n"
+	"host: telemetry.app.example.org:8080\r\n"
+	"content-type: application/json\r\n"
+	"content-length: 512\r\n"
+	"user-agent: okhttp/4.12.0\r\n\r\n",
+
+	"GET /video/segment_00042.ts HTTP/1.1\r\n"
+	"Host:\tcdn-edge-07.media.example.com\r\n"
+	"Range: bytes=1048576-2097151\r\n"
+	"User-Agent: AppleCoreMedia/1.0.0.21F90 (iPhone; U; CPU OS 17_5_1 like Mac OS X; en_us)\r\n"
+	"X-Playback-Session-Id: 6A1E0C5B-7D23-4C1B-9A2E-3F4B5C6D7E8F\r\n"
+	"Accept: */*\r\n\r\n",
+};
+#define NHEADERS (sizeof(headers)/sizeof(headers[0]))
+
+/* Destination names, in the shapes SNI and Host: headers take. */
+static const char* hosts[] = {
+	"example.com",
+	"www.google.com",
+	"static.shop.example.net",
+	"telemetry.app.example.org:8080",
+	"cdn-edge-07.media.example.com",
+	"10.20.30.40",
+	"api.eu-west-1.prod.internal.example.io:8443",
+	"a.b",
+	"xn--bcher-kva.example",
+	"some-really-long-subdomain-name-for-testing.us-east-2.elb.amazonaws.com",
+	"localhost",
+	"intranet:3128",
+};
+#define NHOSTS (sizeof(hosts)/sizeof(hosts[0]))
+
+static struct Routes smallroutes;
+static struct Routes largeroutes;
+
+/* Fills a routing table with a mix of the pattern shapes people write in configs. */
+static void makepatterns(struct Routes* r, int count) {
+	struct Mapping** maps = (struct Mapping**)calloc(count, sizeof(struct Mapping*));
+	char pattern[128];
+	int x;
+
+	for (x = 0; x < count; x++) {
+		switch (x % 5) {
+		case 0: snprintf(pattern, sizeof(pattern), "*.example%d.com", x); break;
+		case 1: snprintf(pattern, sizeof(pattern), "10.%d.*", x % 256); break;
+		case 2: snprintf(pattern, sizeof(pattern), "host%d.internal*", x); break;
+		case 3: snprintf(pattern, sizeof(pattern), "*.svc%d.cluster.local", x); break;
+		case 4: snprintf(pattern, sizeof(pattern), "[a-m]*.tenant%d.example.org", x); break;
+		}
+		maps[x] = (struct Mapping*)calloc(1, sizeof(struct Mapping));
+		maps[x]->pattern = strdup(pattern);
+		maps[x]->proto = SOCKS5;
+	}
+	r->mappings = maps;
+	r->mappingcount = count;
+	r->defmap.proto = DIRECT;
+	r->refs = 1;
+}
+
+static void bfindserversmall(unsigned long iters) {
+	unsigned long x;
+	for (x = 0; x < iters; x++) sink += (unsigned long)findserver(&smallroutes, hosts[x % NHOSTS]);
+}
+
+static void bfindserverlarge(unsigned long iters) {
+	unsigned long x;
+	for (x = 0; x < iters; x++) sink += (unsigned long)findserver(&largeroutes, hosts[x % NHOSTS]);
+}
+
+static void bfindserverhit(unsigned long iters) {
+	static const char* hit[] = { "www.example0.com", "10.1.2.3", "host2.internal", "api.svc3.cluster.local" };
+	unsigned long x;
+	for (x = 0; x < iters; x++) sink += (unsigned long)findserver(&largeroutes, hit[x % 4]);
+}
+
+/* What an accept worker or HTTP/2 stream pays to hold the routing table. */
+static void broutesget(unsigned long iters) {
+	unsigned long x;
+	routes = &smallroutes;
+	for (x = 0; x < iters; x++) routesput(routesget());
+}
+
+static void bfindhost(unsigned long iters) {
+	unsigned long x;
+	char* host;
+	for (x = 0; x < iters; x++) {
+		host = findhost(headers[x % NHEADERS]);
+		sink += host[0];
+		free(host);
+	}
+}
+
+static void bhostport(unsigned long iters) {
+	char host[256];
+	unsigned long x;
+	for (x = 0; x < iters; x++) {
+		strcpy(host, hosts[x % NHOSTS]);
+		sink += hostport(host, 80);
+	}
+}
+
+static void bsocks4a(unsigned long iters) {
+	unsigned char buffer[1024];
+	char host[256];
+	unsigned long x;
+	for (x = 0; x < iters; x++) {
+		strcpy(host, hosts[x % NHOSTS]);
+		sink += socks4arequest(buffer, sizeof(buffer), host, hostport(host, 80));
+	}
+}
+
+static void bsocks5(unsigned long iters) {
+	unsigned char buffer[1024];
+	char host[256];
+	unsigned long x;
+	for (x = 0; x < iters; x++) {
+		strcpy(host, hosts[x % NHOSTS]);
+		sink += socks5request(buffer, sizeof(buffer), host, hostport(host, 80));
+	}
+}
+
+static gnutls_x509_crt_t ca;
+static gnutls_x509_privkey_t cakey;
+static gnutls_x509_privkey_t sessionkey;
+
+static void bmakecert(unsigned long iters) {
+	char host[256];
+	gnutls_x509_privkey_t key;
+	gnutls_x509_crt_t cert;
+	unsigned long x;
+
+	for (x = 0; x < iters; x++) {
+		/* Same steps as gencert(): copy the session key, then build and sign. */
+		strcpy(host, hosts[x % NHOSTS]);
+		hostport(host, 443);
+		gnutls_x509_privkey_init(&key);
+		gnutls_x509_privkey_cpy(key, sessionkey);
+		cert = makecert(host, key, ca, cakey);
+		sink += (unsigned long)cert;
+		gnutls_x509_crt_deinit(cert);
+		gnutls_x509_privkey_deinit(key);
+	}
+}
+
+static void makeca() {
+	unsigned int one = 1;
+
+	gnutls_x509_privkey_init(&cakey);
+	gnutls_x509_privkey_generate(cakey, GNUTLS_PK_RSA, 2048, 0);
+	gnutls_x509_privkey_init(&sessionkey);
+	gnutls_x509_privkey_generate(sessionkey, GNUTLS_PK_RSA,
+		gnutls_sec_param_to_pk_bits(GNUTLS_PK_RSA, GNUTLS_SEC_PARAM_LOW), 0);
+
+	gnutls_x509_crt_init(&ca);
+	gnutls_x509_crt_set_version(ca, 3);
+	gnutls_x509_crt_set_serial(ca, &one, sizeof(one));
+	gnutls_x509_crt_set_dn_by_oid(ca, GNUTLS_OID_X520_COMMON_NAME, 0, "microbench CA", 13);
+	gnutls_x509_crt_set_activation_time(ca, time(NULL) - 86400);
+	gnutls_x509_crt_set_expiration_time(ca, time(NULL) + 86400);
+	gnutls_x509_crt_set_key(ca, cakey);
+	gnutls_x509_crt_set_basic_constraints(ca, 1, -1);
+	gnutls_x509_crt_set_key_usage(ca, GNUTLS_KEY_KEY_CERT_SIGN);
+	gnutls_x509_crt_sign2(ca, ca, cakey, GNUTLS_DIG_SHA256, 0);
+}
+
+static struct Bench benches[] = {
+	{ "findserver/10patterns", bfindserversmall },
+	{ "findserver/1000patterns", bfindserverlarge },
+	{ "findserver/1000patterns-hit", bfindserverhit },
+	{ "routesget", broutesget },
+	{ "findhost", bfindhost },
+	{ "hostport", bhostport },
+	{ "socks4arequest", bsocks4a },
+	{ "socks5request", bsocks5 },
+	{ "makecert", bmakecert },
+};
+#define NBENCHES (sizeof(benches)/sizeof(benches[0]))
+
+static int cmpdouble(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char* argv[]) {
+	const char* filter = NULL;
+	const char* commit = getenv("BENCH_COMMIT");
+	int roundms = 200;
+	int rounds = 9;
+	cpu_set_t cpus;
+	int json = 0;
+	double* results;
+	unsigned long iters, start, elapsed, before, nallocs;
+	int opt, x, r;
+
+	while ((opt = getopt(argc, argv, "t:r:f:j")) != -1) {
+		switch (opt) {
+		case 't': roundms = atoi(optarg); break;
+		case 'r': rounds = atoi(optarg); break;
+		case 'f': filter = optarg; break;
+		case 'j': json = 1; break;
+		default:
+			fprintf(stderr, "Usage: %s [-t ms] [-r rounds] [-f substring] [-j]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (rounds < 1) rounds = 1;
+	results = calloc(rounds, sizeof(double));
+
+	/* Staying on one CPU takes migrations out of the noise. */
+	CPU_ZERO(&cpus);
+	CPU_SET(sched_getcpu(), &cpus);
+	sched_setaffinity(0, sizeof(cpus), &cpus);
+
+	loglevel = LOG_NONE;
+	makepatterns(&smallroutes, 10);
+	makepatterns(&largeroutes, 1000);
+	gnutls_global_init();
+	if (!filter || strstr("makecert", filter)) makeca();
+
+	for (x = 0; x < NBENCHES; x++) {
+		if (filter && !strstr(benches[x].name, filter)) continue;
+
+		/* Calibrate: double the iteration count until a round takes long enough. */
+		iters = 1;
+		do {
+			iters *= 2;
+			start = benchus();
+			benches[x].func(iters);
+			elapsed = benchus() - start;
+		} while (elapsed < roundms * 100UL);
+		iters = iters * roundms * 1000UL / (elapsed ? elapsed : 1);
+		if (iters < 1) iters = 1;
+
+		nallocs = 0;
+		for (r = 0; r < rounds; r++) {
+			before = allocs;
+			start = benchus();
+			benches[x].func(iters);
+			elapsed = benchus() - start;
+			nallocs += allocs - before;
+			results[r] = elapsed * 1000.0 / iters;
+		}
+		qsort(results, rounds, sizeof(double), cmpdouble);
+
+		if (json) {
+			printf("{\"commit\":\"%s\",\"label\":\"micro/%s\",\"mode\":\"micro\",\"iters\":%lu,\"rounds\":%d,"
+				"\"ns_per_op\":%.1f,\"min_ns_per_op\":%.1f,\"spread_pct\":%.1f,\"allocs_per_op\":%.2f}\n",
+				commit ? commit : "unknown", benches[x].name, iters, rounds,
+				results[rounds/2], results[0], (results[rounds-1] - results[0]) * 100 / results[rounds/2],
+				(double)nallocs / (iters * rounds));
+		} else {
+			printf("%-28s %12.1f ns/op %8.2f allocs/op   (min %.1f, spread %.1f%%)\n",
+				benches[x].name, results[rounds/2], (double)nallocs / (iters * rounds),
+				results[0], (results[rounds-1] - results[0]) * 100 / results[rounds/2]);
+		}
+		fflush(stdout);
+	}
+	free(results);
+	return 0;
+}
+
+
+
+/* EOF */
@@ -0,0 +1,380 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Local HTTP/1.1 origin for benchmarks, optionally over TLS.
+ *
+ *   origin -p port [-d delayms] [-s -c ca.pem -k ca.key] [-u]
+ *   origin -g ca.pem ca.key        generate a CA for the proxy and the TLS origin
+ *
+ * GET /bytes/N answers with N bytes, /chunked/N the same with chunked
+ * encoding, /cached/N the same, cacheable for an hour, /revalidate/N the
+ * same, to be revalidated every time (a 304 to any If-None-Match), /stats
+ * with counters, anything else with a short body. With -u it also echoes
+ * UDP datagrams sent to the same port. */
+
+#include "bench.h"
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+
+#define BUFSIZE 65536
+
+struct Peer {
+	int fd;
+	gnutls_session_t tls;
+};
+
+static int delay = 0;
+static gnutls_certificate_credentials_t cred;
+static gnutls_priority_t priorities;
+static unsigned long conns = 0;
+static unsigned long reqs = 0;
+
+static int peerread(struct Peer* p, char* buffer, int size) {
+	int rc;
+	if (!p->tls) return read(p->fd, buffer, size);
+	do {
+		rc = gnutls_record_recv(p->tls, buffer, size);
+	} while (rc == GNUTLS_E_AGAIN || rc == GNUTLS_E_INTERRUPTED);
+	return rc < 0 ? -1 : rc;
+}
+
+static int peerwrite(struct Peer* p, const char* buffer, int size) {
+	int pos = 0;
+	int rc;
+	if (!p->tls) return benchwrite(p->fd, buffer, size);
+	while (pos < size) {
+		rc = gnutls_record_send(p->tls, buffer + pos, size - pos);
+		if (rc == GNUTLS_E_AGAIN || rc == GNUTLS_E_INTERRUPTED) continue;
+		if (rc <= 0) return -1;
+		pos += rc;
+	}
+	return size;
+}
+
+static int sendbody(struct Peer* p, long size, int chunked) {
+	static char filler[BUFSIZE];
+	char head[32];
+	int n;
+
+	if (!filler[0]) memset(filler, 'x', sizeof(filler));
+	while (size > 0) {
+		n = size > BUFSIZE ? BUFSIZE : size;
+		if (chunked) {
+			snprintf(head, sizeof(head), "%x\r\n", n);
+			if (peerwrite(p, head, strlen(head)) <= 0) return -1;
+		}
+		if (peerwrite(p, filler, n) <= 0) return -1;
+		if (chunked && peerwrite(p, "\r\n", 2) <= 0) return -1;
+		size -= n;
+	}
+	if (chunked && peerwrite(p, "0\r\n\r\n", 5) <= 0) return -1;
+	return 0;
+}
+
+/* Answers one request. Returns 1 to keep the connection open. */
+static int respond(struct Peer* p, char* request) {
+	char head[512];
+	char body[128];
+	char* path;
+	char* end;
+	long size = 0;
+	int chunked = 0;
+	const char* cache = "";
+	int keepalive;
+	int notmodified;
+
+	__atomic_fetch_add(&reqs, 1, __ATOMIC_RELAXED);
+	keepalive = !strcasestr(request, "\nConnection: close") && strstr(request, "HTTP/1.1");
+	notmodified = strcasestr(request, "\nIf-None-Match:") != NULL;
+	path = strchr(request, ' ');
+	if (!path) return 0;
+	path++;
+	end = strchr(path, ' ');
+	if (end) *end = 0;
+
+	benchsleep(delay);
+
+	if (!strncmp(path, "/bytes/", 7)) {
+		size = atol(path + 7);
+	} else if (!strncmp(path, "/cached/", 8)) {
+		size = atol(path + 8);
+		cache = "Cache-Control: max-age=3600\r\nETag: \"1\"\r\n";
+	} else if (!strncmp(path, "/revalidate/", 12)) {
+		size = atol(path + 12);
+		cache = "Cache-Control: no-cache\r\nETag: \"1\"\r\n";
+		if (notmodified) {
+			snprintf(head, sizeof(head), "HTTP/1.1 304 Not Modified\r\n%s%s\r\n", cache, keepalive ? "" : "Connection: close\r\n");
+			if (peerwrite(p, head, strlen(head)) <= 0) return 0;
+			return keepalive;
+		}
+	} else if (!strncmp(path, "/chunked/", 9)) {
+		size = atol(path + 9);
+		chunked = 1;
+	} else if (!strcmp(path, "/stats")) {
+		snprintf(body, sizeof(body), "conns=%lu reqs=%lu\n",
+			__atomic_load_n(&conns, __ATOMIC_RELAXED), __atomic_load_n(&reqs, __ATOMIC_RELAXED));
+	} else {
+		strcpy(body, "Hello from the benchmark origin.\n");
+	}
+
+	if (size || chunked) {
+		if (chunked) {
+			snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+				"Transfer-Encoding: chunked\r\n%s\r\n", keepalive ? "" : "Connection: close\r\n");
+		} else {
+			snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: application/octet-stream\r\n"
+				"Content-Length: %ld\r\n%s%s\r\n", size, cache, keepalive ? "" : "Connection: close\r\n");
+		}
+		if (peerwrite(p, head, strlen(head)) <= 0) return 0;
+		if (sendbody(p, size, chunked)) return 0;
+	} else {
+		snprintf(head, sizeof(head), "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n"
+			"Content-Length: %zu\r\n%s\r\n%s", strlen(body), keepalive ? "" : "Connection: close\r\n", body);
+		if (peerwrite(p, head, strlen(head)) <= 0) return 0;
+	}
+	return keepalive;
+}
+
+static void* connthread(void* arg) {
+	struct Peer p = { (int)(long)arg, NULL };
+	char* buffer = malloc(BUFSIZE + 1);
+	char* request;
+	char* headend;
+	char* cl;
+	long bodylen;
+	int len = 0;
+	int rc;
+
+	__atomic_fetch_add(&conns, 1, __ATOMIC_RELAXED);
+	if (cred) {
+		gnutls_init(&p.tls, GNUTLS_SERVER);
+		gnutls_credentials_set(p.tls, GNUTLS_CRD_CERTIFICATE, cred);
+		gnutls_priority_set(p.tls, priorities);
+		gnutls_transport_set_int(p.tls, p.fd);
+		do {
+			rc = gnutls_handshake(p.tls);
+		} while (rc < 0 && !gnutls_error_is_fatal(rc));
+		if (rc < 0) goto end;
+	}
+
+	while (1) {
+		buffer[len] = 0;
+		headend = strstr(buffer, "\r\n\r\n");
+		if (!headend) {
+			if (len >= BUFSIZE) break;
+			rc = peerread(&p, buffer + len, BUFSIZE - len);
+			if (rc <= 0) break;
+			len += rc;
+			continue;
+		}
+
+		/* Skip over any request body; we only care that framing stays intact. */
+		*headend = 0;
+		headend += 4;
+		request = strdup(buffer);
+		bodylen = 0;
+		cl = strcasestr(buffer, "\nContent-Length:");
+		if (cl) bodylen = atol(cl + 16);
+		while (buffer + len - headend < bodylen) {
+			bodylen -= buffer + len - headend;
+			len = 0;
+			headend = buffer;
+			rc = peerread(&p, buffer, BUFSIZE);
+			if (rc <= 0) {
+				free(request);
+				goto end;
+			}
+			len = rc;
+		}
+		headend += bodylen;
+
+		rc = respond(&p, request);
+		free(request);
+		if (!rc) break;
+		len -= headend - buffer;
+		memmove(buffer, headend, len);
+	}
+
+	end:
+	if (p.tls) {
+		gnutls_bye(p.tls, GNUTLS_SHUT_WR);
+		gnutls_deinit(p.tls);
+	}
+	close(p.fd);
+	free(buffer);
+	return NULL;
+}
+
+static gnutls_datum_t loadfile(const char* path) {
+	gnutls_datum_t datum = { NULL, 0 };
+	if (gnutls_load_file(path, &datum) < 0) {
+		fprintf(stderr, "Could not load %s\n", path);
+		exit(1);
+	}
+	return datum;
+}
+
+static void savefile(const char* path, gnutls_datum_t* datum) {
+	FILE* fp = fopen(path, "w");
+	if (!fp) { fprintf(stderr, "Could not write %s: %m\n", path); exit(1); }
+	fwrite(datum->data, 1, datum->size, fp);
+	fclose(fp);
+}
+
+static void makecert(gnutls_x509_crt_t crt, gnutls_x509_privkey_t key, const char* cn, int ca) {
+	static unsigned int serial = 1;
+	unsigned char ip[4] = { 127, 0, 0, 1 };
+	int x;
+
+	gnutls_x509_privkey_generate(key, GNUTLS_PK_RSA, 2048, 0);
+	gnutls_x509_crt_set_version(crt, 3);
+	gnutls_x509_crt_set_serial(crt, &serial, sizeof(serial));
+	serial++;
+	gnutls_x509_crt_set_dn_by_oid(crt, GNUTLS_OID_X520_COMMON_NAME, 0, cn, strlen(cn));
+	gnutls_x509_crt_set_activation_time(crt, time(NULL) - 86400);
+	gnutls_x509_crt_set_expiration_time(crt, time(NULL) + 86400 * 365);
+	gnutls_x509_crt_set_key(crt, key);
+	gnutls_x509_crt_set_basic_constraints(crt, ca, -1);
+	if (ca) {
+		gnutls_x509_crt_set_key_usage(crt, GNUTLS_KEY_KEY_CERT_SIGN | GNUTLS_KEY_CRL_SIGN | GNUTLS_KEY_DIGITAL_SIGNATURE);
+	} else {
+		gnutls_x509_crt_set_key_usage(crt, GNUTLS_KEY_DIGITAL_SIGNATURE | GNUTLS_KEY_KEY_ENCIPHERMENT);
+		/* The benchmarks address origins as 127.0.0.1 through 127.0.0.9. */
+		for (x = 1; x <= 9; x++) {
+			ip[3] = x;
+			gnutls_x509_crt_set_subject_alt_name(crt, GNUTLS_SAN_IPADDRESS, ip, 4, GNUTLS_FSAN_APPEND);
+		}
+		gnutls_x509_crt_set_subject_alt_name(crt, GNUTLS_SAN_DNSNAME, "localhost", 9, GNUTLS_FSAN_APPEND);
+	}
+}
+
+static void generateca(const char* certfile, const char* keyfile) {
+	gnutls_x509_crt_t crt;
+	gnutls_x509_privkey_t key;
+	gnutls_datum_t datum;
+
+	gnutls_x509_crt_init(&crt);
+	gnutls_x509_privkey_init(&key);
+	makecert(crt, key, "tsproxy benchmark CA", 1);
+	gnutls_x509_crt_sign2(crt, crt, key, GNUTLS_DIG_SHA256, 0);
+
+	gnutls_x509_crt_export2(crt, GNUTLS_X509_FMT_PEM, &datum);
+	savefile(certfile, &datum);
+	gnutls_free(datum.data);
+	gnutls_x509_privkey_export2(key, GNUTLS_X509_FMT_PEM, &datum);
+	savefile(keyfile, &datum);
+	gnutls_free(datum.data);
+}
+
+static void tlsinit(const char* cafile, const char* cakeyfile) {
+	gnutls_x509_crt_t ca, crt;
+	gnutls_x509_privkey_t cakey, key;
+	gnutls_datum_t datum;
+
+	gnutls_x509_crt_init(&ca);
+	gnutls_x509_privkey_init(&cakey);
+	datum = loadfile(cafile);
+	gnutls_x509_crt_import(ca, &datum, GNUTLS_X509_FMT_PEM);
+	gnutls_free(datum.data);
+	datum = loadfile(cakeyfile);
+	gnutls_x509_privkey_import(cakey, &datum, GNUTLS_X509_FMT_PEM);
+	gnutls_free(datum.data);
+
+	gnutls_x509_crt_init(&crt);
+	gnutls_x509_privkey_init(&key);
+	makecert(crt, key, "127.0.0.1", 0);
+	gnutls_x509_crt_sign2(crt, ca, cakey, GNUTLS_DIG_SHA256, 0);
+
+	gnutls_certificate_allocate_credentials(&cred);
+	gnutls_certificate_set_x509_key(cred, &crt, 1, key);
+	gnutls_priority_init(&priorities, "NORMAL", NULL);
+}
+
+static void* udpecho(void* arg) {
+	char buffer[65536];
+	struct sockaddr_in addr;
+	socklen_t len;
+	int sock = (int)(long)arg;
+	int rc;
+
+	while (1) {
+		len = sizeof(addr);
+		rc = recvfrom(sock, buffer, sizeof(buffer), 0, (struct sockaddr*)&addr, &len);
+		if (rc < 0) continue;
+		benchsleep(delay);
+		sendto(sock, buffer, rc, 0, (struct sockaddr*)&addr, len);
+	}
+	return NULL;
+}
+
+int main(int argc, char* argv[]) {
+	const char* cafile = NULL;
+	const char* cakeyfile = NULL;
+	int tls = 0;
+	int udp = 0;
+	int port = 0;
+	int lsock, sock;
+	int one = 1;
+	int opt;
+	struct sockaddr_in addr;
+
+	signal(SIGPIPE, SIG_IGN);
+	gnutls_global_init();
+
+	while ((opt = getopt(argc, argv, "p:d:sc:k:gu")) != -1) {
+		switch (opt) {
+		case 'p': port = atoi(optarg); break;
+		case 'd': delay = atoi(optarg); break;
+		case 's': tls = 1; break;
+		case 'c': cafile = optarg; break;
+		case 'k': cakeyfile = optarg; break;
+		case 'u': udp = 1; break;
+		case 'g':
+			if (optind + 2 > argc) break;
+			generateca(argv[optind], argv[optind+1]);
+			return 0;
+		}
+	}
+	if (!port || (tls && (!cafile || !cakeyfile))) {
+		fprintf(stderr, "Usage: %s -p port [-d delayms] [-s -c ca.pem -k ca.key] [-u]\n       %s -g ca.pem ca.key\n", argv[0], argv[0]);
+		return 1;
+	}
+	if (tls) tlsinit(cafile, cakeyfile);
+
+	if (udp) {
+		sock = socket(AF_INET, SOCK_DGRAM, 0);
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		if (bind(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+			fprintf(stderr, "Could not bind to UDP port %d: %m\n", port);
+			return 2;
+		}
+		benchthread(udpecho, (void*)(long)sock);
+	}
+
+	lsock = benchlisten(port);
+	while (1) {
+		sock = accept(lsock, NULL, NULL);
+		if (sock < 0) continue;
+		/* Head and body are separate writes; Nagle would hold the body for a delayed ACK. */
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		benchthread(connthread, (void*)(long)sock);
+	}
+	return 0;
+}
+
+
+
+/* EOF */
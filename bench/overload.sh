@@ -0,0 +1,114 @@
+#!/bin/bash
+#
+# Drives transockproxy well past what it can take, and measures whether the
+# connections it already has stay healthy. A few clients send small
+# requests over kept-alive connections for BENCHTIME seconds; a second in,
+# BENCHFLOOD more start opening a new connection per request for all but
+# the last second. Runs with no flood (baseline), with the flood and no
+# limits (none), and with the flood against maxconns and shedding
+# (admission), and appends the steady clients' results to bench/results/,
+# plus what the flood got through and how many of its connections were
+# refused. Needs no root and no network. Invoked by "make bench".
+#
+# Environment:
+#   BENCHTIME    seconds per run (default 6)
+#   BENCHCONC    steady kept-alive clients (default 8)
+#   BENCHFLOOD   flooding clients (default 2000)
+#   BENCHLIMIT   maxconns for the admission run (default 256)
+#   BENCHDELAY   origin response delay in ms (default 10)
+#   BENCHPORT    base port (default 31000)
+#   BENCHONLY    only run labels matching this shell pattern (default *)
+
+cd "$(dirname "$0")/.." || exit 1
+
+BENCHTIME=${BENCHTIME:-6}
+BENCHCONC=${BENCHCONC:-8}
+BENCHFLOOD=${BENCHFLOOD:-2000}
+BENCHLIMIT=${BENCHLIMIT:-256}
+BENCHDELAY=${BENCHDELAY:-10}
+BENCHPORT=${BENCHPORT:-31000}
+BENCHONLY=${BENCHONLY:-*}
+BENCH_COMMIT=${BENCH_COMMIT:-$(git rev-parse --short HEAD 2>/dev/null || echo unknown)}
+export BENCH_COMMIT
+
+HTTPPORT=$((BENCHPORT + 80))
+PROXYPORT=$((BENCHPORT + 888))
+STATSPORT=$((BENCHPORT + 900))
+
+TOP=$(pwd)
+WORK=$(mktemp -d)
+RESULTS=$TOP/bench/results/$BENCH_COMMIT.jsonl
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do kill "$pid" 2>/dev/null; done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+waitport() {
+	for i in $(seq 300); do
+		(exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "Port $1 never came up." >&2
+	exit 1
+}
+
+# Prints the sum of one counter's series from the stats socket.
+stat() {
+	exec 3<>/dev/tcp/127.0.0.1/$STATSPORT || return
+	printf 'GET /metrics HTTP/1.0\r\n\r\n' >&3
+	awk -v name="$1" 'index($1, name) == 1 { sum += $2 } END { print sum + 0 }' <&3 2>/dev/null
+	exec 3<&-
+}
+
+ulimit -n 65536 2>/dev/null || ulimit -n $(ulimit -Hn)
+
+bench/origin -p $HTTPPORT -d $BENCHDELAY & PIDS="$PIDS $!"
+waitport $HTTPPORT
+
+mkdir -p bench/results
+
+for run in baseline none admission; do
+	label="overload/$run"
+	case "$label" in $BENCHONLY) ;; *) continue ;; esac
+	cat > "$WORK/transockproxy.conf" <<CONF
+listen $PROXYPORT
+stats 127.0.0.1:$STATSPORT
+loglevel none
+backlog 4096
+default direct
+CONF
+	if [ $run = admission ]; then
+		echo "maxconns $BENCHLIMIT" >> "$WORK/transockproxy.conf"
+		echo "shed queue=256 delay=100" >> "$WORK/transockproxy.conf"
+	fi
+
+	(cd "$WORK" && exec "$TOP/transockproxy" > "$WORK/transockproxy.log" 2>&1) &
+	proxypid=$!
+	waitport $PROXYPORT
+	waitport $STATSPORT
+
+	bench/loadgen -a 127.0.0.1:$PROXYPORT -H 127.0.0.1:$HTTPPORT -m keepalive \
+		-c $BENCHCONC -t $BENCHTIME -l "$label" > "$WORK/result" &
+	steady=$!
+	echo '{"conns_per_sec":0,"errors":0}' > "$WORK/flood"
+	if [ $run != baseline ]; then
+		sleep 1
+		bench/loadgen -a 127.0.0.1:$PROXYPORT -H 127.0.0.1:$HTTPPORT -m conn \
+			-c $BENCHFLOOD -t $((BENCHTIME - 2)) > "$WORK/flood"
+	fi
+	wait $steady
+	refused=$(stat tsproxy_refused_connections_total)
+	floodrate=$(sed -n 's/.*"conns_per_sec":\([0-9.]*\).*/\1/p' "$WORK/flood")
+	floodfails=$(sed -n 's/.*"errors":\([0-9]*\).*/\1/p' "$WORK/flood")
+	sed "s/}\$/,\"flood\":$([ $run = baseline ] && echo 0 || echo $BENCHFLOOD),\"flood_conns_per_sec\":$floodrate,\"flood_errors\":$floodfails,\"refused\":$refused}/" \
+		"$WORK/result" | tee -a "$RESULTS"
+	kill $proxypid
+	wait $proxypid 2>/dev/null
+done
+
+echo "Results appended to $RESULTS"
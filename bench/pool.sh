@@ -0,0 +1,86 @@
+#!/bin/bash
+#
+# Runs transockproxy against a pool of three SOCKS5 stubs, one of which is
+# slow, once per balancing policy, and appends one JSON line per policy to
+# bench/results/. Compare the p99/p999 columns: roundrobin sends a third of
+# the connections to the slow stub, leastconn and ewma steer around it.
+# Needs no root and no network. Invoked by "make bench".
+#
+# Environment:
+#   BENCHTIME    seconds per policy (default 3)
+#   BENCHCONC    concurrent clients (default 8)
+#   BENCHPORT    base port (default 28000)
+#   SLOWDELAY    latency the slow stub adds before each handshake reply, in ms (default 20)
+#   BENCHONLY    only run labels matching this shell pattern (default *)
+
+cd "$(dirname "$0")/.." || exit 1
+
+BENCHTIME=${BENCHTIME:-3}
+BENCHCONC=${BENCHCONC:-8}
+BENCHPORT=${BENCHPORT:-28000}
+SLOWDELAY=${SLOWDELAY:-20}
+BENCHONLY=${BENCHONLY:-*}
+BENCH_COMMIT=${BENCH_COMMIT:-$(git rev-parse --short HEAD 2>/dev/null || echo unknown)}
+export BENCH_COMMIT
+
+HTTPPORT=$((BENCHPORT + 80))
+SOCKSPORT=$((BENCHPORT + 50))
+PROXYPORT=$((BENCHPORT + 888))
+
+TOP=$(pwd)
+WORK=$(mktemp -d)
+RESULTS=$TOP/bench/results/$BENCH_COMMIT.jsonl
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do kill "$pid" 2>/dev/null; done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+waitport() {
+	for i in $(seq 300); do
+		(exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "Port $1 never came up." >&2
+	exit 1
+}
+
+start() {
+	"$@" &
+	PIDS="$PIDS $!"
+}
+
+start bench/origin -p $HTTPPORT
+start bench/socksstub -p $((SOCKSPORT + 1))
+start bench/socksstub -p $((SOCKSPORT + 2))
+start bench/socksstub -p $((SOCKSPORT + 3)) -d $SLOWDELAY
+
+waitport $HTTPPORT
+for x in 1 2 3; do waitport $((SOCKSPORT + x)); done
+
+mkdir -p bench/results
+
+for policy in roundrobin leastconn ewma; do
+	label="pool/$policy"
+	case "$label" in $BENCHONLY) ;; *) continue ;; esac
+
+	cat > "$WORK/transockproxy.conf" <<CONF
+listen $PROXYPORT
+loglevel none
+pool stubs $policy socks5://127.0.0.1:$((SOCKSPORT + 1)) socks5://127.0.0.1:$((SOCKSPORT + 2)) socks5://127.0.0.1:$((SOCKSPORT + 3))
+default pool:stubs
+CONF
+	(cd "$WORK" && exec "$TOP/transockproxy" > "$WORK/transockproxy.log" 2>&1) &
+	proxypid=$!
+	waitport $PROXYPORT
+	bench/loadgen -a 127.0.0.1:$PROXYPORT -H 127.0.0.1:$HTTPPORT -m conn \
+		-c $BENCHCONC -t $BENCHTIME -l "$label" | tee -a "$RESULTS"
+	kill $proxypid
+	wait $proxypid 2>/dev/null
+done
+
+echo "Results appended to $RESULTS"
@@ -0,0 +1,494 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Replays a capture file (see capture.c) through the proxy against the
+ * local origin, and prints one JSON object with the results like loadgen's.
+ *
+ *   replay -f trace -a proxy:port [-s sslproxy:port] -o httpport [-O httpsport]
+ *          [-x speed] [-c maxconns] [-t seconds] [-l label]
+ *   replay -f trace -L
+ *
+ * Each connection is opened when it was, scaled by -x (2 is twice as fast),
+ * and sends each of its exchanges when it did: a request for /bytes/N that
+ * brings back about as much as the original did, with a body if it sent a
+ * lot. A captured head lends the request its header lines. The proxy can't
+ * see the original hosts here, so each mapping in the trace is given one of
+ * 127.0.0.1 to 127.0.0.9 (the origin's certificate covers those) in the Host:
+ * header; -L lists them, for a config whose map lines send each address
+ * the way its mapping went. */
+
+#include "bench.h"
+#include <gnutls/gnutls.h>
+
+#define BUFSIZE 65536
+#define RESPHEAD 100
+#define MAXMAPPINGS 256
+#define LATE 100000
+
+struct Exchange {
+	unsigned long at;
+	unsigned long up;
+	unsigned long down;
+	const char* head;
+	int headlen;
+};
+
+struct Record {
+	unsigned long start;
+	unsigned long duration;
+	int ssl;
+	int mapping;
+	int refused;		/* Mapped to block or reject */
+	int count;
+	struct Exchange* ex;
+};
+
+struct Mapping {
+	char pattern[256];
+	char proto[16];
+	int conns;
+};
+
+struct Client {
+	int fd;
+	gnutls_session_t tls;
+	char buf[BUFSIZE + 1];
+	int len;
+	int pos;
+};
+
+static const char* proxyaddr;
+static const char* sslproxyaddr;
+static const char* label = "";
+static int httpport = 0;
+static int httpsport = 0;
+static double speed = 1;
+static int maxconns = 512;
+static int seconds = 0;
+static gnutls_certificate_credentials_t cred;
+
+static struct Record* records;
+static int nrecords;
+static struct Mapping mappings[MAXMAPPINGS];
+static int nmappings;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER;
+static int active = 0;
+static unsigned long t0;
+static unsigned long ops, conns, bytes, errors, late, skipped;
+static unsigned int* lat;
+static unsigned long nlat, maxlat;
+
+static int getvarint(const unsigned char** p, const unsigned char* end, unsigned long* v) {
+	int shift = 0;
+
+	*v = 0;
+	while (*p < end && shift < 64) {
+		*v |= (unsigned long)(**p & 0x7f) << shift;
+		if (!(*(*p)++ & 0x80)) return 0;
+		shift += 7;
+	}
+	return -1;
+}
+
+static int getstring(const unsigned char** p, const unsigned char* end, const char** s, unsigned long* len) {
+	if (getvarint(p, end, len) || *len > end - *p) return -1;
+	*s = (const char*)*p;
+	*p += *len;
+	return 0;
+}
+
+static int bystart(const void* a, const void* b) {
+	const struct Record* x = (const struct Record*)a;
+	const struct Record* y = (const struct Record*)b;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Reads the whole trace into records, and its mappings into mappings. */
+static int load(const char* path) {
+	const unsigned char* p;
+	const unsigned char* end;
+	const char* proto;
+	const char* host;
+	const char* pattern;
+	unsigned long protolen, hostlen, patternlen, n, flags;
+	struct Mapping sorted[MAXMAPPINGS];
+	int remap[MAXMAPPINGS];
+	struct Record* r;
+	unsigned char* data;
+	long size;
+	FILE* fp;
+	int x;
+
+	fp = fopen(path, "r");
+	if (!fp) {
+		fprintf(stderr, "Could not open %s: %m\n", path);
+		return -1;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	data = malloc(size + 1);
+	if (fread(data, 1, size, fp) != size || size < 10 || memcmp(data, "TSPTRACE1\n", 10)) {
+		fprintf(stderr, "%s is not a capture file.\n", path);
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	p = data + 10;
+	end = data + size;
+	while (p < end) {
+		records = realloc(records, (nrecords + 1) * sizeof(struct Record));
+		r = &records[nrecords];
+		memset(r, 0, sizeof(*r));
+		if (getvarint(&p, end, &r->start) || getvarint(&p, end, &r->duration) || getvarint(&p, end, &flags)
+			|| getstring(&p, end, &proto, &protolen) || getstring(&p, end, &host, &hostlen)
+			|| getstring(&p, end, &pattern, &patternlen) || getvarint(&p, end, &n)) break;
+		r->ssl = flags & 1;
+		r->ex = calloc(n ? n : 1, sizeof(struct Exchange));
+		for (r->count = 0; r->count < n; r->count++) {
+			struct Exchange* e = &r->ex[r->count];
+			unsigned long headlen;
+			if (getvarint(&p, end, &e->at) || getvarint(&p, end, &e->up) || getvarint(&p, end, &e->down)
+				|| getstring(&p, end, &e->head, &headlen)) break;
+			e->headlen = headlen;
+		}
+		if (r->count < n) break;
+		r->refused = (protolen == 5 && !memcmp(proto, "block", 5)) || (protolen == 6 && !memcmp(proto, "reject", 6));
+		if (patternlen >= sizeof(mappings[0].pattern)) patternlen = sizeof(mappings[0].pattern) - 1;
+		for (x = 0; x < nmappings; x++) {
+			if (strlen(mappings[x].pattern) == patternlen && !memcmp(mappings[x].pattern, pattern, patternlen)) break;
+		}
+		if (x == nmappings && nmappings < MAXMAPPINGS) {
+			memcpy(mappings[x].pattern, pattern, patternlen);
+			snprintf(mappings[x].proto, sizeof(mappings[x].proto), "%.*s", (int)protolen, proto);
+			nmappings++;
+		}
+		r->mapping = x < MAXMAPPINGS ? x : 0;
+		nrecords++;
+	}
+	if (p < end) fprintf(stderr, "%s is cut short after %d connections.\n", path, nrecords);
+
+	/* Records are in the order they closed; replay them in the order they opened, and
+	 * number the mappings that way too, so the same start of a trace always gets the same addresses. */
+	qsort(records, nrecords, sizeof(struct Record), bystart);
+	for (x = 0; x < nmappings; x++) remap[x] = -1;
+	for (x = 0, n = 0; x < nrecords; x++) {
+		r = &records[x];
+		if (remap[r->mapping] < 0) {
+			remap[r->mapping] = n;
+			sorted[n++] = mappings[r->mapping];
+		}
+		r->mapping = remap[r->mapping];
+	}
+	memcpy(mappings, sorted, n * sizeof(struct Mapping));
+	return 0;
+}
+
+static void record(unsigned long us) {
+	if (nlat == maxlat) {
+		maxlat = maxlat ? maxlat * 2 : 65536;
+		lat = realloc(lat, maxlat * sizeof(unsigned int));
+	}
+	lat[nlat++] = us;
+}
+
+static void clientclose(struct Client* c) {
+	if (c->tls) {
+		gnutls_deinit(c->tls);
+		c->tls = NULL;
+	}
+	if (c->fd >= 0) close(c->fd);
+	c->fd = -1;
+}
+
+static int clientopen(struct Client* c, const char* addr, const char* sni) {
+	struct timeval tv = { 10, 0 };
+	int one = 1;
+	int rc;
+
+	c->len = c->pos = 0;
+	c->tls = NULL;
+	c->fd = benchconnect(addr);
+	if (c->fd < 0) return -1;
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	setsockopt(c->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	if (!sni) return 0;
+
+	gnutls_init(&c->tls, GNUTLS_CLIENT);
+	gnutls_credentials_set(c->tls, GNUTLS_CRD_CERTIFICATE, cred);
+	gnutls_set_default_priority(c->tls);
+	gnutls_server_name_set(c->tls, GNUTLS_NAME_DNS, sni, strlen(sni));
+	gnutls_transport_set_int(c->tls, c->fd);
+	do {
+		rc = gnutls_handshake(c->tls);
+	} while (rc < 0 && !gnutls_error_is_fatal(rc));
+	if (rc < 0) {
+		clientclose(c);
+		return -1;
+	}
+	return 0;
+}
+
+static int clientfill(struct Client* c) {
+	int rc;
+	if (c->pos == c->len) c->pos = c->len = 0;
+	if (c->len == BUFSIZE) {
+		memmove(c->buf, c->buf + c->pos, c->len - c->pos);
+		c->len -= c->pos;
+		c->pos = 0;
+	}
+	if (c->tls) {
+		do {
+			rc = gnutls_record_recv(c->tls, c->buf + c->len, BUFSIZE - c->len);
+		} while (rc == GNUTLS_E_INTERRUPTED || rc == GNUTLS_E_AGAIN);
+		if (rc < 0) rc = -1;
+	} else {
+		rc = read(c->fd, c->buf + c->len, BUFSIZE - c->len);
+	}
+	if (rc > 0) c->len += rc;
+	return rc;
+}
+
+static int clientsend(struct Client* c, const char* data, int size) {
+	int pos = 0;
+	int rc;
+	if (!c->tls) return benchwrite(c->fd, data, size);
+	while (pos < size) {
+		rc = gnutls_record_send(c->tls, data + pos, size - pos);
+		if (rc <= 0) return -1;
+		pos += rc;
+	}
+	return size;
+}
+
+/* Reads a whole response. Returns the bytes it took, or -1. */
+static long response(struct Client* c) {
+	char* head;
+	char* end;
+	char* cl;
+	long length = 0;
+	long got;
+	int n;
+
+	while (1) {
+		head = c->buf + c->pos;
+		c->buf[c->len] = 0;
+		if ((end = strstr(head, "\r\n\r\n"))) break;
+		if (c->len - c->pos >= BUFSIZE - 1) return -1;
+		if (clientfill(c) <= 0) return -1;
+	}
+	if (strncmp(head, "HTTP/1.", 7)) return -1;
+	cl = strcasestr(head, "\r\nContent-Length:");
+	if (cl && cl < end) length = atol(cl + 17);
+	c->pos = end + 4 - c->buf;
+	got = c->pos - (head - c->buf);
+
+	while (length > 0) {
+		n = c->len - c->pos;
+		if (n > length) n = length;
+		got += n;
+		length -= n;
+		c->pos += n;
+		if (!length) break;
+		if (clientfill(c) <= 0) return -1;
+	}
+	return got;
+}
+
+/* Builds the request for e into out: the captured head's header lines, if
+ * any, under our own request line, Host: and framing. Returns its length,
+ * and the body length in *body. */
+static int buildrequest(char* out, int size, const struct Exchange* e, const char* host, long* body) {
+	const char* line;
+	const char* next;
+	const char* end;
+	long down = e->down > RESPHEAD ? e->down - RESPHEAD : 0;
+	int n, len;
+
+	n = snprintf(out, size, "%s /bytes/%ld HTTP/1.1\r\nHost: %s\r\n", e->up > 1024 ? "POST" : "GET", down, host);
+	if (e->headlen && memchr(e->head, '\n', e->headlen)) {
+		end = e->head + e->headlen;
+		line = (const char*)memchr(e->head, '\n', e->headlen) + 1;
+		for (; line < end; line = next) {
+			next = memchr(line, '\n', end - line);
+			if (!next) break;
+			next++;
+			len = next - line;
+			if (len <= 2) break;
+			if (!strncasecmp(line, "Host:", 5) || !strncasecmp(line, "Content-Length:", 15)
+				|| !strncasecmp(line, "Transfer-Encoding:", 18) || !strncasecmp(line, "Connection:", 11)
+				|| !strncasecmp(line, "Expect:", 7) || !strncasecmp(line, "Upgrade:", 8)) continue;
+			if (n + len + 64 >= size) break;
+			memcpy(out + n, line, len);
+			n += len;
+		}
+	}
+	*body = e->up > 1024 && e->up > n + 64 ? e->up - n - 64 : 0;
+	if (*body) n += snprintf(out + n, size - n, "Content-Length: %ld\r\n", *body);
+	n += snprintf(out + n, size - n, "\r\n");
+	return n;
+}
+
+static void waituntil(unsigned long us) {
+	unsigned long now = benchus();
+	if (us > now) usleep(us - now);
+}
+
+static void* replayconn(void* arg) {
+	struct Record* r = (struct Record*)arg;
+	struct Client* c = calloc(1, sizeof(struct Client));
+	static char filler[BUFSIZE];
+	char request[4096];
+	char host[64];
+	char sni[16];
+	unsigned long start = benchus();
+	unsigned long sent, xbytes = 0;
+	long body, n;
+	int failed = 0;
+	int x;
+
+	if (!filler[0]) memset(filler, 'x', sizeof(filler));
+	snprintf(sni, sizeof(sni), "127.0.0.%d", 1 + r->mapping % 9);
+	snprintf(host, sizeof(host), "%s:%d", sni, r->ssl ? httpsport : httpport);
+	c->fd = -1;
+	if (clientopen(c, r->ssl ? sslproxyaddr : proxyaddr, r->ssl ? sni : NULL)) failed = !r->refused;
+
+	for (x = 0; c->fd >= 0 && x < r->count; x++) {
+		waituntil(start + r->ex[x].at / speed * 1000);
+		n = buildrequest(request, sizeof(request), &r->ex[x], host, &body);
+		sent = benchus();
+		if (clientsend(c, request, n) != n) n = -1;
+		for (; n >= 0 && body > 0; body -= sizeof(filler) < body ? sizeof(filler) : body) {
+			if (clientsend(c, filler, sizeof(filler) < body ? sizeof(filler) : body) <= 0) n = -1;
+		}
+		if (n >= 0) n = response(c);
+		if (n < 0) {
+			/* Turned away, as it was meant to be. */
+			failed = !r->refused;
+			break;
+		}
+		xbytes += n;
+		pthread_mutex_lock(&lock);
+		ops++;
+		record(benchus() - sent);
+		pthread_mutex_unlock(&lock);
+	}
+	/* Kept open, idle, as long as the original was. */
+	if (c->fd >= 0) waituntil(start + r->duration / speed * 1000);
+	clientclose(c);
+	free(c);
+
+	pthread_mutex_lock(&lock);
+	if (failed) errors++;
+	else conns++;
+	bytes += xbytes;
+	active--;
+	pthread_cond_signal(&done);
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+static int cmplat(const void* a, const void* b) {
+	unsigned int x = *(const unsigned int*)a;
+	unsigned int y = *(const unsigned int*)b;
+	return x < y ? -1 : x > y;
+}
+
+static double percentile(unsigned long n, double q) {
+	unsigned long idx;
+	if (!n) return 0;
+	idx = (unsigned long)(n * q);
+	if (idx >= n) idx = n - 1;
+	return lat[idx] / 1000.0;
+}
+
+int main(int argc, char* argv[]) {
+	const char* trace = NULL;
+	const char* commit = getenv("BENCH_COMMIT");
+	unsigned long due, now, end;
+	int list = 0;
+	int x, opt;
+
+	signal(SIGPIPE, SIG_IGN);
+	while ((opt = getopt(argc, argv, "f:a:s:o:O:x:c:t:l:L")) != -1) {
+		switch (opt) {
+		case 'f': trace = optarg; break;
+		case 'a': proxyaddr = optarg; break;
+		case 's': sslproxyaddr = optarg; break;
+		case 'o': httpport = atoi(optarg); break;
+		case 'O': httpsport = atoi(optarg); break;
+		case 'x': speed = atof(optarg); break;
+		case 'c': maxconns = atoi(optarg); break;
+		case 't': seconds = atoi(optarg); break;
+		case 'l': label = optarg; break;
+		case 'L': list = 1; break;
+		}
+	}
+	if (!trace || (!list && (!proxyaddr || !httpport)) || speed <= 0 || maxconns < 1) {
+		fprintf(stderr, "Usage: %s -f trace -a proxy:port [-s sslproxy:port] -o httpport [-O httpsport] [-x speed] [-c maxconns] [-t seconds] [-l label]\n"
+			"       %s -f trace -L\n", argv[0], argv[0]);
+		return 1;
+	}
+	if (load(trace)) return 1;
+
+	if (list) {
+		for (x = 0; x < nrecords; x++) mappings[records[x].mapping].conns++;
+		for (x = 0; x < nmappings; x++) {
+			printf("127.0.0.%d %s %s %d\n", 1 + x % 9, mappings[x].proto, mappings[x].pattern, mappings[x].conns);
+		}
+		return 0;
+	}
+
+	gnutls_global_init();
+	gnutls_certificate_allocate_credentials(&cred);
+	t0 = benchus();
+	end = seconds ? t0 + seconds * 1000000UL : 0;
+	for (x = 0; x < nrecords; x++) {
+		if (records[x].ssl && (!sslproxyaddr || !httpsport)) {
+			skipped++;
+			continue;
+		}
+		due = t0 + (records[x].start - records[0].start) / speed * 1000;
+		if (end && due > end) break;
+		waituntil(due);
+		pthread_mutex_lock(&lock);
+		while (active >= maxconns) pthread_cond_wait(&done, &lock);
+		active++;
+		pthread_mutex_unlock(&lock);
+		now = benchus();
+		if (now > due + LATE) late++;
+		benchthread(replayconn, &records[x]);
+	}
+	pthread_mutex_lock(&lock);
+	while (active) pthread_cond_wait(&done, &lock);
+	pthread_mutex_unlock(&lock);
+
+	now = benchus();
+	qsort(lat, nlat, sizeof(unsigned int), cmplat);
+	printf("{\"commit\":\"%s\",\"label\":\"%s\",\"mode\":\"replay\",\"tls\":%d,\"concurrency\":%d,"
+		"\"seconds\":%.2f,\"ops\":%lu,\"errors\":%lu,\"conns_per_sec\":%.1f,\"reqs_per_sec\":%.1f,"
+		"\"mbytes_per_sec\":%.2f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"rss_per_conn_kb\":-1.0,"
+		"\"speed\":%g,\"late_conns\":%lu,\"skipped_conns\":%lu}\n",
+		commit ? commit : "", label, sslproxyaddr != NULL, maxconns, (now - t0) / 1e6, ops, errors,
+		conns / ((now - t0) / 1e6), ops / ((now - t0) / 1e6), bytes / ((now - t0) / 1e6) / 1048576.0,
+		percentile(nlat, 0.5), percentile(nlat, 0.99), percentile(nlat, 0.999), speed, late, skipped);
+	return 0;
+}
+
+
+
+/* EOF */
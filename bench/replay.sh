@@ -0,0 +1,135 @@
+#!/bin/bash
+#
+# Replays a capture through transockproxys against the local origins and
+# SOCKS5 stub, at 1x and BENCHSPEED times as fast, and appends one JSON line
+# per run to bench/results/. With no BENCHTRACE it records one first: a
+# few seconds of browser-like HTTP, direct and through the stub, plus new
+# HTTPS connections and a bulk download, captured with request heads. Each
+# mapping in the trace is sent to its own 127.0.0.x by replay, and the
+# config gets a map line for each, going direct, through the stub, or
+# turned away, the way the mapping did when it was captured.
+# Needs no root and no network. Invoked by "make bench".
+#
+# Environment:
+#   BENCHTRACE   capture file to replay (default: record one)
+#   BENCHTIME    seconds to record for (default 3)
+#   BENCHSPEED   the faster replay's speed-up (default 4)
+#   BENCHPORT    base port (default 30000)
+#   BENCHONLY    only run labels matching this shell pattern (default *)
+
+cd "$(dirname "$0")/.." || exit 1
+
+BENCHTIME=${BENCHTIME:-3}
+BENCHSPEED=${BENCHSPEED:-4}
+BENCHPORT=${BENCHPORT:-30000}
+BENCHONLY=${BENCHONLY:-*}
+BENCH_COMMIT=${BENCH_COMMIT:-$(git rev-parse --short HEAD 2>/dev/null || echo unknown)}
+export BENCH_COMMIT
+
+HTTPPORT=$((BENCHPORT + 80))
+TLSPORT=$((BENCHPORT + 443))
+SOCKSPORT=$((BENCHPORT + 1080))
+PROXYPORT=$((BENCHPORT + 888))
+SSLPORT=$((BENCHPORT + 889))
+
+TOP=$(pwd)
+WORK=$(mktemp -d)
+RESULTS=$TOP/bench/results/$BENCH_COMMIT.jsonl
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do kill "$pid" 2>/dev/null; done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+waitport() {
+	for i in $(seq 300); do
+		(exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "Port $1 never came up." >&2
+	exit 1
+}
+
+startproxy() {
+	(cd "$WORK" && exec "$TOP/transockproxys" > "$WORK/transockproxys.log" 2>&1) &
+	proxypid=$!
+	waitport $PROXYPORT
+	waitport $SSLPORT
+}
+
+stopproxy() {
+	kill $proxypid
+	wait $proxypid 2>/dev/null
+}
+
+ulimit -n 65536 2>/dev/null || ulimit -n $(ulimit -Hn)
+
+bench/origin -g "$WORK/ca.pem" "$WORK/ca.key" || exit 1
+bench/origin -p $HTTPPORT & PIDS="$PIDS $!"
+bench/origin -p $TLSPORT -s -c "$WORK/ca.pem" -k "$WORK/ca.key" & PIDS="$PIDS $!"
+bench/socksstub -p $SOCKSPORT & PIDS="$PIDS $!"
+waitport $HTTPPORT
+waitport $TLSPORT
+waitport $SOCKSPORT
+
+mkdir -p bench/results
+
+TRACE=${BENCHTRACE:-$WORK/trace}
+if [ -z "$BENCHTRACE" ]; then
+	cat > "$WORK/transockproxy.conf" <<CONF
+listen $PROXYPORT
+ssl $SSLPORT
+sslcert $WORK/ca.pem
+sslkey $WORK/ca.key
+ssltrust $WORK/ca.pem
+loglevel none
+httpmode aware
+capture $TRACE payload
+map 127.0.0.2:* socks5://127.0.0.1:$SOCKSPORT
+default direct
+CONF
+	startproxy
+	LOADS=""
+	bench/loadgen -a 127.0.0.1:$PROXYPORT -H 127.0.0.1:$HTTPPORT -m browser -r 6 -c 4 -t $BENCHTIME > /dev/null & LOADS="$LOADS $!"
+	bench/loadgen -a 127.0.0.1:$PROXYPORT -H 127.0.0.2:$HTTPPORT -m browser -r 3 -c 2 -t $BENCHTIME > /dev/null & LOADS="$LOADS $!"
+	bench/loadgen -a 127.0.0.1:$SSLPORT -H 127.0.0.1:$TLSPORT -S -m conn -c 2 -t $BENCHTIME > /dev/null & LOADS="$LOADS $!"
+	bench/loadgen -a 127.0.0.1:$PROXYPORT -H 127.0.0.1:$HTTPPORT -m bulk -b 4194304 -c 1 -t $BENCHTIME > /dev/null & LOADS="$LOADS $!"
+	wait $LOADS
+	stopproxy
+fi
+bench/replay -f "$TRACE" -L > "$WORK/mappings" || exit 1
+echo "Trace: $(du -k "$TRACE" | cut -f1) KB, mappings:" >&2
+cat "$WORK/mappings" >&2
+
+cat > "$WORK/transockproxy.conf" <<CONF
+listen $PROXYPORT
+ssl $SSLPORT
+sslcert $WORK/ca.pem
+sslkey $WORK/ca.key
+ssltrust $WORK/ca.pem
+loglevel none
+httpmode aware
+CONF
+while read addr proto pattern conns; do
+	case $proto in
+	direct) echo "map $addr:* direct" ;;
+	block|reject) echo "map $addr:* $proto" ;;
+	socks*|pool) echo "map $addr:* socks5://127.0.0.1:$SOCKSPORT" ;;
+	esac
+done < "$WORK/mappings" >> "$WORK/transockproxy.conf"
+echo "default direct" >> "$WORK/transockproxy.conf"
+
+for speed in 1 $BENCHSPEED; do
+	label="replay/${speed}x"
+	case "$label" in $BENCHONLY) ;; *) continue ;; esac
+	startproxy
+	bench/replay -f "$TRACE" -a 127.0.0.1:$PROXYPORT -s 127.0.0.1:$SSLPORT -o $HTTPPORT -O $TLSPORT \
+		-x $speed -l "$label" | tee -a "$RESULTS"
+	stopproxy
+done
+
+echo "Results appended to $RESULTS"
@@ -0,0 +1,120 @@
+#!/bin/bash
+#
+# Runs transockproxy and transockproxys against local stub servers on
+# loopback and records one JSON line per scenario in bench/results/.
+# Needs no root and no network. Invoked by "make bench".
+#
+# Environment:
+#   BENCHTIME    seconds per scenario (default 3)
+#   BENCHCONC    concurrent clients (default 8)
+#   BENCHIDLE    connections for the RSS scenario (default 500)
+#   BENCHPORT    base port (default 28000)
+#   SOCKSDELAY   latency injected by the SOCKS stub, in ms (default 0)
+#   ORIGINDELAY  latency injected by the origins, in ms (default 0)
+#   BENCHONLY    only run labels matching this shell pattern (default *)
+#   BENCHCONF    file with extra lines appended to the proxy config
+
+cd "$(dirname "$0")/.." || exit 1
+
+BENCHTIME=${BENCHTIME:-3}
+BENCHCONC=${BENCHCONC:-8}
+BENCHIDLE=${BENCHIDLE:-500}
+BENCHPORT=${BENCHPORT:-28000}
+SOCKSDELAY=${SOCKSDELAY:-0}
+ORIGINDELAY=${ORIGINDELAY:-0}
+BENCHONLY=${BENCHONLY:-*}
+BENCH_COMMIT=${BENCH_COMMIT:-$(git rev-parse --short HEAD 2>/dev/null || echo unknown)}
+export BENCH_COMMIT
+
+HTTPPORT=$((BENCHPORT + 80))
+TLSPORT=$((BENCHPORT + 443))
+SOCKSPORT=$((BENCHPORT + 50))
+PROXYPORT=$((BENCHPORT + 888))
+SSLPORT=$((BENCHPORT + 889))
+STATSPORT=$((BENCHPORT + 900))
+
+TOP=$(pwd)
+WORK=$(mktemp -d)
+RESULTS=$TOP/bench/results/$BENCH_COMMIT.jsonl
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do kill "$pid" 2>/dev/null; done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+waitport() {
+	for i in $(seq 300); do
+		(exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "Port $1 never came up." >&2
+	exit 1
+}
+
+start() {
+	"$@" &
+	PIDS="$PIDS $!"
+	LASTPID=$!
+}
+
+# Each mapping type gets its own loopback address, so the Host: header picks it.
+mappings="direct:127.0.0.1 socks4:127.0.0.2 socks4a:127.0.0.3 socks5:127.0.0.4"
+
+bench/origin -g "$WORK/ca.pem" "$WORK/ca.key" || exit 1
+start bench/origin -p $HTTPPORT -d $ORIGINDELAY
+start bench/origin -p $TLSPORT -d $ORIGINDELAY -s -c "$WORK/ca.pem" -k "$WORK/ca.key"
+start bench/socksstub -p $SOCKSPORT -d $SOCKSDELAY
+
+cat > "$WORK/transockproxy.conf" <<CONF
+listen $PROXYPORT
+ssl $SSLPORT
+sslcert $WORK/ca.pem
+sslkey $WORK/ca.key
+ssltrust $WORK/ca.pem
+stats 127.0.0.1:$STATSPORT
+loglevel none
+map 127.0.0.2* socks4://127.0.0.1:$SOCKSPORT
+map 127.0.0.3* socks4a://127.0.0.1:$SOCKSPORT
+map 127.0.0.4* socks5://127.0.0.1:$SOCKSPORT
+default direct
+CONF
+[ -n "$BENCHCONF" ] && cat "$BENCHCONF" >> "$WORK/transockproxy.conf"
+
+waitport $HTTPPORT
+waitport $TLSPORT
+waitport $SOCKSPORT
+
+mkdir -p bench/results
+: > "$RESULTS"
+
+run() {
+	# run <binary> <tls flag> <origin port> <proxy port>
+	binary=$1 tlsflag=$2 originport=$3 proxyport=$4
+	(cd "$WORK" && exec "$TOP/$binary" > "$WORK/$binary.log" 2>&1) &
+	proxypid=$!
+	PIDS="$PIDS $proxypid"
+	waitport $proxyport
+	for m in $mappings; do
+		name=${m%%:*}
+		addr=${m#*:}
+		for mode in conn keepalive bulk idle; do
+			label="$name/$([ -n "$tlsflag" ] && echo tls || echo http)/$mode"
+			case "$label" in $BENCHONLY) ;; *) continue ;; esac
+			bench/loadgen -a 127.0.0.1:$proxyport -H $addr:$originport -m $mode $tlsflag \
+				-c $BENCHCONC -t $BENCHTIME -n $BENCHIDLE -P $proxypid -l "$label" | tee -a "$RESULTS"
+			# Give the proxy a moment to reap the previous scenario's connections.
+			sleep 1
+		done
+	done
+	kill $proxypid
+	wait $proxypid 2>/dev/null
+}
+
+run transockproxy "" $HTTPPORT $PROXYPORT
+run transockproxys -S $TLSPORT $SSLPORT
+
+echo "Results written to $RESULTS"
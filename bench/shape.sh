@@ -0,0 +1,88 @@
+#!/bin/bash
+#
+# Measures small-request latency through transockproxy while bulk downloads
+# share the same mapping, once unlimited and once with "ratelimit default",
+# and appends one JSON line per run to bench/results/: the small requests'
+# latency with the bulk downloads' throughput added. With the limit on, bulk
+# should settle near BENCHRATE while the small requests, which get the
+# bucket's reserve, stay close to their unloaded latency.
+# Needs no root and no network. Invoked by "make bench".
+#
+# Environment:
+#   BENCHTIME    seconds per run (default 3)
+#   BENCHBULK    concurrent bulk downloads (default 2)
+#   BENCHPORT    base port (default 28000)
+#   BENCHRATE    the limit, in ratelimit's syntax (default 4m)
+#   BENCHONLY    only run labels matching this shell pattern (default *)
+
+cd "$(dirname "$0")/.." || exit 1
+
+BENCHTIME=${BENCHTIME:-3}
+BENCHBULK=${BENCHBULK:-2}
+BENCHPORT=${BENCHPORT:-28000}
+BENCHRATE=${BENCHRATE:-4m}
+BENCHONLY=${BENCHONLY:-*}
+BENCH_COMMIT=${BENCH_COMMIT:-$(git rev-parse --short HEAD 2>/dev/null || echo unknown)}
+export BENCH_COMMIT
+
+HTTPPORT=$((BENCHPORT + 80))
+PROXYPORT=$((BENCHPORT + 888))
+STATSPORT=$((BENCHPORT + 900))
+
+TOP=$(pwd)
+WORK=$(mktemp -d)
+RESULTS=$TOP/bench/results/$BENCH_COMMIT.jsonl
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do kill "$pid" 2>/dev/null; done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+waitport() {
+	for i in $(seq 300); do
+		(exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "Port $1 never came up." >&2
+	exit 1
+}
+
+bench/origin -p $HTTPPORT & PIDS="$PIDS $!"
+waitport $HTTPPORT
+
+mkdir -p bench/results
+
+for limit in unlimited limited; do
+	label="shape/$limit"
+	case "$label" in $BENCHONLY) ;; *) continue ;; esac
+
+	cat > "$WORK/transockproxy.conf" <<CONF
+listen $PROXYPORT
+stats 127.0.0.1:$STATSPORT
+loglevel none
+default direct
+CONF
+	[ $limit = limited ] && echo "ratelimit default $BENCHRATE" >> "$WORK/transockproxy.conf"
+
+	(cd "$WORK" && exec "$TOP/transockproxy" > "$WORK/transockproxy.log" 2>&1) &
+	proxypid=$!
+	waitport $PROXYPORT
+	# Small enough downloads that the bulk run ends soon after the small one.
+	bench/loadgen -a 127.0.0.1:$PROXYPORT -H 127.0.0.1:$HTTPPORT -m bulk -b 1048576 \
+		-c $BENCHBULK -t $BENCHTIME -l "$label/bulk" > "$WORK/bulk" &
+	bulkpid=$!
+	sleep 0.5
+	bench/loadgen -a 127.0.0.1:$PROXYPORT -H 127.0.0.1:$HTTPPORT -m browser -u / \
+		-c 1 -t $((BENCHTIME - 1)) -l "$label" > "$WORK/result"
+	wait $bulkpid
+	bulkrate=$(sed 's/.*"mbytes_per_sec":\([0-9.]*\).*/\1/' "$WORK/bulk")
+	sed "s/}\$/,\"bulk_mbytes_per_sec\":${bulkrate:-0}}/" "$WORK/result" | tee -a "$RESULTS"
+	kill $proxypid
+	wait $proxypid 2>/dev/null
+done
+
+echo "Results appended to $RESULTS"
@@ -0,0 +1,91 @@
+#!/bin/bash
+#
+# Measures transockproxy through a SOCKS5 stub that holds relayed data back
+# BENCHLATENCY ms each way, like a long link (no netem, so no root), with
+# the default mapping bare and with socket profiles, and appends one JSON
+# line per run to bench/results/: bulk downloads, and small requests on
+# kept-alive connections. "tuned" has big buffers, Nagle off and a low
+# unsent-data mark; "bbr" adds BBR congestion control, or notes in the log
+# that it fell back to the default where the module isn't available.
+# Needs no root and no network. Invoked by "make bench".
+#
+# Environment:
+#   BENCHTIME      seconds per run (default 3)
+#   BENCHCONC      concurrent connections (default 8)
+#   BENCHLATENCY   one-way latency added by the stub, in ms (default 50)
+#   BENCHPORT      base port (default 29000)
+#   BENCHONLY      only run labels matching this shell pattern (default *)
+
+cd "$(dirname "$0")/.." || exit 1
+
+BENCHTIME=${BENCHTIME:-3}
+BENCHCONC=${BENCHCONC:-8}
+BENCHLATENCY=${BENCHLATENCY:-50}
+BENCHPORT=${BENCHPORT:-29000}
+BENCHONLY=${BENCHONLY:-*}
+BENCH_COMMIT=${BENCH_COMMIT:-$(git rev-parse --short HEAD 2>/dev/null || echo unknown)}
+export BENCH_COMMIT
+
+HTTPPORT=$((BENCHPORT + 80))
+SOCKSPORT=$((BENCHPORT + 1080))
+PROXYPORT=$((BENCHPORT + 888))
+
+TOP=$(pwd)
+WORK=$(mktemp -d)
+RESULTS=$TOP/bench/results/$BENCH_COMMIT.jsonl
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do kill "$pid" 2>/dev/null; done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+waitport() {
+	for i in $(seq 300); do
+		(exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "Port $1 never came up." >&2
+	exit 1
+}
+
+bench/origin -p $HTTPPORT & PIDS="$PIDS $!"
+bench/socksstub -p $SOCKSPORT -l $BENCHLATENCY & PIDS="$PIDS $!"
+waitport $HTTPPORT
+waitport $SOCKSPORT
+
+mkdir -p bench/results
+
+for profile in none tuned bbr; do
+	cat > "$WORK/transockproxy.conf" <<CONF
+listen $PROXYPORT
+loglevel warn
+sockprofile tuned rcvbuf=4m sndbuf=4m nodelay=on notsentlowat=16k keepalive=60,10,5 usertimeout=30000
+sockprofile bbr rcvbuf=4m sndbuf=4m nodelay=on notsentlowat=16k congestion=bbr
+CONF
+	if [ $profile = none ]; then
+		echo "default socks5://127.0.0.1:$SOCKSPORT" >> "$WORK/transockproxy.conf"
+	else
+		echo "default socks5://127.0.0.1:$SOCKSPORT profile=$profile" >> "$WORK/transockproxy.conf"
+	fi
+
+	(cd "$WORK" && exec "$TOP/transockproxy" > "$WORK/transockproxy.log" 2>&1) &
+	proxypid=$!
+	waitport $PROXYPORT
+	grep -h "not available" "$WORK/transockproxy.log" >&2
+
+	for mode in bulk keepalive; do
+		label="sockprofile/$profile/$mode"
+		case "$label" in $BENCHONLY) ;; *) continue ;; esac
+		bench/loadgen -a 127.0.0.1:$PROXYPORT -H 127.0.0.1:$HTTPPORT -m $mode -b 4194304 \
+			-c $BENCHCONC -t $BENCHTIME -l "$label" > "$WORK/result"
+		sed "s/}\$/,\"latency_ms\":$BENCHLATENCY}/" "$WORK/result" | tee -a "$RESULTS"
+	done
+	kill $proxypid
+	wait $proxypid 2>/dev/null
+done
+
+echo "Results appended to $RESULTS"
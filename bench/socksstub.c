@@ -0,0 +1,355 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Minimal SOCKS4, SOCKS4a and SOCKS5 (no auth, CONNECT and UDP ASSOCIATE)
+ * server for benchmarks, with injectable latency before each handshake reply.
+ * With -l, relayed data is also held back that many ms each way, like a long
+ * link: the bytes in flight pile up in a queue instead of being slowed down.
+ *
+ *   socksstub -p port [-d delayms] [-l latencyms] */
+
+#include "bench.h"
+
+/* Most a delayed direction holds before it stops reading, like a bottleneck's queue. */
+#define LINKQUEUE (8 << 20)
+
+static int delay = 0;
+static int latency = 0;
+
+struct Chunk {
+	struct Chunk* next;
+	unsigned long due;
+	int len;
+	char data[16384];
+};
+
+/* One direction of a delayed relay. */
+struct Link {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct Chunk* head;
+	struct Chunk** tail;
+	long queued;
+	int from, to;
+	int done;
+};
+
+static int dial(struct sockaddr_in* addr) {
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (connect(sock, (struct sockaddr*)addr, sizeof(*addr))) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+static int resolve(const char* host, struct sockaddr_in* addr) {
+	struct addrinfo hints;
+	struct addrinfo* info;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, NULL, &hints, &info)) return -1;
+	addr->sin_addr = ((struct sockaddr_in*)info->ai_addr)->sin_addr;
+	freeaddrinfo(info);
+	return 0;
+}
+
+/* Reads a NUL-terminated string off the socket. */
+static int readstring(int fd, char* buffer, int size) {
+	int pos = 0;
+	while (pos < size) {
+		if (read(fd, buffer + pos, 1) != 1) return -1;
+		if (!buffer[pos]) return pos;
+		pos++;
+	}
+	return -1;
+}
+
+static int socks4(int csock) {
+	unsigned char req[7];
+	unsigned char reply[8] = { 0, 0x5a, 0, 0, 0, 0, 0, 0 };
+	char user[256], host[256];
+	struct sockaddr_in addr;
+	int ssock;
+
+	if (benchread(csock, req, 7) != 7 || req[0] != 1) return -1;
+	if (readstring(csock, user, sizeof(user)) < 0) return -1;
+
+	addr.sin_family = AF_INET;
+	memcpy(&addr.sin_port, req + 1, 2);
+	memcpy(&addr.sin_addr, req + 3, 4);
+	if (!req[3] && !req[4] && !req[5] && req[6]) {
+		/* SOCKS4a: the real destination name follows. */
+		if (readstring(csock, host, sizeof(host)) < 0) return -1;
+		if (resolve(host, &addr)) reply[1] = 0x5b;
+	}
+
+	benchsleep(delay);
+	ssock = reply[1] == 0x5a ? dial(&addr) : -1;
+	if (ssock < 0) reply[1] = 0x5b;
+	benchwrite(csock, reply, sizeof(reply));
+	return ssock;
+}
+
+/* Relays datagrams for one UDP association until its TCP connection closes.
+ * The first sender is taken to be the client; everyone else is a destination. */
+static void udprelay(int csock, int usock) {
+	unsigned char buffer[65536];
+	struct pollfd fds[2] = { { csock, POLLIN, 0 }, { usock, POLLIN, 0 } };
+	struct sockaddr_in client, from, to;
+	socklen_t len;
+	int known = 0;
+	int rc;
+
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	while (poll(fds, 2, -1) > 0) {
+		if (fds[0].revents) return;
+		len = sizeof(from);
+		rc = recvfrom(usock, buffer + 10, sizeof(buffer) - 10, 0, (struct sockaddr*)&from, &len);
+		if (rc < 0) continue;
+		if (!known) {
+			client = from;
+			known = 1;
+		}
+		if (from.sin_addr.s_addr == client.sin_addr.s_addr && from.sin_port == client.sin_port) {
+			/* RSV, FRAG, ATYP: unfragmented IPv4 only. */
+			if (rc < 10 || buffer[12] || buffer[13] != 1) continue;
+			memcpy(&to.sin_addr, buffer + 14, 4);
+			memcpy(&to.sin_port, buffer + 18, 2);
+			sendto(usock, buffer + 20, rc - 10, 0, (struct sockaddr*)&to, sizeof(to));
+		} else {
+			memset(buffer, 0, 3);
+			buffer[3] = 1;
+			memcpy(buffer + 4, &from.sin_addr, 4);
+			memcpy(buffer + 8, &from.sin_port, 2);
+			sendto(usock, buffer, rc + 10, 0, (struct sockaddr*)&client, sizeof(client));
+		}
+	}
+}
+
+static void associate(int csock) {
+	unsigned char reply[10] = { 5, 0, 0, 1, 0, 0, 0, 0, 0, 0 };
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	int usock;
+
+	/* Relay on the address the client reached us at. */
+	getsockname(csock, (struct sockaddr*)&addr, &len);
+	addr.sin_port = 0;
+	usock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (bind(usock, (struct sockaddr*)&addr, sizeof(addr))) reply[1] = 1;
+	len = sizeof(addr);
+	getsockname(usock, (struct sockaddr*)&addr, &len);
+	memcpy(reply + 4, &addr.sin_addr, 4);
+	memcpy(reply + 8, &addr.sin_port, 2);
+
+	benchsleep(delay);
+	benchwrite(csock, reply, sizeof(reply));
+	if (!reply[1]) udprelay(csock, usock);
+	close(usock);
+}
+
+static int socks5(int csock) {
+	unsigned char buffer[512];
+	unsigned char reply[10] = { 5, 0, 0, 1, 0, 0, 0, 0, 0, 0 };
+	struct sockaddr_in addr;
+	int ssock = -1;
+	int n;
+
+	if (benchread(csock, buffer, 1) != 1) return -1;
+	n = buffer[0];
+	if (benchread(csock, buffer, n) != n) return -1;
+	benchsleep(delay);
+	buffer[0] = 5;
+	buffer[1] = 0;
+	benchwrite(csock, buffer, 2);
+
+	if (benchread(csock, buffer, 4) != 4 || buffer[0] != 5) return -1;
+	if (buffer[1] == 3 && buffer[3] == 1) {
+		/* UDP ASSOCIATE; where the client will send from doesn't matter here. */
+		if (benchread(csock, buffer, 6) != 6) return -1;
+		associate(csock);
+		return -1;
+	}
+	if (buffer[1] != 1) return -1;
+	addr.sin_family = AF_INET;
+	switch (buffer[3]) {
+	case 1:
+		if (benchread(csock, buffer, 6) != 6) return -1;
+		memcpy(&addr.sin_addr, buffer, 4);
+		memcpy(&addr.sin_port, buffer + 4, 2);
+		break;
+	case 3:
+		if (benchread(csock, buffer, 1) != 1) return -1;
+		n = buffer[0];
+		if (benchread(csock, buffer, n + 2) != n + 2) return -1;
+		memcpy(&addr.sin_port, buffer + n, 2);
+		buffer[n] = 0;
+		if (resolve((char*)buffer, &addr)) reply[1] = 4;
+		break;
+	default:
+		reply[1] = 8;
+	}
+
+	benchsleep(delay);
+	if (!reply[1]) ssock = dial(&addr);
+	if (ssock < 0 && !reply[1]) reply[1] = 5;
+	benchwrite(csock, reply, sizeof(reply));
+	return ssock;
+}
+
+static void relay(int a, int b) {
+	char buffer[16384];
+	struct pollfd fds[2] = { { a, POLLIN, 0 }, { b, POLLIN, 0 } };
+	int x, rc;
+
+	while (poll(fds, 2, -1) > 0) {
+		for (x = 0; x < 2; x++) {
+			if (!fds[x].revents) continue;
+			rc = read(fds[x].fd, buffer, sizeof(buffer));
+			if (rc <= 0) return;
+			if (benchwrite(fds[!x].fd, buffer, rc) <= 0) return;
+		}
+	}
+}
+
+static void* linkwriter(void* arg) {
+	struct Link* l = (struct Link*)arg;
+	struct Chunk* c;
+	unsigned long now;
+
+	pthread_mutex_lock(&l->lock);
+	while (1) {
+		while (!l->head && !l->done) pthread_cond_wait(&l->cond, &l->lock);
+		if (!(c = l->head)) break;
+		l->head = c->next;
+		if (!l->head) l->tail = &l->head;
+		l->queued -= c->len;
+		pthread_cond_broadcast(&l->cond);
+		pthread_mutex_unlock(&l->lock);
+		now = benchus();
+		if (c->due > now) usleep(c->due - now);
+		if (benchwrite(l->to, c->data, c->len) <= 0) shutdown(l->from, SHUT_RD);
+		free(c);
+		pthread_mutex_lock(&l->lock);
+	}
+	pthread_mutex_unlock(&l->lock);
+	shutdown(l->to, SHUT_WR);
+	return NULL;
+}
+
+static void* linkreader(void* arg) {
+	struct Link* l = (struct Link*)arg;
+	struct Chunk* c;
+	pthread_t tid;
+
+	pthread_create(&tid, NULL, linkwriter, l);
+	while (1) {
+		c = (struct Chunk*)malloc(sizeof(struct Chunk));
+		c->len = read(l->from, c->data, sizeof(c->data));
+		if (c->len <= 0) {
+			free(c);
+			break;
+		}
+		c->due = benchus() + latency * 1000UL;
+		c->next = NULL;
+		pthread_mutex_lock(&l->lock);
+		while (l->queued >= LINKQUEUE) pthread_cond_wait(&l->cond, &l->lock);
+		*l->tail = c;
+		l->tail = &c->next;
+		l->queued += c->len;
+		pthread_cond_broadcast(&l->cond);
+		pthread_mutex_unlock(&l->lock);
+	}
+	pthread_mutex_lock(&l->lock);
+	l->done = 1;
+	pthread_cond_broadcast(&l->cond);
+	pthread_mutex_unlock(&l->lock);
+	pthread_join(tid, NULL);
+	return NULL;
+}
+
+/* relay(), with each chunk held back latency ms on its way. */
+static void linkrelay(int a, int b) {
+	struct Link l[2];
+	pthread_t tid;
+	int x;
+
+	memset(l, 0, sizeof(l));
+	for (x = 0; x < 2; x++) {
+		pthread_mutex_init(&l[x].lock, NULL);
+		pthread_cond_init(&l[x].cond, NULL);
+		l[x].tail = &l[x].head;
+		l[x].from = x ? b : a;
+		l[x].to = x ? a : b;
+	}
+	pthread_create(&tid, NULL, linkreader, &l[1]);
+	linkreader(&l[0]);
+	pthread_join(tid, NULL);
+}
+
+static void* connthread(void* arg) {
+	int csock = (int)(long)arg;
+	int ssock = -1;
+	unsigned char version;
+	int one = 1;
+
+	setsockopt(csock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (read(csock, &version, 1) == 1) {
+		if (version == 4) ssock = socks4(csock);
+		else if (version == 5) ssock = socks5(csock);
+	}
+	if (ssock >= 0) {
+		setsockopt(ssock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (latency) linkrelay(csock, ssock);
+		else relay(csock, ssock);
+		close(ssock);
+	}
+	close(csock);
+	return NULL;
+}
+
+int main(int argc, char* argv[]) {
+	int port = 0;
+	int lsock, sock;
+	int opt;
+
+	signal(SIGPIPE, SIG_IGN);
+	while ((opt = getopt(argc, argv, "p:d:l:")) != -1) {
+		switch (opt) {
+		case 'p': port = atoi(optarg); break;
+		case 'd': delay = atoi(optarg); break;
+		case 'l': latency = atoi(optarg); break;
+		}
+	}
+	if (!port) {
+		fprintf(stderr, "Usage: %s -p port [-d delayms] [-l latencyms]\n", argv[0]);
+		return 1;
+	}
+
+	lsock = benchlisten(port);
+	while (1) {
+		sock = accept(lsock, NULL, NULL);
+		if (sock < 0) continue;
+		benchthread(connthread, (void*)(long)sock);
+	}
+	return 0;
+}
+
+
+
+/* EOF */
@@ -0,0 +1,138 @@
+#!/bin/bash
+#
+# Opens BENCHCONNS connections to transockproxy and transockproxys and
+# stalls them, half sending nothing and half stopping partway through a
+# request head (a TLS ClientHello, on the SSL listener). Fails unless the
+# access log shows every one timed out within its header/tls timeout plus
+# a timer wheel tick (and BENCHSLACK ms for scheduling 10k threads or
+# fibers at once), and tsproxy_active_connections is back to 0 by then.
+# Appends one JSON line per listener to bench/results/, with the CPU the
+# proxy used in all, and while it only held the stalled connections (from
+# halfway through the timeout to just before it). Invoked by "make bench".
+# Needs no root and no network.
+#
+# Environment:
+#   BENCHCONNS     stalled connections per listener (default 10000)
+#   BENCHTIMEOUT   header and tls timeout, in seconds (default 3)
+#   BENCHSLACK     extra ms allowed for each close (default 500)
+#   BENCHPORT      base port (default 32000)
+
+cd "$(dirname "$0")/.." || exit 1
+
+BENCHCONNS=${BENCHCONNS:-10000}
+BENCHTIMEOUT=${BENCHTIMEOUT:-3}
+BENCHSLACK=${BENCHSLACK:-500}
+BENCHPORT=${BENCHPORT:-32000}
+BENCH_COMMIT=${BENCH_COMMIT:-$(git rev-parse --short HEAD 2>/dev/null || echo unknown)}
+export BENCH_COMMIT
+
+PROXYPORT=$((BENCHPORT + 888))
+SSLPORT=$((BENCHPORT + 889))
+STATSPORT=$((BENCHPORT + 900))
+TICK=$(sed -n 's/^#define TIMERTICK \([0-9]*\).*/\1/p' transockproxy.h)
+
+TOP=$(pwd)
+WORK=$(mktemp -d)
+RESULTS=$TOP/bench/results/$BENCH_COMMIT.jsonl
+PIDS=""
+FAILED=0
+
+cleanup() {
+	for pid in $PIDS; do kill "$pid" 2>/dev/null; done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+waitport() {
+	for i in $(seq 300); do
+		(exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "Port $1 never came up." >&2
+	exit 1
+}
+
+stat() {
+	exec 3<>/dev/tcp/127.0.0.1/$STATSPORT || return
+	printf 'GET /metrics HTTP/1.0\r\n\r\n' >&3
+	awk -v name="$1" '$1 == name { print $2 }' <&3 2>/dev/null
+	exec 3<&-
+}
+
+# The proxy's user plus system CPU time so far, in clock ticks.
+cputicks() {
+	awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+ulimit -n 65536 2>/dev/null || ulimit -n $(ulimit -Hn)
+mkdir -p bench/results
+"$TOP/bench/origin" -g "$WORK/ca.pem" "$WORK/ca.key" || exit 1
+
+run() {
+	local binary=$1 flag=$2 port=$3
+	local label="stall/$binary"
+	local limit=$((BENCHTIMEOUT * 1000 + TICK + BENCHSLACK))
+
+	cat > "$WORK/transockproxy.conf" <<CONF
+listen $PROXYPORT
+ssl $SSLPORT
+sslcert $WORK/ca.pem
+sslkey $WORK/ca.key
+stats 127.0.0.1:$STATSPORT
+accesslog $WORK/access
+loglevel none
+backlog 4096
+timeout header $BENCHTIMEOUT
+timeout tls $BENCHTIMEOUT
+default direct
+CONF
+	(cd "$WORK" && exec "$TOP/$binary" > "$WORK/$binary.log" 2>&1) &
+	proxypid=$!
+	waitport $port
+	waitport $STATSPORT
+
+	before=$(cputicks $proxypid)
+	start=$(date +%s%N)
+	bench/loadgen -a 127.0.0.1:$port -H 127.0.0.1:80 -m stall $flag -n $BENCHCONNS \
+		-t $((BENCHTIMEOUT * 3 + 5)) -l "$label" > "$WORK/result" &
+	loadpid=$!
+	sleep $(awk "BEGIN { print $BENCHTIMEOUT / 2 }")
+	waitstart=$(cputicks $proxypid)
+	sleep $(awk "BEGIN { print $BENCHTIMEOUT / 2 - 0.2 }")
+	waitcpu=$(( ($(cputicks $proxypid) - waitstart) * 1000 / $(getconf CLK_TCK) ))
+	wait $loadpid
+	# Sockets are shut down on the tick; the connections are freed once their threads get to it.
+	for i in $(seq $(( (TICK + BENCHSLACK) / 50 ))); do
+		active=$(stat tsproxy_active_connections)
+		[ "$active" = 0 ] && break
+		sleep 0.05
+	done
+	wall=$(( ($(date +%s%N) - start) / 1000000 ))
+	cpu=$(( ($(cputicks $proxypid) - before) * 1000 / $(getconf CLK_TCK) ))
+	kill $proxypid
+	wait $proxypid 2>/dev/null
+
+	# From the proxy's side: accepted to closed, and why.
+	read timedout slowest <<< $(awk '/close=timeout:(header|tls)/ { n++ }
+		{ for (i = 1; i <= NF; i++) if ($i ~ /^total=/) { t = substr($i, 7); if (t > m) m = t } }
+		END { printf "%d %d\n", n, m }' "$WORK/access")
+	sed "s/}\$/,\"timeout_ms\":$((BENCHTIMEOUT * 1000)),\"timed_out\":$timedout,\"slowest_ms\":$slowest,\"wall_ms\":$wall,\"proxy_cpu_ms\":$cpu,\"wait_cpu_ms\":$waitcpu,\"active_after\":$active}/" \
+		"$WORK/result" | tee -a "$RESULTS"
+
+	errors=$(sed 's/.*"errors":\([0-9]*\).*/\1/' "$WORK/result")
+	if [ "$errors" != 0 ] || [ "$timedout" != $BENCHCONNS ] || [ "$slowest" -gt $limit ] || [ "$active" != 0 ]; then
+		echo "FAIL: $binary: $timedout of $BENCHCONNS timed out, slowest after $slowest ms (limit $limit), $errors never closed, $active still open" >&2
+		FAILED=1
+	else
+		echo "PASS: $binary: $BENCHCONNS stalled connections timed out within $slowest ms (limit $limit), ${cpu} ms proxy CPU, $waitcpu ms of it while they waited"
+	fi
+	rm -f "$WORK/access"
+}
+
+run transockproxy "" $PROXYPORT
+[ -x transockproxys ] && run transockproxys -S $SSLPORT
+
+echo "Results appended to $RESULTS"
+exit $FAILED
@@ -0,0 +1,123 @@
+#!/bin/bash
+#
+# Runs transockproxys against the local TLS origin with TLS connections on a
+# thread each ("tlsworkers 0") and on fibers (the default), and appends one
+# JSON line per run to bench/results/: new connections per second, each a
+# client and an upstream handshake, and proxy RSS growth per idle
+# connection held open. Fibers should hold idle connections in far less
+# memory, at much the same handshake rate. Then new connections again with
+# the upstream certificate check cache on and off ("sslverifycache 0"),
+# with the microseconds spent verifying per upstream handshake added.
+# Needs no root and no network. Invoked by "make bench".
+#
+# Environment:
+#   BENCHTIME    seconds per run (default 3)
+#   BENCHCONC    concurrent clients (default 32)
+#   BENCHPORT    base port (default 29000)
+#   BENCHIDLE    idle connections to hold (default 2000)
+#   BENCHONLY    only run labels matching this shell pattern (default *)
+
+cd "$(dirname "$0")/.." || exit 1
+
+BENCHTIME=${BENCHTIME:-3}
+BENCHCONC=${BENCHCONC:-32}
+BENCHPORT=${BENCHPORT:-29000}
+BENCHIDLE=${BENCHIDLE:-2000}
+BENCHONLY=${BENCHONLY:-*}
+BENCH_COMMIT=${BENCH_COMMIT:-$(git rev-parse --short HEAD 2>/dev/null || echo unknown)}
+export BENCH_COMMIT
+
+TLSPORT=$((BENCHPORT + 443))
+SSLPORT=$((BENCHPORT + 889))
+STATSPORT=$((BENCHPORT + 900))
+
+TOP=$(pwd)
+WORK=$(mktemp -d)
+RESULTS=$TOP/bench/results/$BENCH_COMMIT.jsonl
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do kill "$pid" 2>/dev/null; done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+waitport() {
+	for i in $(seq 300); do
+		(exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "Port $1 never came up." >&2
+	exit 1
+}
+
+# Prints the value of one counter from the stats socket.
+stat() {
+	exec 3<>/dev/tcp/127.0.0.1/$STATSPORT || return
+	printf 'GET /metrics HTTP/1.0\r\n\r\n' >&3
+	awk -v name="$1" '$1 == name { print $2 }' <&3 2>/dev/null
+	exec 3<&-
+}
+
+ulimit -n 65536 2>/dev/null || ulimit -n $(ulimit -Hn)
+
+bench/origin -g "$WORK/ca.pem" "$WORK/ca.key" || exit 1
+bench/origin -p $TLSPORT -s -c "$WORK/ca.pem" -k "$WORK/ca.key" & PIDS="$PIDS $!"
+waitport $TLSPORT
+
+mkdir -p bench/results
+
+for workers in threads fibers; do
+	for mode in conn idle; do
+		label="tls/$workers/$mode"
+		case "$label" in $BENCHONLY) ;; *) continue ;; esac
+
+		cat > "$WORK/transockproxy.conf" <<CONF
+ssl $SSLPORT
+sslcert $WORK/ca.pem
+sslkey $WORK/ca.key
+ssltrust $WORK/ca.pem
+loglevel none
+$([ $workers = threads ] && echo "tlsworkers 0")
+default direct
+CONF
+		(cd "$WORK" && exec "$TOP/transockproxys" > "$WORK/transockproxys.log" 2>&1) &
+		proxypid=$!
+		waitport $SSLPORT
+		bench/loadgen -a 127.0.0.1:$SSLPORT -H 127.0.0.1:$TLSPORT -S -m $mode -c $BENCHCONC -t $BENCHTIME \
+			-n $BENCHIDLE -P $proxypid -l "$label" | tee -a "$RESULTS"
+		kill $proxypid
+		wait $proxypid 2>/dev/null
+	done
+done
+
+for cache in cached uncached; do
+	label="tls/verify/$cache"
+	case "$label" in $BENCHONLY) ;; *) continue ;; esac
+
+	cat > "$WORK/transockproxy.conf" <<CONF
+ssl $SSLPORT
+sslcert $WORK/ca.pem
+sslkey $WORK/ca.key
+ssltrust $WORK/ca.pem
+stats 127.0.0.1:$STATSPORT
+loglevel none
+$([ $cache = uncached ] && echo "sslverifycache 0")
+default direct
+CONF
+	(cd "$WORK" && exec "$TOP/transockproxys" > "$WORK/transockproxys.log" 2>&1) &
+	proxypid=$!
+	waitport $SSLPORT
+	bench/loadgen -a 127.0.0.1:$SSLPORT -H 127.0.0.1:$TLSPORT -S -m conn -c $BENCHCONC -t $BENCHTIME \
+		-l "$label" > "$WORK/result"
+	checks=$(( $(stat 'tsproxy_tls_verify_total{result="cached"}') + $(stat 'tsproxy_tls_verify_total{result="checked"}') ))
+	seconds=$(awk "BEGIN { print $(stat 'tsproxy_tls_verify_seconds_total{result="cached"}') + $(stat 'tsproxy_tls_verify_seconds_total{result="checked"}') }")
+	perhandshake=$(awk "BEGIN { printf \"%.1f\", $checks ? $seconds * 1000000 / $checks : 0 }")
+	sed "s/}\$/,\"verify_us_per_handshake\":$perhandshake}/" "$WORK/result" | tee -a "$RESULTS"
+	kill $proxypid
+	wait $proxypid 2>/dev/null
+done
+
+echo "Results appended to $RESULTS"
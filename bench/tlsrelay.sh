@@ -0,0 +1,94 @@
+#!/bin/bash
+#
+# Runs transockproxys against the local TLS origin and measures the relay
+# itself: bulk downloads over kept-alive connections (MB/s) and chatty ones,
+# many small requests each (requests/s). Appends one JSON line per run to
+# bench/results/ with the CPU seconds the proxy spent added, so a relay that
+# moves the same bytes in fewer, larger records shows up even when loopback
+# bandwidth doesn't.
+# Needs no root and no network. Invoked by "make bench".
+#
+# Environment:
+#   BENCHTIME    seconds per run (default 3)
+#   BENCHCONC    concurrent clients for the chatty run (default 16)
+#   BENCHBULK    bytes per bulk download (default 64 MB)
+#   BENCHPORT    base port (default 30000)
+#   BENCHONLY    only run labels matching this shell pattern (default *)
+
+cd "$(dirname "$0")/.." || exit 1
+
+BENCHTIME=${BENCHTIME:-3}
+BENCHCONC=${BENCHCONC:-16}
+BENCHBULK=${BENCHBULK:-67108864}
+BENCHPORT=${BENCHPORT:-30000}
+BENCHONLY=${BENCHONLY:-*}
+BENCH_COMMIT=${BENCH_COMMIT:-$(git rev-parse --short HEAD 2>/dev/null || echo unknown)}
+export BENCH_COMMIT
+
+TLSPORT=$((BENCHPORT + 443))
+SSLPORT=$((BENCHPORT + 889))
+
+TOP=$(pwd)
+WORK=$(mktemp -d)
+RESULTS=$TOP/bench/results/$BENCH_COMMIT.jsonl
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do kill "$pid" 2>/dev/null; done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+waitport() {
+	for i in $(seq 300); do
+		(exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "Port $1 never came up." >&2
+	exit 1
+}
+
+# Prints the CPU time a process has used so far, in clock ticks.
+cputicks() {
+	awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+bench/origin -g "$WORK/ca.pem" "$WORK/ca.key" || exit 1
+bench/origin -p $TLSPORT -s -c "$WORK/ca.pem" -k "$WORK/ca.key" & PIDS="$PIDS $!"
+waitport $TLSPORT
+
+cat > "$WORK/transockproxy.conf" <<CONF
+ssl $SSLPORT
+sslcert $WORK/ca.pem
+sslkey $WORK/ca.key
+ssltrust $WORK/ca.pem
+loglevel none
+default direct
+CONF
+
+mkdir -p bench/results
+
+for run in bulk chatty; do
+	label="tlsrelay/$run"
+	case "$label" in $BENCHONLY) ;; *) continue ;; esac
+
+	(cd "$WORK" && exec "$TOP/transockproxys" > "$WORK/transockproxys.log" 2>&1) &
+	proxypid=$!
+	waitport $SSLPORT
+	before=$(cputicks $proxypid)
+	if [ $run = bulk ]; then
+		bench/loadgen -a 127.0.0.1:$SSLPORT -H 127.0.0.1:$TLSPORT -S -m bulk -b $BENCHBULK -c 2 -t $BENCHTIME \
+			-l "$label" > "$WORK/result"
+	else
+		bench/loadgen -a 127.0.0.1:$SSLPORT -H 127.0.0.1:$TLSPORT -S -m keepalive -u /bytes/2048 -c $BENCHCONC \
+			-t $BENCHTIME -l "$label" > "$WORK/result"
+	fi
+	cpu=$(awk "BEGIN { printf \"%.2f\", ($(cputicks $proxypid) - $before) / $(getconf CLK_TCK) }")
+	sed "s/}\$/,\"proxy_cpu_sec\":$cpu}/" "$WORK/result" | tee -a "$RESULTS"
+	kill $proxypid
+	wait $proxypid 2>/dev/null
+done
+
+echo "Results appended to $RESULTS"
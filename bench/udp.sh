@@ -0,0 +1,93 @@
+#!/bin/bash
+#
+# Runs transockproxy with a UDP listener forwarding to a local UDP echo and
+# bounces datagrams through it, once going direct and once through a SOCKS5
+# UDP association with the local stub, and appends one JSON line per run to
+# bench/results/ with the flows the proxy set up added. Each client starts a
+# new flow every BENCHREQS round trips, so a run measures flow setup (and the
+# SOCKS5 handshake) as well as relaying.
+# Needs no root and no network. Invoked by "make bench".
+#
+# Environment:
+#   BENCHTIME    seconds per run (default 3)
+#   BENCHCONC    concurrent clients (default 8)
+#   BENCHPORT    base port (default 28000)
+#   BENCHREQS    round trips per flow (default 100)
+#   BENCHONLY    only run labels matching this shell pattern (default *)
+
+cd "$(dirname "$0")/.." || exit 1
+
+BENCHTIME=${BENCHTIME:-3}
+BENCHCONC=${BENCHCONC:-8}
+BENCHPORT=${BENCHPORT:-28000}
+BENCHREQS=${BENCHREQS:-100}
+BENCHONLY=${BENCHONLY:-*}
+BENCH_COMMIT=${BENCH_COMMIT:-$(git rev-parse --short HEAD 2>/dev/null || echo unknown)}
+export BENCH_COMMIT
+
+ECHOPORT=$((BENCHPORT + 53))
+SOCKSPORT=$((BENCHPORT + 1080))
+UDPPORT=$((BENCHPORT + 853))
+STATSPORT=$((BENCHPORT + 900))
+
+TOP=$(pwd)
+WORK=$(mktemp -d)
+RESULTS=$TOP/bench/results/$BENCH_COMMIT.jsonl
+PIDS=""
+
+cleanup() {
+	for pid in $PIDS; do kill "$pid" 2>/dev/null; done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+waitport() {
+	for i in $(seq 300); do
+		(exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "Port $1 never came up." >&2
+	exit 1
+}
+
+# Prints the value of one counter from the stats socket.
+stat() {
+	exec 3<>/dev/tcp/127.0.0.1/$STATSPORT || return
+	printf 'GET /metrics HTTP/1.0\r\n\r\n' >&3
+	awk -v name="$1" '$1 == name { print $2 }' <&3 2>/dev/null
+	exec 3<&-
+}
+
+bench/origin -p $ECHOPORT -u & PIDS="$PIDS $!"
+bench/socksstub -p $SOCKSPORT & PIDS="$PIDS $!"
+waitport $ECHOPORT
+waitport $SOCKSPORT
+
+mkdir -p bench/results
+
+for route in direct socks5; do
+	label="udp/$route"
+	case "$label" in $BENCHONLY) ;; *) continue ;; esac
+
+	cat > "$WORK/transockproxy.conf" <<CONF
+udp $UDPPORT 127.0.0.1:$ECHOPORT
+stats 127.0.0.1:$STATSPORT
+loglevel none
+default $([ $route = socks5 ] && echo socks5://127.0.0.1:$SOCKSPORT || echo direct)
+CONF
+
+	(cd "$WORK" && exec "$TOP/transockproxy" > "$WORK/transockproxy.log" 2>&1) &
+	proxypid=$!
+	waitport $STATSPORT
+	before=$(stat tsproxy_udp_flows_total)
+	bench/loadgen -a 127.0.0.1:$UDPPORT -m udp -r $BENCHREQS -c $BENCHCONC -t $BENCHTIME -l "$label" > "$WORK/result"
+	after=$(stat tsproxy_udp_flows_total)
+	rate=$(awk "BEGIN { printf \"%.1f\", (${after:-0} - ${before:-0}) / $BENCHTIME }")
+	sed "s/}\$/,\"flows_per_sec\":$rate}/" "$WORK/result" | tee -a "$RESULTS"
+	kill $proxypid
+	wait $proxypid 2>/dev/null
+done
+
+echo "Results appended to $RESULTS"
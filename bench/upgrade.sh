@@ -0,0 +1,103 @@
+#!/bin/bash
+#
+# Upgrades transockproxy and transockproxys (SIGUSR2) several times while
+# bench/loadgen opens new connections as fast as it can, and fails if a
+# single connection was refused or broken, or an old process didn't exit.
+# Needs no root and no network. Invoked by "make upgradetest".
+#
+# Environment:
+#   BENCHTIME    seconds of load per binary (default 6)
+#   BENCHCONC    concurrent clients (default 8)
+#   BENCHPORT    base port (default 28000)
+#   UPGRADES     upgrades per run (default 3)
+
+cd "$(dirname "$0")/.." || exit 1
+
+BENCHTIME=${BENCHTIME:-6}
+BENCHCONC=${BENCHCONC:-8}
+BENCHPORT=${BENCHPORT:-28000}
+UPGRADES=${UPGRADES:-3}
+
+HTTPPORT=$((BENCHPORT + 80))
+TLSPORT=$((BENCHPORT + 443))
+PROXYPORT=$((BENCHPORT + 888))
+SSLPORT=$((BENCHPORT + 889))
+
+TOP=$(pwd)
+WORK=$(mktemp -d)
+PIDS=""
+FAILED=0
+
+cleanup() {
+	for pid in $PIDS $(pgrep -f "$WORK/"); do kill "$pid" 2>/dev/null; done
+	wait 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+waitport() {
+	for i in $(seq 300); do
+		(exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+		sleep 0.1
+	done
+	echo "Port $1 never came up." >&2
+	exit 1
+}
+
+bench/origin -g "$WORK/ca.pem" "$WORK/ca.key" || exit 1
+bench/origin -p $HTTPPORT & PIDS="$PIDS $!"
+bench/origin -p $TLSPORT -s -c "$WORK/ca.pem" -k "$WORK/ca.key" & PIDS="$PIDS $!"
+
+cat > "$WORK/transockproxy.conf" <<CONF
+listen $PROXYPORT
+ssl $SSLPORT
+sslcert $WORK/ca.pem
+sslkey $WORK/ca.key
+ssltrust $WORK/ca.pem
+loglevel warn
+default direct
+CONF
+
+waitport $HTTPPORT
+waitport $TLSPORT
+
+run() {
+	# run <binary> <tls flag> <origin port> <proxy port>
+	binary=$1 tlsflag=$2 originport=$3 proxyport=$4
+	cp "$binary" "$WORK/$binary"
+	(cd "$WORK" && exec "$WORK/$binary" >> "$WORK/$binary.log" 2>&1) &
+	waitport $proxyport
+	first=$(pgrep -n -f "$WORK/$binary")
+
+	bench/loadgen -a 127.0.0.1:$proxyport -H 127.0.0.1:$originport -m conn $tlsflag \
+		-c $BENCHCONC -t $BENCHTIME -l "upgrade/$binary" > "$WORK/result" &
+	loadpid=$!
+
+	for i in $(seq $UPGRADES); do
+		sleep $(awk "BEGIN { print $BENCHTIME / ($UPGRADES + 1) }")
+		current=$(pgrep -n -f "$WORK/$binary")
+		kill -USR2 "$current"
+	done
+	wait $loadpid
+	cat "$WORK/result"
+
+	errors=$(sed 's/.*"errors":\([0-9]*\).*/\1/' "$WORK/result")
+	ops=$(sed 's/.*"ops":\([0-9]*\).*/\1/' "$WORK/result")
+	# Old processes only have idle keep-alives left to drain, which loadgen doesn't make.
+	sleep 2
+	left=$(pgrep -f "$WORK/$binary" | wc -l)
+	if [ "$errors" != 0 ] || [ "$ops" = 0 ] || [ "$left" != 1 ] || pgrep -f "$WORK/$binary" | grep -qx "$first"; then
+		echo "FAIL: $binary: $ops connections, $errors errors, $left processes left after $UPGRADES upgrades" >&2
+		cat "$WORK/$binary.log" >&2
+		FAILED=1
+	else
+		echo "PASS: $binary: $ops connections, no errors across $UPGRADES upgrades"
+	fi
+	pkill -f "$WORK/$binary"
+}
+
+run transockproxy "" $HTTPPORT $PROXYPORT
+[ -x transockproxys ] && run transockproxys -S $TLSPORT $SSLPORT
+
+exit $FAILED
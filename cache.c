@@ -0,0 +1,568 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Response cache for the HTTP-aware relay. Cacheable GET responses are kept
+ * as one file per object under the cache directory, with the index (key,
+ * stored head, freshness and validators) in memory, so it starts empty on
+ * every run. Hits are sent with sendfile(). Stale objects with a validator
+ * are revalidated with a conditional request, and the least recently used
+ * ones are dropped to stay under the size cap. While one client fetches or
+ * revalidates a URL, others asking for it wait for that instead of each
+ * going upstream. */
+
+#include "transockproxy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#define CACHEBUCKETS 4096
+
+struct CacheEntry {
+	struct CacheEntry* next;	/* Hash chain */
+	struct CacheEntry* newer;	/* LRU list */
+	struct CacheEntry* older;
+	char* key;
+	unsigned long id;	/* Object file, or 0 while nothing is stored yet */
+	char* head;	/* Response head, without the blank line */
+	int headlen;
+	long size;
+	unsigned long stored;
+	long age;	/* Age it already had when stored, seconds */
+	long lifetime;	/* Seconds */
+	char* etag;
+	char* lastmod;
+	int fetching;
+};
+
+char* cachedir = NULL;
+unsigned long cachesize = 0;
+
+static pthread_mutex_t cachelock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cachecond = PTHREAD_COND_INITIALIZER;
+static struct CacheEntry* buckets[CACHEBUCKETS];
+static struct CacheEntry* newest = NULL;
+static struct CacheEntry* oldest = NULL;
+static unsigned long cachebytes = 0;
+static int cacheentries = 0;
+static unsigned long nextid = 0;
+
+static const char* months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+
+/* Finds a header in a head block. Returns its value and sets *vlen, or NULL. */
+static const char* headerget(const char* head, int len, const char* name, int* vlen) {
+	const char* end = head + len;
+	const char* p;
+	const char* eol;
+	int nlen = strlen(name);
+
+	for (p = strstr(head, "\r\n"); p && p + 2 < end; p = eol) {
+		p += 2;
+		eol = strstr(p, "\r\n");
+		if (!eol || eol > end) break;
+		if (eol - p > nlen && p[nlen] == ':' && !strncasecmp(p, name, nlen)) {
+			for (p += nlen + 1; *p == ' ' || *p == '\t'; p++);
+			*vlen = eol - p;
+			return p;
+		}
+	}
+	return NULL;
+}
+
+/* Value of a "name=N" directive in a Cache-Control value, or -1. */
+static long directive(const char* value, int len, const char* name) {
+	int nlen = strlen(name);
+	int x;
+
+	for (x = 0; x + nlen < len; x++) {
+		if ((x == 0 || value[x-1] == ' ' || value[x-1] == ',') && !strncasecmp(value + x, name, nlen) && value[x + nlen] == '=') {
+			return atol(value + x + nlen + 1 + (value[x + nlen + 1] == '"'));
+		}
+	}
+	return -1;
+}
+
+/* Parses an IMF-fixdate ("Sun, 06 Nov 1994 08:49:37 GMT"). Returns -1 if it isn't one. */
+static long httpdate(const char* value, int len) {
+	char text[64];
+	char month[4];
+	struct tm tm;
+	int x;
+
+	if (!value || len >= (int)sizeof(text)) return -1;
+	memcpy(text, value, len);
+	text[len] = 0;
+	memset(&tm, 0, sizeof(tm));
+	if (sscanf(text, "%*3s, %d %3s %d %d:%d:%d", &tm.tm_mday, month, &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) return -1;
+	for (x = 0; x < 12; x++) {
+		if (!strcmp(month, months[x])) break;
+	}
+	if (x == 12) return -1;
+	tm.tm_mon = x;
+	tm.tm_year -= 1900;
+	return timegm(&tm);
+}
+
+static char* headerdup(const char* head, int len, const char* name) {
+	const char* value;
+	int vlen;
+
+	value = headerget(head, len, name, &vlen);
+	return value ? strndup(value, vlen) : NULL;
+}
+
+/* How long a response stays fresh, in seconds, from its Cache-Control or
+ * Expires, or a tenth of its age since Last-Modified (up to a day) if it has
+ * neither. Returns -1 if it mustn't be stored at all. */
+static long freshness(const char* head, int len) {
+	const char* cc;
+	const char* value;
+	long lifetime, date, expires, lastmod;
+	int cclen = 0;
+	int vlen;
+
+	cc = headerget(head, len, "Cache-Control", &cclen);
+	if (cc && (hastoken(cc, cclen, "no-store") || hastoken(cc, cclen, "private"))) return -1;
+	if (cc && hastoken(cc, cclen, "no-cache")) return 0;
+	if (cc && (lifetime = directive(cc, cclen, "s-maxage")) >= 0) return lifetime;
+	if (cc && (lifetime = directive(cc, cclen, "max-age")) >= 0) return lifetime;
+
+	value = headerget(head, len, "Date", &vlen);
+	date = value ? httpdate(value, vlen) : -1;
+	if (date < 0) date = time(NULL);
+	value = headerget(head, len, "Expires", &vlen);
+	if (value) {
+		/* An invalid Expires, like "0", means already expired. */
+		expires = httpdate(value, vlen);
+		return expires > date ? expires - date : 0;
+	}
+	value = headerget(head, len, "Last-Modified", &vlen);
+	lastmod = value ? httpdate(value, vlen) : -1;
+	if (lastmod >= 0 && lastmod < date) return (date - lastmod) / 10 < 86400 ? (date - lastmod) / 10 : 86400;
+	return 0;
+}
+
+/* Named after the process too, since an upgrade has two of them using the directory for a while. */
+static void objectpath(char* path, int size, unsigned long id) {
+	snprintf(path, size, "%s/%d-%lu.obj", cachedir, getpid(), id);
+}
+
+static int objectopen(unsigned long id) {
+	char path[PATH_MAX];
+
+	objectpath(path, sizeof(path), id);
+	return open(path, O_RDONLY);
+}
+
+static void objectremove(unsigned long id) {
+	char path[PATH_MAX];
+
+	objectpath(path, sizeof(path), id);
+	unlink(path);
+}
+
+/* The rest is called with cachelock held. */
+
+static struct CacheEntry** bucket(const char* key) {
+	return &buckets[keyhash(key) % CACHEBUCKETS];
+}
+
+static struct CacheEntry* entryfind(const char* key) {
+	struct CacheEntry* e;
+
+	for (e = *bucket(key); e; e = e->next) {
+		if (!strcmp(e->key, key)) return e;
+	}
+	return NULL;
+}
+
+static void lruremove(struct CacheEntry* e) {
+	if (e->newer) e->newer->older = e->older;
+	else newest = e->older;
+	if (e->older) e->older->newer = e->newer;
+	else oldest = e->newer;
+	e->newer = e->older = NULL;
+}
+
+static void lrufront(struct CacheEntry* e) {
+	if (newest == e) return;
+	if (e->newer || e->older || oldest == e) lruremove(e);
+	e->older = newest;
+	if (newest) newest->newer = e;
+	newest = e;
+	if (!oldest) oldest = e;
+}
+
+/* Forgets what's stored for e, but leaves it in the index. */
+static void entryclear(struct CacheEntry* e) {
+	if (!e->id) return;
+	lruremove(e);
+	objectremove(e->id);
+	cachebytes -= e->headlen + e->size;
+	cacheentries--;
+	e->id = 0;
+	free(e->head);
+	free(e->etag);
+	free(e->lastmod);
+	e->head = e->etag = e->lastmod = NULL;
+}
+
+static void entryfree(struct CacheEntry* e) {
+	struct CacheEntry** pe;
+
+	entryclear(e);
+	for (pe = bucket(e->key); *pe != e; pe = &(*pe)->next);
+	*pe = e->next;
+	free(e->key);
+	free(e);
+}
+
+/* Drops the least recently used objects until there's room for need more bytes. */
+static void evict(unsigned long need) {
+	struct CacheEntry* e = oldest;
+	struct CacheEntry* next;
+
+	while (e && cachebytes + need > cachesize) {
+		next = e->newer;
+		/* Somebody is revalidating it right now; they'll take care of it. */
+		if (!e->fetching) entryfree(e);
+		e = next;
+	}
+}
+
+static int fresh(const struct CacheEntry* e, unsigned long now) {
+	return e->age + (long)((now - e->stored) / 1000) < e->lifetime;
+}
+
+/* Fills in what a hit or revalidation needs from e. Returns 0, or -1 if its object is gone. */
+static int refopen(struct CacheRef* ref, struct CacheEntry* e, unsigned long now) {
+	ref->fd = objectopen(e->id);
+	if (ref->fd < 0) return -1;
+	ref->head = (char*)malloc(e->headlen);
+	memcpy(ref->head, e->head, e->headlen);
+	ref->headlen = e->headlen;
+	ref->size = e->size;
+	ref->age = e->age + (now - e->stored) / 1000;
+	return 0;
+}
+
+/* Decides how the request in head (of len bytes, for host) is handled:
+ * CACHE_HIT to be served with cacheserve(), CACHE_FILL or CACHE_REVALIDATE
+ * to be fetched with ref->conditions added and passed to cachestore() or
+ * cacherefresh(), then cachedone(), or CACHE_PASS to leave the cache out. */
+void cachefind(struct CacheRef* ref, const char* head, int len, const char* host) {
+	struct CacheEntry* e;
+	struct timespec until;
+	const char* target;
+	const char* value;
+	unsigned long now;
+	char dest[CIRCUITKEYSIZE];
+	int reload = 0;
+	int waited = 0;
+	int vlen;
+
+	memset(ref, 0, sizeof(*ref));
+	ref->fd = ref->tmpfd = -1;
+	ref->state = CACHE_PASS;
+	if (!cachedir || strncmp(head, "GET ", 4)) return;
+
+	/* Anything the origin has to decide on gets passed through as is. */
+	if (headerget(head, len, "Authorization", &vlen) || headerget(head, len, "Range", &vlen)
+		|| headerget(head, len, "If-None-Match", &vlen) || headerget(head, len, "If-Modified-Since", &vlen)
+		|| headerget(head, len, "If-Match", &vlen) || headerget(head, len, "If-Unmodified-Since", &vlen)
+		|| headerget(head, len, "If-Range", &vlen)) return;
+	value = headerget(head, len, "Cache-Control", &vlen);
+	if (value && hastoken(value, vlen, "no-store")) return;
+	if (value && hastoken(value, vlen, "no-cache")) reload = 1;
+	value = headerget(head, len, "Pragma", &vlen);
+	if (value && hastoken(value, vlen, "no-cache")) reload = 1;
+
+	target = head + 4;
+	vlen = strcspn(target, " \r\n");
+	circuitkey(dest, host, 80);
+	ref->key = (char*)malloc(strlen(dest) + vlen + 1);
+	sprintf(ref->key, "%s%.*s", dest, vlen, target);
+
+	pthread_mutex_lock(&cachelock);
+	while (1) {
+		now = mstime();
+		e = entryfind(ref->key);
+		if (e && e->id && !reload && fresh(e, now)) {
+			if (!refopen(ref, e, now)) {
+				lrufront(e);
+				ref->state = CACHE_HIT;
+				statadd(waited ? STAT_CACHECOLLAPSED : STAT_CACHEHITS, 1);
+				break;
+			}
+			/* Somebody deleted the file under us. */
+			entryclear(e);
+		}
+		if (e && e->fetching) {
+			/* Someone else is already on it; wait for that rather than fetch it again. */
+			if (waited) {
+				ref->state = CACHE_PASS;
+				break;
+			}
+			clock_gettime(CLOCK_REALTIME, &until);
+			until.tv_sec += CACHEWAIT / 1000;
+			while (e->fetching && !exitflag) {
+				if (pthread_cond_timedwait(&cachecond, &cachelock, &until) == ETIMEDOUT) break;
+			}
+			/* e may be gone by now, so start over. After one wait, a second one isn't worth it. */
+			waited = 1;
+			reload = 0;
+			continue;
+		}
+
+		if (!e) {
+			e = (struct CacheEntry*)calloc(1, sizeof(struct CacheEntry));
+			e->key = strdup(ref->key);
+			e->next = *bucket(e->key);
+			*bucket(e->key) = e;
+		}
+		e->fetching = 1;
+		ref->entry = e;
+		ref->state = CACHE_FILL;
+		if (e->id && (e->etag || e->lastmod) && !refopen(ref, e, now)) {
+			ref->state = CACHE_REVALIDATE;
+			ref->conditions = (char*)malloc((e->etag ? strlen(e->etag) : 0) + (e->lastmod ? strlen(e->lastmod) : 0) + 48);
+			sprintf(ref->conditions, "%s%s%s%s%s%s",
+				e->etag ? "If-None-Match: " : "", e->etag ? e->etag : "", e->etag ? "\r\n" : "",
+				e->lastmod ? "If-Modified-Since: " : "", e->lastmod ? e->lastmod : "", e->lastmod ? "\r\n" : "");
+		} else {
+			statadd(STAT_CACHEMISSES, 1);
+		}
+		break;
+	}
+	pthread_mutex_unlock(&cachelock);
+}
+
+/* Called with the response head when fetching for the cache. Returns a
+ * descriptor to write the body to with cachewrite(), or -1 if this response
+ * isn't going to be stored. */
+int cachestore(struct CacheRef* ref, const char* head, int len, int status, long length) {
+	char path[PATH_MAX];
+	const char* p;
+	const char* eol;
+	long lifetime;
+	int vlen;
+
+	if (ref->state != CACHE_FILL && ref->state != CACHE_REVALIDATE) return -1;
+	/* Whatever was stored before is out of date now. */
+	ref->drop = 1;
+	if (status != 200 || length < 0 || (unsigned long)length > cachesize / 8) return -1;
+	if (headerget(head, len, "Set-Cookie", &vlen) || headerget(head, len, "Vary", &vlen)) return -1;
+	lifetime = freshness(head, len);
+	if (lifetime < 0) return -1;
+	if (!lifetime && !headerget(head, len, "ETag", &vlen) && !headerget(head, len, "Last-Modified", &vlen)) return -1;
+
+	ref->id = __atomic_add_fetch(&nextid, 1, __ATOMIC_RELAXED);
+	objectpath(path, sizeof(path), ref->id);
+	ref->tmpfd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (ref->tmpfd < 0) {
+		warn("Could not create cache object %s: %m\n", path);
+		return -1;
+	}
+
+	/* Keep the head without the hop-by-hop headers and Age, which cacheserve() adds. */
+	ref->newhead = (char*)malloc(len);
+	ref->newheadlen = 0;
+	for (p = head; p < head + len - 2; p = eol + 2) {
+		eol = strstr(p, "\r\n");
+		if (p != head && (!strncasecmp(p, "Connection:", 11) || !strncasecmp(p, "Keep-Alive:", 11)
+			|| !strncasecmp(p, "Proxy-Connection:", 17) || !strncasecmp(p, "Age:", 4))) continue;
+		memcpy(ref->newhead + ref->newheadlen, p, eol + 2 - p);
+		ref->newheadlen += eol + 2 - p;
+	}
+	p = headerget(head, len, "Age", &vlen);
+	ref->newage = p ? atol(p) : 0;
+	ref->lifetime = lifetime;
+	ref->etag = headerdup(head, len, "ETag");
+	ref->lastmod = headerdup(head, len, "Last-Modified");
+	ref->length = length;
+	ref->written = 0;
+	return ref->tmpfd;
+}
+
+/* Adds part of the body being fetched to the object. Gives up on storing it on error. */
+void cachewrite(struct CacheRef* ref, const char* data, int len) {
+	if (ref->tmpfd < 0) return;
+	if (writeall(ref->tmpfd, data, len) != len) {
+		warn("Error writing cache object: %m\n");
+		close(ref->tmpfd);
+		ref->tmpfd = -1;
+		return;
+	}
+	ref->written += len;
+}
+
+/* Called with the head of a 304 to a revalidation. Returns 1 if the stored
+ * copy is good for another while and can be sent with cacheserve(). */
+int cacherefresh(struct CacheRef* ref, const char* head, int len) {
+	struct CacheEntry* e = (struct CacheEntry*)ref->entry;
+	const char* value;
+	long lifetime;
+	int vlen;
+
+	if (ref->state != CACHE_REVALIDATE) return 0;
+	lifetime = freshness(head, len);
+	value = headerget(head, len, "Age", &vlen);
+
+	pthread_mutex_lock(&cachelock);
+	e->stored = mstime();
+	e->age = value ? atol(value) : 0;
+	/* A 304 that says nothing about freshness keeps the old rules. */
+	if (lifetime >= 0 && (headerget(head, len, "Cache-Control", &vlen) || headerget(head, len, "Expires", &vlen))) e->lifetime = lifetime;
+	lrufront(e);
+	ref->age = e->age;
+	e->fetching = 0;
+	pthread_cond_broadcast(&cachecond);
+	pthread_mutex_unlock(&cachelock);
+
+	statadd(STAT_CACHEREVALIDATED, 1);
+	ref->entry = NULL;
+	ref->state = CACHE_HIT;
+	return 1;
+}
+
+/* Sends the stored response to sock. Returns 0 on success. */
+int cacheserve(struct CacheRef* ref, struct Conn* c, int sock, int keepalive) {
+	char* out = (char*)malloc(ref->headlen + 64);
+	off_t offset = 0;
+	ssize_t rc;
+	int len;
+
+	memcpy(out, ref->head, ref->headlen);
+	len = ref->headlen + sprintf(out + ref->headlen, "Age: %ld\r\n%s\r\n", ref->age, keepalive ? "Connection: keep-alive\r\n" : "");
+	rc = writeall(sock, out, len);
+	free(out);
+	if (rc != len) return -1;
+	conntraffic(c, 0, len);
+
+	while (offset < ref->size) {
+		rc = sendfile(sock, ref->fd, &offset, ref->size - offset);
+		if (rc <= 0) {
+			if (rc < 0 && errno == EINTR) continue;
+			return -1;
+		}
+		conntraffic(c, 0, rc);
+	}
+	return 0;
+}
+
+/* Finishes a lookup: stores what was fetched if ok and it all arrived, and
+ * lets anyone waiting for it go. Safe to call more than once. */
+void cachedone(struct CacheRef* ref, int ok) {
+	struct CacheEntry* e = (struct CacheEntry*)ref->entry;
+	unsigned long need;
+
+	if (ref->tmpfd >= 0) close(ref->tmpfd);
+	if (ref->fd >= 0) close(ref->fd);
+	ref->tmpfd = ref->fd = -1;
+
+	if (e) {
+		pthread_mutex_lock(&cachelock);
+		need = ref->newheadlen + ref->length;
+		if (ok && ref->newhead && ref->written == ref->length && need <= cachesize) {
+			entryclear(e);
+			evict(need);
+			e->id = ref->id;
+			e->head = ref->newhead;
+			e->headlen = ref->newheadlen;
+			e->size = ref->length;
+			e->stored = mstime();
+			e->age = ref->newage;
+			e->lifetime = ref->lifetime;
+			e->etag = ref->etag;
+			e->lastmod = ref->lastmod;
+			ref->newhead = ref->etag = ref->lastmod = NULL;
+			lrufront(e);
+			cachebytes += need;
+			cacheentries++;
+		} else {
+			if (ref->id) objectremove(ref->id);
+			if (ref->drop) entryclear(e);
+		}
+		e->fetching = 0;
+		if (!e->id) entryfree(e);
+		pthread_cond_broadcast(&cachecond);
+		pthread_mutex_unlock(&cachelock);
+	}
+
+	free(ref->key);
+	free(ref->head);
+	free(ref->conditions);
+	free(ref->newhead);
+	free(ref->etag);
+	free(ref->lastmod);
+	memset(ref, 0, sizeof(*ref));
+	ref->fd = ref->tmpfd = -1;
+	ref->state = CACHE_PASS;
+}
+
+void cacheusage(unsigned long* bytes, int* entries) {
+	pthread_mutex_lock(&cachelock);
+	*bytes = cachebytes;
+	*entries = cacheentries;
+	pthread_mutex_unlock(&cachelock);
+}
+
+/* The index doesn't survive a restart, so neither do the objects: this
+ * removes the ones left by processes that are gone. Returns 0, or -1 if the
+ * directory is unusable. */
+int cacheinit() {
+	char path[PATH_MAX];
+	struct dirent* de;
+	DIR* dir;
+	int len;
+	int pid;
+
+	dir = opendir(cachedir);
+	if (!dir) {
+		fprintf(stderr, "Could not open cache directory %s: %m\n", cachedir);
+		return -1;
+	}
+	while ((de = readdir(dir))) {
+		len = strlen(de->d_name);
+		if (len < 5 || strcmp(de->d_name + len - 4, ".obj")) continue;
+		pid = atoi(de->d_name);
+		if (pid > 0 && (!kill(pid, 0) || errno != ESRCH)) continue;
+		snprintf(path, sizeof(path), "%s/%s", cachedir, de->d_name);
+		unlink(path);
+	}
+	closedir(dir);
+	printf("Caching up to %lu MB in %s.\n", cachesize >> 20, cachedir);
+	return 0;
+}
+
+/* Removes this process's objects on the way out. */
+void cacheclear() {
+	struct CacheEntry* e;
+	int x;
+
+	if (!cachedir) return;
+	pthread_mutex_lock(&cachelock);
+	for (x = 0; x < CACHEBUCKETS; x++) {
+		for (e = buckets[x]; e; e = e->next) {
+			if (e->id) objectremove(e->id);
+		}
+	}
+	pthread_mutex_unlock(&cachelock);
+}
+
+
+
+/* EOF */
@@ -0,0 +1,170 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Traffic capture, for bench/replay. Each client connection's traffic is
+ * cut into exchanges, a new one whenever the client sends after hearing
+ * back (or at each request the proxy parses), and when it closes it's
+ * encoded and handed to the log thread, which appends it to the capture
+ * file. The file is "TSPTRACE1\n" and then a
+ * record per connection, in the order they closed, of unsigned LEB128
+ * varints (v) and length-prefixed strings (s, a varint then the bytes):
+ *
+ *   v start (ms since the epoch)  v duration (ms)  v flags (1: SSL)
+ *   s mapping's proto  s host  s mapping  v exchanges, then each of those:
+ *   v when (ms after start)  v bytes up  v bytes down  s head
+ *
+ * The head is the request head that began the exchange, as far as the
+ * proxy saw it, with "capture <file> payload"; otherwise it's empty. */
+
+#include "transockproxy.h"
+#include <time.h>
+
+struct CaptureExchange {
+	unsigned long at;
+	unsigned long up;
+	unsigned long down;
+	char* head;
+	int headlen;
+};
+
+/* Locked, since an HTTP/2 connection's reader and its streams' threads
+ * account for its traffic at the same time. */
+struct Capture {
+	pthread_mutex_t lock;
+	unsigned long start;	/* mstime() */
+	unsigned long wall;	/* The same, since the epoch */
+	char* head;		/* Waiting for the exchange it begins */
+	int headlen;
+	int request;		/* The next traffic begins an exchange, whichever way. */
+	int count;
+	int size;
+	struct CaptureExchange* ex;
+};
+
+char* capturefile = NULL;
+int capturepayload = 0;
+
+void capturenew(struct Conn* c) {
+	struct timespec ts;
+
+	if (!capturefile) return;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	c->capture = (struct Capture*)calloc(1, sizeof(struct Capture));
+	pthread_mutex_init(&c->capture->lock, NULL);
+	c->capture->start = mstime();
+	c->capture->wall = ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/* From conntraffic(): up after down (or first) starts an exchange, the rest adds to it. */
+void capturetraffic(struct Conn* c, int up, int bytes) {
+	struct Capture* cap = c->capture;
+	struct CaptureExchange* e;
+
+	pthread_mutex_lock(&cap->lock);
+	e = cap->count ? &cap->ex[cap->count - 1] : NULL;
+	if ((cap->request || (up && (!e || e->down))) && cap->count < CAPTUREEXCHANGES) {
+		if (cap->count == cap->size) {
+			cap->size = cap->size ? cap->size * 2 : 4;
+			cap->ex = (struct CaptureExchange*)realloc(cap->ex, cap->size * sizeof(struct CaptureExchange));
+		}
+		e = &cap->ex[cap->count++];
+		e->at = mstime() - cap->start;
+		e->up = e->down = 0;
+		e->head = cap->head;
+		e->headlen = cap->headlen;
+		cap->head = NULL;
+		cap->headlen = 0;
+		cap->request = 0;
+	}
+	if (e && up) e->up += bytes;
+	else if (e) e->down += bytes;
+	pthread_mutex_unlock(&cap->lock);
+}
+
+/* Where the proxy knows a request begins (cache hits send nothing upstream):
+ * starts an exchange, with the head if payloads are captured. */
+void capturerequest(struct Conn* c, const char* head, int len) {
+	struct Capture* cap = c->capture;
+
+	if (!cap) return;
+	pthread_mutex_lock(&cap->lock);
+	cap->request = 1;
+	if (capturepayload) {
+		if (len > CAPTUREHEAD) len = CAPTUREHEAD;
+		free(cap->head);
+		cap->head = (char*)malloc(len);
+		memcpy(cap->head, head, len);
+		cap->headlen = len;
+	}
+	pthread_mutex_unlock(&cap->lock);
+}
+
+static int putvarint(unsigned char* p, unsigned long v) {
+	int n = 0;
+
+	while (v >= 0x80) {
+		p[n++] = (v & 0x7f) | 0x80;
+		v >>= 7;
+	}
+	p[n++] = v;
+	return n;
+}
+
+static int putstring(unsigned char* p, const char* s, int len) {
+	int n = putvarint(p, len);
+
+	memcpy(p + n, s, len);
+	return n + len;
+}
+
+/* From connfree(): encodes c's record for the log thread, and lets go of its capture. */
+void capturedone(struct Conn* c) {
+	struct Capture* cap = c->capture;
+	const char* proto = c->map ? protonames[c->map->proto] : "-";
+	const char* host = c->host ? c->host : "-";
+	const char* mapping = !c->map ? "-" : c->map == &c->routes->defmap ? "default" : c->map->pattern;
+	unsigned char* buf;
+	int size, len, x;
+
+	if (!cap) return;
+	size = 64 + strlen(proto) + strlen(host) + strlen(mapping);
+	for (x = 0; x < cap->count; x++) size += 40 + cap->ex[x].headlen;
+	buf = (unsigned char*)malloc(size);
+
+	len = putvarint(buf, cap->wall);
+	len += putvarint(buf + len, mstime() - cap->start);
+	len += putvarint(buf + len, c->ssl ? 1 : 0);
+	len += putstring(buf + len, proto, strlen(proto));
+	len += putstring(buf + len, host, strlen(host));
+	len += putstring(buf + len, mapping, strlen(mapping));
+	len += putvarint(buf + len, cap->count);
+	for (x = 0; x < cap->count; x++) {
+		len += putvarint(buf + len, cap->ex[x].at);
+		len += putvarint(buf + len, cap->ex[x].up);
+		len += putvarint(buf + len, cap->ex[x].down);
+		len += putstring(buf + len, cap->ex[x].head ? cap->ex[x].head : "", cap->ex[x].headlen);
+		free(cap->ex[x].head);
+	}
+	logcapture(buf, len);
+
+	free(cap->head);
+	free(cap->ex);
+	pthread_mutex_destroy(&cap->lock);
+	free(cap);
+	c->capture = NULL;
+}
+
+
+
+/* EOF */
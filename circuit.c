@@ -0,0 +1,220 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Circuit breaker. Destinations (host:port, as the client asked for them)
+ * that fail to connect circuitfails times in a row get their circuit
+ * opened: new clients for them are turned away at once instead of each
+ * tying up a thread in the same resolve/connect/handshake. A background
+ * probe retries the destination with growing backoff and closes the
+ * circuit once it answers. Only failing destinations have an entry, and
+ * closed entries are dropped once their failures are CIRCUITWINDOW old. */
+
+#include "transockproxy.h"
+#include <ctype.h>
+
+struct Circuit {
+	struct Circuit* next;
+	char key[CIRCUITKEYSIZE];	/* "host:port" */
+	int fails;
+	int open;
+	int probing;
+	int backoff;
+	unsigned long lastfail;
+	unsigned long nextprobe;
+};
+
+struct CircuitShard {
+	pthread_mutex_t lock;
+	struct Circuit* head;
+} __attribute__((aligned(64)));
+
+int circuitfails = CIRCUITFAILS;
+
+static struct CircuitShard shards[CIRCUITSHARDS];
+static int opencount = 0;
+
+/* Builds the lookup key for host (which may carry its own ":port") into key. */
+void circuitkey(char* key, const char* host, unsigned short defport) {
+	char name[CIRCUITKEYSIZE - 6];
+	unsigned short port;
+	int x;
+
+	snprintf(name, sizeof(name), "%s", host);
+	port = hostport(name, defport);
+	for (x = 0; name[x]; x++) name[x] = tolower((unsigned char)name[x]);
+	snprintf(key, CIRCUITKEYSIZE, "%s:%hu", name, port);
+}
+
+/* FNV-1a */
+unsigned int keyhash(const char* key) {
+	unsigned int hash = 2166136261U;
+
+	while (*key) hash = (hash ^ (unsigned char)*key++) * 16777619U;
+	return hash;
+}
+
+static struct CircuitShard* circuitshard(const char* key) {
+	return &shards[keyhash(key) % CIRCUITSHARDS];
+}
+
+/* Call with the shard locked. */
+static struct Circuit* circuitfind(struct CircuitShard* s, const char* key) {
+	struct Circuit* e;
+
+	for (e = s->head; e; e = e->next) {
+		if (!strcmp(e->key, key)) return e;
+	}
+	return NULL;
+}
+
+/* Returns 1 if the circuit for key is open, and the connection should be turned away. */
+int circuitopen(const char* key) {
+	struct CircuitShard* s = circuitshard(key);
+	struct Circuit* e;
+	int open;
+
+	if (circuitfails <= 0 || !__atomic_load_n(&opencount, __ATOMIC_RELAXED)) return 0;
+	pthread_mutex_lock(&s->lock);
+	e = circuitfind(s, key);
+	open = e && e->open;
+	pthread_mutex_unlock(&s->lock);
+	if (open) statadd(STAT_CIRCUITSKIPS, 1);
+	return open;
+}
+
+/* Records the outcome of a connection attempt to key. */
+void circuitresult(const char* key, int ok) {
+	struct CircuitShard* s = circuitshard(key);
+	struct Circuit* e;
+	unsigned long now;
+
+	if (circuitfails <= 0) return;
+	pthread_mutex_lock(&s->lock);
+	e = circuitfind(s, key);
+	if (ok) {
+		/* Only failing destinations have entries, so this is usually a miss. */
+		if (e) {
+			e->fails = 0;
+			if (e->open) __atomic_fetch_sub(&opencount, 1, __ATOMIC_RELAXED);
+			e->open = 0;
+		}
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+
+	now = mstime();
+	if (!e) {
+		e = (struct Circuit*)calloc(1, sizeof(struct Circuit));
+		snprintf(e->key, sizeof(e->key), "%s", key);
+		e->next = s->head;
+		s->head = e;
+	}
+	if (now - e->lastfail > CIRCUITWINDOW) e->fails = 0;
+	e->fails++;
+	e->lastfail = now;
+	if (!e->open && e->fails >= circuitfails) {
+		e->open = 1;
+		e->backoff = CIRCUITPROBEMS;
+		e->nextprobe = now + e->backoff;
+		__atomic_fetch_add(&opencount, 1, __ATOMIC_RELAXED);
+		statadd(STAT_CIRCUITOPENS, 1);
+		warn("%s failed %d times in a row, turning its clients away until it answers again.\n", key, e->fails);
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+int circuitcount() {
+	return __atomic_load_n(&opencount, __ATOMIC_RELAXED);
+}
+
+/* Tries the destination the way a client connection would, through whatever
+ * mapping it has now, so a reload that reroutes it takes effect here too. */
+static void* circuitprobe(void* arg) {
+	struct Circuit* e = (struct Circuit*)arg;
+	struct CircuitShard* s = circuitshard(e->key);
+	struct Conn* c = connprobe();
+	unsigned short port;
+	int ok;
+
+	c->host = strdup(e->key);
+	port = hostport(c->host, 80);
+	c->map = findmapping(c->routes, c->host);
+	ok = upstreamdial(c, c->map, c->host, port);
+	connfree(c);
+	statadd(ok ? STAT_CIRCUITPROBES : STAT_CIRCUITPROBEFAILS, 1);
+
+	pthread_mutex_lock(&s->lock);
+	if (ok) {
+		if (e->open) {
+			__atomic_fetch_sub(&opencount, 1, __ATOMIC_RELAXED);
+			warn("%s answered again, letting its clients through.\n", e->key);
+		}
+		e->open = 0;
+		e->fails = 0;
+	} else {
+		e->backoff = e->backoff * 2 < CIRCUITPROBEMAX ? e->backoff * 2 : CIRCUITPROBEMAX;
+		e->nextprobe = mstime() + e->backoff;
+		log("%s still not answering, next try in %d seconds.\n", e->key, e->backoff / 1000);
+	}
+	e->probing = 0;
+	pthread_mutex_unlock(&s->lock);
+	return NULL;
+}
+
+/* Starts probes that are due and drops entries that have gone quiet. Entries
+ * are only freed here, never while a probe holds one. */
+static void* circuitthread(void* arg) {
+	struct Circuit** pe;
+	struct Circuit* e;
+	unsigned long now;
+	pthread_t tid;
+	int x;
+
+	while (1) {
+		sleep(1);
+		now = mstime();
+		for (x = 0; x < CIRCUITSHARDS; x++) {
+			pthread_mutex_lock(&shards[x].lock);
+			pe = &shards[x].head;
+			while ((e = *pe)) {
+				if (!e->open && !e->probing && now - e->lastfail > CIRCUITWINDOW) {
+					*pe = e->next;
+					free(e);
+					continue;
+				}
+				if (e->open && !e->probing && now >= e->nextprobe) {
+					e->probing = 1;
+					pthread_create(&tid, NULL, circuitprobe, e);
+					pthread_detach(tid);
+				}
+				pe = &e->next;
+			}
+			pthread_mutex_unlock(&shards[x].lock);
+		}
+	}
+	return NULL;
+}
+
+void circuitstart() {
+	pthread_t tid;
+	int x;
+
+	for (x = 0; x < CIRCUITSHARDS; x++) pthread_mutex_init(&shards[x].lock, NULL);
+	pthread_create(&tid, NULL, circuitthread, NULL);
+	pthread_detach(tid);
+}
+
+
+
+/* EOF */
@@ -0,0 +1,335 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Fibers: connection code written as straight-line blocking code, run on
+ * small stacks multiplexed over a few worker threads. A fiber that would
+ * block on a socket parks itself in its worker's epoll with fiberpoll()
+ * and the worker runs something else until the socket is ready. Work that
+ * can only block (name lookups, connects through SOCKS) goes to a thread of
+ * its own with fiberblocking() while the fiber waits.
+ *
+ * A fiber stays on the worker it started on, so thread-local state (errno,
+ * the stats shard) behaves as it does on a thread. Called from a plain
+ * thread, fiberpoll() and fiberblocking() just block. */
+
+#include "transockproxy.h"
+#include <errno.h>
+#include <poll.h>
+#include <ucontext.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+#define FIBERMAXFDS 2
+
+struct Fiber;
+
+/* One fd a fiber is waiting on; what the worker's epoll hands back. */
+struct FiberFd {
+	struct Fiber* f;
+	int fd;
+	int revents;
+};
+
+struct Fiber {
+	struct Fiber* next;
+	struct FiberWorker* w;
+	ucontext_t ctx;
+	void* stack;
+	void* (*func)(void*);
+	void* arg;
+	struct FiberFd fds[FIBERMAXFDS];
+	int queued;
+	int done;
+};
+
+struct FiberWorker {
+	pthread_mutex_t lock;
+	struct Fiber* incoming;		/* Made runnable by other threads, guarded by lock */
+	struct Fiber* ready;		/* Made runnable by this worker's epoll */
+	struct Fiber** readytail;
+	struct Fiber* current;
+	ucontext_t sched;
+	int epfd;
+	int wakefd;
+} __attribute__((aligned(64)));
+
+/* For the blocking thread started by fiberblocking(). */
+struct FiberCall {
+	struct Fiber* f;
+	void (*func)(void*);
+	void* arg;
+};
+
+int fiberworkers = -1;
+
+static struct FiberWorker* workers;
+static int nworkers = 0;
+static unsigned int nextworker = 0;
+static int total = 0;
+static __thread struct FiberWorker* self;
+
+static void fiberwake(struct Fiber* f) {
+	struct FiberWorker* w = f->w;
+	unsigned long one = 1;
+
+	pthread_mutex_lock(&w->lock);
+	f->next = w->incoming;
+	w->incoming = f;
+	pthread_mutex_unlock(&w->lock);
+	write(w->wakefd, &one, sizeof(one));
+}
+
+static void fiberentry() {
+	struct Fiber* f = self->current;
+
+	f->func(f->arg);
+	f->done = 1;
+	/* uc_link is unset: the fiber never returns, the scheduler just drops it. */
+	swapcontext(&f->ctx, &self->sched);
+}
+
+static void fiberfree(struct Fiber* f) {
+	munmap(f->stack, FIBERSTACK);
+	free(f);
+}
+
+static void fiberrun(struct FiberWorker* w, struct Fiber* f) {
+	f->queued = 0;
+	w->current = f;
+	swapcontext(&w->sched, &f->ctx);
+	w->current = NULL;
+	if (f->done) {
+		__atomic_fetch_sub(&total, 1, __ATOMIC_RELAXED);
+		fiberfree(f);
+	}
+}
+
+static void* fiberworker(void* arg) {
+	struct FiberWorker* w = (struct FiberWorker*)arg;
+	struct epoll_event events[64];
+	struct Fiber* f;
+	struct Fiber* in;
+	struct Fiber* next;
+	struct FiberFd* ffd;
+	unsigned long n;
+	int x, rc;
+
+	self = w;
+	/* Alongside the accept worker of the same number, if there are any. */
+	if (workercount()) workerpin(w - workers);
+	while (1) {
+		/* Whatever came from other threads, oldest first. */
+		pthread_mutex_lock(&w->lock);
+		in = w->incoming;
+		w->incoming = NULL;
+		pthread_mutex_unlock(&w->lock);
+		for (f = NULL; in; in = next) {
+			next = in->next;
+			in->next = f;
+			f = in;
+		}
+		while (f) {
+			in = f->next;
+			fiberrun(w, f);
+			f = in;
+		}
+
+		while ((f = w->ready)) {
+			w->ready = f->next;
+			if (!w->ready) w->readytail = &w->ready;
+			fiberrun(w, f);
+		}
+
+		rc = epoll_wait(w->epfd, events, 64, -1);
+		for (x = 0; x < rc; x++) {
+			if (!events[x].data.ptr) {
+				read(w->wakefd, &n, sizeof(n));
+				continue;
+			}
+			ffd = (struct FiberFd*)events[x].data.ptr;
+			ffd->revents = (events[x].events & EPOLLIN ? POLLIN : 0) | (events[x].events & EPOLLOUT ? POLLOUT : 0)
+				| (events[x].events & EPOLLERR ? POLLERR : 0) | (events[x].events & EPOLLHUP ? POLLHUP : 0);
+			if (ffd->f->queued) continue;
+			ffd->f->queued = 1;
+			ffd->f->next = NULL;
+			*w->readytail = ffd->f;
+			w->readytail = &ffd->f->next;
+		}
+	}
+	return NULL;
+}
+
+/* Runs func(arg) on a fiber, or on a thread of its own if fibers are off.
+ * Returns 0, or an error number if there's neither to be had. */
+int fiberspawn(void* (*func)(void*), void* arg) {
+	struct Fiber* f;
+	struct FiberWorker* w;
+	pthread_t tid;
+	int rc;
+
+	if (!nworkers) {
+		if (!(rc = pthread_create(&tid, NULL, func, arg))) pthread_detach(tid);
+		return rc;
+	}
+
+	f = (struct Fiber*)calloc(1, sizeof(struct Fiber));
+	if (!f) return ENOMEM;
+	/* Only touched pages cost memory; the bottom one is left unmapped to catch an overflow. */
+	f->stack = mmap(NULL, FIBERSTACK, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+	if (f->stack == MAP_FAILED) {
+		warn("Could not allocate a fiber stack: %m\n");
+		free(f);
+		if (!(rc = pthread_create(&tid, NULL, func, arg))) pthread_detach(tid);
+		return rc;
+	}
+	mprotect(f->stack, 4096, PROT_NONE);
+	f->func = func;
+	f->arg = arg;
+	getcontext(&f->ctx);
+	f->ctx.uc_stack.ss_sp = f->stack;
+	f->ctx.uc_stack.ss_size = FIBERSTACK;
+	f->ctx.uc_link = NULL;
+	makecontext(&f->ctx, fiberentry, 0);
+
+	/* From an accept worker, to the fiber worker on the same CPU. */
+	if (workerid >= 0) w = &workers[workerid % nworkers];
+	else w = &workers[__atomic_fetch_add(&nextworker, 1, __ATOMIC_RELAXED) % nworkers];
+	f->w = w;
+	__atomic_fetch_add(&total, 1, __ATOMIC_RELAXED);
+	fiberwake(f);
+	return 0;
+}
+
+/* Like poll() with no timeout, for up to FIBERMAXFDS sockets. On a fiber, the
+ * worker gets on with other fibers meanwhile. Connection timeouts still work
+ * by shutting the sockets down. */
+int fiberpoll(struct pollfd* fds, int n) {
+	struct Fiber* f = self ? self->current : NULL;
+	struct epoll_event ev;
+	int x, count;
+
+	if (!f || n > FIBERMAXFDS) return poll(fds, n, -1);
+
+	for (x = 0; x < n; x++) {
+		f->fds[x].f = f;
+		f->fds[x].fd = fds[x].fd;
+		f->fds[x].revents = 0;
+		ev.events = (fds[x].events & POLLIN ? EPOLLIN : 0) | (fds[x].events & POLLOUT ? EPOLLOUT : 0);
+		ev.data.ptr = &f->fds[x];
+		if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, fds[x].fd, &ev)) {
+			/* Already closed under us, most likely; let the caller find out. */
+			f->fds[x].revents = POLLERR;
+			f->fds[x].fd = -1;
+		}
+	}
+	for (x = 0, count = 0; x < n; x++) count += f->fds[x].revents != 0;
+	if (!count) swapcontext(&f->ctx, &self->sched);
+
+	for (x = 0, count = 0; x < n; x++) {
+		if (f->fds[x].fd >= 0) epoll_ctl(self->epfd, EPOLL_CTL_DEL, f->fds[x].fd, NULL);
+		fds[x].revents = f->fds[x].revents;
+		count += fds[x].revents != 0;
+	}
+	return count;
+}
+
+static void* fibercall(void* arg) {
+	struct FiberCall* call = (struct FiberCall*)arg;
+
+	call->func(call->arg);
+	fiberwake(call->f);
+	return NULL;
+}
+
+/* Runs func(arg), which may block, without holding up the worker: on a
+ * thread of its own while the fiber waits for it. */
+void fiberblocking(void (*func)(void*), void* arg) {
+	struct Fiber* f = self ? self->current : NULL;
+	struct FiberCall call;
+	pthread_t tid;
+
+	if (!f) {
+		func(arg);
+		return;
+	}
+	call.f = f;
+	call.func = func;
+	call.arg = arg;
+	if (pthread_create(&tid, NULL, fibercall, &call)) {
+		func(arg);
+		return;
+	}
+	pthread_detach(tid);
+	swapcontext(&f->ctx, &self->sched);
+}
+
+/* usleep(), without holding up the worker. */
+void fibersleep(unsigned long us) {
+	struct itimerspec its;
+	struct pollfd pfd;
+
+	if (!fibered()) {
+		usleep(us);
+		return;
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = us / 1000000;
+	its.it_value.tv_nsec = (us % 1000000) * 1000;
+	pfd.fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (pfd.fd < 0 || timerfd_settime(pfd.fd, 0, &its, NULL)) {
+		if (pfd.fd >= 0) close(pfd.fd);
+		usleep(us);
+		return;
+	}
+	pfd.events = POLLIN;
+	fiberpoll(&pfd, 1);
+	close(pfd.fd);
+}
+
+/* Whether we're on a fiber, and so should keep sockets non-blocking. */
+int fibered() {
+	return self && self->current;
+}
+
+int fibercount() {
+	return __atomic_load_n(&total, __ATOMIC_RELAXED);
+}
+
+void fiberstart() {
+	struct epoll_event ev;
+	pthread_t tid;
+	int x;
+
+	nworkers = fiberworkers;
+	if (nworkers < 0) nworkers = workercount() ? workercount() : sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers <= 0) return;
+	workers = (struct FiberWorker*)calloc(nworkers, sizeof(struct FiberWorker));
+	for (x = 0; x < nworkers; x++) {
+		pthread_mutex_init(&workers[x].lock, NULL);
+		workers[x].readytail = &workers[x].ready;
+		workers[x].epfd = epoll_create1(EPOLL_CLOEXEC);
+		workers[x].wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(workers[x].epfd, EPOLL_CTL_ADD, workers[x].wakefd, &ev);
+		pthread_create(&tid, NULL, fiberworker, &workers[x]);
+		pthread_detach(tid);
+	}
+}
+
+
+
+/* EOF */
@@ -14,6 +14,8 @@
     
 #include "transockproxy.h"
 #include <fcntl.h>
+#include <poll.h>
+#include <netinet/tcp.h>
 #include <sys/stat.h>
 #include <gnutls/x509.h>
 
@@ -25,14 +27,20 @@ static gnutls_certificate_credentials_t cred;
 static gnutls_certificate_credentials_t scred;
 static gnutls_dh_params_t dhparams;
 static gnutls_priority_t priorities;
+static gnutls_datum_t ticketkey;
 
 static gnutls_x509_crt_t cacert;
 static gnutls_x509_privkey_t cakey;
 static gnutls_x509_crt_t starcert;
 static gnutls_x509_privkey_t sessionkey;
-static unsigned int serial = 0;
+static unsigned int serial = 1;
+
+/* Offered to clients when http2 is on, h2 first. */
+static const gnutls_datum_t alpn[] = {
+	{ (unsigned char*)"h2", 2 },
+	{ (unsigned char*)"http/1.1", 8 }
+};
 
-int verifycert(gnutls_session_t session);
 int gencert(gnutls_session_t, const gnutls_datum_t* req_ca_rdn, int nreqs,
 	const gnutls_pk_algorithm_t* pk_algos, int pk_algos_length,
 	gnutls_retr2_st *);
@@ -55,6 +63,9 @@ void gnutlsinit() {
 	
 	gnutls_certificate_allocate_credentials(&scred);
 	gnutls_certificate_set_verify_function(scred, verifycert);
+
+	/* Replaced by the old process's key when taking over from an upgrade, so its tickets still work. */
+	gnutls_session_ticket_key_generate(&ticketkey);
 	
 	bits = gnutls_sec_param_to_pk_bits(GNUTLS_PK_DH, GNUTLS_SEC_PARAM_LOW);
 	gnutls_dh_params_init(&dhparams);
@@ -78,6 +89,8 @@ void gnutlspostinit() {
 
 	if (!certfile || !keyfile) return;
 
+	if (verifyinit(scred)) exit(1);
+
 	rc = stat(keyfile, &st);
 	if (rc) {
 		warn("[GnuTLS] Error fetching info about keyfile %s: %m\n", keyfile);
@@ -147,6 +160,7 @@ void gnutlspostinit() {
 	
 	
 	gnutls_x509_crt_init(&starcert);
+	gnutls_x509_crt_set_version(starcert, 3);
 	gnutls_x509_crt_set_dn_by_oid(starcert, GNUTLS_OID_X520_COMMON_NAME, 0, "*", 1);
 	gnutls_x509_crt_set_serial(starcert, &serial, 4); serial++;
 	gnutls_x509_crt_set_activation_time(starcert, time(NULL)-86400);
@@ -154,7 +168,11 @@ void gnutlspostinit() {
 	gnutls_x509_crt_set_key(starcert, sessionkey);
 	gnutls_x509_crt_set_key_usage(starcert, GNUTLS_KEY_DATA_ENCIPHERMENT|GNUTLS_KEY_KEY_ENCIPHERMENT);
 	
-	gnutls_x509_crt_sign(starcert, cacert, cakey);
+	rc = gnutls_x509_crt_sign2(starcert, cacert, cakey, GNUTLS_DIG_SHA256, 0);
+	if (rc < 0) {
+		warn("[GnuTLS] Error signing certificate: %s\n", gnutls_strerror(rc));
+		exit(1);
+	}
 	
 	gnutls_x509_crt_print(starcert, GNUTLS_CRT_PRINT_ONELINE, &datum);
 	log("[GnuTLS] Generated cert: %s\n", datum.data);
@@ -170,34 +188,183 @@ void gnutlspostinit() {
 	}
 }
 
+int gnutlsgetticketkey(unsigned char* buffer, int size) {
+	if (ticketkey.size > size) return 0;
+	memcpy(buffer, ticketkey.data, ticketkey.size);
+	return ticketkey.size;
+}
+
+void gnutlssetticketkey(const unsigned char* key, int size) {
+	if (size != ticketkey.size) {
+		warn("[GnuTLS] Ticket key from old process is %d bytes, expected %u; not using it.\n", size, ticketkey.size);
+		return;
+	}
+	memcpy(ticketkey.data, key, size);
+}
+
+/* On a fiber sockets are non-blocking; waits for whichever way session's last call got stuck. */
+static void gnutlswait(gnutls_session_t session) {
+	struct pollfd pfd;
+
+	pfd.fd = (int)(long)gnutls_transport_get_ptr(session);
+	pfd.events = gnutls_record_get_direction(session) ? POLLOUT : POLLIN;
+	fiberpoll(&pfd, 1);
+}
+
 int gnutlswriteall(gnutls_session_t fd, const char* buffer, int size) {
 	int pos = 0;
 	int rc;
 	do {
 		rc = gnutls_record_send(fd, buffer + pos, size - pos);
+		if (rc == GNUTLS_E_AGAIN) {
+			gnutlswait(fd);
+			continue;
+		}
 		if (rc <= 0) return rc;
 		pos += rc;
 	} while (pos < size);
 	return size;
 }
 
+/* Moves what from has for us to to, straight out of GnuTLS's record buffers and
+ * corked, so reads coalesce into full-size records. Keeps reading while from has
+ * whole records buffered, up to TLSCORKSIZE. Returns the bytes moved, 0 at the
+ * end, GNUTLS_E_AGAIN if nothing was ready, or an error reading or sending. */
+static int gnutlsrelay(gnutls_session_t from, gnutls_session_t to) {
+	gnutls_packet_t packet;
+	gnutls_datum_t data;
+	int total = 0;
+	int senderr = 0;
+	int rc;
+
+	gnutls_record_cork(to);
+	do {
+		rc = gnutls_record_recv_packet(from, &packet);
+		if (rc == GNUTLS_E_INTERRUPTED) rc = GNUTLS_E_AGAIN;
+		if (rc <= 0) break;
+		gnutls_packet_get(packet, &data, NULL);
+		/* Corked, this mostly just copies into the pending record, but it can still
+		 * fail or flush early; what's been read from from can't be put back, so
+		 * GNUTLS_E_AGAIN waits here rather than going back to the caller. */
+		senderr = gnutlswriteall(to, (const char*)data.data, data.size);
+		gnutls_packet_deinit(packet);
+		if (senderr < 0) break;
+		senderr = 0;
+		total += data.size;
+	} while (total < TLSCORKSIZE && gnutls_record_check_pending(from));
+
+	/* Flushed even after an error reading, so what came before it isn't lost. */
+	while (1) {
+		int err = gnutls_record_uncork(to, 0);
+		if (err == GNUTLS_E_AGAIN || err == GNUTLS_E_INTERRUPTED) {
+			gnutlswait(to);
+			continue;
+		}
+		if (err < 0) return err;
+		break;
+	}
+	if (senderr) return senderr;
+	return total ? total : rc;
+}
+
+/* Starts TLS to host over c's upstream socket. Returns 1, or 0 with only the socket left to close. */
+int gnutlsdial(struct Conn* c, gnutls_session_t* session, const char* host) {
+	int rc;
+
+	rc = gnutls_init(session, GNUTLS_CLIENT);
+	if (rc) {
+		warn("[%d] GnuTLS client init failed.\n", c->csock);
+		*session = NULL;
+		return 0;
+	}
+	gnutls_credentials_set(*session, GNUTLS_CRD_CERTIFICATE, scred);
+	gnutls_transport_set_ptr(*session, (gnutls_transport_ptr_t)(long)c->ssock);
+	gnutls_server_name_set(*session, GNUTLS_NAME_DNS, host, strlen(host));
+	gnutls_session_set_ptr(*session, (void*)host);
+	gnutls_priority_set(*session, priorities);
+
+	connphase(c, PHASE_TLS);
+	do {
+		rc = gnutls_handshake(*session);
+		if (rc == GNUTLS_E_AGAIN) gnutlswait(*session);
+	} while (rc < 0 && !gnutls_error_is_fatal(rc) && !c->expired);
+	if (rc < 0) {
+		warn("[%d] Fatal error during GnuTLS handshake with server: %s\n", c->csock, gnutls_strerror(rc));
+		gnutls_deinit(*session);
+		*session = NULL;
+		return 0;
+	}
+	statadd(STAT_TLSCONNECTS, 1);
+	return 1;
+}
+
+/* Looks up the SNI as soon as the ClientHello is in, so a blocked host is
+ * turned away before gencert() goes to the trouble of a certificate. */
+static int gnutlsblock(gnutls_session_t session) {
+	struct Conn* c = (struct Conn*)gnutls_session_get_ptr(session);
+	char hostname[256];
+	size_t hostlen = sizeof(hostname);
+	unsigned int hosttype;
+	enum Proto proto;
+
+	if (gnutls_server_name_get(session, hostname, &hostlen, &hosttype, 0) < 0) return 0;
+	/* Others are counted once the Host: header has the final say. */
+	proto = findmapping(c->routes, hostname)->proto;
+	if (proto != BLOCK && proto != REJECT) return 0;
+	c->host = strdup(hostname);
+	c->map = findserver(c->routes, hostname);
+	connblocked(c);
+	return GNUTLS_E_UNWANTED_ALGORITHM;
+}
+
+/* What a fiber hands to fiberblocking(): upstreamconnect() can block on DNS
+ * and SOCKS, and h2serve() runs threads of its own on blocking sockets. */
+struct GnutlsCall {
+	struct Conn* c;
+	const struct Mapping* map;
+	char* host;
+	gnutls_session_t session;
+	int rc;
+};
+
+static void gnutlsconnect(void* arg) {
+	struct GnutlsCall* call = (struct GnutlsCall*)arg;
+
+	call->rc = upstreamconnect(call->c, call->map, call->host, 443);
+}
+
+static void gnutlsh2(void* arg) {
+	struct GnutlsCall* call = (struct GnutlsCall*)arg;
+
+	h2serve(call->c, call->session);
+}
+
+static void setblocking(int sock, int blocking) {
+	int flags = fcntl(sock, F_GETFL);
+
+	fcntl(sock, F_SETFL, blocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK);
+}
+
 void* gnutlsthread(void* arg) {
+	struct Conn* c = (struct Conn*)arg;
 	const struct Mapping* map;
-	struct sockaddr_in addr;
 	int ssock = 0;
-	int csock = (long)arg;
+	int csock = c->csock;
 	char* buffer;
 	int rc;
-	char* tok;
 	char* host = NULL;
-	fd_set fds;
-	fd_set rfds;
+	struct pollfd pfds[2];
+	struct GnutlsCall call;
 	gnutls_session_t csession = NULL, ssession = NULL;
-	char* firstpacket;
+	gnutls_datum_t proto;
+	char* firstpacket = NULL;
 	int firstpacketsize;
+	size_t snilen;
+	unsigned int snitype;
 	
-	running++;
-	buffer = (char*)malloc(BUFFERSIZE);
+	c->ssl = 1;
+	buffer = bufget(c->node);
+	if (fibered()) setblocking(csock, 0);
 	
 	rc = gnutls_init(&csession, GNUTLS_SERVER);
 	if (rc) {
@@ -206,26 +373,54 @@ void* gnutlsthread(void* arg) {
 	}
 	gnutls_credentials_set(csession, GNUTLS_CRD_CERTIFICATE, cred);
 	gnutls_certificate_server_set_request(csession, GNUTLS_CERT_IGNORE);
+	gnutls_session_ticket_enable_server(csession, &ticketkey);
 	gnutls_priority_set(csession, priorities);
+	if (c->routes->http2) gnutls_alpn_set_protocols(csession, alpn, 2, GNUTLS_ALPN_SERVER_PRECEDENCE);
 	
 	gnutls_transport_set_ptr(csession, (gnutls_transport_ptr_t)(long)csock);
+	gnutls_session_set_ptr(csession, c);
+	gnutls_handshake_set_post_client_hello_function(csession, gnutlsblock);
 	
+	connphase(c, PHASE_TLS);
 	do {
 		rc = gnutls_handshake(csession);
-	} while (rc < 0 && !gnutls_error_is_fatal(rc));
+		if (rc == GNUTLS_E_AGAIN) gnutlswait(csession);
+	} while (rc < 0 && !gnutls_error_is_fatal(rc) && !c->expired);
+	if (c->blocked) {
+		if (c->blocked == BLOCK) gnutls_alert_send(csession, GNUTLS_AL_FATAL, GNUTLS_A_ACCESS_DENIED);
+		goto end;
+	}
 	if (rc < 0) {
 		warn("[%d] Fatal error during GnuTLS handshake with client: %s\n", csock, gnutls_strerror(rc));
 		goto end;
 	}
+	statadd(STAT_TLSACCEPTS, 1);
+
+	if (c->routes->http2 && !gnutls_alpn_get_selected_protocol(csession, &proto)
+		&& proto.size == 2 && !memcmp(proto.data, "h2", 2)) {
+		setblocking(csock, 1);
+		/* Its streams may each map somewhere else; the client's socket goes by the SNI. */
+		snilen = BUFFERSIZE;
+		if (!gnutls_server_name_get(csession, buffer, &snilen, &snitype, 0))
+			sockprofile(csock, findmapping(c->routes, buffer)->profile);
+		call.c = c;
+		call.session = csession;
+		fiberblocking(gnutlsh2, &call);
+		goto end;
+	}
 
 	/* Find connection info from client. This *should* all fit in the first packet. */
-	rc = gnutls_record_recv(csession, buffer, BUFFERSIZE);
+	connphase(c, PHASE_HEADER);
+	do {
+		rc = gnutls_record_recv(csession, buffer, BUFFERSIZE-1);
+		if (rc == GNUTLS_E_AGAIN) gnutlswait(csession);
+	} while (rc == GNUTLS_E_AGAIN && !c->expired);
 	if (rc == 0) {
 		warn("[%d] Client closed connection before sending headers.\n", csock);
 		goto end;
 	}
 	if (rc < 0) {
-		warn("[%d] Error reading request headers: %s\n", csock, gnutls_strerror(rc));
+		if (!c->expired) warn("[%d] Error reading request headers: %s\n", csock, gnutls_strerror(rc));
 		goto end;
 	}
 	firstpacket = (char*)malloc(rc);
@@ -233,15 +428,7 @@ void* gnutlsthread(void* arg) {
 	firstpacketsize = rc;
 
 	buffer[rc] = 0;
-	strtok(buffer, "\r\n");
-	/* First token should be "GET /foo HTTP/1.1" so we can skip that safely. */
-	while ((tok = strtok(NULL, "\r\n"))) {
-		if (!strncasecmp(tok, "Host: ", 6)) {
-			host = strdup(tok + 6);
-			break;
-		}
-	}
-	
+	host = findhost(buffer);
 	if (host == NULL) {
 		warn("[%d] Client did not provide Host: header.\n", csock);
 		goto end;
@@ -250,122 +437,113 @@ void* gnutlsthread(void* arg) {
 
 
 	/* Establish SOCKS connection. */
-	map = findserver(host);
-	
-	ssock = socket(AF_INET, SOCK_STREAM, 0);
-
-	switch (map->proto) {
-	case INVALID:
+	map = findserver(c->routes, host);
+	c->host = host;
+	c->map = map;
+	sockprofile(csock, map->profile);
+	if (connblocked(c)) {
+		rc = blockresponse(buffer, BUFFERSIZE, map);
+		if (rc) gnutlswriteall(csession, buffer, rc);
 		goto end;
-	
-	case DIRECT:
-		if (!directconnect(csock, ssock, host, "443", map)) goto end;
-		break;
-
-	case SOCKS4:
-		rc = connect(ssock, (struct sockaddr*)&addr, sizeof(addr));
-		if (rc) { warn("[%d] Could not connect to server: %m\n", csock); return 0; }
-		if (!socks4connect(csock, ssock, host, 443)) goto end;
-		break;
-	
-	case SOCKS4A:
-		rc = connect(ssock, (struct sockaddr*)&addr, sizeof(addr));
-		if (rc) { warn("[%d] Could not connect to server: %m\n", csock); return 0; }
-		if (!socks4aconnect(csock, ssock, host, 443)) goto end;
-		break;
-	
-	case SOCKS5:
-		rc = connect(ssock, (struct sockaddr*)&addr, sizeof(addr));
-		if (rc) { warn("[%d] Could not connect to server: %m\n", csock); return 0; }
-		if (!socks5connect(csock, ssock, host, 443)) goto end;
-		break;
 	}
+	
+	call.c = c;
+	call.map = map;
+	call.host = host;
+	fiberblocking(gnutlsconnect, &call);
+	if (!call.rc) goto end;
+	ssock = c->ssock;
+	if (fibered()) setblocking(ssock, 0);
+	/* gnutlsrelay() does its own coalescing; Nagle would only hold back the last record of each batch. */
+	socknodelay(csock, map->profile);
+	socknodelay(ssock, map->profile);
 
 	/* We're connected through the proxy, now start SSL to the end server. */
-	rc = gnutls_init(&ssession, GNUTLS_CLIENT);
-	if (rc) {
-		warn("[%d] GnuTLS client init failed.\n", csock);
-		goto end;
-	}
-	gnutls_credentials_set(ssession, GNUTLS_CRD_CERTIFICATE, scred);
-	gnutls_transport_set_ptr(ssession, (gnutls_transport_ptr_t)(long)ssock);
-	gnutls_server_name_set(ssession, GNUTLS_NAME_DNS, host, strlen(host));
-	gnutls_priority_set(ssession, priorities);
-	
-	do {
-		rc = gnutls_handshake(ssession);
-	} while (rc < 0 && !gnutls_error_is_fatal(rc));
-	if (rc < 0) {
-		warn("[%d] Fatal error during GnuTLS handshake with server: %s\n", csock, gnutls_strerror(rc));
-		goto end;
-	}
+	if (!gnutlsdial(c, &ssession, host)) goto end;
 	
+	connphase(c, PHASE_RELAY);
+	capturerequest(c, firstpacket, firstpacketsize);
 	rc = gnutlswriteall(ssession, firstpacket, firstpacketsize);
 	free(firstpacket); 
+	firstpacket = NULL;
+	if (rc <= 0) {
+		warn("[%d] Error sending to server: %s\n", csock, gnutls_strerror(rc));
+		c->failed = 1;
+		goto end;
+	}
+	conntraffic(c, 1, rc);
 	
 	
 	/* Relay data. */
-	FD_ZERO(&fds);
-	FD_SET(csock, &fds);
-	FD_SET(ssock, &fds);
+	pfds[0].fd = csock;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = ssock;
+	pfds[1].events = POLLIN;
 	
 	do {
-		rfds = fds;
-		rc = select(FD_SETSIZE, &rfds, NULL, NULL, NULL);
-		if (rc < 0) break;
+		/* Records GnuTLS already holds won't make the socket readable again. */
+		pfds[0].revents = gnutls_record_check_pending(csession) ? POLLIN : 0;
+		pfds[1].revents = gnutls_record_check_pending(ssession) ? POLLIN : 0;
+		if (!pfds[0].revents && !pfds[1].revents && fiberpoll(pfds, 2) < 0) break;
 		
-		if (FD_ISSET(csock, &rfds)) {
-			rc = gnutls_record_recv(csession, buffer, BUFFERSIZE);
+		if (pfds[0].revents) {
+			rc = gnutlsrelay(csession, ssession);
 			if (rc == 0) break;
-			if (rc < 0) {
-				warn("[%d] Error reading from client: %m\n", csock);
-				break;
-			}
-		
-			rc = gnutlswriteall(ssession, buffer, rc);
-			if (rc <= 0) {
-				warn("[%d] Error sending to server: %m\n", csock);
+			if (rc < 0 && rc != GNUTLS_E_AGAIN) {
+				warn("[%d] Error relaying from client: %s\n", csock, gnutls_strerror(rc));
+				c->failed = 1;
 				break;
 			}
+			if (rc > 0) conntraffic(c, 1, rc);
 		}
-		if (FD_ISSET(ssock, &rfds)) {
-			rc = gnutls_record_recv(ssession, buffer, BUFFERSIZE);
+		if (pfds[1].revents) {
+			rc = gnutlsrelay(ssession, csession);
 			if (rc == 0) break;
-			if (rc <= 0) {
-				warn("[%d] Error reading from server: %m\n", csock);
-				break;
-			}
-		
-			rc = gnutlswriteall(csession, buffer, rc);
-			if (rc <= 0) {
-				warn("[%d] Error sending to client: %m\n", csock);
+			if (rc < 0 && rc != GNUTLS_E_AGAIN) {
+				warn("[%d] Error relaying from server: %s\n", csock, gnutls_strerror(rc));
+				c->failed = 1;
 				break;
 			}
+			if (rc > 0) conntraffic(c, 0, rc);
 		}
 	} while (exitflag == 0);
 	
 	end:
+	/* SHUT_WR: waiting for the peer's close_notify could block forever on a dead peer. */
 	if (ssession) {
-		gnutls_bye(ssession, GNUTLS_SHUT_RDWR);
+		if (!c->expired) gnutls_bye(ssession, GNUTLS_SHUT_WR);
 		gnutls_deinit(ssession);
 	}
 	if (csession) {
+		if (!c->expired && !c->blocked) gnutls_bye(csession, GNUTLS_SHUT_WR);
 		gnutls_deinit(csession);	
-		gnutls_bye(csession, GNUTLS_SHUT_RDWR);
 	}
-	if (csock > 0) close(csock);
-	if (ssock > 0) close(ssock);
-	if (host) free(host);
-	if (buffer) free(buffer);
-	running--;
+	bufput(c->node, buffer);
+	connfree(c);
+	if (firstpacket) free(firstpacket);
 	log("[%d] SSL relay finished.\n", csock);
 	return NULL;
 }
 
-int verifycert(gnutls_session_t session) {
-	return 0;
+/* Builds a one-day certificate for hostname around key, signed by ca. */
+gnutls_x509_crt_t makecert(const char* hostname, gnutls_x509_privkey_t key, gnutls_x509_crt_t ca, gnutls_x509_privkey_t cakey) {
+	gnutls_x509_crt_t cert;
+	unsigned int certserial = __atomic_fetch_add(&serial, 1, __ATOMIC_RELAXED);
+
+	gnutls_x509_crt_init(&cert);
+	gnutls_x509_crt_set_version(cert, 3);
+	gnutls_x509_crt_set_dn_by_oid(cert, GNUTLS_OID_X520_COMMON_NAME, 0, hostname, strlen(hostname));
+	gnutls_x509_crt_set_serial(cert, &certserial, 4);
+	gnutls_x509_crt_set_activation_time(cert, time(NULL)-86400);
+	gnutls_x509_crt_set_expiration_time(cert, time(NULL)+86400);
+	gnutls_x509_crt_set_key(cert, key);
+	gnutls_x509_crt_set_key_usage(cert, GNUTLS_KEY_DATA_ENCIPHERMENT|GNUTLS_KEY_KEY_ENCIPHERMENT);
+	
+	gnutls_x509_crt_sign2(cert, ca, cakey, GNUTLS_DIG_SHA256, 0);
+	return cert;
 }
 
+
 int gencert(gnutls_session_t session, 
 	const gnutls_datum_t* req_ca_rdn, int nreqs,
 	const gnutls_pk_algorithm_t* pk_algos, int pk_algos_length,
@@ -395,19 +573,13 @@ int gencert(gnutls_session_t session,
 	gnutls_x509_privkey_init(&key);
 	gnutls_x509_privkey_cpy(key, sessionkey);
 	
-	gnutls_x509_crt_init(&cert);
-	gnutls_x509_crt_set_dn_by_oid(cert, GNUTLS_OID_X520_COMMON_NAME, 0, hostname, hostlen);
-	gnutls_x509_crt_set_serial(cert, &serial, 4); serial++;
-	gnutls_x509_crt_set_activation_time(cert, time(NULL)-86400);
-	gnutls_x509_crt_set_expiration_time(cert, time(NULL)+86400);
-	gnutls_x509_crt_set_key(cert, key);
-	gnutls_x509_crt_set_key_usage(cert, GNUTLS_KEY_DATA_ENCIPHERMENT|GNUTLS_KEY_KEY_ENCIPHERMENT);
-	
-	gnutls_x509_crt_sign(cert, cacert, cakey);
+	cert = makecert(hostname, key, cacert, cakey);
 	
-	gnutls_x509_crt_print(cert, GNUTLS_CRT_PRINT_ONELINE, &datum);
-	log("[GnuTLS] Generated cert: %s\n", datum.data);
-	gnutls_free(datum.data);
+	if (loglevel >= LOG_INFO) {
+		gnutls_x509_crt_print(cert, GNUTLS_CRT_PRINT_ONELINE, &datum);
+		log("[GnuTLS] Generated cert: %s\n", datum.data);
+		gnutls_free(datum.data);
+	}
 	
 	ret->cert_type = GNUTLS_CRT_X509;
 	ret->key_type = GNUTLS_PRIVKEY_X509;
@@ -0,0 +1,1012 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* HTTP/2 (RFC 7540) on the client side of the TLS listener, for clients
+ * that negotiate h2 by ALPN. One thread reads frames off the connection and
+ * hands each request stream to a thread of its own, which sends it upstream
+ * as HTTP/1.1 over TLS on a pooled keep-alive connection and frames the
+ * response back. All writes to the client go through h2write() under one
+ * lock; GnuTLS lets one thread send while another receives.
+ *
+ * Flow control: what we send is held to both the connection's and the
+ * stream's window. What the client sends on a stream is buffered up to the
+ * initial window and only credited back once it's gone upstream, so a slow
+ * origin throttles its own uploads and nobody else's. The connection window
+ * is credited at once, since every stream has its own buffer anyway. */
+
+#include "transockproxy.h"
+#include <errno.h>
+#include <netinet/tcp.h>
+
+#define H2PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2FRAMESIZE 16384	/* Largest frame we take, the protocol's minimum */
+#define H2WINDOW 65535		/* Initial window, which we leave at the protocol's default */
+#define H2TABLESIZE 4096	/* HPACK table size, likewise */
+#define H2HEADERMAX (BUFFERSIZE * 4)	/* Largest header block we'll put back together */
+#define H2REQSIZE (BUFFERSIZE * 2)
+
+enum H2Type {
+	H2_DATA,
+	H2_HEADERS,
+	H2_PRIORITY,
+	H2_RST_STREAM,
+	H2_SETTINGS,
+	H2_PUSH_PROMISE,
+	H2_PING,
+	H2_GOAWAY,
+	H2_WINDOW_UPDATE,
+	H2_CONTINUATION
+};
+
+#define H2_END_STREAM 0x1
+#define H2_ACK 0x1
+#define H2_END_HEADERS 0x4
+#define H2_PADDED 0x8
+#define H2_PRIORITY_FLAG 0x20
+
+enum H2Error {
+	H2_NO_ERROR,
+	H2_PROTOCOL_ERROR,
+	H2_INTERNAL_ERROR,
+	H2_FLOW_CONTROL_ERROR,
+	H2_SETTINGS_TIMEOUT,
+	H2_STREAM_CLOSED,
+	H2_FRAME_SIZE_ERROR,
+	H2_REFUSED_STREAM,
+	H2_CANCEL,
+	H2_COMPRESSION_ERROR,
+	H2_CONNECT_ERROR,
+	H2_ENHANCE_YOUR_CALM
+};
+
+struct H2Conn;
+
+/* Everything below conn is guarded by the connection's lock. */
+struct H2Stream {
+	struct H2Stream* next;
+	struct H2Conn* h;
+	struct Conn* conn;
+	unsigned int id;
+	/* The request, as decoded by the reading thread */
+	char* method;
+	char* path;
+	char* authority;
+	char* head;	/* Regular headers, as HTTP/1.1 lines */
+	int headlen;
+	char* cookie;
+	long length;	/* content-length, or -1 */
+	long received;	/* DATA so far, which has to come to length */
+	int nobody;
+	int toolarge;
+	int malformed;	/* A field HTTP/1.1 couldn't carry as it is, see h2header() */
+	/* Request body waiting to go upstream */
+	char* body;
+	int bodylen;
+	int endstream;	/* The client has sent all of it */
+	int reset;
+	long window;	/* What we may still send on it */
+	int ssock;	/* Upstream socket, so a reset can interrupt the stream's thread */
+};
+
+struct H2Conn {
+	struct Conn* c;
+	gnutls_session_t session;
+	pthread_mutex_t wlock;
+	int dead;	/* A write failed; guarded by wlock */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct H2Stream* streams;
+	int active;
+	int upstreams;	/* Streams with an upstream connection */
+	unsigned int lastid;
+	long window;
+	long initialwindow;	/* The client's SETTINGS_INITIAL_WINDOW_SIZE */
+	int maxframe;	/* The client's SETTINGS_MAX_FRAME_SIZE */
+	int closing;
+	int goaway;
+	struct Hpack decoder;
+};
+
+static void h2put32(unsigned char* p, unsigned int n) {
+	p[0] = n >> 24;
+	p[1] = n >> 16;
+	p[2] = n >> 8;
+	p[3] = n;
+}
+
+static unsigned int h2get32(const unsigned char* p) {
+	return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/* Sends one frame. Returns 0, or -1 if the connection is gone. */
+static int h2write(struct H2Conn* h, int type, int flags, unsigned int id, const void* payload, int len) {
+	unsigned char hdr[9];
+	ssize_t rc = -1;
+
+	hdr[0] = len >> 16;
+	hdr[1] = len >> 8;
+	hdr[2] = len;
+	hdr[3] = type;
+	hdr[4] = flags;
+	h2put32(hdr + 5, id);
+
+	pthread_mutex_lock(&h->wlock);
+	if (!h->dead) {
+		/* Corked, so the header and payload go out as one record. */
+		gnutls_record_cork(h->session);
+		rc = gnutls_record_send(h->session, hdr, sizeof(hdr));
+		if (rc >= 0 && len) rc = gnutls_record_send(h->session, payload, len);
+		/* Uncorked even after a failed send, so nothing is left pending behind it. */
+		if (rc >= 0) rc = gnutls_record_uncork(h->session, GNUTLS_RECORD_WAIT);
+		else gnutls_record_uncork(h->session, GNUTLS_RECORD_WAIT);
+		if (rc < 0) h->dead = 1;
+		else conntraffic(h->c, 0, sizeof(hdr) + len);
+	}
+	pthread_mutex_unlock(&h->wlock);
+	return rc < 0 ? -1 : 0;
+}
+
+static void h2rst(struct H2Conn* h, unsigned int id, enum H2Error code) {
+	unsigned char p[4];
+
+	h2put32(p, code);
+	h2write(h, H2_RST_STREAM, 0, id, p, sizeof(p));
+}
+
+static void h2credit(struct H2Conn* h, unsigned int id, int n) {
+	unsigned char p[4];
+
+	h2put32(p, n);
+	h2write(h, H2_WINDOW_UPDATE, 0, id, p, sizeof(p));
+}
+
+static void h2goaway(struct H2Conn* h, enum H2Error code) {
+	unsigned char p[8];
+
+	h2put32(p, h->lastid);
+	h2put32(p + 4, code);
+	h2write(h, H2_GOAWAY, 0, 0, p, sizeof(p));
+}
+
+/* Call with the connection locked. */
+static struct H2Stream* h2find(struct H2Conn* h, unsigned int id) {
+	struct H2Stream* s;
+
+	for (s = h->streams; s; s = s->next) {
+		if (s->id == id) return s;
+	}
+	return NULL;
+}
+
+/* Call with the connection locked. */
+static void h2reset(struct H2Stream* s) {
+	s->reset = 1;
+	if (s->ssock > 0) shutdown(s->ssock, SHUT_RDWR);
+}
+
+static void h2streamfree(struct H2Stream* s) {
+	free(s->method);
+	free(s->path);
+	free(s->authority);
+	free(s->head);
+	free(s->cookie);
+	free(s->body);
+	free(s);
+}
+
+/* Sends len bytes of response body as DATA frames, as the windows allow. */
+static int h2data(struct H2Conn* h, struct H2Stream* s, const char* data, int len, int last) {
+	long n;
+
+	do {
+		pthread_mutex_lock(&h->lock);
+		while (len && !s->reset && !h->closing && (h->window <= 0 || s->window <= 0)) pthread_cond_wait(&h->cond, &h->lock);
+		if (s->reset || h->closing) {
+			pthread_mutex_unlock(&h->lock);
+			return -1;
+		}
+		n = len;
+		if (n > h->window) n = h->window;
+		if (n > s->window) n = s->window;
+		if (n > h->maxframe) n = h->maxframe;
+		h->window -= n;
+		s->window -= n;
+		pthread_mutex_unlock(&h->lock);
+
+		if (h2write(h, H2_DATA, last && n == len ? H2_END_STREAM : 0, s->id, data, n)) return -1;
+		s->conn->lastactive = mstime();
+		data += n;
+		len -= n;
+	} while (len > 0);
+	return 0;
+}
+
+/* Sends n bytes of body from b. */
+static int h2copy(struct H2Conn* h, struct H2Stream* s, struct HttpBuf* b, long n, int last) {
+	long avail;
+
+	if (!n && last) return h2data(h, s, NULL, 0, 1);
+	while (n > 0) {
+		if (b->pos == b->len && buffill(b) <= 0) return -1;
+		avail = b->len - b->pos;
+		if (avail > n) avail = n;
+		if (h2data(h, s, b->data + b->pos, avail, last && avail == n)) return -1;
+		b->pos += avail;
+		n -= avail;
+	}
+	return 0;
+}
+
+/* Sends a chunked body from b as plain DATA, dropping the trailers. */
+static int h2chunked(struct H2Conn* h, struct H2Stream* s, struct HttpBuf* b) {
+	long size;
+	int len;
+
+	do {
+		len = readline(b);
+		if (len < 0) return -1;
+		size = chunksize(b->data + b->pos, len);
+		b->pos += len;
+		if (size < 0 || (size && h2copy(h, s, b, size, 0))) return -1;
+		if (size && (readline(b) != 2 || b->data[b->pos] != '\r')) return -1;
+		if (size) b->pos += 2;
+	} while (size);
+
+	do {
+		len = readline(b);
+		if (len < 0) return -1;
+		b->pos += len;
+	} while (len > 2);
+	return h2data(h, s, NULL, 0, 1);
+}
+
+/* Sends a close-delimited body from b. */
+static int h2copyall(struct H2Conn* h, struct H2Stream* s, struct HttpBuf* b) {
+	int n;
+
+	while (1) {
+		n = b->len - b->pos;
+		if (n && h2data(h, s, b->data + b->pos, n, 0)) return -1;
+		b->pos = b->len;
+		/* TLS servers often skip close_notify; a bare close ends the body all the same. */
+		if (buffill(b) <= 0) return h2data(h, s, NULL, 0, 1);
+	}
+}
+
+/* Moves the request body upstream as it arrives, crediting the client's window as it goes. */
+static int h2sendbody(struct H2Conn* h, struct H2Stream* s, gnutls_session_t session, int chunked) {
+	char* buf = (char*)malloc(H2WINDOW);
+	char line[16];
+	int n, end;
+	int rc = -1;
+
+	while (1) {
+		pthread_mutex_lock(&h->lock);
+		while (!s->bodylen && !s->endstream && !s->reset && !h->closing) pthread_cond_wait(&h->cond, &h->lock);
+		if (s->reset || h->closing) {
+			pthread_mutex_unlock(&h->lock);
+			break;
+		}
+		n = s->bodylen;
+		memcpy(buf, s->body, n);
+		s->bodylen = 0;
+		end = s->endstream;
+		pthread_mutex_unlock(&h->lock);
+
+		if (n) {
+			if (chunked && gnutlswriteall(session, line, snprintf(line, sizeof(line), "%x\r\n", n)) <= 0) break;
+			if (gnutlswriteall(session, buf, n) <= 0) break;
+			if (chunked && gnutlswriteall(session, "\r\n", 2) <= 0) break;
+			s->conn->lastactive = mstime();
+			if (!end) h2credit(h, s->id, n);
+		}
+		if (end) {
+			rc = chunked && gnutlswriteall(session, "0\r\n\r\n", 5) <= 0 ? -1 : 0;
+			break;
+		}
+	}
+	free(buf);
+	return rc;
+}
+
+/* Answers a stream with just a status, for when upstream can't. */
+static void h2reply(struct H2Conn* h, struct H2Stream* s, int status) {
+	unsigned char block[64];
+	int pos;
+
+	pos = hpackstatus(block, sizeof(block), status);
+	if (status != 204) pos += hpackencode(block + pos, sizeof(block) - pos, "content-length", 14, "0", 1);
+	h2write(h, H2_HEADERS, H2_END_HEADERS | H2_END_STREAM, s->id, block, pos);
+}
+
+/* Turns an HTTP/1.1 response head into a HEADERS block. Returns its length, or -1. */
+static int h2encodehead(unsigned char* block, int size, const char* p, int len, int status) {
+	const char* end = p + len;
+	const char* eol;
+	const char* value;
+	int pos, n, nlen;
+
+	pos = hpackstatus(block, size, status);
+	if (pos < 0) return -1;
+	for (p = strstr(p, "\r\n") + 2; p < end - 2; p = eol + 2) {
+		eol = strstr(p, "\r\n");
+		value = memchr(p, ':', eol - p);
+		if (!value) continue;
+		nlen = value - p;
+		for (value++; *value == ' ' || *value == '\t'; value++);
+
+		/* Connection-specific headers have no place in HTTP/2. */
+		if ((nlen == 10 && !strncasecmp(p, "Connection", 10))
+			|| (nlen == 10 && !strncasecmp(p, "Keep-Alive", 10))
+			|| (nlen == 16 && !strncasecmp(p, "Proxy-Connection", 16))
+			|| (nlen == 17 && !strncasecmp(p, "Transfer-Encoding", 17))
+			|| (nlen == 7 && !strncasecmp(p, "Upgrade", 7))) continue;
+		n = hpackencode(block + pos, size - pos, p, nlen, value, eol - value);
+		if (n < 0) return -1;
+		pos += n;
+	}
+	return pos;
+}
+
+/* Gets a TLS connection to the stream's host, from the idle pool unless
+ * fresh is set. Returns 1 if it was reused, 0 if it's new, or -1. */
+static int h2upstream(struct Conn* c, const char* key, gnutls_session_t* session, int fresh) {
+	void* pooled;
+	char* dest;
+	int sock;
+	int rc;
+
+	if (!fresh && key[0] && (sock = idleget(key, &c->upstream, &pooled)) > 0) {
+		connattach(c, sock);
+		*session = (gnutls_session_t)pooled;
+		statadd(STAT_UPSTREAMREUSES, 1);
+		return 1;
+	}
+	c->rejected = 0;
+	dest = strdup(c->host);
+	rc = upstreamconnect(c, c->map, dest, 443);
+	if (rc) {
+		socknodelay(c->ssock, c->map->profile);
+		/* upstreamconnect() took the port off, which leaves the name to send as SNI. */
+		rc = gnutlsdial(c, session, dest);
+	}
+	free(dest);
+	return rc ? 0 : -1;
+}
+
+static void h2upstreamclose(struct H2Conn* h, struct H2Stream* s, struct Conn* c, gnutls_session_t* session) {
+	int sock;
+
+	pthread_mutex_lock(&h->lock);
+	s->ssock = -1;
+	pthread_mutex_unlock(&h->lock);
+	sock = conndetach(c);
+	if (*session) gnutls_deinit(*session);
+	*session = NULL;
+	if (sock > 0) close(sock);
+	if (c->via) {
+		poolrelease(c->via);
+		c->via = NULL;
+	}
+}
+
+static void* h2stream(void* arg) {
+	struct H2Stream* s = (struct H2Stream*)arg;
+	struct H2Stream** ps;
+	struct H2Conn* h = s->h;
+	struct Conn* c = s->conn;
+	struct HttpBuf* sb = (struct HttpBuf*)malloc(sizeof(struct HttpBuf));
+	struct HttpHead resp;
+	gnutls_session_t session = NULL;
+	unsigned char* block = NULL;
+	char key[IDLEKEYSIZE];
+	char* req = (char*)malloc(H2REQSIZE);
+	int reqlen;
+	int chunked, reused, framed, nobody, blocklen;
+	int retried = 0;
+	int slot = 0;
+	int reusable = 0;
+	int sent = 0;
+	int status = 0;
+	int rc, n;
+
+	c->host = strdup(s->authority);
+	c->map = findserver(c->routes, c->host);
+	idlekey(key, c->map, c->host, 1);
+	if (connblocked(c)) {
+		if (c->blocked == BLOCK) {
+			status = c->map->status;
+			goto end;
+		}
+		pthread_mutex_lock(&h->lock);
+		rc = !s->reset;
+		s->reset = 1;
+		pthread_mutex_unlock(&h->lock);
+		if (rc) h2rst(h, s->id, H2_CANCEL);
+		goto end;
+	}
+
+	chunked = !s->nobody && s->length < 0;
+	reqlen = snprintf(req, H2REQSIZE, "%s %s HTTP/1.1\r\nHost: %s\r\n%s%s%s%s%sConnection: keep-alive\r\n\r\n",
+		s->method, s->path, s->authority, s->head ? s->head : "",
+		s->cookie ? "Cookie: " : "", s->cookie ? s->cookie : "", s->cookie ? "\r\n" : "",
+		chunked ? "Transfer-Encoding: chunked\r\n" : "");
+	if (s->toolarge || reqlen >= H2REQSIZE) {
+		status = 431;
+		goto end;
+	}
+
+	pthread_mutex_lock(&h->lock);
+	while (h->upstreams >= H2UPSTREAMS && !s->reset && !h->closing) pthread_cond_wait(&h->cond, &h->lock);
+	if (s->reset || h->closing) {
+		pthread_mutex_unlock(&h->lock);
+		goto end;
+	}
+	h->upstreams++;
+	slot = 1;
+	pthread_mutex_unlock(&h->lock);
+
+	retry:
+	reused = h2upstream(c, key, &session, retried);
+	if (reused < 0) {
+		status = c->shortcircuit ? 503 : 502;
+		goto end;
+	}
+	pthread_mutex_lock(&h->lock);
+	s->ssock = c->ssock;
+	if (s->reset) shutdown(c->ssock, SHUT_RDWR);
+	pthread_mutex_unlock(&h->lock);
+	sb->fd = c->ssock;
+	sb->session = session;
+	sb->len = sb->pos = 0;
+	connphase(c, PHASE_RELAY);
+
+	/* A pooled connection may have been closed under us; bodyless requests get one more go on a new one. */
+	rc = gnutlswriteall(session, req, reqlen);
+	if (rc == reqlen && !s->nobody) rc = h2sendbody(h, s, session, chunked) ? -1 : reqlen;
+	n = rc == reqlen ? readhead(sb) : -1;
+	while (n > 0) {
+		parsehead(sb->data + sb->pos, n, &resp, 0);
+		if (resp.status < 100 || resp.status >= 200 || resp.status == 101) break;
+		sb->pos += n;
+		n = readhead(sb);
+	}
+	if (n <= 0) {
+		if (s->reset) goto end;
+		if (reused && s->nobody && !retried) {
+			h2upstreamclose(h, s, c, &session);
+			retried = 1;
+			goto retry;
+		}
+		warn("[%d] Error reading response for stream %u from %s.\n", h->c->csock, s->id, c->host);
+		c->failed = 1;
+		status = 502;
+		goto end;
+	}
+	/* No upgrades in HTTP/2, and no guessing at which length is meant. */
+	if (resp.status == 101 || resp.badlength) {
+		status = 502;
+		goto end;
+	}
+
+	block = (unsigned char*)malloc(H2FRAMESIZE);
+	blocklen = h2encodehead(block, H2FRAMESIZE, sb->data + sb->pos, n, resp.status);
+	if (blocklen < 0) {
+		status = 502;
+		goto end;
+	}
+	sb->pos += n;
+	nobody = !strcmp(s->method, "HEAD") || resp.status == 204 || resp.status == 304 || (!resp.chunked && !resp.length);
+	framed = nobody || resp.chunked || resp.length >= 0;
+	if (h2write(h, H2_HEADERS, H2_END_HEADERS | (nobody ? H2_END_STREAM : 0), s->id, block, blocklen)) goto end;
+	sent = 1;
+
+	if (nobody) rc = 0;
+	else if (resp.chunked) rc = h2chunked(h, s, sb);
+	else if (resp.length >= 0) rc = h2copy(h, s, sb, resp.length, 1);
+	else rc = h2copyall(h, s, sb);
+	if (rc) {
+		if (!s->reset && !h->closing) {
+			warn("[%d] Error relaying response for stream %u from %s.\n", h->c->csock, s->id, c->host);
+			c->failed = 1;
+			h2rst(h, s->id, H2_INTERNAL_ERROR);
+		}
+		goto end;
+	}
+	reusable = framed && !resp.close && resp.version >= 1 && sb->pos == sb->len
+		&& !gnutls_record_check_pending(session);
+
+	end:
+	if (status && !sent && !s->reset) h2reply(h, s, status);
+	if (reusable && key[0]) {
+		pthread_mutex_lock(&h->lock);
+		s->ssock = -1;
+		reusable = !s->reset;
+		pthread_mutex_unlock(&h->lock);
+	}
+	if (reusable && key[0]) {
+		idleput(key, conndetach(c), &c->upstream, session);
+	} else {
+		h2upstreamclose(h, s, c, &session);
+	}
+
+	pthread_mutex_lock(&h->lock);
+	/* Done answering; tell the client not to bother sending the rest of its body. */
+	if (!s->endstream && !s->reset && !h->closing) {
+		s->reset = 1;
+		pthread_mutex_unlock(&h->lock);
+		h2rst(h, s->id, H2_NO_ERROR);
+		pthread_mutex_lock(&h->lock);
+	}
+	for (ps = &h->streams; *ps != s; ps = &(*ps)->next);
+	*ps = s->next;
+	h->active--;
+	h->upstreams -= slot;
+	pthread_cond_broadcast(&h->cond);
+	pthread_mutex_unlock(&h->lock);
+
+	h2streamfree(s);
+	connfree(c);
+	free(block);
+	free(sb);
+	free(req);
+	return NULL;
+}
+
+/* Called by hpackdecode() for each request header. Fields that would let
+ * the HTTP/1.1 request say something else than the stream did (RFC 9113
+ * 8.2.1), on an upstream connection other clients will reuse, mark the
+ * stream malformed instead. */
+static void h2header(void* arg, const char* name, int nlen, const char* value, int vlen) {
+	struct H2Stream* s = (struct H2Stream*)arg;
+	char** pseudo = NULL;
+	long length;
+	int n;
+
+	for (n = 0; n < nlen; n++) {
+		if (name[n] == '\r' || name[n] == '\n' || !name[n] || (name[n] >= 'A' && name[n] <= 'Z')) s->malformed = 1;
+	}
+	for (n = 0; n < vlen; n++) {
+		if (value[n] == '\r' || value[n] == '\n' || !value[n]) s->malformed = 1;
+	}
+	if (!nlen || s->malformed) {
+		s->malformed = 1;
+		return;
+	}
+
+	if (nlen == 7 && !memcmp(name, ":method", 7)) pseudo = &s->method;
+	else if (nlen == 5 && !memcmp(name, ":path", 5)) pseudo = &s->path;
+	else if (nlen == 10 && !memcmp(name, ":authority", 10)) pseudo = &s->authority;
+	if (pseudo) {
+		/* The request line is "method path HTTP/1.1", so neither may have a space in it. */
+		if (pseudo != &s->authority && (memchr(value, ' ', vlen) || memchr(value, '\t', vlen))) s->malformed = 1;
+		if (!*pseudo) *pseudo = strndup(value, vlen);
+		return;
+	}
+	if (name[0] == ':') {
+		if (!(nlen == 7 && !memcmp(name, ":scheme", 7)) && !(nlen == 9 && !memcmp(name, ":protocol", 9))) s->malformed = 1;
+		return;
+	}
+
+	if (nlen == 4 && !strncasecmp(name, "host", 4)) {
+		if (!s->authority) s->authority = strndup(value, vlen);
+		return;
+	}
+	/* HTTP/2 lets cookies come as separate fields; HTTP/1.1 wants them on one line. */
+	if (nlen == 6 && !strncasecmp(name, "cookie", 6)) {
+		n = s->cookie ? strlen(s->cookie) : 0;
+		s->cookie = (char*)realloc(s->cookie, n + vlen + 3);
+		if (n) memcpy(s->cookie + n, "; ", 2), n += 2;
+		memcpy(s->cookie + n, value, vlen);
+		s->cookie[n + vlen] = 0;
+		return;
+	}
+	if ((nlen == 10 && !strncasecmp(name, "connection", 10))
+		|| (nlen == 10 && !strncasecmp(name, "keep-alive", 10))
+		|| (nlen == 16 && !strncasecmp(name, "proxy-connection", 16))
+		|| (nlen == 17 && !strncasecmp(name, "transfer-encoding", 17))
+		|| (nlen == 7 && !strncasecmp(name, "upgrade", 7))
+		|| (nlen == 2 && !strncasecmp(name, "te", 2))) return;
+	if (nlen == 14 && !strncasecmp(name, "content-length", 14)) {
+		length = contentlength(value, value + vlen);
+		if (length < 0 || (s->length >= 0 && length != s->length)) s->malformed = 1;
+		else s->length = length;
+	}
+
+	if (s->headlen + nlen + vlen + 4 >= BUFFERSIZE) {
+		s->toolarge = 1;
+		return;
+	}
+	if (!s->head) s->head = (char*)malloc(BUFFERSIZE);
+	n = s->headlen;
+	memcpy(s->head + n, name, nlen);
+	n += nlen;
+	memcpy(s->head + n, ": ", 2);
+	n += 2;
+	memcpy(s->head + n, value, vlen);
+	n += vlen;
+	memcpy(s->head + n, "\r\n", 2);
+	s->headlen = n + 2;
+	s->head[s->headlen] = 0;
+}
+
+static void h2ignore(void* arg, const char* name, int nlen, const char* value, int vlen) {
+}
+
+/* Starts a stream from a complete header block. Returns 0, or a connection error. */
+static enum H2Error h2headers(struct H2Conn* h, unsigned int id, int end, const unsigned char* block, int len) {
+	struct H2Stream* s;
+	pthread_t tid;
+	int bad;
+
+	if (id <= h->lastid) {
+		/* Trailers, which HTTP/1.1 upstreams wouldn't know what to do with; the table still has to see them. */
+		if (hpackdecode(&h->decoder, block, len, h2ignore, NULL)) return H2_COMPRESSION_ERROR;
+		pthread_mutex_lock(&h->lock);
+		s = h2find(h, id);
+		bad = s && end && !s->reset && s->length >= 0 && s->received != s->length;
+		if (bad) h2reset(s);
+		else if (s && end) s->endstream = 1;
+		pthread_cond_broadcast(&h->cond);
+		pthread_mutex_unlock(&h->lock);
+		if (!s) h2rst(h, id, H2_STREAM_CLOSED);
+		if (bad) h2rst(h, id, H2_PROTOCOL_ERROR);
+		return H2_NO_ERROR;
+	}
+
+	h->lastid = id;
+	s = (struct H2Stream*)calloc(1, sizeof(struct H2Stream));
+	s->h = h;
+	s->id = id;
+	s->length = -1;
+	s->ssock = -1;
+	if (hpackdecode(&h->decoder, block, len, h2header, s)) {
+		h2streamfree(s);
+		return H2_COMPRESSION_ERROR;
+	}
+	s->nobody = s->endstream = end;
+	if (end && s->length > 0) s->malformed = 1;
+
+	if (s->malformed || !s->method || !s->path || !s->authority || !strcmp(s->method, "CONNECT")) {
+		if (s->malformed) warn("[%d] Malformed request headers on stream %u.\n", h->c->csock, id);
+		h2rst(h, id, !s->malformed && s->method && !strcmp(s->method, "CONNECT") ? H2_REFUSED_STREAM : H2_PROTOCOL_ERROR);
+		h2streamfree(s);
+		return H2_NO_ERROR;
+	}
+
+	pthread_mutex_lock(&h->lock);
+	if (h->goaway || h->active >= H2MAXSTREAMS) {
+		pthread_mutex_unlock(&h->lock);
+		h2rst(h, id, H2_REFUSED_STREAM);
+		h2streamfree(s);
+		return H2_NO_ERROR;
+	}
+	s->window = h->initialwindow;
+	s->conn = connprobe();
+	/* Streams keep to the routes their connection was accepted with. */
+	routesput(s->conn->routes);
+	s->conn->routes = h->c->routes;
+	__atomic_fetch_add(&s->conn->routes->refs, 1, __ATOMIC_RELAXED);
+	s->conn->caddr = h->c->caddr;
+	s->conn->ssl = 1;
+	s->next = h->streams;
+	h->streams = s;
+	h->active++;
+	pthread_mutex_unlock(&h->lock);
+
+	statadd(STAT_H2STREAMS, 1);
+	if (pthread_create(&tid, NULL, h2stream, s)) {
+		warn("[%d] Couldn't start a thread for stream %u: %m\n", h->c->csock, id);
+		pthread_mutex_lock(&h->lock);
+		h->streams = s->next;
+		h->active--;
+		pthread_mutex_unlock(&h->lock);
+		connfree(s->conn);
+		h2streamfree(s);
+		h2rst(h, id, H2_REFUSED_STREAM);
+		return H2_NO_ERROR;
+	}
+	pthread_detach(tid);
+	return H2_NO_ERROR;
+}
+
+/* Reads exactly len bytes. Returns 0, or -1 if the client closed or failed. */
+static int h2recv(struct H2Conn* h, unsigned char* p, int len) {
+	ssize_t rc;
+
+	while (len > 0) {
+		rc = gnutls_record_recv(h->session, p, len);
+		if (rc == GNUTLS_E_INTERRUPTED && !h->c->expired) continue;
+		if (rc <= 0) return -1;
+		conntraffic(h->c, 1, rc);
+		p += rc;
+		len -= rc;
+	}
+	return 0;
+}
+
+/* Strips padding off a DATA or HEADERS payload. Returns 0, or -1 if it's malformed. */
+static int h2unpad(int flags, const unsigned char** p, int* len) {
+	int pad;
+
+	if (!(flags & H2_PADDED)) return 0;
+	if (*len < 1) return -1;
+	pad = (*p)[0];
+	if (pad >= *len) return -1;
+	(*p)++;
+	*len -= pad + 1;
+	return 0;
+}
+
+static enum H2Error h2settings(struct H2Conn* h, int flags, const unsigned char* p, int len) {
+	struct H2Stream* s;
+	unsigned int value;
+	long delta;
+	int x;
+
+	if (flags & H2_ACK) return H2_NO_ERROR;
+	if (len % 6) return H2_FRAME_SIZE_ERROR;
+	for (x = 0; x < len; x += 6) {
+		value = h2get32(p + x + 2);
+		switch (p[x] << 8 | p[x + 1]) {
+		case 0x2:	/* ENABLE_PUSH, which only servers can be told */
+			if (value > 1) return H2_PROTOCOL_ERROR;
+			break;
+		case 0x4:	/* INITIAL_WINDOW_SIZE, which applies to open streams too */
+			if (value > 0x7fffffff) return H2_FLOW_CONTROL_ERROR;
+			pthread_mutex_lock(&h->lock);
+			delta = (long)value - h->initialwindow;
+			h->initialwindow = value;
+			for (s = h->streams; s; s = s->next) s->window += delta;
+			pthread_cond_broadcast(&h->cond);
+			pthread_mutex_unlock(&h->lock);
+			break;
+		case 0x5:	/* MAX_FRAME_SIZE */
+			if (value < 16384 || value > 16777215) return H2_PROTOCOL_ERROR;
+			h->maxframe = value < H2FRAMESIZE ? value : H2FRAMESIZE;
+			break;
+		}
+	}
+	h2write(h, H2_SETTINGS, H2_ACK, 0, NULL, 0);
+	return H2_NO_ERROR;
+}
+
+static enum H2Error h2windowupdate(struct H2Conn* h, unsigned int id, const unsigned char* p, int len) {
+	struct H2Stream* s;
+	unsigned int n;
+	enum H2Error rc = H2_NO_ERROR;
+
+	if (len != 4) return H2_FRAME_SIZE_ERROR;
+	n = h2get32(p) & 0x7fffffff;
+	pthread_mutex_lock(&h->lock);
+	if (!id) {
+		if (!n || h->window + n > 0x7fffffff) rc = n ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR;
+		else h->window += n;
+	} else if ((s = h2find(h, id))) {
+		if (!n || s->window + n > 0x7fffffff) {
+			h2reset(s);
+			pthread_mutex_unlock(&h->lock);
+			h2rst(h, id, n ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+			pthread_mutex_lock(&h->lock);
+		} else {
+			s->window += n;
+		}
+	}
+	pthread_cond_broadcast(&h->cond);
+	pthread_mutex_unlock(&h->lock);
+	return rc;
+}
+
+static enum H2Error h2dataframe(struct H2Conn* h, unsigned int id, int flags, const unsigned char* p, int len) {
+	struct H2Stream* s;
+	int total = len;
+	int closed = 0;
+
+	if (!id) return H2_PROTOCOL_ERROR;
+	if (h2unpad(flags, &p, &len)) return H2_PROTOCOL_ERROR;
+	/* Every stream buffers its own, so the connection's window never needs holding back. */
+	if (total) h2credit(h, 0, total);
+
+	pthread_mutex_lock(&h->lock);
+	s = h2find(h, id);
+	if (!s || s->endstream) closed = 1;
+	else if (!s->reset) {
+		if (s->bodylen + len > H2WINDOW) {
+			h2reset(s);
+			pthread_mutex_unlock(&h->lock);
+			h2rst(h, id, H2_FLOW_CONTROL_ERROR);
+			return H2_NO_ERROR;
+		}
+		/* A body that doesn't come to its content-length (RFC 9113 8.1.1) would
+		 * end early or run into the next request on the upstream connection;
+		 * none of it goes any further, and the upstream isn't pooled. */
+		s->received += len;
+		if (s->length >= 0 && (s->received > s->length || ((flags & H2_END_STREAM) && s->received != s->length))) {
+			h2reset(s);
+			pthread_mutex_unlock(&h->lock);
+			warn("[%d] Body of stream %u doesn't match its content-length.\n", h->c->csock, id);
+			h2rst(h, id, H2_PROTOCOL_ERROR);
+			return H2_NO_ERROR;
+		}
+		if (!s->body) s->body = (char*)malloc(H2WINDOW);
+		memcpy(s->body + s->bodylen, p, len);
+		s->bodylen += len;
+		if (flags & H2_END_STREAM) s->endstream = 1;
+		pthread_cond_broadcast(&h->cond);
+	}
+	pthread_mutex_unlock(&h->lock);
+
+	if (closed) {
+		if (id > h->lastid) return H2_PROTOCOL_ERROR;
+		h2rst(h, id, H2_STREAM_CLOSED);
+	} else if (total > len && !(flags & H2_END_STREAM)) {
+		/* Padding never reaches the stream's buffer, so it's credited back now. */
+		h2credit(h, id, total - len);
+	}
+	return H2_NO_ERROR;
+}
+
+void h2serve(struct Conn* c, gnutls_session_t session) {
+	struct H2Conn* h = (struct H2Conn*)calloc(1, sizeof(struct H2Conn));
+	struct H2Stream* s;
+	unsigned char settings[6];
+	unsigned char hdr[9];
+	unsigned char* buf = (unsigned char*)malloc(H2FRAMESIZE);
+	unsigned char* block = NULL;
+	const unsigned char* p;
+	enum H2Error err = H2_NO_ERROR;
+	unsigned int id;
+	int len, type, flags, n, end, blocklen;
+
+	h->c = c;
+	h->session = session;
+	h->window = h->initialwindow = H2WINDOW;
+	h->maxframe = H2FRAMESIZE;
+	pthread_mutex_init(&h->wlock, NULL);
+	pthread_mutex_init(&h->lock, NULL);
+	pthread_cond_init(&h->cond, NULL);
+	hpackinit(&h->decoder, H2TABLESIZE);
+	statadd(STAT_H2CONNS, 1);
+
+	connphase(c, PHASE_HEADER);
+	if (h2recv(h, buf, sizeof(H2PREFACE) - 1) || memcmp(buf, H2PREFACE, sizeof(H2PREFACE) - 1)) {
+		if (!c->expired) warn("[%d] Client negotiated h2 but didn't send the preface.\n", c->csock);
+		c->failed = 1;
+		goto end;
+	}
+	settings[0] = 0;
+	settings[1] = 0x3;	/* MAX_CONCURRENT_STREAMS */
+	h2put32(settings + 2, H2MAXSTREAMS);
+	h2write(h, H2_SETTINGS, 0, 0, settings, sizeof(settings));
+	connphase(c, PHASE_RELAY);
+
+	while (exitflag == 0 && !err) {
+		if (h2recv(h, hdr, sizeof(hdr))) break;
+		len = hdr[0] << 16 | hdr[1] << 8 | hdr[2];
+		type = hdr[3];
+		flags = hdr[4];
+		id = h2get32(hdr + 5) & 0x7fffffff;
+		if (len > H2FRAMESIZE) {
+			err = H2_FRAME_SIZE_ERROR;
+			break;
+		}
+		if (h2recv(h, buf, len)) break;
+
+		switch (type) {
+		case H2_DATA:
+			err = h2dataframe(h, id, flags, buf, len);
+			break;
+		case H2_HEADERS:
+			p = buf;
+			n = len;
+			if (!id || !(id & 1) || h2unpad(flags, &p, &n)) {
+				err = H2_PROTOCOL_ERROR;
+				break;
+			}
+			if (flags & H2_PRIORITY_FLAG) {
+				if (n < 5) {
+					err = H2_PROTOCOL_ERROR;
+					break;
+				}
+				p += 5;
+				n -= 5;
+			}
+			end = flags & H2_END_STREAM;
+			block = (unsigned char*)malloc(H2HEADERMAX);
+			memcpy(block, p, n);
+			blocklen = n;
+			/* The rest of the block comes in CONTINUATIONs, with nothing in between. */
+			while (!(flags & H2_END_HEADERS)) {
+				if (h2recv(h, hdr, sizeof(hdr))) {
+					err = H2_CANCEL;
+					break;
+				}
+				len = hdr[0] << 16 | hdr[1] << 8 | hdr[2];
+				flags = hdr[4];
+				if (hdr[3] != H2_CONTINUATION || (h2get32(hdr + 5) & 0x7fffffff) != id) {
+					err = H2_PROTOCOL_ERROR;
+					break;
+				}
+				if (blocklen + len > H2HEADERMAX) {
+					err = H2_ENHANCE_YOUR_CALM;
+					break;
+				}
+				if (h2recv(h, block + blocklen, len)) {
+					err = H2_CANCEL;
+					break;
+				}
+				blocklen += len;
+			}
+			if (!err) err = h2headers(h, id, end, block, blocklen);
+			free(block);
+			block = NULL;
+			break;
+		case H2_PRIORITY:
+			break;
+		case H2_RST_STREAM:
+			if (len != 4) {
+				err = H2_FRAME_SIZE_ERROR;
+				break;
+			}
+			pthread_mutex_lock(&h->lock);
+			if ((s = h2find(h, id))) h2reset(s);
+			pthread_cond_broadcast(&h->cond);
+			pthread_mutex_unlock(&h->lock);
+			break;
+		case H2_SETTINGS:
+			err = id ? H2_PROTOCOL_ERROR : h2settings(h, flags, buf, len);
+			break;
+		case H2_PING:
+			if (len != 8) err = H2_FRAME_SIZE_ERROR;
+			else if (!(flags & H2_ACK)) h2write(h, H2_PING, H2_ACK, 0, buf, len);
+			break;
+		case H2_GOAWAY:
+			/* Let what's running finish; the client won't start anything new. */
+			h->goaway = 1;
+			break;
+		case H2_WINDOW_UPDATE:
+			err = h2windowupdate(h, id, buf, len);
+			break;
+		case H2_PUSH_PROMISE:
+		case H2_CONTINUATION:
+			err = H2_PROTOCOL_ERROR;
+			break;
+		}
+	}
+	/* Nobody left to read anything after a cancel. */
+	if (err && err != H2_CANCEL) {
+		warn("[%d] HTTP/2 connection error %d.\n", c->csock, err);
+		c->failed = 1;
+		h2goaway(h, err);
+	}
+
+	end:
+	pthread_mutex_lock(&h->lock);
+	h->closing = 1;
+	for (s = h->streams; s; s = s->next) h2reset(s);
+	pthread_cond_broadcast(&h->cond);
+	while (h->active) pthread_cond_wait(&h->cond, &h->lock);
+	pthread_mutex_unlock(&h->lock);
+
+	hpackfree(&h->decoder);
+	pthread_mutex_destroy(&h->wlock);
+	pthread_mutex_destroy(&h->lock);
+	pthread_cond_destroy(&h->cond);
+	free(h);
+	free(buf);
+}
+
+
+
+/* EOF */
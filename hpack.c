@@ -0,0 +1,372 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* HPACK (RFC 7541), the header compression of HTTP/2. Decoding is complete,
+ * since we have to understand whatever the client sends. Encoding only ever
+ * uses literals without indexing and without Huffman coding, which every
+ * decoder accepts and which leaves nothing for the two ends to keep in sync. */
+
+#include "transockproxy.h"
+
+struct HpackStatic {
+	const char* name;
+	const char* value;
+};
+
+static const struct HpackStatic statictable[] = {
+	{ ":authority", "" }, { ":method", "GET" }, { ":method", "POST" }, { ":path", "/" },
+	{ ":path", "/index.html" }, { ":scheme", "http" }, { ":scheme", "https" }, { ":status", "200" },
+	{ ":status", "204" }, { ":status", "206" }, { ":status", "304" }, { ":status", "400" },
+	{ ":status", "404" }, { ":status", "500" }, { "accept-charset", "" }, { "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" }, { "accept-ranges", "" }, { "accept", "" }, { "access-control-allow-origin", "" },
+	{ "age", "" }, { "allow", "" }, { "authorization", "" }, { "cache-control", "" },
+	{ "content-disposition", "" }, { "content-encoding", "" }, { "content-language", "" }, { "content-length", "" },
+	{ "content-location", "" }, { "content-range", "" }, { "content-type", "" }, { "cookie", "" },
+	{ "date", "" }, { "etag", "" }, { "expect", "" }, { "expires", "" },
+	{ "from", "" }, { "host", "" }, { "if-match", "" }, { "if-modified-since", "" },
+	{ "if-none-match", "" }, { "if-range", "" }, { "if-unmodified-since", "" }, { "last-modified", "" },
+	{ "link", "" }, { "location", "" }, { "max-forwards", "" }, { "proxy-authenticate", "" },
+	{ "proxy-authorization", "" }, { "range", "" }, { "referer", "" }, { "refresh", "" },
+	{ "retry-after", "" }, { "server", "" }, { "set-cookie", "" }, { "strict-transport-security", "" },
+	{ "transfer-encoding", "" }, { "user-agent", "" }, { "vary", "" }, { "via", "" },
+	{ "www-authenticate", "" }
+};
+#define STATICSIZE ((int)(sizeof(statictable) / sizeof(statictable[0])))
+
+/* Code and length in bits of each symbol, 256 being end-of-string. */
+static const struct {
+	unsigned int code;
+	unsigned char bits;
+} huffman[257] = {
+	{ 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 }, { 0xfffffe4, 28 }, { 0xfffffe5, 28 },
+	{ 0xfffffe6, 28 }, { 0xfffffe7, 28 }, { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+	{ 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 }, { 0xfffffed, 28 }, { 0xfffffee, 28 },
+	{ 0xfffffef, 28 }, { 0xffffff0, 28 }, { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+	{ 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 }, { 0xffffff8, 28 }, { 0xffffff9, 28 },
+	{ 0xffffffa, 28 }, { 0xffffffb, 28 }, { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+	{ 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 }, { 0x3fa, 10 }, { 0x3fb, 10 },
+	{ 0xf9, 8 }, { 0x7fb, 11 }, { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+	{ 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 }, { 0x1a, 6 }, { 0x1b, 6 },
+	{ 0x1c, 6 }, { 0x1d, 6 }, { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+	{ 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 }, { 0x1ffa, 13 }, { 0x21, 6 },
+	{ 0x5d, 7 }, { 0x5e, 7 }, { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+	{ 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 }, { 0x67, 7 }, { 0x68, 7 },
+	{ 0x69, 7 }, { 0x6a, 7 }, { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+	{ 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 }, { 0xfc, 8 }, { 0x73, 7 },
+	{ 0xfd, 8 }, { 0x1ffb, 13 }, { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+	{ 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 }, { 0x24, 6 }, { 0x5, 5 },
+	{ 0x25, 6 }, { 0x26, 6 }, { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+	{ 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 }, { 0x2b, 6 }, { 0x76, 7 },
+	{ 0x2c, 6 }, { 0x8, 5 }, { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+	{ 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 }, { 0x7fc, 11 }, { 0x3ffd, 14 },
+	{ 0x1ffd, 13 }, { 0xffffffc, 28 }, { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+	{ 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 }, { 0x3fffd6, 22 }, { 0x7fffda, 23 },
+	{ 0x7fffdb, 23 }, { 0x7fffdc, 23 }, { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+	{ 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 }, { 0xffffee, 24 }, { 0x7fffe1, 23 },
+	{ 0x7fffe2, 23 }, { 0x7fffe3, 23 }, { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+	{ 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 }, { 0x3fffda, 22 }, { 0x1fffdd, 21 },
+	{ 0xfffe9, 20 }, { 0x3fffdb, 22 }, { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+	{ 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 }, { 0x1fffdf, 21 }, { 0x3fffdf, 22 },
+	{ 0x7fffeb, 23 }, { 0x7fffec, 23 }, { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+	{ 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 }, { 0xfffea, 20 }, { 0x3fffe2, 22 },
+	{ 0x3fffe3, 22 }, { 0x3fffe4, 22 }, { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+	{ 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 }, { 0x3fffe7, 22 }, { 0x7ffff2, 23 },
+	{ 0x3fffe8, 22 }, { 0x1ffffec, 25 }, { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+	{ 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 }, { 0x7fff2, 19 }, { 0x1fffe3, 21 },
+	{ 0x3ffffe6, 26 }, { 0x7ffffe0, 27 }, { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+	{ 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 }, { 0xffffffd, 28 }, { 0x7ffffe3, 27 },
+	{ 0x7ffffe4, 27 }, { 0x7ffffe5, 27 }, { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+	{ 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 }, { 0x3fffea, 22 }, { 0x3fffeb, 22 },
+	{ 0x1ffffee, 25 }, { 0x1ffffef, 25 }, { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+	{ 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 }, { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 },
+	{ 0x7ffffe9, 27 }, { 0x7ffffea, 27 }, { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+	{ 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 }, { 0x3fffffff, 30 }
+};
+
+/* Decoding tree built from the table above. A non-negative child is another
+ * node, a negative one is the symbol -child-1. */
+static short hufftree[256][2];
+static pthread_once_t huffonce = PTHREAD_ONCE_INIT;
+
+static void huffbuild() {
+	int nodes = 1;
+	int sym, bit, node;
+	short* child;
+
+	for (sym = 0; sym < 257; sym++) {
+		node = 0;
+		for (bit = huffman[sym].bits - 1; bit >= 0; bit--) {
+			child = &hufftree[node][(huffman[sym].code >> bit) & 1];
+			if (!bit) *child = -sym - 1;
+			else {
+				if (!*child) *child = nodes++;
+				node = *child;
+			}
+		}
+	}
+}
+
+/* Decodes len bytes of Huffman code into out. Returns the decoded length, or -1. */
+static int huffdecode(const unsigned char* in, int len, char* out) {
+	int node = 0;
+	int depth = 0;
+	int ones = 1;
+	int pos = 0;
+	int x, bit, child;
+
+	pthread_once(&huffonce, huffbuild);
+	for (x = 0; x < len; x++) {
+		for (bit = 7; bit >= 0; bit--) {
+			child = hufftree[node][(in[x] >> bit) & 1];
+			ones = ones && ((in[x] >> bit) & 1);
+			depth++;
+			if (child < 0) {
+				/* End-of-string inside a string is an error. */
+				if (child == -257) return -1;
+				out[pos++] = -child - 1;
+				node = depth = 0;
+				ones = 1;
+			} else {
+				node = child;
+			}
+		}
+	}
+	/* What's left over must be a short run of ones (a prefix of end-of-string). */
+	if (depth > 7 || !ones) return -1;
+	return pos;
+}
+
+void hpackinit(struct Hpack* t, int maxsize) {
+	memset(t, 0, sizeof(*t));
+	t->maxsize = t->limit = maxsize;
+	t->slots = maxsize / 32 + 1;
+	t->entries = (struct HpackEntry*)calloc(t->slots, sizeof(struct HpackEntry));
+}
+
+static void hpackevict(struct Hpack* t, int size) {
+	struct HpackEntry* e;
+
+	while (t->count && t->size + size > t->maxsize) {
+		e = &t->entries[(t->first + t->count - 1) % t->slots];
+		t->size -= e->nlen + e->vlen + 32;
+		free(e->name);
+		t->count--;
+	}
+}
+
+static void hpackadd(struct Hpack* t, const char* name, int nlen, const char* value, int vlen) {
+	struct HpackEntry* e;
+	int size = nlen + vlen + 32;
+	char* copy;
+
+	/* Copy first: name may point into an entry that's about to be evicted. */
+	copy = (char*)malloc(nlen + vlen + 1);
+	memcpy(copy, name, nlen);
+	memcpy(copy + nlen, value, vlen);
+	hpackevict(t, size);
+	/* Too big for the table just empties it. */
+	if (size > t->maxsize) {
+		free(copy);
+		return;
+	}
+	t->first = (t->first + t->slots - 1) % t->slots;
+	e = &t->entries[t->first];
+	e->name = copy;
+	e->value = e->name + nlen;
+	e->nlen = nlen;
+	e->vlen = vlen;
+	t->size += size;
+	t->count++;
+}
+
+void hpackfree(struct Hpack* t) {
+	hpackevict(t, t->maxsize + 1);
+	free(t->entries);
+}
+
+/* Looks up a 1-based index in the static table, then the dynamic one. Returns 0, or -1 if there's no such entry. */
+static int hpackget(const struct Hpack* t, int index, const char** name, int* nlen, const char** value, int* vlen) {
+	const struct HpackEntry* e;
+
+	if (index <= 0) return -1;
+	if (index <= STATICSIZE) {
+		*name = statictable[index - 1].name;
+		*nlen = strlen(*name);
+		*value = statictable[index - 1].value;
+		*vlen = strlen(*value);
+		return 0;
+	}
+	index -= STATICSIZE + 1;
+	if (index >= t->count) return -1;
+	e = &t->entries[(t->first + index) % t->slots];
+	*name = e->name;
+	*nlen = e->nlen;
+	*value = e->value;
+	*vlen = e->vlen;
+	return 0;
+}
+
+/* Reads an integer with an n-bit prefix. Returns it, or -1. */
+static long hpackint(const unsigned char** p, const unsigned char* end, int n) {
+	long value;
+	int shift = 0;
+
+	if (*p >= end) return -1;
+	value = *(*p)++ & ((1 << n) - 1);
+	if (value < (1 << n) - 1) return value;
+	do {
+		if (*p >= end || shift > 28) return -1;
+		value += (long)(**p & 0x7f) << shift;
+		shift += 7;
+	} while (*(*p)++ & 0x80);
+	return value;
+}
+
+/* Reads a string, decoding it into scratch if it's Huffman coded. Returns 0, or -1. */
+static int hpackstring(const unsigned char** p, const unsigned char* end, char** scratch, const char** str, int* len) {
+	int huff;
+	long n;
+
+	if (*p >= end) return -1;
+	huff = **p & 0x80;
+	n = hpackint(p, end, 7);
+	if (n < 0 || n > end - *p) return -1;
+	if (huff) {
+		*len = huffdecode(*p, n, *scratch);
+		if (*len < 0) return -1;
+		*str = *scratch;
+		*scratch += *len;
+	} else {
+		*str = (const char*)*p;
+		*len = n;
+	}
+	*p += n;
+	return 0;
+}
+
+/* Decodes a header block, calling func for each header. Returns 0, or -1 on
+ * a compression error, after which the table is out of step and the
+ * connection has to go. */
+int hpackdecode(struct Hpack* t, const unsigned char* p, int len, void (*func)(void*, const char*, int, const char*, int), void* arg) {
+	const unsigned char* end = p + len;
+	const char* name;
+	const char* value;
+	char* scratch;
+	char* sp;
+	long index;
+	int nlen, vlen;
+	int rc = -1;
+	int add;
+
+	/* Huffman codes are at least 5 bits, so nothing decodes to more than 8/5 of its size. */
+	scratch = (char*)malloc(len * 2 + 1);
+	sp = scratch;
+	while (p < end) {
+		if (*p & 0x80) {
+			index = hpackint(&p, end, 7);
+			if (hpackget(t, index, &name, &nlen, &value, &vlen)) goto fail;
+			func(arg, name, nlen, value, vlen);
+			continue;
+		}
+		if ((*p & 0xe0) == 0x20) {
+			/* Dynamic table size update, up to what our SETTINGS allow. */
+			index = hpackint(&p, end, 5);
+			if (index < 0 || index > t->limit) goto fail;
+			t->maxsize = index;
+			hpackevict(t, 0);
+			continue;
+		}
+		add = (*p & 0xc0) == 0x40;
+		index = hpackint(&p, end, add ? 6 : 4);
+		if (index < 0) goto fail;
+		if (index) {
+			if (hpackget(t, index, &name, &nlen, &value, &vlen)) goto fail;
+		} else if (hpackstring(&p, end, &sp, &name, &nlen)) {
+			goto fail;
+		}
+		if (hpackstring(&p, end, &sp, &value, &vlen)) goto fail;
+		func(arg, name, nlen, value, vlen);
+		if (add) hpackadd(t, name, nlen, value, vlen);
+	}
+	rc = 0;
+
+	fail:
+	free(scratch);
+	return rc;
+}
+
+static int hpackputint(unsigned char* out, int size, int prefix, int n, unsigned long value) {
+	int pos = 0;
+
+	if (size < 1) return -1;
+	if (value < (1UL << n) - 1) {
+		out[pos++] = prefix | value;
+		return pos;
+	}
+	out[pos++] = prefix | ((1 << n) - 1);
+	value -= (1 << n) - 1;
+	while (value >= 0x80) {
+		if (pos >= size) return -1;
+		out[pos++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	if (pos >= size) return -1;
+	out[pos++] = value;
+	return pos;
+}
+
+static int hpackputstring(unsigned char* out, int size, const char* str, int len) {
+	int pos = hpackputint(out, size, 0, 7, len);
+
+	if (pos < 0 || pos + len > size) return -1;
+	memcpy(out + pos, str, len);
+	return pos + len;
+}
+
+/* Encodes a header as a literal without indexing, lowercasing the name.
+ * Returns the encoded length, or -1 if it doesn't fit in size. */
+int hpackencode(unsigned char* out, int size, const char* name, int nlen, const char* value, int vlen) {
+	int pos = 0;
+	int n, x;
+
+	if (size < 1) return -1;
+	out[pos++] = 0;
+	n = hpackputstring(out + pos, size - pos, name, nlen);
+	if (n < 0) return -1;
+	for (x = 0; x < nlen; x++) {
+		if (name[x] >= 'A' && name[x] <= 'Z') out[pos + n - nlen + x] = name[x] - 'A' + 'a';
+	}
+	pos += n;
+	n = hpackputstring(out + pos, size - pos, value, vlen);
+	if (n < 0) return -1;
+	return pos + n;
+}
+
+/* Encodes :status, with the static table's name. */
+int hpackstatus(unsigned char* out, int size, int status) {
+	char value[8];
+	int pos;
+	int n;
+
+	if (status == 200) return hpackputint(out, size, 0x80, 7, 8);
+	snprintf(value, sizeof(value), "%03d", status % 1000);
+	pos = hpackputint(out, size, 0, 4, 8);
+	if (pos < 0) return -1;
+	n = hpackputstring(out + pos, size - pos, value, 3);
+	return n < 0 ? -1 : pos + n;
+}
+
+
+
+/* EOF */
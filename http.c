@@ -0,0 +1,719 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* HTTP-aware relaying ("httpmode aware"). Instead of reading Host: once and
+ * then shovelling bytes, each request is parsed, routed on its own Host:,
+ * and its body and response are relayed by their framing (Content-Length,
+ * chunked, or until close). That makes the upstream connection free again
+ * once a response is done, so connections to direct destinations are kept
+ * in a per-host idle pool and reused by later clients. Connection and
+ * Keep-Alive are hop-by-hop: upstream always gets keep-alive, and the client
+ * gets closed when it asked for that. Upgrade and CONNECT requests are
+ * tunnelled like before. With a cache configured, GETs go through cache.c. */
+
+#include "transockproxy.h"
+#include <ctype.h>
+#include <errno.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+
+/* Room for a rewritten head, plus a revalidation's conditions. */
+#define OUTSIZE (BUFFERSIZE * 2)
+
+struct Idle {
+	struct Idle* next;
+	char key[IDLEKEYSIZE];
+	int sock;
+	void* session;
+	struct sockaddr_in addr;
+	unsigned long since;
+};
+
+struct IdleShard {
+	pthread_mutex_t lock;
+	struct Idle* head;
+} __attribute__((aligned(64)));
+
+static struct IdleShard idle[IDLESHARDS];
+static int idlecount = 0;
+
+static const char badrequest[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char badgateway[] = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char continued[] = "HTTP/1.1 100 Continue\r\n\r\n";
+
+/* Pooling key for a direct connection to host through map: the interface,
+ * then host:port, and whether it's a TLS connection. Empty for anything but
+ * direct mappings, which aren't pooled. */
+void idlekey(char* key, const struct Mapping* map, const char* host, int tls) {
+	char dest[CIRCUITKEYSIZE];
+
+	if (map->proto != DIRECT) {
+		key[0] = 0;
+		return;
+	}
+	circuitkey(dest, host, tls ? 443 : 80);
+	snprintf(key, IDLEKEYSIZE, "%s/%s%s", map->iface, dest, tls ? "/tls" : "");
+}
+
+static void idleclose(int sock, void* session) {
+	#ifdef GNUTLS
+	if (session) gnutls_deinit((gnutls_session_t)session);
+	#endif
+	close(sock);
+}
+
+/* Returns an idle connection for key that's still open, and its TLS session if it has one, or -1. */
+int idleget(const char* key, struct sockaddr_in* addr, void** session) {
+	struct IdleShard* s = &idle[keyhash(key) % IDLESHARDS];
+	struct Idle** pe;
+	struct Idle* e;
+	char c;
+	int sock;
+
+	while (1) {
+		pthread_mutex_lock(&s->lock);
+		for (pe = &s->head; (e = *pe); pe = &e->next) {
+			if (!strcmp(e->key, key)) break;
+		}
+		if (e) *pe = e->next;
+		pthread_mutex_unlock(&s->lock);
+		if (!e) return -1;
+
+		__atomic_fetch_sub(&idlecount, 1, __ATOMIC_RELAXED);
+		sock = e->sock;
+		*addr = e->addr;
+		*session = e->session;
+		free(e);
+		/* Anything readable now is either a close or junk; either way it's no good. */
+		if (recv(sock, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return sock;
+		idleclose(sock, *session);
+	}
+}
+
+void idleput(const char* key, int sock, const struct sockaddr_in* addr, void* session) {
+	struct IdleShard* s = &idle[keyhash(key) % IDLESHARDS];
+	struct Idle* e;
+	int count = 0;
+
+	pthread_mutex_lock(&s->lock);
+	for (e = s->head; e; e = e->next) {
+		if (!strcmp(e->key, key)) count++;
+	}
+	if (count >= IDLEPERHOST) {
+		pthread_mutex_unlock(&s->lock);
+		idleclose(sock, session);
+		return;
+	}
+	e = (struct Idle*)malloc(sizeof(struct Idle));
+	snprintf(e->key, sizeof(e->key), "%s", key);
+	e->sock = sock;
+	e->session = session;
+	e->addr = *addr;
+	e->since = mstime();
+	e->next = s->head;
+	s->head = e;
+	pthread_mutex_unlock(&s->lock);
+	__atomic_fetch_add(&idlecount, 1, __ATOMIC_RELAXED);
+}
+
+int httpidlecount() {
+	return __atomic_load_n(&idlecount, __ATOMIC_RELAXED);
+}
+
+/* Reads more into b, moving what's left to the front first if it's full. Returns read()'s result. */
+int buffill(struct HttpBuf* b) {
+	int rc;
+
+	if (b->pos == b->len) b->pos = b->len = 0;
+	if (b->len == BUFFERSIZE && b->pos) {
+		memmove(b->data, b->data + b->pos, b->len - b->pos);
+		b->len -= b->pos;
+		b->pos = 0;
+	}
+	if (b->len == BUFFERSIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	#ifdef GNUTLS
+	if (b->session) {
+		rc = gnutls_record_recv((gnutls_session_t)b->session, b->data + b->len, BUFFERSIZE - b->len);
+		if (rc < 0) rc = -1;
+	} else
+	#endif
+	rc = read(b->fd, b->data + b->len, BUFFERSIZE - b->len);
+	if (rc > 0) b->len += rc;
+	return rc;
+}
+
+/* Waits for a whole header block at b->pos. Returns its length, 0 if the
+ * peer closed before sending anything, or -1. */
+int readhead(struct HttpBuf* b) {
+	char* end;
+	int rc;
+
+	while (1) {
+		b->data[b->len] = 0;
+		end = strstr(b->data + b->pos, "\r\n\r\n");
+		if (end) return end + 4 - (b->data + b->pos);
+		rc = buffill(b);
+		if (rc == 0 && b->pos == b->len) return 0;
+		if (rc <= 0) return -1;
+	}
+}
+
+/* Waits for a whole line at b->pos. Returns its length including the newline, or -1. */
+int readline(struct HttpBuf* b) {
+	char* eol;
+
+	while (1) {
+		eol = memchr(b->data + b->pos, '\n', b->len - b->pos);
+		if (eol) return eol + 1 - (b->data + b->pos);
+		if (buffill(b) <= 0) return -1;
+	}
+}
+
+/* Does the comma-separated header value contain token? */
+int hastoken(const char* value, int len, const char* token) {
+	int tlen = strlen(token);
+	int x = 0;
+
+	while (x < len) {
+		while (x < len && (value[x] == ' ' || value[x] == '\t' || value[x] == ',')) x++;
+		if (len - x >= tlen && !strncasecmp(value + x, token, tlen)
+			&& (x + tlen == len || strchr(" \t,;", value[x + tlen]))) return 1;
+		while (x < len && value[x] != ',') x++;
+	}
+	return 0;
+}
+
+/* A Content-Length value: its number, or -1 if it isn't all digits. A list
+ * of the same number (repeated headers folded together) counts as that. */
+long contentlength(const char* p, const char* end) {
+	long length = -1;
+	long n;
+
+	while (1) {
+		while (p < end && (*p == ' ' || *p == '\t')) p++;
+		if (p == end || *p < '0' || *p > '9') return -1;
+		for (n = 0; p < end && *p >= '0' && *p <= '9'; p++) {
+			if (n > (LONG_MAX - 9) / 10) return -1;
+			n = n * 10 + *p - '0';
+		}
+		if (length >= 0 && n != length) return -1;
+		length = n;
+		while (p < end && (*p == ' ' || *p == '\t')) p++;
+		if (p == end) return length;
+		if (*p++ != ',') return -1;
+	}
+}
+
+/* The size on a chunk-size line of len bytes, CRLF included: hex digits,
+ * maybe an extension after ';', and nothing else. Returns -1 if it isn't
+ * one, or says more than CHUNKMAX. */
+long chunksize(const char* p, int len) {
+	const char* start = p;
+	const char* end = p + len;
+	long size = 0;
+
+	for (; p < end && isxdigit((unsigned char)*p); p++) {
+		size = size * 16 + (*p <= '9' ? *p - '0' : (*p | 0x20) - 'a' + 10);
+		if (size > CHUNKMAX) return -1;
+	}
+	if (p == start) return -1;
+	while (p < end && (*p == ' ' || *p == '\t')) p++;
+	if (p < end && *p == ';') while (p < end - 2 && *p != '\r') p++;
+	if (end - p != 2 || p[0] != '\r' || p[1] != '\n') return -1;
+	return size;
+}
+
+/* Parses the framing-related parts of a request or response head. */
+void parsehead(const char* p, int len, struct HttpHead* h, int request) {
+	const char* end = p + len;
+	const char* eol;
+	const char* value;
+	long length;
+	int vlen;
+
+	memset(h, 0, sizeof(*h));
+	h->len = len;
+	h->length = -1;
+
+	eol = strstr(p, "\r\n");
+	if (request) {
+		h->head = !strncmp(p, "HEAD ", 5);
+		h->connect = !strncmp(p, "CONNECT ", 8);
+		value = strstr(p, " HTTP/1.");
+		h->version = value && value < eol ? value[8] - '0' : 0;
+	} else {
+		h->version = !strncmp(p, "HTTP/1.", 7) ? p[7] - '0' : 0;
+		h->status = eol - p > 9 ? atoi(p + 9) : 0;
+	}
+
+	for (p = eol + 2; p < end - 2; p = eol + 2) {
+		eol = strstr(p, "\r\n");
+		value = memchr(p, ':', eol - p);
+		if (!value) continue;
+		vlen = value - p;
+		for (value++; *value == ' ' || *value == '\t'; value++);
+
+		if (vlen == 14 && !strncasecmp(p, "Content-Length", 14)) {
+			/* Two lengths that disagree are how requests get smuggled; don't pick one. */
+			length = contentlength(value, eol);
+			if (length < 0 || (h->length >= 0 && length != h->length)) h->badlength = 1;
+			else h->length = length;
+		}
+		else if (vlen == 17 && !strncasecmp(p, "Transfer-Encoding", 17)) h->chunked |= hastoken(value, eol - value, "chunked");
+		else if (vlen == 6 && !strncasecmp(p, "Expect", 6)) h->expect = hastoken(value, eol - value, "100-continue");
+		else if ((vlen == 10 && !strncasecmp(p, "Connection", 10)) || (vlen == 16 && !strncasecmp(p, "Proxy-Connection", 16))) {
+			h->close |= hastoken(value, eol - value, "close");
+			h->keepalive |= hastoken(value, eol - value, "keep-alive");
+			h->upgrade |= hastoken(value, eol - value, "upgrade");
+		}
+	}
+	/* Chunked wins over a Content-Length that came along with it. */
+	if (h->chunked) h->length = -1;
+}
+
+/* Copies head into out without the hop-by-hop headers, adding extra and
+ * asking upstream to keep the connection open. Returns the new length, or 0
+ * if it won't fit. */
+static int rewritehead(char* out, int size, const char* head, const struct HttpHead* h, const char* extra) {
+	const char* end = head + h->len - 2;
+	const char* p = head;
+	const char* eol;
+	int pos = 0;
+	int n;
+
+	for (; p < end; p = eol + 2) {
+		eol = strstr(p, "\r\n");
+		n = eol + 2 - p;
+		if (p != head && (!strncasecmp(p, "Connection:", 11) || !strncasecmp(p, "Keep-Alive:", 11)
+			|| !strncasecmp(p, "Proxy-Connection:", 17) || (h->expect && !strncasecmp(p, "Expect:", 7)))) continue;
+		if (pos + n > size) return 0;
+		memcpy(out + pos, p, n);
+		pos += n;
+	}
+	n = snprintf(out + pos, size - pos, "%sConnection: keep-alive\r\n\r\n", extra);
+	if (n >= size - pos) return 0;
+	return pos + n;
+}
+
+/* Copies n bytes from b to fd, whatever's buffered first. Returns 0 on success. */
+static int copybody(struct Conn* c, struct HttpBuf* b, int fd, long n, int up) {
+	int len;
+
+	while (n > 0) {
+		if (b->pos == b->len && buffill(b) <= 0) return -1;
+		len = b->len - b->pos < n ? b->len - b->pos : n;
+		if (writeall(fd, b->data + b->pos, len) <= 0) return -1;
+		conntraffic(c, up, len);
+		b->pos += len;
+		n -= len;
+	}
+	return 0;
+}
+
+/* copybody() that also hands the body to the cache. */
+static int copycached(struct Conn* c, struct HttpBuf* b, int fd, long n, struct CacheRef* ref) {
+	int len;
+
+	while (n > 0) {
+		if (b->pos == b->len && buffill(b) <= 0) return -1;
+		len = b->len - b->pos < n ? b->len - b->pos : n;
+		if (writeall(fd, b->data + b->pos, len) <= 0) return -1;
+		cachewrite(ref, b->data + b->pos, len);
+		conntraffic(c, 0, len);
+		b->pos += len;
+		n -= len;
+	}
+	return 0;
+}
+
+/* Copies a chunked body, trailers and all, from b to fd. Returns 0 on success. */
+static int copychunked(struct Conn* c, struct HttpBuf* b, int fd, int up) {
+	long size;
+	int len;
+
+	do {
+		len = readline(b);
+		if (len < 0) return -1;
+		/* Misreading a size would end the body in the wrong place and take the rest for the next message. */
+		size = chunksize(b->data + b->pos, len);
+		if (size < 0 || copybody(c, b, fd, len, up)) return -1;
+		if (size && copybody(c, b, fd, size, up)) return -1;
+		if (size && (readline(b) != 2 || b->data[b->pos] != '\r' || copybody(c, b, fd, 2, up))) return -1;
+	} while (size);
+
+	do {
+		len = readline(b);
+		if (len < 0 || copybody(c, b, fd, len, up)) return -1;
+	} while (len > 2);
+	return 0;
+}
+
+/* Copies from b to fd until b's end closes. Returns 0 if it closed cleanly. */
+static int copyall(struct Conn* c, struct HttpBuf* b, int fd, int up) {
+	int rc;
+
+	while (1) {
+		if (b->pos < b->len) {
+			if (writeall(fd, b->data + b->pos, b->len - b->pos) <= 0) return -1;
+			conntraffic(c, up, b->len - b->pos);
+			b->pos = b->len;
+		}
+		rc = buffill(b);
+		if (rc == 0) return 0;
+		if (rc < 0) return -1;
+	}
+}
+
+/* Relays raw bytes both ways until either side closes, for upgrades and CONNECT. */
+static void tunnel(struct Conn* c, struct HttpBuf* cb, struct HttpBuf* sb) {
+	struct pollfd pfds[2];
+	int rc;
+
+	if ((cb->pos < cb->len && copybody(c, cb, sb->fd, cb->len - cb->pos, 1))
+		|| (sb->pos < sb->len && copybody(c, sb, cb->fd, sb->len - sb->pos, 0))) {
+		c->failed = 1;
+		return;
+	}
+
+	pfds[0].fd = cb->fd;
+	pfds[0].events = POLLIN;
+	pfds[1].fd = sb->fd;
+	pfds[1].events = POLLIN;
+	while (exitflag == 0) {
+		if (poll(pfds, 2, -1) < 0) break;
+		if (pfds[0].revents) {
+			rc = buffill(cb);
+			if (rc == 0) break;
+			if (rc < 0 || copybody(c, cb, sb->fd, cb->len - cb->pos, 1)) { c->failed = 1; break; }
+		}
+		if (pfds[1].revents) {
+			rc = buffill(sb);
+			if (rc == 0) break;
+			if (rc < 0 || copybody(c, sb, cb->fd, sb->len - sb->pos, 0)) { c->failed = 1; break; }
+		}
+	}
+}
+
+/* Puts the upstream connection back in the idle pool if it's clean and pooled, or closes it. */
+static void upstreamrelease(struct Conn* c, const char* key, int reusable) {
+	int sock = conndetach(c);
+
+	if (sock <= 0) return;
+	if (reusable && key[0]) idleput(key, sock, &c->upstream, NULL);
+	else close(sock);
+	if (c->via) {
+		poolrelease(c->via);
+		c->via = NULL;
+	}
+}
+
+/* Gets an upstream connection for host, from the idle pool unless fresh is
+ * set. Returns 1 if it was reused, 0 if it's new, or -1 if none could be had. */
+static int upstreamacquire(struct Conn* c, const struct Mapping* map, const char* host, const char* key, int fresh) {
+	void* session;
+	char* dest;
+	int sock;
+	int rc;
+
+	if (!fresh && key[0] && (sock = idleget(key, &c->upstream, &session)) > 0) {
+		connattach(c, sock);
+		statadd(STAT_UPSTREAMREUSES, 1);
+		return 1;
+	}
+	c->rejected = 0;
+	dest = strdup(host);
+	rc = upstreamconnect(c, map, dest, 80);
+	free(dest);
+	if (!rc) return -1;
+	/* Heads and bodies go out in separate writes; don't let Nagle hold the second one back. */
+	socknodelay(c->ssock, map->profile);
+	return 0;
+}
+
+void* httpthread(void* arg) {
+	struct Conn* c = (struct Conn*)arg;
+	struct HttpBuf* cb = (struct HttpBuf*)malloc(sizeof(struct HttpBuf));
+	struct HttpBuf* sb = (struct HttpBuf*)malloc(sizeof(struct HttpBuf));
+	struct HttpHead req, resp;
+	struct CacheRef cref;
+	const struct Mapping* map;
+	const struct Mapping* curmap = NULL;
+	char key[IDLEKEYSIZE] = "";
+	char* out = (char*)malloc(OUTSIZE);
+	char* host;
+	char saved;
+	int csock = c->csock;
+	int requests = 0;
+	int reusable = 0;
+	int reused, retried, framed, tee;
+	int outlen;
+	int n;
+
+	n = 1;
+	setsockopt(csock, IPPROTO_TCP, TCP_NODELAY, &n, sizeof(n));
+	cb->fd = csock;
+	cb->len = cb->pos = 0;
+	cb->session = sb->session = NULL;
+	sb->fd = -1;
+	sb->len = sb->pos = 0;
+	memset(&cref, 0, sizeof(cref));
+	cref.fd = cref.tmpfd = -1;
+
+	while (exitflag == 0) {
+		/* Waiting for the next request is header time, on the header timeout, not relay. */
+		connphase(c, PHASE_HEADER);
+		n = readhead(cb);
+		if (n == 0) {
+			if (!requests && !c->expired) warn("[%d] Client closed connection before sending headers.\n", csock);
+			/* Hanging up between requests is how keep-alive ends, not an error. */
+			if (requests && !c->expired) connphase(c, PHASE_RELAY);
+			break;
+		}
+		if (n < 0) {
+			if (!c->expired) warn("[%d] Error reading request headers: %m\n", csock);
+			c->failed = requests > 0;
+			break;
+		}
+		parsehead(cb->data + cb->pos, n, &req, 1);
+		if (req.badlength) {
+			warn("[%d] Request has a malformed or conflicting Content-Length.\n", csock);
+			writeall(csock, badrequest, sizeof(badrequest)-1);
+			c->failed = 1;
+			break;
+		}
+
+		/* findhost() wants the head on its own. */
+		saved = cb->data[cb->pos + n];
+		cb->data[cb->pos + n] = 0;
+		host = findhost(cb->data + cb->pos);
+		cb->data[cb->pos + n] = saved;
+		if (!host) {
+			warn("[%d] Client did not provide Host: header.\n", csock);
+			c->failed = requests > 0;
+			break;
+		}
+
+		/* A request for somewhere else needs another upstream connection. */
+		map = findserver(c->routes, host);
+		if (c->ssock > 0 && (map != curmap || strcasecmp(host, c->host))) upstreamrelease(c, key, reusable);
+		connhost(c, host);
+		if (map->profile != (c->map ? c->map->profile : NULL)) sockprofile(csock, map->profile);
+		c->map = map;
+		requests++;
+		statadd(STAT_HTTPREQUESTS, 1);
+		if (connblocked(c)) {
+			n = blockresponse(out, OUTSIZE, map);
+			if (n) writeall(csock, out, n);
+			break;
+		}
+
+		capturerequest(c, cb->data + cb->pos, n);
+		if (!req.upgrade && !req.connect && !req.chunked && req.length <= 0) cachefind(&cref, cb->data + cb->pos, n, host);
+		if (cref.state == CACHE_HIT) {
+			cb->pos += n;
+			connphase(c, PHASE_RELAY);
+			n = cacheserve(&cref, c, csock, req.version < 1 && req.keepalive);
+			cachedone(&cref, 0);
+			if (n) {
+				c->failed = 1;
+				break;
+			}
+			if (req.close || (req.version < 1 && !req.keepalive)) break;
+			continue;
+		}
+
+		reused = 0;
+		if (c->ssock <= 0) {
+			curmap = map;
+			idlekey(key, map, host, 0);
+			reused = upstreamacquire(c, map, host, key, 0);
+			if (reused < 0) {
+				writeall(csock, badgateway, sizeof(badgateway)-1);
+				break;
+			}
+			sb->fd = c->ssock;
+			sb->len = sb->pos = 0;
+		}
+		connphase(c, PHASE_RELAY);
+		reusable = 0;
+
+		if (req.upgrade || req.connect) {
+			if (copybody(c, cb, c->ssock, n, 1)) c->failed = 1;
+			else tunnel(c, cb, sb);
+			break;
+		}
+
+		outlen = rewritehead(out, OUTSIZE, cb->data + cb->pos, &req, cref.conditions ? cref.conditions : "");
+		if (!outlen) {
+			warn("[%d] Request headers too large.\n", csock);
+			c->failed = 1;
+			break;
+		}
+		cb->pos += n;
+		if (req.expect && writeall(csock, continued, sizeof(continued)-1) <= 0) {
+			c->failed = 1;
+			break;
+		}
+
+		/* A pooled connection may have been closed by the other end just now. If
+		 * nothing came back and there was no body to lose, try once on a new one. */
+		retried = 0;
+		while (1) {
+			if (writeall(c->ssock, out, outlen) == outlen) {
+				conntraffic(c, 1, outlen);
+				if (req.chunked) n = copychunked(c, cb, c->ssock, 1);
+				else n = req.length > 0 ? copybody(c, cb, c->ssock, req.length, 1) : 0;
+				if (n) {
+					warn("[%d] Error relaying request body.\n", csock);
+					c->failed = 1;
+					goto end;
+				}
+				do {
+					n = readhead(sb);
+					if (n <= 0) break;
+					parsehead(sb->data + sb->pos, n, &resp, 0);
+					if (resp.status < 100 || resp.status >= 200 || resp.status == 101) break;
+					if (copybody(c, sb, csock, n, 0)) {
+						c->failed = 1;
+						goto end;
+					}
+				} while (1);
+				if (n > 0) break;
+			}
+			if (!reused || retried || req.chunked || req.length > 0) {
+				warn("[%d] Error reading response headers: %m\n", csock);
+				writeall(csock, badgateway, sizeof(badgateway)-1);
+				c->failed = 1;
+				goto end;
+			}
+			retried = 1;
+			upstreamrelease(c, key, 0);
+			reused = upstreamacquire(c, map, host, key, 1);
+			if (reused < 0) {
+				writeall(csock, badgateway, sizeof(badgateway)-1);
+				goto end;
+			}
+			sb->fd = c->ssock;
+			sb->len = sb->pos = 0;
+		}
+
+		if (resp.badlength) {
+			warn("[%d] Response has a malformed or conflicting Content-Length.\n", csock);
+			writeall(csock, badgateway, sizeof(badgateway)-1);
+			c->failed = 1;
+			goto end;
+		}
+
+		if (resp.status == 101) {
+			if (copybody(c, sb, csock, n, 0)) c->failed = 1;
+			else tunnel(c, cb, sb);
+			break;
+		}
+
+		/* Our copy is still good: send that rather than a 304 the client didn't ask for. */
+		if (resp.status == 304 && cacherefresh(&cref, sb->data + sb->pos, n)) {
+			sb->pos += n;
+			reusable = !resp.close && (resp.version >= 1 || resp.keepalive);
+			if (!reusable) upstreamrelease(c, key, 0);
+			n = cacheserve(&cref, c, csock, req.version < 1 && req.keepalive);
+			cachedone(&cref, 0);
+			if (n) {
+				c->failed = 1;
+				break;
+			}
+			if (req.close || (req.version < 1 && !req.keepalive)) break;
+			continue;
+		}
+
+		tee = req.head ? -1 : cachestore(&cref, sb->data + sb->pos, n, resp.status, resp.length);
+		if (copybody(c, sb, csock, n, 0)) {
+			c->failed = 1;
+			break;
+		}
+
+		framed = 1;
+		if (req.head || resp.status == 204 || resp.status == 304) n = 0;
+		else if (resp.chunked) n = copychunked(c, sb, csock, 0);
+		else if (resp.length >= 0) n = tee >= 0 ? copycached(c, sb, csock, resp.length, &cref) : copybody(c, sb, csock, resp.length, 0);
+		else {
+			framed = 0;
+			n = copyall(c, sb, csock, 0);
+		}
+		cachedone(&cref, !n);
+		if (n) {
+			warn("[%d] Error relaying response body.\n", csock);
+			c->failed = 1;
+			break;
+		}
+
+		reusable = framed && !resp.close && (resp.version >= 1 || resp.keepalive);
+		if (!reusable) upstreamrelease(c, key, 0);
+		if (!framed || req.close || (req.version < 1 && !req.keepalive)) break;
+	}
+
+	end:
+	cachedone(&cref, 0);
+	upstreamrelease(c, key, reusable);
+	connfree(c);
+	free(out);
+	free(cb);
+	free(sb);
+	log("[%d] Relay finished, %d request%s.\n", csock, requests, requests == 1 ? "" : "s");
+	return NULL;
+}
+
+/* Closes idle connections nobody picked up within IDLETIMEOUT. */
+static void* idlethread(void* arg) {
+	struct Idle** pe;
+	struct Idle* e;
+	unsigned long now;
+	int x;
+
+	while (1) {
+		sleep(1);
+		now = mstime();
+		for (x = 0; x < IDLESHARDS; x++) {
+			pthread_mutex_lock(&idle[x].lock);
+			pe = &idle[x].head;
+			while ((e = *pe)) {
+				if (now - e->since < IDLETIMEOUT) {
+					pe = &e->next;
+					continue;
+				}
+				*pe = e->next;
+				idleclose(e->sock, e->session);
+				free(e);
+				__atomic_fetch_sub(&idlecount, 1, __ATOMIC_RELAXED);
+			}
+			pthread_mutex_unlock(&idle[x].lock);
+		}
+	}
+	return NULL;
+}
+
+void httpstart() {
+	pthread_t tid;
+	int x;
+
+	for (x = 0; x < IDLESHARDS; x++) pthread_mutex_init(&idle[x].lock, NULL);
+	pthread_create(&tid, NULL, idlethread, NULL);
+	pthread_detach(tid);
+}
+
+
+
+/* EOF */
@@ -0,0 +1,389 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#define _GNU_SOURCE
+#include "transockproxy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <time.h>
+
+#define LOGRINGSIZE 1024
+#define LOGMSGSIZE 200
+#define LOGHOSTSIZE 64
+#define LOGOUTSIZE 65536
+#define LOGINTERVAL 10000
+
+enum LogType {
+	LOGTYPE_MSG,
+	LOGTYPE_ACCESS,
+	LOGTYPE_CAPTURE
+};
+
+/* An encoded capture record, see capture.c; the log thread frees it. */
+struct LogCapture {
+	unsigned char* data;
+	int len;
+};
+
+struct LogAccess {
+	struct sockaddr_in client;
+	struct sockaddr_in upstream;
+	int csock;
+	int ssl;
+	int phase;
+	int expired;
+	int failed;
+	int shortcircuit;
+	int blocked;
+	unsigned long bytesup;
+	unsigned long bytesdown;
+	unsigned long total;
+	unsigned long timings[PHASES];
+	char host[LOGHOSTSIZE];
+	char mapping[LOGHOSTSIZE];
+};
+
+struct LogRecord {
+	unsigned long seq;
+	unsigned long time;
+	int type;
+	int level;
+	union {
+		char msg[LOGMSGSIZE];
+		struct LogAccess access;
+		struct LogCapture capture;
+	};
+};
+
+/* Bounded multi-producer queue (Vyukov style): producers claim a slot by
+ * bumping head, fill it, then publish it through its sequence number.
+ * Only the log thread consumes, so tail needs no atomics. There's one per
+ * CPU rather than per thread, since connections each have a thread of
+ * their own; producers on a ring only meet when one of them is preempted
+ * in the middle of claiming a slot. */
+struct LogRing {
+	unsigned long head __attribute__((aligned(64)));
+	unsigned long tail __attribute__((aligned(64)));
+	struct LogRecord records[LOGRINGSIZE];
+};
+
+struct LogOut {
+	int fd;
+	int len;
+	char buf[LOGOUTSIZE];
+};
+
+/* Detached, stdout and stderr go nowhere, so daemons only say what's wrong unless told otherwise. */
+#ifdef DAEMON
+int loglevel = LOG_WARN;
+#else
+int loglevel = LOG_INFO;
+#endif
+char* accesslog;
+char* errorlog;
+
+static const char* levelnames[] = { "none", "warn", "info" };
+
+static struct LogRing* rings;
+static int nrings;
+static pthread_mutex_t drainlock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct LogOut infoout = { 1 };
+static struct LogOut warnout = { 2 };
+static struct LogOut accessout = { -1 };
+static struct LogOut captureout = { -1 };
+static struct LogOut* infop = &infoout;
+static int logrunning = 0;
+static int msgsink = 1;		/* Messages have somewhere to go, see logstart() */
+
+static unsigned long realms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+/* Claims a record on this CPU's ring. Returns NULL, counting it under dropstat, if the ring is full. */
+static struct LogRecord* logreserve(int dropstat) {
+	struct LogRing* r;
+	struct LogRecord* rec;
+	unsigned long pos, seq;
+	long dif;
+	int cpu = sched_getcpu();
+
+	r = &rings[cpu > 0 ? cpu % nrings : 0];
+
+	pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	while (1) {
+		rec = &r->records[pos % LOGRINGSIZE];
+		seq = __atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE);
+		dif = (long)seq - (long)pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&r->head, &pos, pos+1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+		} else if (dif < 0) {
+			statadd(dropstat, 1);
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+		}
+	}
+	rec->time = realms();
+	return rec;
+}
+
+static void logcommit(struct LogRecord* rec) {
+	__atomic_store_n(&rec->seq, rec->seq + 1, __ATOMIC_RELEASE);
+}
+
+void logmsg(int level, const char* fmt, ...) {
+	struct LogRecord* rec;
+	va_list ap;
+	int err = errno;
+
+	/* Until the log thread is up (startup errors that exit), write directly. */
+	if (!logrunning) {
+		va_start(ap, fmt);
+		vdprintf(level == LOG_WARN ? warnout.fd : infop->fd, fmt, ap);
+		va_end(ap);
+		return;
+	}
+	if (!msgsink) return;
+
+	rec = logreserve(STAT_LOGDROPS);
+	if (!rec) return;
+
+	rec->type = LOGTYPE_MSG;
+	rec->level = level;
+	errno = err;
+	va_start(ap, fmt);
+	vsnprintf(rec->msg, LOGMSGSIZE, fmt, ap);
+	va_end(ap);
+	logcommit(rec);
+}
+
+void logaccess(const struct Conn* c) {
+	struct LogRecord* rec;
+	struct LogAccess* a;
+
+	if (!accesslog) return;
+	rec = logreserve(STAT_LOGDROPS);
+	if (!rec) return;
+
+	rec->type = LOGTYPE_ACCESS;
+	rec->level = LOG_INFO;
+	a = &rec->access;
+	a->client = c->caddr;
+	a->upstream = c->upstream;
+	a->csock = c->csock;
+	a->ssl = c->ssl;
+	a->phase = c->phase;
+	a->expired = c->expired;
+	a->failed = c->failed;
+	a->shortcircuit = c->shortcircuit;
+	a->blocked = c->blocked;
+	a->bytesup = c->bytesup;
+	a->bytesdown = c->bytesdown;
+	a->total = ustime() - c->start;
+	memcpy(a->timings, c->timings, sizeof(a->timings));
+	snprintf(a->host, LOGHOSTSIZE, "%s", c->host ? c->host : "-");
+	if (c->map) snprintf(a->mapping, LOGHOSTSIZE, "%s", c->map == &c->routes->defmap ? "default" : c->map->pattern);
+	else strcpy(a->mapping, "-");
+	logcommit(rec);
+}
+
+void logcapture(unsigned char* data, int len) {
+	struct LogRecord* rec;
+
+	/* Replays would be short of traffic without saying so, so these get a counter of their own. */
+	rec = captureout.fd >= 0 ? logreserve(STAT_CAPTUREDROPS) : NULL;
+	if (!rec) {
+		free(data);
+		return;
+	}
+	rec->type = LOGTYPE_CAPTURE;
+	rec->level = LOG_INFO;
+	rec->capture.data = data;
+	rec->capture.len = len;
+	logcommit(rec);
+}
+
+int loglevelbyname(const char* name) {
+	int x;
+	for (x = 0; x < sizeof(levelnames)/sizeof(levelnames[0]); x++) {
+		if (!strcmp(name, levelnames[x])) return x;
+	}
+	return -1;
+}
+
+static void logflushout(struct LogOut* out) {
+	if (out->len && out->fd >= 0) writeall(out->fd, out->buf, out->len);
+	out->len = 0;
+}
+
+static void logappend(struct LogOut* out, const char* fmt, ...) {
+	va_list ap;
+	int rc;
+
+	if (out->fd < 0) return;
+	if (out->len > LOGOUTSIZE - 1024) logflushout(out);
+	va_start(ap, fmt);
+	rc = vsnprintf(out->buf + out->len, LOGOUTSIZE - out->len, fmt, ap);
+	va_end(ap);
+	if (rc > 0) out->len += rc < LOGOUTSIZE - out->len ? rc : LOGOUTSIZE - out->len - 1;
+}
+
+/* Binary, for the capture file. */
+static void logwrite(struct LogOut* out, const unsigned char* data, int len) {
+	if (out->len + len > LOGOUTSIZE) logflushout(out);
+	if (len > LOGOUTSIZE) {
+		writeall(out->fd, (const char*)data, len);
+		return;
+	}
+	memcpy(out->buf + out->len, data, len);
+	out->len += len;
+}
+
+static void logtimestamp(struct LogOut* out, unsigned long ms) {
+	time_t secs = ms / 1000;
+	struct tm tm;
+	char stamp[32];
+
+	gmtime_r(&secs, &tm);
+	strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%S", &tm);
+	logappend(out, "%s.%03luZ ", stamp, ms % 1000);
+}
+
+static void logformat(struct LogRecord* rec) {
+	struct LogAccess* a = &rec->access;
+	struct LogOut* out;
+	char client[INET_ADDRSTRLEN], upstream[INET_ADDRSTRLEN];
+	int x;
+
+	if (rec->type == LOGTYPE_MSG) {
+		out = rec->level == LOG_WARN ? &warnout : infop;
+		if (errorlog) logtimestamp(out, rec->time);
+		logappend(out, "%s", rec->msg);
+		return;
+	}
+	if (rec->type == LOGTYPE_CAPTURE) {
+		logwrite(&captureout, rec->capture.data, rec->capture.len);
+		free(rec->capture.data);
+		return;
+	}
+
+	out = &accessout;
+	inet_ntop(AF_INET, &a->client.sin_addr, client, sizeof(client));
+	inet_ntop(AF_INET, &a->upstream.sin_addr, upstream, sizeof(upstream));
+	logtimestamp(out, rec->time);
+	logappend(out, "client=%s:%hu%s host=%s map=%s upstream=%s:%hu up=%lu down=%lu",
+		client, ntohs(a->client.sin_port), a->ssl ? " ssl" : "", a->host, a->mapping,
+		upstream, ntohs(a->upstream.sin_port), a->bytesup, a->bytesdown);
+	for (x = 0; x < PHASES; x++) {
+		if (a->timings[x]) logappend(out, " %s=%.3f", phasenames[x], a->timings[x] / 1000.0);
+	}
+	logappend(out, " total=%.3f", a->total / 1000.0);
+	if (a->expired) logappend(out, " close=timeout:%s\n", phasenames[a->phase]);
+	else if (a->shortcircuit) logappend(out, " close=circuit\n");
+	else if (a->blocked) logappend(out, " close=%s\n", protonames[a->blocked]);
+	else if (a->failed || a->phase != PHASE_RELAY) logappend(out, " close=error:%s\n", phasenames[a->phase]);
+	else logappend(out, " close=closed\n");
+}
+
+static int logdrain() {
+	struct LogRing* r;
+	struct LogRecord* rec;
+	int count = 0;
+	int x;
+
+	pthread_mutex_lock(&drainlock);
+	for (x = 0; x < nrings; x++) {
+		r = &rings[x];
+		while (1) {
+			rec = &r->records[r->tail % LOGRINGSIZE];
+			if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != r->tail + 1) break;
+			logformat(rec);
+			__atomic_store_n(&rec->seq, r->tail + LOGRINGSIZE, __ATOMIC_RELEASE);
+			r->tail++;
+			count++;
+		}
+	}
+	logflushout(&infoout);
+	logflushout(&warnout);
+	logflushout(&accessout);
+	logflushout(&captureout);
+	pthread_mutex_unlock(&drainlock);
+	return count;
+}
+
+static void* logthread(void* arg) {
+	while (1) {
+		if (!logdrain()) usleep(LOGINTERVAL);
+	}
+	return NULL;
+}
+
+static int logopen(const char* path) {
+	int fd;
+	if (!strcmp(path, "-")) return 1;
+	fd = open(path, O_WRONLY|O_CREAT|O_APPEND, 0644);
+	if (fd < 0) { fprintf(stderr, "Error opening log file %s: %m\n", path); exit(1); }
+	return fd;
+}
+
+void loginit() {
+	int x, y;
+
+	nrings = sysconf(_SC_NPROCESSORS_CONF);
+	if (nrings < 1) nrings = 1;
+	if (nrings > MAXCPUS) nrings = MAXCPUS;
+	if (posix_memalign((void**)&rings, 64, nrings * sizeof(struct LogRing))) {
+		fprintf(stderr, "Could not allocate log rings.\n");
+		exit(1);
+	}
+	for (x = 0; x < nrings; x++) {
+		rings[x].head = rings[x].tail = 0;
+		for (y = 0; y < LOGRINGSIZE; y++) rings[x].records[y].seq = y;
+	}
+	if (errorlog) {
+		warnout.fd = logopen(errorlog);
+		infop = &warnout;
+	}
+	if (accesslog) accessout.fd = logopen(accesslog);
+	if (capturefile) {
+		captureout.fd = logopen(capturefile);
+		/* A new file gets the header; an old one (say, after an upgrade) is added to. */
+		if (!lseek(captureout.fd, 0, SEEK_END)) writeall(captureout.fd, "TSPTRACE1\n", 10);
+	}
+}
+
+void logstart() {
+	pthread_t tid;
+
+	/* After daemon(), messages without an errorlog would only be formatted for /dev/null. */
+	#ifdef DAEMON
+	msgsink = errorlog != NULL;
+	#endif
+	pthread_create(&tid, NULL, logthread, NULL);
+	pthread_detach(tid);
+	logrunning = 1;
+}
+
+void logflush() {
+	logdrain();
+}
+
+
+
+/* EOF */
@@ -14,6 +14,9 @@
 
 #include "transockproxy.h"
 
+/* Sent instead of connecting when the destination's circuit is open. */
+static const char badgateway[] = "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
 int writeall(int fd, const char* buffer, int size) {
 	int pos = 0;
 	int rc;
@@ -25,95 +28,90 @@ int writeall(int fd, const char* buffer, int size) {
 	return size;
 }
 
+/* Returns a copy of the Host: header value, or NULL if there isn't a complete one in buffer yet. */
+char* findhost(const char* buffer) {
+	const char* p = buffer;
+	const char* end;
+
+	/* First line should be "GET /foo HTTP/1.1" so we can skip that safely. */
+	while ((p = strchr(p, '\n'))) {
+		p++;
+		if (strncasecmp(p, "Host:", 5)) continue;
+		p += 5;
+		while (*p == ' ' || *p == '\t') p++;
+		end = strpbrk(p, "\r\n");
+		if (!end) return NULL;
+		return strndup(p, end - p);
+	}
+	return NULL;
+}
+
 void* connthread(void* arg) {
+	struct Conn* c = (struct Conn*)arg;
 	const struct Mapping* map;
-	struct sockaddr_in addr;
-	int ssock = 0;
-	int csock = (long)arg;
+	int csock = c->csock;
+	int ssock;
 	char* buffer;
+	int len = 0;
 	int rc;
-	char* tok;
 	char* host = NULL;
 	fd_set fds;
 	fd_set rfds;
-	int tries = 0;
 	
-	running++;
-	buffer = (char*)malloc(BUFFERSIZE);
+	buffer = bufget(c->node);
 
-	tryagain:
-	rc = recv(csock, buffer, BUFFERSIZE-1, MSG_PEEK);
-	if (rc == 0) {
-		warn("[%d] Client closed connection before sending headers.\n", csock);
-		goto end;
-	}
-	if (rc < 0) {
-		warn("[%d] Error reading request headers: %m\n", csock);
-		goto end;
-	}
-	buffer[rc] = 0;
-	/* Technically it's case-insensitive, but these should cover almost all cases. */
-	if (!strstr(buffer, "Host: ") && !strstr(buffer, "host: ")) {
-		usleep(10000);
-		tries++;
-		if (tries > 1000) {
-			warn("[%d] Waiting for Host: header timed out.\n", csock);
+	connphase(c, PHASE_HEADER);
+	buffer[0] = 0;
+	while (!(host = findhost(buffer))) {
+		if (strstr(buffer, "\r\n\r\n")) {
+			warn("[%d] Client did not provide Host: header.\n", csock);
 			goto end;
 		}
-		if (rc >= BUFFERSIZE-1) {
-			warn("[%d] Host: header not found within first %d bytes.\n", csock, rc);
+		if (len >= BUFFERSIZE-1) {
+			warn("[%d] Host: header not found within first %d bytes.\n", csock, len);
 			goto end;
 		}
-		goto tryagain;
-	}
-
-	strtok(buffer, "\r\n");
-	/* First token should be "GET /foo HTTP/1.1" so we can skip that safely. */
-	while ((tok = strtok(NULL, "\r\n"))) {
-		if (!strncasecmp(tok, "Host: ", 6)) {
-			host = strdup(tok + 6);
-			break;
+		rc = read(csock, buffer + len, BUFFERSIZE-1 - len);
+		if (rc == 0) {
+			if (!c->expired) warn("[%d] Client closed connection before sending headers.\n", csock);
+			goto end;
 		}
+		if (rc < 0) {
+			warn("[%d] Error reading request headers: %m\n", csock);
+			goto end;
+		}
+		len += rc;
+		buffer[len] = 0;
 	}
-	
-	if (host == NULL) {
-		warn("[%d] Client did not provide Host: header.\n", csock);
-		goto end;
-	}
-	
 
 
 	/* Establish SOCKS connection. */
-	map = findserver(host);
+	map = findserver(c->routes, host);
+	c->host = host;
+	c->map = map;
+	sockprofile(csock, map->profile);
+	if (connblocked(c)) {
+		len = blockresponse(buffer, BUFFERSIZE, map);
+		if (len) writeall(csock, buffer, len);
+		goto end;
+	}
 	
-	ssock = socket(AF_INET, SOCK_STREAM, 0);
+	if (!upstreamconnect(c, map, host, 80)) {
+		if (c->shortcircuit) writeall(csock, badgateway, sizeof(badgateway)-1);
+		goto end;
+	}
+	ssock = c->ssock;
 
-	switch (map->proto) {
-	case INVALID:
+	/* Whatever we read while looking for the Host: header goes out first. */
+	connphase(c, PHASE_RELAY);
+	capturerequest(c, buffer, len);
+	rc = writeall(ssock, buffer, len);
+	if (rc <= 0) {
+		warn("[%d] Error sending to server: %m\n", csock);
+		c->failed = 1;
 		goto end;
-	
-	case DIRECT:
-		if (!directconnect(csock, ssock, host, "80", map)) goto end;
-		break;
-		
-	case SOCKS4:
-		rc = connect(ssock, (struct sockaddr*)&addr, sizeof(addr));
-		if (rc) { warn("[%d] Could not connect to server: %m\n", csock); return 0; }
-		if (!socks4connect(csock, ssock, host, 80)) goto end;
-		break;
-	
-	case SOCKS4A:
-		rc = connect(ssock, (struct sockaddr*)&addr, sizeof(addr));
-		if (rc) { warn("[%d] Could not connect to server: %m\n", csock); return 0; }
-		if (!socks4aconnect(csock, ssock, host, 80)) goto end;
-		break;
-	
-	case SOCKS5:
-		rc = connect(ssock, (struct sockaddr*)&addr, sizeof(addr));
-		if (rc) { warn("[%d] Could not connect to server: %m\n", csock); return 0; }
-		if (!socks5connect(csock, ssock, host, 80)) goto end;
-		break;
 	}
+	conntraffic(c, 1, rc);
 	
 	
 	/* Relay data. */
@@ -131,37 +129,40 @@ void* connthread(void* arg) {
 			if (rc == 0) break;
 			if (rc < 0) {
 				warn("[%d] Error reading from client: %m\n", csock);
+				c->failed = 1;
 				break;
 			}
 		
 			rc = writeall(ssock, buffer, rc);
 			if (rc <= 0) {
 				warn("[%d] Error sending to server: %m\n", csock);
+				c->failed = 1;
 				break;
 			}
+			conntraffic(c, 1, rc);
 		}
 		if (FD_ISSET(ssock, &rfds)) {
 			rc = read(ssock, buffer, BUFFERSIZE);
 			if (rc == 0) break;
 			if (rc <= 0) {
 				warn("[%d] Error reading from server: %m\n", csock);
+				c->failed = 1;
 				break;
 			}
 		
 			rc = writeall(csock, buffer, rc);
 			if (rc <= 0) {
 				warn("[%d] Error sending to client: %m\n", csock);
+				c->failed = 1;
 				break;
 			}
+			conntraffic(c, 0, rc);
 		}
 	} while (exitflag == 0);
 	
 	end:
-	if (csock > 0) close(csock);
-	if (ssock > 0) close(ssock);
-	if (host) free(host);
-	if (buffer) free(buffer);
-	running--;
+	bufput(c->node, buffer);
+	connfree(c);
 	log("[%d] Relay finished.\n", csock);
 	return NULL;
 }
@@ -0,0 +1,198 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Upstream proxy pools. A mapping can point at a named pool instead of a
+ * single proxy; each connection then picks one of the pool's upstreams.
+ * Upstreams that fail several handshakes in a row are ejected for a while,
+ * and a background thread checks every upstream with a TCP connect (plus
+ * the greeting, for SOCKS5) and skips the ones that don't answer. */
+
+#include "transockproxy.h"
+
+const char* balancenames[] = { "roundrobin", "leastconn", "ewma" };
+
+static const unsigned char greeting[] = { 0x05, 0x01, 0x00 };
+
+int upstreamup(const struct Upstream* u, unsigned long now) {
+	return __atomic_load_n(&u->healthy, __ATOMIC_RELAXED)
+		&& __atomic_load_n(&u->ejecteduntil, __ATOMIC_RELAXED) <= now;
+}
+
+/* Peak EWMA: a slower sample is taken as is, faster ones pull it down by an
+ * eighth of the difference. An upstream that starts stalling is avoided at
+ * once, and has to prove itself for a while before it gets its share back. */
+static void poolsample(struct Upstream* u, unsigned long us) {
+	unsigned long ewma = __atomic_load_n(&u->ewma, __ATOMIC_RELAXED);
+
+	if (us > ewma) ewma = us;
+	else ewma -= (ewma - us) / 8;
+	__atomic_store_n(&u->ewma, ewma, __ATOMIC_RELAXED);
+}
+
+/* Picks an upstream for a new connection and counts it as outstanding
+ * until poolrelease(). Never fails: if every upstream is down, the least
+ * bad one is tried anyway rather than refusing the connection here. */
+struct Upstream* poolpick(struct Pool* p) {
+	unsigned long now = mstime();
+	unsigned int start = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+	struct Upstream* best = NULL;
+	struct Upstream* u;
+	unsigned long score, bestscore = 0;
+	int pass, x;
+
+	for (pass = 0; pass < 2 && !best; pass++) {
+		/* Starting from a rotating offset spreads out ties. */
+		for (x = 0; x < p->count; x++) {
+			u = &p->upstreams[(start + x) % p->count];
+			if (!pass && !upstreamup(u, now)) continue;
+			if (p->balance == BALANCE_ROUNDROBIN) {
+				best = u;
+				break;
+			}
+			score = __atomic_load_n(&u->outstanding, __ATOMIC_RELAXED);
+			if (p->balance == BALANCE_EWMA) score = (__atomic_load_n(&u->ewma, __ATOMIC_RELAXED) + 1) * (score + 1);
+			if (!best || score < bestscore) {
+				best = u;
+				bestscore = score;
+			}
+		}
+		if (!best) log("All upstreams in pool %s are down, trying them anyway.\n", p->name);
+	}
+
+	__atomic_fetch_add(&best->outstanding, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&best->conns, 1, __ATOMIC_RELAXED);
+	return best;
+}
+
+/* Reports how the handshake through u went. ok means the proxy did its
+ * part, even if it refused the destination. */
+void poolresult(struct Upstream* u, int ok, unsigned long us) {
+	if (ok) {
+		__atomic_store_n(&u->fails, 0, __ATOMIC_RELAXED);
+		poolsample(u, us);
+		return;
+	}
+	__atomic_fetch_add(&u->failures, 1, __ATOMIC_RELAXED);
+	if (__atomic_add_fetch(&u->fails, 1, __ATOMIC_RELAXED) < POOLEJECTFAILS) return;
+
+	__atomic_store_n(&u->fails, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&u->ejecteduntil, mstime() + POOLEJECTMS, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&u->ejections, 1, __ATOMIC_RELAXED);
+	warn("Upstream %s failed %d handshakes in a row, skipping it for %d seconds.\n",
+		u->name, POOLEJECTFAILS, POOLEJECTMS / 1000);
+}
+
+void poolrelease(struct Upstream* u) {
+	__atomic_fetch_sub(&u->outstanding, 1, __ATOMIC_RELAXED);
+}
+
+/* A reload builds new pools from scratch; upstreams that are still there
+ * keep what we've learned about them. */
+void poolcarry(struct Routes* r, const struct Routes* old) {
+	struct Upstream* u;
+	const struct Upstream* o;
+	int p, q, x, y;
+
+	for (p = 0; p < r->poolcount; p++) {
+		for (q = 0; q < old->poolcount; q++) {
+			if (!strcmp(r->pools[p]->name, old->pools[q]->name)) break;
+		}
+		if (q == old->poolcount) continue;
+
+		for (x = 0; x < r->pools[p]->count; x++) {
+			u = &r->pools[p]->upstreams[x];
+			for (y = 0; y < old->pools[q]->count; y++) {
+				o = &old->pools[q]->upstreams[y];
+				if (o->proto != u->proto || memcmp(&o->addr, &u->addr, sizeof(u->addr))) continue;
+				/* With health checks turned off nothing would ever mark it up again. */
+				if (r->healthcheck) u->healthy = __atomic_load_n(&o->healthy, __ATOMIC_RELAXED);
+				u->ejecteduntil = __atomic_load_n(&o->ejecteduntil, __ATOMIC_RELAXED);
+				u->ewma = __atomic_load_n(&o->ewma, __ATOMIC_RELAXED);
+				break;
+			}
+		}
+	}
+}
+
+void poolfree(struct Pool* p) {
+	free(p->name);
+	free(p->upstreams);
+	free(p);
+}
+
+/* Returns 1 if the upstream accepted a connection (and, for SOCKS5, answered
+ * the greeting) within timeout milliseconds. SOCKS4 has no greeting, so a
+ * connect is all we can check without asking it for a destination. */
+static int healthcheck(struct Upstream* u, int timeout, unsigned long* us) {
+	struct timeval tv;
+	unsigned char reply[2];
+	unsigned long start = ustime();
+	int sock;
+	int ok = 0;
+
+	/* Running out of descriptors says nothing about the upstream. */
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) return __atomic_load_n(&u->healthy, __ATOMIC_RELAXED);
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = timeout % 1000 * 1000;
+	setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	if (!connect(sock, (struct sockaddr*)&u->addr, sizeof(u->addr))) {
+		if (u->proto != SOCKS5) ok = 1;
+		else if (writeall(sock, (const char*)greeting, sizeof(greeting)) == sizeof(greeting)
+			&& read(sock, reply, 2) == 2 && reply[0] == 0x05 && reply[1] == 0x00) ok = 1;
+	}
+	close(sock);
+	*us = ustime() - start;
+	return ok;
+}
+
+static void* poolthread(void* arg) {
+	struct Routes* r;
+	struct Upstream* u;
+	unsigned long us;
+	int interval;
+	int p, x, ok;
+
+	while (1) {
+		r = routesget();
+		interval = r->healthcheck;
+		for (p = 0; interval && p < r->poolcount; p++) {
+			for (x = 0; x < r->pools[p]->count; x++) {
+				u = &r->pools[p]->upstreams[x];
+				ok = healthcheck(u, interval * 1000 < HEALTHTIMEOUT ? interval * 1000 : HEALTHTIMEOUT, &us);
+				if (ok != __atomic_load_n(&u->healthy, __ATOMIC_RELAXED)) {
+					warn("Upstream %s in pool %s is %s.\n", u->name, r->pools[p]->name, ok ? "back up" : "down");
+				}
+				__atomic_store_n(&u->healthy, ok, __ATOMIC_RELAXED);
+				if (ok) poolsample(u, us);
+			}
+		}
+		routesput(r);
+		sleep(interval ? interval : 1);
+	}
+	return NULL;
+}
+
+void poolstart() {
+	pthread_t tid;
+
+	pthread_create(&tid, NULL, poolthread, NULL);
+	pthread_detach(tid);
+}
+
+
+
+/* EOF */
@@ -0,0 +1,189 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Every client connection, from connnew() to connfree(), on one of
+ * CONNSHARDS lists picked by its socket. A dump (GET /connections on the
+ * stats socket, or SIGUSR1 to the log) copies each shard out under its lock
+ * and formats the copy afterwards, so relays are only held up by the copy,
+ * and only if they're opening or closing a connection on the same shard.
+ * The fields a relay updates as it goes are read without the lock, and may
+ * be a moment old. */
+
+#include "transockproxy.h"
+
+#define DUMPHOSTSIZE 64
+
+struct ConnShard {
+	pthread_mutex_t lock;
+	struct Conn* head;
+	int count;
+} __attribute__((aligned(64)));
+
+/* What a dump keeps of a connection once its shard lock is dropped. */
+struct ConnInfo {
+	int csock;
+	int ssl;
+	int phase;
+	struct sockaddr_in caddr;
+	unsigned long start;
+	unsigned long phasestart;
+	unsigned long lastactive;
+	unsigned long bytesup;
+	unsigned long bytesdown;
+	char host[DUMPHOSTSIZE];
+	char mapping[DUMPHOSTSIZE];
+	char via[32];
+};
+
+static struct ConnShard shards[CONNSHARDS];
+
+void registryinit() {
+	int x;
+
+	for (x = 0; x < CONNSHARDS; x++) pthread_mutex_init(&shards[x].lock, NULL);
+}
+
+void connregister(struct Conn* c) {
+	struct ConnShard* s = &shards[(c->csock > 0 ? c->csock : 0) % CONNSHARDS];
+
+	c->regshard = s - shards;
+	pthread_mutex_lock(&s->lock);
+	c->regprev = NULL;
+	c->regnext = s->head;
+	if (s->head) s->head->regprev = c;
+	s->head = c;
+	__atomic_store_n(&s->count, s->count + 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&s->lock);
+}
+
+void connunregister(struct Conn* c) {
+	struct ConnShard* s = &shards[c->regshard];
+
+	pthread_mutex_lock(&s->lock);
+	if (c->regprev) c->regprev->regnext = c->regnext;
+	else s->head = c->regnext;
+	if (c->regnext) c->regnext->regprev = c->regprev;
+	__atomic_store_n(&s->count, s->count - 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* Replaces c's host, freeing the old one, without a dump reading it as it goes. */
+void connhost(struct Conn* c, char* host) {
+	struct ConnShard* s = &shards[c->regshard];
+	char* old;
+
+	pthread_mutex_lock(&s->lock);
+	old = c->host;
+	c->host = host;
+	pthread_mutex_unlock(&s->lock);
+	if (old && old != host) free(old);
+}
+
+/* Open client connections. */
+int conncount() {
+	int n = 0;
+	int x;
+
+	for (x = 0; x < CONNSHARDS; x++) n += __atomic_load_n(&shards[x].count, __ATOMIC_RELAXED);
+	return n;
+}
+
+static int byage(const void* a, const void* b) {
+	const struct ConnInfo* x = (const struct ConnInfo*)a;
+	const struct ConnInfo* y = (const struct ConnInfo*)b;
+
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+static int bybytes(const void* a, const void* b) {
+	const struct ConnInfo* x = (const struct ConnInfo*)a;
+	const struct ConnInfo* y = (const struct ConnInfo*)b;
+	unsigned long xb = x->bytesup + x->bytesdown;
+	unsigned long yb = y->bytesup + y->bytesdown;
+
+	return xb > yb ? -1 : xb < yb;
+}
+
+/* Writes a line per open connection to fp, oldest first or, with bytes set,
+ * the busiest first. Returns how many there were. */
+int conndump(FILE* fp, int bytes) {
+	struct ConnInfo* info = NULL;
+	struct ConnInfo* i;
+	struct Conn* c;
+	unsigned long now, nowms;
+	int size = 0;
+	int n = 0;
+	int x;
+
+	for (x = 0; x < CONNSHARDS; x++) {
+		pthread_mutex_lock(&shards[x].lock);
+		for (c = shards[x].head; c; c = c->regnext) {
+			if (n == size) {
+				size = size ? size * 2 : 256;
+				info = (struct ConnInfo*)realloc(info, size * sizeof(struct ConnInfo));
+			}
+			i = &info[n++];
+			i->csock = c->csock;
+			i->ssl = c->ssl;
+			i->phase = c->phase;
+			i->caddr = c->caddr;
+			i->start = c->start;
+			i->phasestart = c->phasestart;
+			i->lastactive = c->lastactive;
+			i->bytesup = c->bytesup;
+			i->bytesdown = c->bytesdown;
+			snprintf(i->host, DUMPHOSTSIZE, "%s", c->host ? c->host : "-");
+			snprintf(i->mapping, DUMPHOSTSIZE, "%s", !c->map ? "-" : c->map == &c->routes->defmap ? "default" : c->map->pattern);
+			snprintf(i->via, sizeof(i->via), "%s", c->via ? c->via->name : "-");
+		}
+		pthread_mutex_unlock(&shards[x].lock);
+	}
+
+	if (n) qsort(info, n, sizeof(struct ConnInfo), bytes ? bybytes : byage);
+	now = ustime();
+	nowms = mstime();
+	fprintf(fp, "fd\tclient\tssl\thost\tmapping\tvia\tphase\tphase_s\tage_s\tidle_s\tbytes_up\tbytes_down\n");
+	for (x = 0; x < n; x++) {
+		i = &info[x];
+		fprintf(fp, "%d\t%s:%hu\t%d\t%s\t%s\t%s\t%s\t%.1f\t%.1f\t",
+			i->csock, inet_ntoa(i->caddr.sin_addr), ntohs(i->caddr.sin_port), i->ssl, i->host, i->mapping, i->via,
+			phasenames[i->phase], i->phasestart ? (now - i->phasestart) / 1e6 : 0.0, (now - i->start) / 1e6);
+		if (i->lastactive) fprintf(fp, "%.1f", (nowms - i->lastactive) / 1e3);
+		else fprintf(fp, "-");
+		fprintf(fp, "\t%lu\t%lu\n", i->bytesup, i->bytesdown);
+	}
+	free(info);
+	return n;
+}
+
+/* For SIGUSR1: the dump, a line at a time to the log whatever the log level. */
+void connlogdump() {
+	char* body;
+	char* line;
+	char* save;
+	size_t bodysize;
+	FILE* fp;
+	int n;
+
+	fp = open_memstream(&body, &bodysize);
+	n = conndump(fp, 0);
+	fclose(fp);
+	logmsg(LOG_WARN, "%d open connection%s:\n", n, n == 1 ? "" : "s");
+	for (line = strtok_r(body, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) logmsg(LOG_WARN, "%s\n", line);
+	free(body);
+}
+
+
+
+/* EOF */
@@ -0,0 +1,170 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Bandwidth shaping. Mappings and clients can each have a token bucket
+ * (see the ratelimit config line). Relays pay for what they've moved
+ * after the fact, with one atomic subtraction per buffer, and a relay that
+ * leaves a bucket short sleeps until it has refilled, which stops it
+ * reading and lets TCP push back on the sender.
+ *
+ * Bulk connections may only drain a bucket down to a quarter of its burst;
+ * the rest is kept for connections that have moved little lately, so a
+ * small request isn't queued behind a download. Connections waiting on
+ * the same bucket each wake up after their own buffer's worth, which
+ * shares what there is evenly between them. */
+
+#include "transockproxy.h"
+
+/* A client's bucket, shared by all its connections. */
+struct ClientBucket {
+	struct ClientBucket* next;
+	struct in_addr addr;
+	int refs;
+	struct Bucket b;
+};
+
+struct ShapeShard {
+	pthread_mutex_t lock;
+	struct ClientBucket* head;
+} __attribute__((aligned(64)));
+
+static struct ShapeShard shards[SHAPESHARDS];
+
+void bucketinit(struct Bucket* b, unsigned long rate, long burst) {
+	b->rate = rate;
+	b->burst = burst;
+	b->tokens = burst;
+	b->last = ustime();
+}
+
+/* Adds the tokens earned since b->last. */
+static void bucketfill(struct Bucket* b, unsigned long now) {
+	unsigned long last = __atomic_load_n(&b->last, __ATOMIC_RELAXED);
+	unsigned long next;
+	long add, t;
+
+	if (now <= last) return;
+	if (now - last >= 60000000) {
+		add = b->burst;
+		next = now;
+	} else {
+		add = (now - last) * b->rate / 1000000;
+		if (add <= 0) return;
+		/* Only as far as the whole bytes added, so fractions carry over. */
+		next = last + add * 1000000 / b->rate;
+	}
+	/* Whoever moves last forward adds the tokens for that stretch. */
+	if (!__atomic_compare_exchange_n(&b->last, &last, next, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) return;
+	t = __atomic_add_fetch(&b->tokens, add, __ATOMIC_RELAXED);
+	while (t > b->burst && !__atomic_compare_exchange_n(&b->tokens, &t, b->burst, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Takes n bytes from b, then waits until it's back above floor. */
+static void bucketcharge(struct Bucket* b, long n, long floor) {
+	unsigned long start = 0;
+	unsigned long wait;
+	long t;
+
+	bucketfill(b, ustime());
+	t = __atomic_sub_fetch(&b->tokens, n, __ATOMIC_RELAXED);
+	while (t < floor && exitflag <= 1) {
+		if (!start) start = ustime();
+		wait = (floor - t) * 1000000 / b->rate;
+		if (wait < 1000) wait = 1000;
+		if (wait > 1000000) wait = 1000000;
+		fibersleep(wait);
+		bucketfill(b, ustime());
+		t = __atomic_load_n(&b->tokens, __ATOMIC_RELAXED);
+	}
+	if (start) {
+		statadd(STAT_SHAPEWAITS, 1);
+		statadd(STAT_SHAPEWAITUS, ustime() - start);
+	}
+}
+
+/* Charges bytes the connection has just relayed to its buckets. */
+void shape(struct Conn* c, int bytes) {
+	unsigned long now = mstime();
+	unsigned long halves = (now - c->shapelast) / SHAPEDECAY;
+	int bulk;
+
+	/* Roughly what it moved in the last few SHAPEDECAYs. */
+	c->shapebytes = halves >= 64 ? 0 : c->shapebytes >> halves;
+	if (halves) c->shapelast = now;
+	c->shapebytes += bytes;
+	bulk = c->shapebytes > SHAPEINTERACTIVE;
+
+	if (c->map && c->map->bucket) bucketcharge(c->map->bucket, bytes, bulk ? c->map->bucket->burst / 4 : 0);
+	if (c->clientbucket) bucketcharge(&c->clientbucket->b, bytes, bulk ? c->clientbucket->b.burst / 4 : 0);
+}
+
+/* Finds (or makes) the bucket for c's client, if the routes limit clients. */
+void shapeclient(struct Conn* c) {
+	struct ShapeShard* s;
+	struct ClientBucket* cb;
+	struct ClientBucket** pcb;
+	unsigned long now;
+
+	if (!c->routes->clientrate) return;
+	s = &shards[ntohl(c->caddr.sin_addr.s_addr) % SHAPESHARDS];
+	now = ustime();
+	pthread_mutex_lock(&s->lock);
+	for (pcb = &s->head; (cb = *pcb); ) {
+		if (cb->addr.s_addr == c->caddr.sin_addr.s_addr) break;
+		/* Buckets nobody holds are only remembered until they're full again. */
+		if (!cb->refs) {
+			bucketfill(&cb->b, now);
+			if (cb->b.tokens >= cb->b.burst) {
+				*pcb = cb->next;
+				free(cb);
+				continue;
+			}
+		}
+		pcb = &cb->next;
+	}
+	if (!cb) {
+		cb = (struct ClientBucket*)calloc(1, sizeof(struct ClientBucket));
+		cb->addr = c->caddr.sin_addr;
+		bucketinit(&cb->b, c->routes->clientrate, c->routes->clientburst);
+		cb->next = s->head;
+		s->head = cb;
+	}
+	/* A reload may have changed the limit. */
+	cb->b.rate = c->routes->clientrate;
+	cb->b.burst = c->routes->clientburst;
+	cb->refs++;
+	pthread_mutex_unlock(&s->lock);
+	c->clientbucket = cb;
+}
+
+void shaperelease(struct Conn* c) {
+	struct ShapeShard* s;
+
+	if (!c->clientbucket) return;
+	s = &shards[ntohl(c->caddr.sin_addr.s_addr) % SHAPESHARDS];
+	pthread_mutex_lock(&s->lock);
+	c->clientbucket->refs--;
+	pthread_mutex_unlock(&s->lock);
+	c->clientbucket = NULL;
+}
+
+void shapestart() {
+	int x;
+
+	for (x = 0; x < SHAPESHARDS; x++) pthread_mutex_init(&shards[x].lock, NULL);
+}
+
+
+
+/* EOF */
@@ -0,0 +1,61 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Socket profiles: the buffer, Nagle, congestion control and keepalive
+ * settings a mapping's connections get, on the upstream socket before it
+ * connects (so the window scale fits the buffers) and on the client's as
+ * soon as its mapping is known. readconfig() has already tried each one on a
+ * scratch socket, so a failure here is only worth a log line. */
+
+#include "transockproxy.h"
+#include <netinet/tcp.h>
+
+static void sockopt(int sock, int level, int name, int value, const char* what) {
+	if (value < 0) return;
+	if (setsockopt(sock, level, name, &value, sizeof(value))) log("[%d] Could not set %s: %m\n", sock, what);
+}
+
+void sockprofile(int sock, const struct SockProfile* p) {
+	if (!p || sock <= 0) return;
+	sockopt(sock, SOL_SOCKET, SO_RCVBUF, p->rcvbuf, "SO_RCVBUF");
+	sockopt(sock, SOL_SOCKET, SO_SNDBUF, p->sndbuf, "SO_SNDBUF");
+	sockopt(sock, IPPROTO_TCP, TCP_NODELAY, p->nodelay, "TCP_NODELAY");
+	#ifdef TCP_NOTSENT_LOWAT
+	sockopt(sock, IPPROTO_TCP, TCP_NOTSENT_LOWAT, p->notsentlowat, "TCP_NOTSENT_LOWAT");
+	#endif
+	if (p->keepidle >= 0) sockopt(sock, SOL_SOCKET, SO_KEEPALIVE, p->keepidle > 0, "SO_KEEPALIVE");
+	if (p->keepidle > 0) {
+		sockopt(sock, IPPROTO_TCP, TCP_KEEPIDLE, p->keepidle, "TCP_KEEPIDLE");
+		sockopt(sock, IPPROTO_TCP, TCP_KEEPINTVL, p->keepintvl, "TCP_KEEPINTVL");
+		sockopt(sock, IPPROTO_TCP, TCP_KEEPCNT, p->keepcnt, "TCP_KEEPCNT");
+	}
+	#ifdef TCP_USER_TIMEOUT
+	sockopt(sock, IPPROTO_TCP, TCP_USER_TIMEOUT, p->usertimeout, "TCP_USER_TIMEOUT");
+	#endif
+	#ifdef TCP_CONGESTION
+	if (p->congestion[0] && setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, p->congestion, strlen(p->congestion)))
+		log("[%d] Could not set congestion control %s: %m\n", sock, p->congestion);
+	#endif
+}
+
+/* For the paths that turn Nagle off for themselves: unless the profile says otherwise. */
+void socknodelay(int sock, const struct SockProfile* p) {
+	int on = p && p->nodelay >= 0 ? p->nodelay : 1;
+
+	setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+
+
+/* EOF */
@@ -0,0 +1,434 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "transockproxy.h"
+#include <time.h>
+#include <sys/un.h>
+#include <poll.h>
+
+/* Histograms are log-linear: 16 linear sub-buckets per power of two of
+ * microseconds (about 6% precision), up to 2^32us. */
+#define HISTSUB 4
+#define HISTMAXBITS 32
+#define HISTBUCKETS ((HISTMAXBITS - HISTSUB + 1) << HISTSUB)
+
+/* Every thread updates one shard with relaxed atomics, and readers sum
+ * them all up. Shards are cache-line aligned so they don't share lines. */
+struct StatShard {
+	unsigned long counters[STATS];
+	unsigned long histsum[HISTS];
+	unsigned long hist[HISTS][HISTBUCKETS];
+} __attribute__((aligned(64)));
+
+char* statsaddr;
+int statscontrol = 0;	/* "stats ... control": clients of the stats socket may change the log level */
+static int statssock = -1;
+static volatile int statsstopped = 0;
+
+static struct StatShard shards[STATSHARDS];
+static unsigned int nextshard = 0;
+static __thread int myshard = -1;
+
+static const char* statnames[HISTS] = {
+	"header_wait", "dns", "connect", "socks_handshake", "tls_handshake", "first_byte"
+};
+
+unsigned long ustime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static struct StatShard* statshard() {
+	if (myshard < 0) {
+		myshard = __atomic_fetch_add(&nextshard, 1, __ATOMIC_RELAXED) % STATSHARDS;
+	}
+	return &shards[myshard];
+}
+
+static int histbucket(unsigned long v) {
+	int msb;
+	if (v < (1UL << HISTSUB)) return v;
+	msb = 63 - __builtin_clzl(v);
+	if (msb >= HISTMAXBITS) return HISTBUCKETS-1;
+	return ((msb - HISTSUB + 1) << HISTSUB) + ((v >> (msb - HISTSUB)) & ((1 << HISTSUB) - 1));
+}
+
+static unsigned long histupper(int b) {
+	int e = b >> HISTSUB;
+	int m = b & ((1 << HISTSUB) - 1);
+	if (e == 0) return b;
+	return ((unsigned long)((1 << HISTSUB) + m + 1) << (e - 1)) - 1;
+}
+
+void statadd(enum Stat stat, unsigned long n) {
+	__atomic_fetch_add(&statshard()->counters[stat], n, __ATOMIC_RELAXED);
+}
+
+void stathist(enum Hist hist, unsigned long us) {
+	struct StatShard* s = statshard();
+	__atomic_fetch_add(&s->hist[hist][histbucket(us)], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->histsum[hist], us, __ATOMIC_RELAXED);
+}
+
+unsigned long statget(enum Stat stat) {
+	unsigned long total = 0;
+	int x;
+	for (x = 0; x < STATSHARDS; x++) {
+		total += __atomic_load_n(&shards[x].counters[stat], __ATOMIC_RELAXED);
+	}
+	return total;
+}
+
+/* Sums a histogram over all shards into buckets[], returns the count. */
+static unsigned long histget(enum Hist hist, unsigned long* buckets, unsigned long* sum) {
+	unsigned long count = 0;
+	int x, b;
+
+	memset(buckets, 0, HISTBUCKETS * sizeof(unsigned long));
+	*sum = 0;
+	for (x = 0; x < STATSHARDS; x++) {
+		for (b = 0; b < HISTBUCKETS; b++) {
+			buckets[b] += __atomic_load_n(&shards[x].hist[hist][b], __ATOMIC_RELAXED);
+		}
+		*sum += __atomic_load_n(&shards[x].histsum[hist], __ATOMIC_RELAXED);
+	}
+	for (b = 0; b < HISTBUCKETS; b++) count += buckets[b];
+	return count;
+}
+
+static unsigned long histquantile(const unsigned long* buckets, unsigned long count, double q) {
+	unsigned long want = (unsigned long)(count * q);
+	unsigned long seen = 0;
+	int b;
+
+	if (want >= count) want = count - 1;
+	for (b = 0; b < HISTBUCKETS; b++) {
+		seen += buckets[b];
+		if (seen > want) return histupper(b);
+	}
+	return histupper(HISTBUCKETS-1);
+}
+
+/* Label values come from the configuration, so escape them as the exposition format requires. */
+static void labelprint(FILE* fp, const char* name, const char* value) {
+	fprintf(fp, "%s=\"", name);
+	for (; *value; value++) {
+		switch (*value) {
+		case '\\': fputs("\\\\", fp); break;
+		case '"': fputs("\\\"", fp); break;
+		case '\n': fputs("\\n", fp); break;
+		default: fputc(*value, fp); break;
+		}
+	}
+	fputc('"', fp);
+}
+
+static void upstreamprint(FILE* fp, struct Routes* r) {
+	static const char* names[] = {
+		"connections_total", "failures_total", "ejections_total", "outstanding", "up", "latency_seconds"
+	};
+	const struct Upstream* u;
+	unsigned long now = mstime();
+	double v;
+	int m, p, x;
+
+	if (!r->poolcount) return;
+	for (m = 0; m < sizeof(names)/sizeof(names[0]); m++) {
+		fprintf(fp, "# TYPE tsproxy_upstream_%s %s\n", names[m], m < 3 ? "counter" : "gauge");
+		for (p = 0; p < r->poolcount; p++) {
+			for (x = 0; x < r->pools[p]->count; x++) {
+				u = &r->pools[p]->upstreams[x];
+				switch (m) {
+				case 0: v = __atomic_load_n(&u->conns, __ATOMIC_RELAXED); break;
+				case 1: v = __atomic_load_n(&u->failures, __ATOMIC_RELAXED); break;
+				case 2: v = __atomic_load_n(&u->ejections, __ATOMIC_RELAXED); break;
+				case 3: v = __atomic_load_n(&u->outstanding, __ATOMIC_RELAXED); break;
+				case 4: v = upstreamup(u, now); break;
+				default: v = __atomic_load_n(&u->ewma, __ATOMIC_RELAXED) / 1e6; break;
+				}
+				fprintf(fp, "tsproxy_upstream_%s{", names[m]);
+				labelprint(fp, "pool", r->pools[p]->name);
+				fputc(',', fp);
+				labelprint(fp, "upstream", u->name);
+				fprintf(fp, "} %g\n", v);
+			}
+		}
+	}
+}
+
+static void statsprint(FILE* fp) {
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	unsigned long buckets[HISTBUCKETS];
+	unsigned long count, sum, cumulative, bytes;
+	struct Routes* r;
+	int x, b, entries;
+
+	fprintf(fp, "# TYPE tsproxy_accepts_total counter\n");
+	fprintf(fp, "tsproxy_accepts_total %lu\n", statget(STAT_ACCEPTS));
+	fprintf(fp, "# TYPE tsproxy_active_connections gauge\n");
+	fprintf(fp, "tsproxy_active_connections %d\n", conncount());
+	fprintf(fp, "# TYPE tsproxy_bytes_total counter\n");
+	fprintf(fp, "tsproxy_bytes_total{direction=\"up\"} %lu\n", statget(STAT_BYTESUP));
+	fprintf(fp, "tsproxy_bytes_total{direction=\"down\"} %lu\n", statget(STAT_BYTESDOWN));
+	fprintf(fp, "# TYPE tsproxy_log_dropped_total counter\n");
+	fprintf(fp, "tsproxy_log_dropped_total %lu\n", statget(STAT_LOGDROPS));
+	fprintf(fp, "# TYPE tsproxy_capture_dropped_total counter\n");
+	fprintf(fp, "tsproxy_capture_dropped_total %lu\n", statget(STAT_CAPTUREDROPS));
+
+	fprintf(fp, "# TYPE tsproxy_errors_total counter\n");
+	for (x = 0; x < PHASES; x++) {
+		fprintf(fp, "tsproxy_errors_total{phase=\"%s\"} %lu\n", phasenames[x], statget(STAT_ERRORS + x));
+	}
+	fprintf(fp, "# TYPE tsproxy_timeouts_total counter\n");
+	for (x = 0; x < PHASES; x++) {
+		fprintf(fp, "tsproxy_timeouts_total{phase=\"%s\"} %lu\n", phasenames[x], statget(STAT_TIMEOUTS + x));
+	}
+
+	fprintf(fp, "# TYPE tsproxy_upstream_connects_total counter\n");
+	fprintf(fp, "tsproxy_upstream_connects_total %lu\n", statget(STAT_UPSTREAMCONNECTS));
+	fprintf(fp, "# TYPE tsproxy_upstream_reuses_total counter\n");
+	fprintf(fp, "tsproxy_upstream_reuses_total %lu\n", statget(STAT_UPSTREAMREUSES));
+	fprintf(fp, "# TYPE tsproxy_upstream_idle_connections gauge\n");
+	fprintf(fp, "tsproxy_upstream_idle_connections %d\n", httpidlecount());
+	fprintf(fp, "# TYPE tsproxy_http_requests_total counter\n");
+	fprintf(fp, "tsproxy_http_requests_total %lu\n", statget(STAT_HTTPREQUESTS));
+	fprintf(fp, "# TYPE tsproxy_tls_handshakes_total counter\n");
+	fprintf(fp, "tsproxy_tls_handshakes_total{side=\"client\"} %lu\n", statget(STAT_TLSACCEPTS));
+	fprintf(fp, "tsproxy_tls_handshakes_total{side=\"upstream\"} %lu\n", statget(STAT_TLSCONNECTS));
+	fprintf(fp, "# TYPE tsproxy_tls_verify_total counter\n");
+	fprintf(fp, "tsproxy_tls_verify_total{result=\"cached\"} %lu\n", statget(STAT_VERIFYCACHED));
+	fprintf(fp, "tsproxy_tls_verify_total{result=\"checked\"} %lu\n", statget(STAT_VERIFYCHECKED));
+	fprintf(fp, "# TYPE tsproxy_tls_verify_seconds_total counter\n");
+	fprintf(fp, "tsproxy_tls_verify_seconds_total{result=\"cached\"} %.6f\n", statget(STAT_VERIFYCACHEDUS) / 1000000.0);
+	fprintf(fp, "tsproxy_tls_verify_seconds_total{result=\"checked\"} %.6f\n", statget(STAT_VERIFYCHECKEDUS) / 1000000.0);
+	fprintf(fp, "# TYPE tsproxy_tls_verify_failures_total counter\n");
+	fprintf(fp, "tsproxy_tls_verify_failures_total %lu\n", statget(STAT_VERIFYFAILS));
+	fprintf(fp, "# TYPE tsproxy_http2_connections_total counter\n");
+	fprintf(fp, "tsproxy_http2_connections_total %lu\n", statget(STAT_H2CONNS));
+	fprintf(fp, "# TYPE tsproxy_http2_streams_total counter\n");
+	fprintf(fp, "tsproxy_http2_streams_total %lu\n", statget(STAT_H2STREAMS));
+	fprintf(fp, "# TYPE tsproxy_accepts_off_cpu_total counter\n");
+	fprintf(fp, "tsproxy_accepts_off_cpu_total{scope=\"cpu\"} %lu\n", statget(STAT_OFFCPU));
+	fprintf(fp, "tsproxy_accepts_off_cpu_total{scope=\"node\"} %lu\n", statget(STAT_OFFNODE));
+	fprintf(fp, "# TYPE tsproxy_fibers gauge\n");
+	fprintf(fp, "tsproxy_fibers %d\n", fibercount());
+	fprintf(fp, "# TYPE tsproxy_udp_flows_total counter\n");
+	fprintf(fp, "tsproxy_udp_flows_total %lu\n", statget(STAT_UDPFLOWS));
+	fprintf(fp, "# TYPE tsproxy_udp_flows_active gauge\n");
+	fprintf(fp, "tsproxy_udp_flows_active %d\n", udpflowcount());
+	fprintf(fp, "# TYPE tsproxy_udp_datagrams_total counter\n");
+	fprintf(fp, "tsproxy_udp_datagrams_total{direction=\"up\"} %lu\n", statget(STAT_UDPUP));
+	fprintf(fp, "tsproxy_udp_datagrams_total{direction=\"down\"} %lu\n", statget(STAT_UDPDOWN));
+	fprintf(fp, "# TYPE tsproxy_udp_drops_total counter\n");
+	fprintf(fp, "tsproxy_udp_drops_total %lu\n", statget(STAT_UDPDROPS));
+	fprintf(fp, "# TYPE tsproxy_shaping_waits_total counter\n");
+	fprintf(fp, "tsproxy_shaping_waits_total %lu\n", statget(STAT_SHAPEWAITS));
+	fprintf(fp, "# TYPE tsproxy_shaping_wait_seconds_total counter\n");
+	fprintf(fp, "tsproxy_shaping_wait_seconds_total %.6f\n", statget(STAT_SHAPEWAITUS) / 1e6);
+
+	cacheusage(&bytes, &entries);
+	fprintf(fp, "# TYPE tsproxy_cache_requests_total counter\n");
+	fprintf(fp, "tsproxy_cache_requests_total{result=\"hit\"} %lu\n", statget(STAT_CACHEHITS));
+	fprintf(fp, "tsproxy_cache_requests_total{result=\"collapsed\"} %lu\n", statget(STAT_CACHECOLLAPSED));
+	fprintf(fp, "tsproxy_cache_requests_total{result=\"revalidated\"} %lu\n", statget(STAT_CACHEREVALIDATED));
+	fprintf(fp, "tsproxy_cache_requests_total{result=\"miss\"} %lu\n", statget(STAT_CACHEMISSES));
+	fprintf(fp, "# TYPE tsproxy_cache_bytes gauge\n");
+	fprintf(fp, "tsproxy_cache_bytes %lu\n", bytes);
+	fprintf(fp, "# TYPE tsproxy_cache_objects gauge\n");
+	fprintf(fp, "tsproxy_cache_objects %d\n", entries);
+
+	fprintf(fp, "# TYPE tsproxy_blocked_connections_total counter\n");
+	fprintf(fp, "tsproxy_blocked_connections_total{action=\"block\"} %lu\n", statget(STAT_BLOCKED));
+	fprintf(fp, "tsproxy_blocked_connections_total{action=\"reject\"} %lu\n", statget(STAT_REJECTED));
+
+	fprintf(fp, "# TYPE tsproxy_accept_errors_total counter\n");
+	fprintf(fp, "tsproxy_accept_errors_total %lu\n", statget(STAT_ACCEPTERRORS));
+	fprintf(fp, "# TYPE tsproxy_refused_connections_total counter\n");
+	for (x = ADMITTED + 1; x < REFUSALS; x++)
+		fprintf(fp, "tsproxy_refused_connections_total{reason=\"%s\"} %lu\n", refusalnames[x], statget(STAT_REFUSED + x));
+
+	fprintf(fp, "# TYPE tsproxy_circuits_open gauge\n");
+	fprintf(fp, "tsproxy_circuits_open %d\n", circuitcount());
+	fprintf(fp, "# TYPE tsproxy_circuit_opened_total counter\n");
+	fprintf(fp, "tsproxy_circuit_opened_total %lu\n", statget(STAT_CIRCUITOPENS));
+	fprintf(fp, "# TYPE tsproxy_circuit_avoided_connects_total counter\n");
+	fprintf(fp, "tsproxy_circuit_avoided_connects_total %lu\n", statget(STAT_CIRCUITSKIPS));
+	fprintf(fp, "# TYPE tsproxy_circuit_probes_total counter\n");
+	fprintf(fp, "tsproxy_circuit_probes_total{result=\"ok\"} %lu\n", statget(STAT_CIRCUITPROBES));
+	fprintf(fp, "tsproxy_circuit_probes_total{result=\"failed\"} %lu\n", statget(STAT_CIRCUITPROBEFAILS));
+
+	fprintf(fp, "# TYPE tsproxy_config_reloads_total counter\n");
+	fprintf(fp, "tsproxy_config_reloads_total{result=\"ok\"} %lu\n", statget(STAT_RELOADS));
+	fprintf(fp, "tsproxy_config_reloads_total{result=\"failed\"} %lu\n", statget(STAT_RELOADFAILS));
+	fprintf(fp, "# TYPE tsproxy_config_reload_seconds gauge\n");
+	fprintf(fp, "tsproxy_config_reload_seconds %g\n", lastreloadus / 1e6);
+
+	/* Per-mapping and per-upstream counts restart from zero with each configuration generation. */
+	r = routesget();
+	fprintf(fp, "# TYPE tsproxy_config_generation gauge\n");
+	fprintf(fp, "tsproxy_config_generation %lu\n", r->generation);
+	fprintf(fp, "# TYPE tsproxy_mapping_connections_total counter\n");
+	for (x = 0; x < r->mappingcount; x++) {
+		fprintf(fp, "tsproxy_mapping_connections_total{");
+		labelprint(fp, "pattern", r->mappings[x]->pattern);
+		fprintf(fp, "} %lu\n", __atomic_load_n(&r->mappings[x]->hits, __ATOMIC_RELAXED));
+	}
+	fprintf(fp, "tsproxy_mapping_connections_total{pattern=\"default\"} %lu\n",
+		__atomic_load_n(&r->defmap.hits, __ATOMIC_RELAXED));
+	upstreamprint(fp, r);
+	routesput(r);
+
+	for (x = 0; x < HISTS; x++) {
+		count = histget(x, buckets, &sum);
+
+		/* Exported at one bucket per power of two; quantiles use the full resolution. */
+		fprintf(fp, "# TYPE tsproxy_%s_seconds histogram\n", statnames[x]);
+		cumulative = 0;
+		for (b = 0; b < HISTBUCKETS; b++) {
+			cumulative += buckets[b];
+			if (b >> HISTSUB && (b & ((1 << HISTSUB) - 1)) == (1 << HISTSUB) - 1) {
+				fprintf(fp, "tsproxy_%s_seconds_bucket{le=\"%g\"} %lu\n",
+					statnames[x], (histupper(b) + 1) / 1e6, cumulative);
+			}
+		}
+		fprintf(fp, "tsproxy_%s_seconds_bucket{le=\"+Inf\"} %lu\n", statnames[x], count);
+		fprintf(fp, "tsproxy_%s_seconds_sum %g\n", statnames[x], sum / 1e6);
+		fprintf(fp, "tsproxy_%s_seconds_count %lu\n", statnames[x], count);
+
+		if (!count) continue;
+		fprintf(fp, "# TYPE tsproxy_%s_seconds_quantile gauge\n", statnames[x]);
+		for (b = 0; b < sizeof(quantiles)/sizeof(quantiles[0]); b++) {
+			fprintf(fp, "tsproxy_%s_seconds_quantile{quantile=\"%g\"} %g\n",
+				statnames[x], quantiles[b], histquantile(buckets, count, quantiles[b]) / 1e6);
+		}
+	}
+}
+
+static void* statsthread(void* arg) {
+	int lsock = (long)arg;
+	int sock;
+	char request[1024];
+	char* body;
+	size_t bodysize;
+	FILE* fp;
+	struct timeval tv;
+	struct pollfd pfd;
+	const char* status;
+	int level;
+	int rc;
+
+	while (!statsstopped) {
+		/* Poll first, so a stop request is noticed without taking another connection. */
+		pfd.fd = lsock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 1000) <= 0) continue;
+		if (statsstopped) break;
+		sock = accept(lsock, NULL, NULL);
+		if (sock < 0) continue;
+
+		/* Anything but a log level change or the connection list gets the metrics. Don't wait long for the request. */
+		tv.tv_sec = 1;
+		tv.tv_usec = 0;
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		rc = read(sock, request, sizeof(request)-1);
+		request[rc > 0 ? rc : 0] = 0;
+
+		fp = open_memstream(&body, &bodysize);
+		status = "200 OK";
+		if (!strncmp(request, "GET /connections", 16) && strchr(" /\r\n", request[16])) {
+			conndump(fp, !strncmp(request + 16, "/bytes", 6));
+		} else if (!strncmp(request, "GET /loglevel/", 14) && !statscontrol) {
+			status = "403 Forbidden";
+			fprintf(fp, "Changing the log level needs \"control\" on the stats line.\n");
+		} else if (!strncmp(request, "GET /loglevel/", 14)) {
+			request[14 + strcspn(request + 14, " \r\n")] = 0;
+			level = loglevelbyname(request + 14);
+			if (level >= 0) loglevel = level;
+			fprintf(fp, "loglevel %d\n", loglevel);
+		} else {
+			statsprint(fp);
+		}
+		fclose(fp);
+
+		dprintf(sock, "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", status, bodysize);
+		writeall(sock, body, bodysize);
+		free(body);
+		close(sock);
+	}
+	return NULL;
+}
+
+/* Binds the stats socket, unless one was handed over by an upgrade. Returns it, or -1. */
+int statsinit(int sock) {
+	struct sockaddr_un uaddr;
+	struct sockaddr_in addr;
+	struct hostent* hostinfo;
+	char* host;
+	char* port;
+	int rc;
+
+	if (sock > 0) {
+		statssock = sock;
+		return sock;
+	}
+	if (!statsaddr) return -1;
+
+	if (strchr(statsaddr, '/')) {
+		sock = socket(AF_UNIX, SOCK_STREAM, 0);
+		memset(&uaddr, 0, sizeof(uaddr));
+		uaddr.sun_family = AF_UNIX;
+		strncpy(uaddr.sun_path, statsaddr, sizeof(uaddr.sun_path)-1);
+		unlink(statsaddr);
+		rc = bind(sock, (struct sockaddr*)&uaddr, sizeof(uaddr));
+	} else {
+		host = strdup(statsaddr);
+		port = strchr(host, ':');
+		if (port) *port++ = 0;
+		else { port = host; host = "127.0.0.1"; }
+
+		hostinfo = gethostbyname(host);
+		if (!hostinfo) { fprintf(stderr, "Unknown host %s\n", host); exit(1); }
+
+		sock = socket(AF_INET, SOCK_STREAM, 0);
+		rc = 1;
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &rc, sizeof(int));
+		addr.sin_family = AF_INET;
+		addr.sin_addr = *(struct in_addr*)hostinfo->h_addr;
+		addr.sin_port = htons(atoi(port));
+		rc = bind(sock, (struct sockaddr*)&addr, sizeof(addr));
+	}
+	if (rc) { fprintf(stderr, "Could not bind stats socket %s: %m\n", statsaddr); exit(2); }
+	listen(sock, 8);
+	statssock = sock;
+	printf("Serving stats on %s.\n", statsaddr);
+	return sock;
+}
+
+/* After an upgrade the new process shares our stats socket, so stop taking its requests. */
+void statsstop() {
+	statsstopped = 1;
+}
+
+void statsstart() {
+	pthread_t tid;
+
+	if (statssock < 0) return;
+	pthread_create(&tid, NULL, statsthread, (void*)(long)statssock);
+	pthread_detach(tid);
+}
+
+
+
+/* EOF */
@@ -0,0 +1,186 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+#include "transockproxy.h"
+#include <time.h>
+
+/* Hierarchical timer wheel, same layout as the classic Linux one:
+ * 256 slots of one tick, then three levels of 64 slots each covering
+ * 64 times the previous level. Adding, removing and expiring are O(1);
+ * timers in the upper levels get cascaded down as the wheel turns. */
+#define TVR_BITS 8
+#define TVN_BITS 6
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_MASK (TVR_SIZE - 1)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVN_LEVELS 3
+#define TVMAX ((1UL << (TVR_BITS + TVN_LEVELS*TVN_BITS)) - 1)
+
+struct TimerWheel {
+	pthread_mutex_t lock;
+	unsigned long now;
+	struct Timer* tv1[TVR_SIZE];
+	struct Timer* tvn[TVN_LEVELS][TVN_SIZE];
+};
+
+static struct TimerWheel wheels[TIMERSHARDS];
+static unsigned long timerbase;
+static unsigned int nextshard = 0;
+
+unsigned long mstime() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+static void wheellink(struct Timer** slot, struct Timer* t) {
+	t->next = *slot;
+	if (t->next) t->next->pprev = &t->next;
+	t->pprev = slot;
+	*slot = t;
+}
+
+static void wheelunlink(struct Timer* t) {
+	*t->pprev = t->next;
+	if (t->next) t->next->pprev = t->pprev;
+	t->next = NULL;
+	t->pprev = NULL;
+}
+
+static void wheeladd(struct TimerWheel* w, struct Timer* t) {
+	unsigned long expires = t->expires;
+	unsigned long idx = expires - w->now;
+	int level;
+
+	if ((long)idx < 0) {
+		/* Already due, run it on the next tick. */
+		wheellink(&w->tv1[w->now & TVR_MASK], t);
+		return;
+	}
+	if (idx < TVR_SIZE) {
+		wheellink(&w->tv1[expires & TVR_MASK], t);
+		return;
+	}
+	if (idx > TVMAX) {
+		expires = w->now + TVMAX;
+		t->expires = expires;
+		idx = TVMAX;
+	}
+	for (level = 0; level < TVN_LEVELS-1; level++) {
+		if (idx < 1UL << (TVR_BITS + (level+1)*TVN_BITS)) break;
+	}
+	wheellink(&w->tvn[level][(expires >> (TVR_BITS + level*TVN_BITS)) & TVN_MASK], t);
+}
+
+static int cascade(struct TimerWheel* w, int level) {
+	int index = (w->now >> (TVR_BITS + level*TVN_BITS)) & TVN_MASK;
+	struct Timer* t = w->tvn[level][index];
+	struct Timer* next;
+
+	w->tvn[level][index] = NULL;
+	for (; t; t = next) {
+		next = t->next;
+		wheeladd(w, t);
+	}
+	return index;
+}
+
+static void wheeltick(struct TimerWheel* w) {
+	int index = w->now & TVR_MASK;
+	int level;
+	struct Timer* list = NULL;
+	struct Timer* t;
+	int ms;
+
+	if (!index) {
+		for (level = 0; level < TVN_LEVELS; level++) {
+			if (cascade(w, level)) break;
+		}
+	}
+
+	/* Move the due list aside and advance first, so anything re-armed
+	 * from a callback lands in a later slot instead of this one. */
+	if (w->tv1[index]) {
+		list = w->tv1[index];
+		list->pprev = &list;
+		w->tv1[index] = NULL;
+	}
+	w->now++;
+	while ((t = list)) {
+		wheelunlink(t);
+		ms = t->func(t);
+		if (ms > 0) {
+			t->expires = w->now + (ms + TIMERTICK - 1) / TIMERTICK;
+			wheeladd(w, t);
+		}
+	}
+}
+
+static void* timerthread(void* arg) {
+	struct TimerWheel* w = (struct TimerWheel*)arg;
+	struct timespec ts;
+	unsigned long target;
+
+	while (1) {
+		target = timerbase + (w->now + 1) * TIMERTICK;
+		ts.tv_sec = target / 1000;
+		ts.tv_nsec = (target % 1000) * 1000000;
+		clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+
+		pthread_mutex_lock(&w->lock);
+		target = (mstime() - timerbase) / TIMERTICK;
+		while (w->now < target) wheeltick(w);
+		pthread_mutex_unlock(&w->lock);
+	}
+	return NULL;
+}
+
+void timerinit() {
+	pthread_t tid;
+	int x;
+
+	timerbase = mstime();
+	for (x = 0; x < TIMERSHARDS; x++) {
+		pthread_mutex_init(&wheels[x].lock, NULL);
+		pthread_create(&tid, NULL, timerthread, &wheels[x]);
+		pthread_detach(tid);
+	}
+}
+
+void timerset(struct Timer* t, int ms) {
+	struct TimerWheel* w;
+
+	if (t->shard < 0) {
+		t->shard = __atomic_fetch_add(&nextshard, 1, __ATOMIC_RELAXED) % TIMERSHARDS;
+	}
+	w = &wheels[t->shard];
+
+	pthread_mutex_lock(&w->lock);
+	if (t->pprev) wheelunlink(t);
+	if (ms > 0) {
+		t->expires = w->now + (ms + TIMERTICK - 1) / TIMERTICK;
+		wheeladd(w, t);
+	}
+	pthread_mutex_unlock(&w->lock);
+}
+
+void timerdel(struct Timer* t) {
+	if (t->shard < 0) return;
+	timerset(t, 0);
+}
+
+
+
+/* EOF */
@@ -12,13 +12,25 @@
     along with this program.  If not, see <http://www.gnu.org/licenses/>.
     */
 
+#define _GNU_SOURCE
 #include "transockproxy.h"
+#include <sched.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
 
 volatile sig_atomic_t exitflag = 0;
-volatile sig_atomic_t running = 0;
-struct Mapping defmap;
-struct Mapping** mappings;
-int mappingcount;
+volatile sig_atomic_t reloadflag = 0;
+volatile sig_atomic_t upgradeflag = 0;
+volatile sig_atomic_t dumpflag = 0;
+struct Routes* routes;
+unsigned long lastreloadus;
+static int routesepoch = 0;
+static int routesreaders[2] = { 0, 0 };	/* Threads in routesget(), by epoch */
+int timeouts[PHASES] = { 30, 30, 30, 30, 30, 300 };
+const char* phasenames[PHASES] = { "header", "resolve", "connect", "socks", "tls", "relay" };
+const char* protonames[] = { "invalid", "direct", "socks4", "socks4a", "socks5", "pool", "block", "reject" };
 
 static const unsigned char socks4a[] = {
 	0x04, 0x01,
@@ -35,60 +47,94 @@ static const unsigned char socks5b[] = {
 	0x00, 0x03
 	};
 
+/* The micro-benchmarks link this file in and bring their own main(). */
+#ifndef NOMAIN
 int main(int argc, char* argv[]) {
 	int rc;
 	struct sockaddr_in laddr;
 	struct sockaddr_in ssladdr;
-	struct sockaddr_in caddr;
-	unsigned int caddrsize;
-	int lsock = 0, csock, sslsock = 0;
-	pthread_t tid;
+	struct sockaddr_in udpaddr;
+	int lsock = 0, sslsock = 0, udpsock = 0;
+	int extra[2 * MAXWORKERS];
+	int nextra;
+	int n;
 	pthread_attr_t tattr;
 	fd_set fds;
 	fd_set rfds;
+	struct sigaction sa;
+	struct Routes* r;
+	int statssock = -1;
+	int upgradefd = -1;
+	int inherited;
 	
+	upgradeinit(argv);
+
 	#ifdef GNUTLS
 	gnutlsinit();
 	#endif
 
-	readconfig(&laddr, &ssladdr);
+	r = readconfig(&laddr, &ssladdr, &udpaddr, 1);
+	if (!r) return 1;
+	routesswap(r);
 	
 	#ifdef GNUTLS
 	gnutlspostinit();
 	#endif
 	
+	inherited = upgradeinherit(&lsock, &sslsock, &statssock, &udpsock, extra, &nextra);
+	loginit();
+	statssock = statsinit(statssock);
+	if (cachedir && cacheinit()) return 1;
+	
 	siginterrupt(SIGINT, 1);
 	siginterrupt(SIGTERM, 1);
 	signal(SIGINT, sighandle);
 	signal(SIGTERM, sighandle);
+	/* A peer that went away is reported by write(), not by killing us. */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* No SA_RESTART, so a SIGHUP breaks the accept loop out of select(). */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandle;
+	sigaction(SIGHUP, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+	sigaction(SIGUSR1, &sa, NULL);
 	
-	if (laddr.sin_port) {
+	if (laddr.sin_port && !inherited) {
 		lsock = socket(AF_INET, SOCK_STREAM, 0);
 		if (!lsock) { perror("Could not open listen socket"); return 2; }
 	
 		rc = 1;
 		setsockopt(lsock, SOL_SOCKET, SO_REUSEADDR, &rc, sizeof(int));
+		/* Each accept worker gets a listener of its own on the same port. */
+		if (workerthreads) setsockopt(lsock, SOL_SOCKET, SO_REUSEPORT, &rc, sizeof(int));
 	
 		rc = bind(lsock, (struct sockaddr*)&laddr, sizeof(laddr));
 		if (rc) { perror("Could not bind to port"); return 2; }
 	
-		listen(lsock, 32);
+		listen(lsock, listenbacklog);
 	}
 	
 	#if defined(GNUTLS) || defined(OPENSSL)
-	if (ssladdr.sin_port) {
+	if (ssladdr.sin_port && !inherited) {
 		sslsock = socket(AF_INET, SOCK_STREAM, 0);
 		if (!sslsock) { perror("Could not open SSL socket"); return 2; }
 	
 		rc = 1;
 		setsockopt(sslsock, SOL_SOCKET, SO_REUSEADDR, &rc, sizeof(int));
+		if (workerthreads) setsockopt(sslsock, SOL_SOCKET, SO_REUSEPORT, &rc, sizeof(int));
 	
 		rc = bind(sslsock, (struct sockaddr*)&ssladdr, sizeof(ssladdr));
 		if (rc) { perror("Could not bind to SSL port"); return 2; }
 	
-		listen(sslsock, 32);
+		listen(sslsock, listenbacklog);
 	}
 	#endif
+
+	if (udpaddr.sin_port) {
+		udpsock = udpinit(&udpaddr, udpsock);
+		if (udpsock < 0) return 2;
+	}
 	
 	pthread_attr_init(&tattr);
 	/*For some reason I'm getting undefined reference on this?
@@ -96,79 +142,492 @@ int main(int argc, char* argv[]) {
 	rc = pthread_attr_setstacksize(&tattr, PTHREAD_STACK_MIN);
 	if (rc) fprintf(stderr, "Could not set thread stacksize, using default.\n");
 	
+	/* During an upgrade two processes accept on these, so whoever loses the race mustn't block. */
+	if (lsock) fcntl(lsock, F_SETFL, fcntl(lsock, F_GETFL) | O_NONBLOCK);
+	if (sslsock) fcntl(sslsock, F_SETFL, fcntl(sslsock, F_GETFL) | O_NONBLOCK);
+	workerinit(lsock, sslsock, &laddr, &ssladdr, extra, nextra);
+	
 	printf("Ready.\n");
 	#ifdef DAEMON
-	daemon(0, 0);
+	/* Keep the working directory, so relative paths still work for reloads and upgrades.
+	 * A process started by an upgrade is already detached. */
+	if (!inherited) daemon(1, 0);
+	#endif
+
+	/* Threads don't survive daemon()'s fork, so only start them now. */
+	logstart();
+	timerinit();
+	registryinit();
+	admitinit();
+	statsstart();
+	poolstart();
+	circuitstart();
+	shapestart();
+	httpstart();
+	if (udpaddr.sin_port) udpstart();
+	#ifdef GNUTLS
+	if (ssladdr.sin_port) fiberstart();
 	#endif
+	workerstart();
+	upgradeready();
 
+	/* With workers, this thread only looks after signals and upgrades. */
 	FD_ZERO(&fds);
-	if (lsock) FD_SET(lsock, &fds);
-	if (sslsock) FD_SET(sslsock, &fds);
+	if (lsock && !workercount()) FD_SET(lsock, &fds);
+	if (sslsock && !workercount()) FD_SET(sslsock, &fds);
 
 	while (exitflag == 0) {
-		caddrsize = sizeof(caddr);
-		
 		rfds = fds;
 		rc = select(FD_SETSIZE, &rfds, NULL, NULL, NULL);
-		if (rc < 0) { log("select() returned %d: %m\n", rc); break; }
-		
-		if (FD_ISSET(lsock, &rfds)) {
-			csock = accept(lsock, (struct sockaddr*)&caddr, &caddrsize);
-			if (csock <= 0) {
-				log("accept() returned %d: %m\n", csock);
-				break;
+		if (reloadflag) {
+			reloadflag = 0;
+			reloadconfig();
+		}
+		if (dumpflag) {
+			dumpflag = 0;
+			connlogdump();
+		}
+		if (upgradeflag) {
+			upgradeflag = 0;
+			if (upgradefd < 0) {
+				nextra = workersockets(extra, 2 * MAXWORKERS);
+				upgradefd = upgradestart(lsock, sslsock, statssock, udpsock, extra, nextra);
 			}
-		
-			log("[%d] New connection from %s:%hu\n", 
-				csock, inet_ntoa(caddr.sin_addr), ntohs(caddr.sin_port));
-		
-			pthread_create(&tid, NULL, connthread, (void*)(long)csock);
-			pthread_detach(tid);
+			if (upgradefd >= 0) FD_SET(upgradefd, &fds);
 		}
-		#ifdef GNUTLS
-		if (FD_ISSET(sslsock, &rfds)) {
-			csock = accept(sslsock, (struct sockaddr*)&caddr, &caddrsize);
-			if (csock <= 0) {
-				log("accept() returned %d: %m\n", csock);
+		if (rc < 0 && errno == EINTR) continue;
+		if (rc < 0) { log("select() returned %d: %m\n", rc); break; }
+
+		/* Keep accepting until the new process says it's ready. */
+		if (upgradefd >= 0 && FD_ISSET(upgradefd, &rfds)) {
+			FD_CLR(upgradefd, &fds);
+			rc = upgradefinish(upgradefd);
+			upgradefd = -1;
+			if (rc) {
+				statsstop();
+				udpstop();
 				break;
 			}
-		
-			log("[%d] New SSL connection from %s:%hu\n", 
-				csock, inet_ntoa(caddr.sin_addr), ntohs(caddr.sin_port));
-		
-			pthread_create(&tid, NULL, gnutlsthread, (void*)(long)csock);
-			pthread_detach(tid);		
 		}
+		
+		if (workercount()) continue;
+		if (lsock && FD_ISSET(lsock, &rfds) && acceptconn(lsock, 0)) break;
+		#ifdef GNUTLS
+		if (sslsock && FD_ISSET(sslsock, &rfds) && acceptconn(sslsock, 1)) break;
 		#endif
 	}
 	
+	workerstop();
 	if (lsock) close(lsock);
 	if (sslsock) close(sslsock);
+	udpstop();
 	
-	log("Waiting for all threads to exit.\n");
-	while (running > 0 && exitflag == 1) {
-		log("Waiting... %d thread%s left.\n", running, running == 1 ? "" : "s");
+	/* Relays keep going after an upgrade (exitflag 0) or a first signal; a second signal cuts them off. */
+	log("Waiting for all connections to close.\n");
+	while ((n = conncount()) > 0 && exitflag <= 1) {
+		log("Waiting... %d connection%s left.\n", n, n == 1 ? "" : "s");
+		if (dumpflag) {
+			dumpflag = 0;
+			connlogdump();
+		}
 		sleep(1);
 	}
 	
+	cacheclear();
+
 	#ifdef GNUTLS
 	gnutls_global_deinit();
 	#endif
 	
 	log("Exiting.\n");
+	logflush();
+	return 0;
+}
+#endif
+
+/* Accepts a connection on sock (the SSL listener if ssl) and starts its
+ * thread. Returns 0, or -1 if accept() failed for good. */
+int acceptconn(int sock, int ssl) {
+	struct sockaddr_in caddr;
+	socklen_t caddrsize = sizeof(caddr);
+	struct Conn* conn;
+	pthread_t tid;
+	socklen_t len = sizeof(int);
+	int csock;
+	int cpu, here;
+	int refusal, counted;
+	int rc;
+
+	csock = accept(sock, (struct sockaddr*)&caddr, &caddrsize);
+	if (csock < 0 && (errno == EAGAIN || errno == EINTR || errno == ECONNABORTED)) return 0;
+	/* Out of fds or memory for now: give relays a moment to finish, then carry on. */
+	if (csock < 0 && (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)) {
+		statadd(STAT_ACCEPTERRORS, 1);
+		log("accept() returned %d: %m\n", csock);
+		usleep(ACCEPTBACKOFF * 1000);
+		return 0;
+	}
+	if (csock <= 0) {
+		log("accept() returned %d: %m\n", csock);
+		return -1;
+	}
+
+	statadd(STAT_ACCEPTS, 1);
+	refusal = admit(sock, csock, &caddr, &counted);
+	if (refusal) {
+		refuse(csock, ssl, &caddr, refusal);
+		return 0;
+	}
+	log("[%d] New %sconnection from %s:%hu\n", 
+		csock, ssl ? "SSL " : "", inet_ntoa(caddr.sin_addr), ntohs(caddr.sin_port));
+
+	/* Where its packets were handled, against where its thread will run. */
+	here = sched_getcpu();
+	if (!getsockopt(csock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) && cpu >= 0 && here >= 0 && cpu != here) {
+		statadd(STAT_OFFCPU, 1);
+		if (cpunode(cpu) != cpunode(here)) statadd(STAT_OFFNODE, 1);
+	}
+
+	conn = connnew(csock, &caddr);
+	conn->admitted = counted;
+	conn->node = workernode(workerid);
+	rc = -1;
+	#ifdef GNUTLS
+	if (ssl) rc = fiberspawn(gnutlsthread, conn);
+	#endif
+	if (!ssl && !(rc = pthread_create(&tid, NULL, conn->routes->httpaware ? httpthread : connthread, conn))) pthread_detach(tid);
+	if (rc) {
+		/* Out of threads: turned away like any other refusal, and its admission given back. */
+		refuse(csock, ssl, &caddr, REFUSE_THREADS);
+		conn->csock = -1;
+		connfree(conn);
+	}
 	return 0;
 }
 
 
-void readconfig(struct sockaddr_in* laddr, struct sockaddr_in* ssladdr) {
+/* Config messages go to the terminal at startup, and to the log on reload. */
+static void configlog(int startup, int level, const char* fmt, ...) {
+	char buffer[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buffer, sizeof(buffer), fmt, ap);
+	va_end(ap);
+	if (startup) fputs(buffer, level == LOG_WARN ? stderr : stdout);
+	else if (loglevel >= level) logmsg(level, "%s", buffer);
+}
+
+/* Parses "direct", "direct://iface", "pool:name" or "proto://host:port" into map.
+ * Pools are looked up in r, so they have to be defined first. Returns 0 on success. */
+static int parsemapping(struct Routes* r, struct Mapping* map, char* spec, const char* what, int startup) {
 	struct hostent* hostinfo;
 	char* proto;
 	char* host;
+	char* tok;
+	int port;
+	int x;
+
+	proto = spec ? strtok(spec, ":\r\n") : NULL;
+	host = strtok(NULL, ":\r\n");
+	tok = strtok(NULL, "\r\n");
+	if (!proto) {
+		configlog(startup, LOG_WARN, "Error loading config: %s nothing.\n", what);
+		return -1;
+	}
+	if (host) host += strspn(host, "/");
+
+	if (!strcmp(proto, "direct")) {
+		map->proto = DIRECT;
+		if (host && host[0]) {
+			strncpy(map->iface, host, sizeof(map->iface)-1);
+			configlog(startup, LOG_INFO, "%s direct via %s\n", what, map->iface);
+		} else {
+			map->iface[0] = 0;
+			configlog(startup, LOG_INFO, "%s direct\n", what);
+		}
+		return 0;
+	} else if (!strcmp(proto, "pool")) {
+		for (x = 0; host && x < r->poolcount; x++) {
+			if (!strcmp(r->pools[x]->name, host)) break;
+		}
+		if (!host || x == r->poolcount) {
+			configlog(startup, LOG_WARN, "Error loading config: %s unknown pool '%s'.\n", what, host ? host : "");
+			return -1;
+		}
+		map->proto = POOL;
+		map->pool = r->pools[x];
+		configlog(startup, LOG_INFO, "%s pool %s\n", what, host);
+		return 0;
+	} else if (!strcmp(proto, "block")) {
+		map->proto = BLOCK;
+		map->status = host && host[0] ? atoi(host) : 403;
+		if (map->status != 403 && map->status != 204) {
+			configlog(startup, LOG_WARN, "Error loading config: %s block with status %s (must be 403 or 204).\n", what, host);
+			return -1;
+		}
+		configlog(startup, LOG_INFO, "%s block (%d)\n", what, map->status);
+		return 0;
+	} else if (!strcmp(proto, "reject")) {
+		map->proto = REJECT;
+		configlog(startup, LOG_INFO, "%s reject\n", what);
+		return 0;
+	} else if (!strcmp(proto, "socks4")) {
+		map->proto = SOCKS4;
+	} else if (!strcmp(proto, "socks4a")) {
+		map->proto = SOCKS4A;
+	} else if (!strcmp(proto, "socks5")) {
+		map->proto = SOCKS5;
+	} else {
+		configlog(startup, LOG_WARN, "Unrecognized protocol '%s' (must be direct, pool, socks4, socks4a, socks5, block, or reject)\n", proto);
+		return -1;
+	}
+
+	port = tok ? atoi(tok) : 0;
+	if (!host || !host[0] || port <= 0 || port > 65535) {
+		configlog(startup, LOG_WARN, "Error loading config: %s %s needs a host and port.\n", what, proto);
+		return -1;
+	}
+	hostinfo = gethostbyname(host);
+	if (!hostinfo) {
+		configlog(startup, LOG_WARN, "Unknown host %s\n", host);
+		return -1;
+	}
+
+	map->proxy.sin_family = AF_INET;
+	map->proxy.sin_addr = *(struct in_addr*)hostinfo->h_addr;
+	map->proxy.sin_port = htons(port);
+
+	configlog(startup, LOG_INFO, "%s %s://%s:%d\n", what, proto, host, port);
+	return 0;
+}
+
+/* Parses a byte count with an optional k, m or g suffix. Returns -1 if it isn't one. */
+static long parsebytes(const char* tok) {
+	char* end;
+	long n;
+
+	if (!tok) return -1;
+	n = strtol(tok, &end, 10);
+	if (end == tok || n < 0) return -1;
+	switch (*end) {
+	case 'k': case 'K': n <<= 10; end++; break;
+	case 'm': case 'M': n <<= 20; end++; break;
+	case 'g': case 'G': n <<= 30; end++; break;
+	}
+	return *end ? -1 : n;
+}
+
+/* Parses "<pattern|default|client> rate [burst]" into a rate limit in r. Returns 0 on success. */
+static int parseratelimit(struct Routes* r, char* line, int startup) {
+	struct Mapping* map = NULL;
+	char* save;
+	char* what;
+	long rate, burst;
+	int x;
+
+	what = line ? strtok_r(line, " \t", &save) : NULL;
+	rate = parsebytes(what ? strtok_r(NULL, " \t", &save) : NULL);
+	burst = what ? parsebytes(strtok_r(NULL, " \t", &save)) : -1;
+	if (!what || rate <= 0) {
+		configlog(startup, LOG_WARN, "Error loading config: 'ratelimit' needs a pattern, default or client, and a rate.\n");
+		return -1;
+	}
+	/* A quarter of the burst is held back for interactive connections, which needs room for a few buffers. */
+	if (burst <= 0) burst = rate / 4;
+	if (burst < 8 * BUFFERSIZE) burst = 8 * BUFFERSIZE;
+
+	if (!strcmp(what, "client")) {
+		r->clientrate = rate;
+		r->clientburst = burst;
+		configlog(startup, LOG_INFO, "Clients limited to %ld bytes/s, bursts of %ld.\n", rate, burst);
+		return 0;
+	}
+	if (!strcmp(what, "default")) map = &r->defmap;
+	for (x = 0; !map && x < r->mappingcount; x++) {
+		if (!strcmp(r->mappings[x]->pattern, what)) map = r->mappings[x];
+	}
+	if (!map) {
+		configlog(startup, LOG_WARN, "Error loading config: 'ratelimit' for %s, which no earlier map line has.\n", what);
+		return -1;
+	}
+	if (!map->bucket) map->bucket = (struct Bucket*)malloc(sizeof(struct Bucket));
+	bucketinit(map->bucket, rate, burst);
+	configlog(startup, LOG_INFO, "Mapping %s limited to %ld bytes/s, bursts of %ld.\n", what, rate, burst);
+	return 0;
+}
+
+/* Parses "name [roundrobin|leastconn|ewma] proto://host:port..." into a new pool in r. Returns 0 on success. */
+static int parsepool(struct Routes* r, char* line, int startup) {
+	struct Pool* p;
+	struct Mapping map;
+	char what[256];
+	char* save;
+	char* tok;
+	int x;
+
+	tok = line ? strtok_r(line, " \t\r\n", &save) : NULL;
+	if (!tok) {
+		configlog(startup, LOG_WARN, "Error loading config: 'pool' line without a name.\n");
+		return -1;
+	}
+	for (x = 0; x < r->poolcount; x++) {
+		if (!strcmp(r->pools[x]->name, tok)) {
+			configlog(startup, LOG_WARN, "Error loading config: pool %s defined twice.\n", tok);
+			return -1;
+		}
+	}
+	p = (struct Pool*)calloc(1, sizeof(struct Pool));
+	p->name = strdup(tok);
+	p->balance = BALANCE_EWMA;
+	r->pools = (struct Pool**)realloc(r->pools, (r->poolcount+1) * sizeof(struct Pool*));
+	r->pools[r->poolcount++] = p;
+
+	snprintf(what, sizeof(what), "Pool %s upstream", p->name);
+	while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+		for (x = 0; x <= BALANCE_EWMA; x++) {
+			if (!strcmp(tok, balancenames[x])) break;
+		}
+		if (x <= BALANCE_EWMA) {
+			p->balance = x;
+			continue;
+		}
+
+		memset(&map, 0, sizeof(map));
+		if (parsemapping(r, &map, tok, what, startup)) return -1;
+		if (map.proto != SOCKS4 && map.proto != SOCKS4A && map.proto != SOCKS5) {
+			configlog(startup, LOG_WARN, "Error loading config: pool %s can only hold SOCKS proxies.\n", p->name);
+			return -1;
+		}
+		p->upstreams = (struct Upstream*)realloc(p->upstreams, (p->count+1) * sizeof(struct Upstream));
+		memset(&p->upstreams[p->count], 0, sizeof(struct Upstream));
+		p->upstreams[p->count].proto = map.proto;
+		p->upstreams[p->count].addr = map.proxy;
+		p->upstreams[p->count].healthy = 1;
+		snprintf(p->upstreams[p->count].name, sizeof(p->upstreams[p->count].name), "%s:%hu",
+			inet_ntoa(map.proxy.sin_addr), ntohs(map.proxy.sin_port));
+		p->count++;
+	}
+	if (!p->count) {
+		configlog(startup, LOG_WARN, "Error loading config: pool %s has no upstreams.\n", p->name);
+		return -1;
+	}
+	configlog(startup, LOG_INFO, "Pool %s balances %d upstream%s by %s.\n",
+		p->name, p->count, p->count == 1 ? "" : "s", balancenames[p->balance]);
+	return 0;
+}
+
+/* Parses "name key=value..." into a new socket profile in r. Returns 0 on success. */
+static int parsesockprofile(struct Routes* r, char* line, int startup) {
+	struct SockProfile* p;
+	char* save;
+	char* tok;
+	char* val;
+	long n;
+	int sock;
+	int x;
+
+	tok = line ? strtok_r(line, " \t\r\n", &save) : NULL;
+	if (!tok) {
+		configlog(startup, LOG_WARN, "Error loading config: 'sockprofile' line without a name.\n");
+		return -1;
+	}
+	for (x = 0; x < r->profilecount; x++) {
+		if (!strcmp(r->profiles[x]->name, tok)) {
+			configlog(startup, LOG_WARN, "Error loading config: sockprofile %s defined twice.\n", tok);
+			return -1;
+		}
+	}
+	p = (struct SockProfile*)calloc(1, sizeof(struct SockProfile));
+	p->name = strdup(tok);
+	p->rcvbuf = p->sndbuf = p->nodelay = p->notsentlowat = -1;
+	p->keepidle = p->keepintvl = p->keepcnt = p->usertimeout = -1;
+	r->profiles = (struct SockProfile**)realloc(r->profiles, (r->profilecount+1) * sizeof(struct SockProfile*));
+	r->profiles[r->profilecount++] = p;
+
+	while ((tok = strtok_r(NULL, " \t\r\n", &save))) {
+		val = strchr(tok, '=');
+		if (val) *val++ = 0;
+		else val = "";
+		n = 0;
+		if (!strcmp(tok, "rcvbuf")) n = p->rcvbuf = parsebytes(val);
+		else if (!strcmp(tok, "sndbuf")) n = p->sndbuf = parsebytes(val);
+		else if (!strcmp(tok, "notsentlowat")) n = p->notsentlowat = parsebytes(val);
+		else if (!strcmp(tok, "usertimeout")) n = p->usertimeout = parsebytes(val);
+		else if (!strcmp(tok, "nodelay")) {
+			p->nodelay = !strcmp(val, "on");
+			if (!p->nodelay && strcmp(val, "off")) n = -1;
+		} else if (!strcmp(tok, "keepalive")) {
+			/* off, or idle[,interval[,count]] in seconds */
+			if (!strcmp(val, "off")) p->keepidle = 0;
+			else if (sscanf(val, "%d,%d,%d", &p->keepidle, &p->keepintvl, &p->keepcnt) < 1 || p->keepidle <= 0) n = -1;
+		} else if (!strcmp(tok, "congestion") && *val && strlen(val) < sizeof(p->congestion)) {
+			strcpy(p->congestion, val);
+		} else n = -1;
+		if (n < 0) {
+			configlog(startup, LOG_WARN, "Error loading config: sockprofile %s has a bad setting '%s%s%s'.\n",
+				p->name, tok, *val ? "=" : "", val);
+			return -1;
+		}
+	}
+
+	/* The congestion control module may not be loaded, or allowed; better the default than no connections. */
+	#ifdef TCP_CONGESTION
+	sock = p->congestion[0] ? socket(AF_INET, SOCK_STREAM, 0) : -1;
+	if (sock >= 0) {
+		if (setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, p->congestion, strlen(p->congestion))) {
+			configlog(startup, LOG_WARN, "sockprofile %s: congestion control %s is not available (%s), using the default.\n",
+				p->name, p->congestion, strerror(errno));
+			p->congestion[0] = 0;
+		}
+		close(sock);
+	}
+	#else
+	(void)sock;
+	p->congestion[0] = 0;
+	#endif
+	configlog(startup, LOG_INFO, "Socket profile %s loaded.\n", p->name);
+	return 0;
+}
+
+/* Takes a trailing "profile=name" off a map or default line, and points map at
+ * that profile in r, which has to be defined first. Returns 0 on success. */
+static int parseprofileref(struct Routes* r, struct Mapping* map, char* spec, int startup) {
+	char* ref = spec ? strstr(spec, " profile=") : NULL;
+	int x;
+
+	if (!ref) return 0;
+	*ref = 0;
+	ref += strlen(" profile=");
+	ref[strcspn(ref, " \t\r\n")] = 0;
+	for (x = 0; x < r->profilecount; x++) {
+		if (!strcmp(r->profiles[x]->name, ref)) {
+			map->profile = r->profiles[x];
+			return 0;
+		}
+	}
+	configlog(startup, LOG_WARN, "Error loading config: unknown sockprofile '%s'.\n", ref);
+	return -1;
+}
+
+/* Reads the config file into a new routing table. Listener, certificate,
+ * stats, cache and log file settings only take effect at startup; a reload picks up
+ * the mappings, default, timeouts and log level. Returns NULL if the config
+ * is invalid, in which case nothing has been changed. */
+struct Routes* readconfig(struct sockaddr_in* laddr, struct sockaddr_in* ssladdr, struct sockaddr_in* udpaddr, int startup) {
+	struct Routes* r = (struct Routes*)calloc(1, sizeof(struct Routes));
+	char what[256];
+	int newtimeouts[PHASES];
+	int newloglevel = loglevel;
+	int newcircuitfails = CIRCUITFAILS;
+	int newmaxconns = 0, newmaxperclient = 0;
+	int newshedqueue = 0, newsheddelay = 0;
 	int port;
 	char* line = NULL;
 	size_t linelen = 0;
 	char* tok;
 	struct Mapping* map;
+	int x;
 	
 	laddr->sin_family = AF_INET;
 	laddr->sin_addr.s_addr = htonl(INADDR_ANY);
@@ -178,98 +637,174 @@ void readconfig(struct sockaddr_in* laddr, struct sockaddr_in* ssladdr) {
 	ssladdr->sin_addr.s_addr = htonl(INADDR_ANY);
 	ssladdr->sin_port = 0;
 
-	defmap.proto = INVALID;
+	udpaddr->sin_family = AF_INET;
+	udpaddr->sin_addr.s_addr = htonl(INADDR_ANY);
+	udpaddr->sin_port = 0;
+
+	r->defmap.proto = INVALID;
+	r->healthcheck = 5;
+	r->refs = 1;
+	memcpy(newtimeouts, timeouts, sizeof(timeouts));
 	
 	FILE* fp = fopen("transockproxy.conf", "r");
-	if (!fp) { fprintf(stderr, "Error opening transockproxy.conf: %m\n"); exit(1); }	
+	if (!fp) {
+		configlog(startup, LOG_WARN, "Error opening transockproxy.conf: %m\n");
+		routesput(r);
+		return NULL;
+	}
 
 	while (getline(&line, &linelen, fp) > 0) {
 		if (line[0] == '#' || line[0] == '\r' || line[0] == '\n') continue;
-		tok = strtok(line, " ");
+		tok = strtok(line, " \r\n");
+		if (!tok) continue;
 		
 		if (!strcmp(tok, "listen")) {
 			tok = strtok(NULL, "\r\n");
-			port = atoi(tok);
+			port = tok ? atoi(tok) : 0;
 			laddr->sin_port = htons(port);
-			printf("Listening on port %d.\n", port);
+			if (startup) printf("Listening on port %d.\n", port);
 		} else if (!strcmp(tok, "default")) {
-			proto = strtok(NULL, ":\r\n");
-			host = strtok(NULL, ":\r\n")+2;
 			tok = strtok(NULL, "\r\n");
-			port = tok ? atoi(tok) : 0;
-			
-			if (!strcmp(proto, "direct")) {
-				defmap.proto = DIRECT;
-				if (host != (char*)2) {
-					strcpy(defmap.iface, host);
-					printf("Default server: direct via %s\n", host);
-				} else {
-					defmap.iface[0] = 0;
-					printf("Default server: direct\n");
-				}
-				continue;
-			} else if (!strcmp(proto, "socks4")) {
-				defmap.proto = SOCKS4;
-			} else if (!strcmp(proto, "socks4a")) {
-				defmap.proto = SOCKS4A;
-			} else if (!strcmp(proto, "socks5")) {
-				defmap.proto = SOCKS5;
-			} else {
-				fprintf(stderr, "Unrecognized protocol '%s' (must be direct, socks4, socks4a, or socks5)\n", proto);
-				exit(1);
+			if (parseprofileref(r, &r->defmap, tok, startup)) goto fail;
+			if (parsemapping(r, &r->defmap, tok, "Default server:", startup)) goto fail;
+		} else if (!strcmp(tok, "map")) {
+			tok = strtok(NULL, " \r\n");
+			if (!tok) {
+				configlog(startup, LOG_WARN, "Error loading config: 'map' line without a pattern.\n");
+				goto fail;
 			}
-			
-			hostinfo = gethostbyname(host);
-			if (!hostinfo) { fprintf(stderr, "Unknown host %s\n", host); exit(1); }
+			map = (struct Mapping*)calloc(1, sizeof(struct Mapping));
+			map->pattern = strdup(tok);
+			r->mappings = (struct Mapping**)realloc(r->mappings, (r->mappingcount+1) * sizeof(struct Mapping*));
+			r->mappings[r->mappingcount++] = map;
 
-			defmap.proxy.sin_family = AF_INET;
-			defmap.proxy.sin_addr = *(struct in_addr*)hostinfo->h_addr;
-			defmap.proxy.sin_port = htons(port);
-
-			printf("Default server: %s://%s:%hu\n", proto, host, port);
-		} else if (!strcmp(tok, "map")) {
-			map = (struct Mapping*)malloc(sizeof(struct Mapping));
-			map->pattern = strdup(strtok(NULL, " "));
-			
-			proto = strtok(NULL, ":\r\n");
-			host = strtok(NULL, ":\r\n")+2;
-
-			if (!strcmp(proto, "direct")) {
-				map->proto = DIRECT;
-				if (host != (char*)2) {
-					strcpy(map->iface, host);
-					printf("Mapping pattern %s to direct via %s\n", map->pattern, map->iface);
-				} else {
-					map->iface[0] = 0;
-					printf("Mapping pattern %s to direct\n", map->pattern);
+			snprintf(what, sizeof(what), "Mapping pattern %s to", map->pattern);
+			tok = strtok(NULL, "\r\n");
+			if (parseprofileref(r, map, tok, startup)) goto fail;
+			if (parsemapping(r, map, tok, what, startup)) goto fail;
+		} else if (!strcmp(tok, "pool")) {
+			if (parsepool(r, strtok(NULL, "\r\n"), startup)) goto fail;
+		} else if (!strcmp(tok, "sockprofile")) {
+			if (parsesockprofile(r, strtok(NULL, "\r\n"), startup)) goto fail;
+		} else if (!strcmp(tok, "healthcheck")) {
+			tok = strtok(NULL, "\r\n");
+			r->healthcheck = tok ? atoi(tok) : 0;
+			configlog(startup, LOG_INFO, "Health checks every %d seconds.\n", r->healthcheck);
+		} else if (!strcmp(tok, "httpmode")) {
+			tok = strtok(NULL, " \r\n");
+			if (!tok || (strcmp(tok, "aware") && strcmp(tok, "stream"))) {
+				configlog(startup, LOG_WARN, "Unrecognized httpmode '%s' (must be stream or aware)\n", tok ? tok : "");
+				goto fail;
+			}
+			r->httpaware = !strcmp(tok, "aware");
+			configlog(startup, LOG_INFO, "HTTP mode %s.\n", tok);
+		} else if (!strcmp(tok, "http2")) {
+			tok = strtok(NULL, " \r\n");
+			if (!tok || (strcmp(tok, "on") && strcmp(tok, "off"))) {
+				configlog(startup, LOG_WARN, "Unrecognized http2 setting '%s' (must be on or off)\n", tok ? tok : "");
+				goto fail;
+			}
+			r->http2 = !strcmp(tok, "on");
+			configlog(startup, LOG_INFO, "HTTP/2 %s.\n", tok);
+		} else if (!strcmp(tok, "ratelimit")) {
+			if (parseratelimit(r, strtok(NULL, "\r\n"), startup)) goto fail;
+		} else if (!strcmp(tok, "circuit")) {
+			tok = strtok(NULL, "\r\n");
+			newcircuitfails = tok ? atoi(tok) : 0;
+			configlog(startup, LOG_INFO, "Circuit breaker %s.\n", newcircuitfails > 0 ? "on" : "off");
+		} else if (!strcmp(tok, "maxconns")) {
+			tok = strtok(NULL, "\r\n");
+			newmaxconns = tok ? atoi(tok) : 0;
+			if (newmaxconns > 0) configlog(startup, LOG_INFO, "At most %d connections at once.\n", newmaxconns);
+		} else if (!strcmp(tok, "maxperclient")) {
+			tok = strtok(NULL, "\r\n");
+			newmaxperclient = tok ? atoi(tok) : 0;
+			if (newmaxperclient > 0) configlog(startup, LOG_INFO, "At most %d connections at once per client.\n", newmaxperclient);
+		} else if (!strcmp(tok, "shed")) {
+			/* queue=n and/or delay=ms, or off */
+			while ((tok = strtok(NULL, " \t\r\n"))) {
+				if (!strncmp(tok, "queue=", 6)) newshedqueue = atoi(tok + 6);
+				else if (!strncmp(tok, "delay=", 6)) newsheddelay = atoi(tok + 6);
+				else if (!strcmp(tok, "off")) newshedqueue = newsheddelay = 0;
+				else {
+					configlog(startup, LOG_WARN, "Error loading config: unrecognized shed setting '%s' (must be queue=n or delay=ms)\n", tok);
+					goto fail;
 				}
-				continue;
-			} else if (!strcmp(proto, "socks4")) {
-				map->proto = SOCKS4;
-			} else if (!strcmp(proto, "socks4a")) {
-				map->proto = SOCKS4A;
-			} else if (!strcmp(proto, "socks5")) {
-				map->proto = SOCKS5;
-			} else {
-				fprintf(stderr, "Unrecognized protocol '%s' (must be direct, socks4, socks4a, or socks5)\n", proto);
-				exit(1);
 			}
-
-			hostinfo = gethostbyname(host);
-			if (!hostinfo) { fprintf(stderr, "Unknown host %s\n", host); exit(1); }
-			
+			configlog(startup, LOG_INFO, "Shedding new connections past %d queued or %d ms waiting.\n", newshedqueue, newsheddelay);
+		} else if (!strcmp(tok, "loglevel")) {
 			tok = strtok(NULL, "\r\n");
-			port = atoi(tok);
-			
-			map->proxy.sin_family = AF_INET;
-			map->proxy.sin_addr = *(struct in_addr*)hostinfo->h_addr;
-			map->proxy.sin_port = htons(port);
-			
-			mappings = (struct Mapping**)realloc(mappings, (mappingcount+1) * sizeof(struct Mapping*));
-			mappings[mappingcount] = map;
-			mappingcount++;
-
-			printf("Mapping pattern %s to %s://%s:%hu\n", map->pattern, proto, host, port);
+			newloglevel = tok ? loglevelbyname(tok) : -1;
+			if (newloglevel < 0) {
+				configlog(startup, LOG_WARN, "Unrecognized log level '%s' (must be none, warn, or info)\n", tok ? tok : "");
+				goto fail;
+			}
+		} else if (!strcmp(tok, "timeout")) {
+			tok = strtok(NULL, " \r\n");
+			if (tok && !strcmp(tok, "idle")) tok = "relay";
+			for (x = 0; tok && x < PHASES; x++) {
+				if (!strcmp(tok, phasenames[x])) break;
+			}
+			if (!tok || x == PHASES) {
+				configlog(startup, LOG_WARN, "Unrecognized timeout '%s' (must be header, resolve, connect, socks, tls, or idle)\n", tok ? tok : "");
+				goto fail;
+			}
+			tok = strtok(NULL, "\r\n");
+			newtimeouts[x] = tok ? atoi(tok) : 0;
+			configlog(startup, LOG_INFO, "Timeout for %s set to %d seconds.\n", phasenames[x], newtimeouts[x]);
+		} else if (!startup) {
+			/* The rest needs a restart to change. */
+			continue;
+		} else if (!strcmp(tok, "stats")) {
+			tok = strtok(NULL, " \r\n");
+			if (!tok) {
+				fprintf(stderr, "Error loading config: 'stats' line without an address.\n");
+				goto fail;
+			}
+			statsaddr = strdup(tok);
+			tok = strtok(NULL, " \r\n");
+			statscontrol = tok && !strcmp(tok, "control");
+		} else if (!strcmp(tok, "accesslog")) {
+			tok = strtok(NULL, "\r\n");
+			accesslog = strdup(tok);
+		} else if (!strcmp(tok, "capture")) {
+			tok = strtok(NULL, " \r\n");
+			if (!tok) {
+				fprintf(stderr, "Error loading config: 'capture' line without a file.\n");
+				goto fail;
+			}
+			capturefile = strdup(tok);
+			tok = strtok(NULL, " \r\n");
+			capturepayload = tok && !strcmp(tok, "payload");
+			printf("Capturing traffic to %s%s.\n", capturefile, capturepayload ? ", with request heads" : "");
+		} else if (!strcmp(tok, "cache")) {
+			tok = strtok(NULL, " \r\n");
+			if (!tok) {
+				fprintf(stderr, "Error loading config: 'cache' line without a directory.\n");
+				goto fail;
+			}
+			cachedir = strdup(tok);
+			tok = strtok(NULL, "\r\n");
+			cachesize = (unsigned long)(tok ? atoi(tok) : CACHESIZE) << 20;
+		} else if (!strcmp(tok, "udp")) {
+			tok = strtok(NULL, " \r\n");
+			port = tok ? atoi(tok) : 0;
+			udpaddr->sin_port = htons(port);
+			tok = strtok(NULL, " \r\n");
+			if (tok) udpdest = strdup(tok);
+			printf("Listening on UDP port %d%s%s.\n", port, udpdest ? ", forwarding to " : "", udpdest ? udpdest : "");
+		} else if (!strcmp(tok, "workers")) {
+			tok = strtok(NULL, " \r\n");
+			workerthreads = !tok || !strcmp(tok, "auto") ? -1 : atoi(tok);
+		} else if (!strcmp(tok, "cpus")) {
+			tok = strtok(NULL, "\r\n");
+			if (tok) workercpus = strdup(tok);
+		} else if (!strcmp(tok, "errorlog")) {
+			tok = strtok(NULL, "\r\n");
+			errorlog = strdup(tok);
+		} else if (!strcmp(tok, "backlog")) {
+			tok = strtok(NULL, " \r\n");
+			listenbacklog = tok && atoi(tok) > 0 ? atoi(tok) : LISTENBACKLOG;
 		}
 		#if defined(GNUTLS) || defined(OPENSSL)
 		else if (!strcmp(tok, "ssl")) {
@@ -283,17 +818,32 @@ void readconfig(struct sockaddr_in* laddr, struct sockaddr_in* ssladdr) {
 		} else if (!strcmp(tok, "sslkey")) {
 			tok = strtok(NULL, "\r\n");
 			keyfile = strdup(tok);
+		} else if (!strcmp(tok, "ssltrust")) {
+			tok = strtok(NULL, "\r\n");
+			ssltrust = strdup(tok);
+		} else if (!strcmp(tok, "sslverify")) {
+			tok = strtok(NULL, " \r\n");
+			sslverify = !tok || strcmp(tok, "off");
+		} else if (!strcmp(tok, "sslverifycache")) {
+			tok = strtok(NULL, " \r\n");
+			verifycachesize = tok ? atoi(tok) : VERIFYCACHE;
+		} else if (!strcmp(tok, "tlsworkers")) {
+			tok = strtok(NULL, " \r\n");
+			fiberworkers = tok ? atoi(tok) : -1;
+			if (fiberworkers) printf("TLS connections run on fibers over %d worker threads.\n", fiberworkers > 0 ? fiberworkers : (int)sysconf(_SC_NPROCESSORS_ONLN));
+			else printf("TLS connections run on a thread each.\n");
 		}
 		#endif
 	}
 	
 	fclose(fp);
+	fp = NULL;
 	
 	#ifdef GNUTLS
-	if (ssladdr->sin_port) {
+	if (startup && ssladdr->sin_port) {
 		if (certfile == NULL || keyfile == NULL) {
 			fprintf(stderr, "Error loading config: SSL requested but missing sslcert and/or sslkey entries.\n");
-			exit(1);
+			goto fail;
 		}
 		/*if (gnutls_certificate_set_x509_key_file(cred, certfile, keyfile, GNUTLS_X509_FMT_PEM) < 0) {
 			fprintf(stderr, "Error loading SSL cert or key file.\n");
@@ -302,36 +852,365 @@ void readconfig(struct sockaddr_in* laddr, struct sockaddr_in* ssladdr) {
 	}
 	#endif
 	
-	if (laddr->sin_port == 0 && ssladdr->sin_port == 0) {
-		fprintf(stderr, "Error loading config: Not listening on any ports. Needs a 'listen' and/or 'ssl' line.\n");
-		exit(1);
+	if (startup && laddr->sin_port == 0 && ssladdr->sin_port == 0 && udpaddr->sin_port == 0) {
+		fprintf(stderr, "Error loading config: Not listening on any ports. Needs a 'listen', 'ssl' and/or 'udp' line.\n");
+		goto fail;
 	}
-	if (defmap.proto == INVALID) {
-		fprintf(stderr, "Error loading config: No 'default' line found.\n");
-		exit(1);
+	if (r->defmap.proto == INVALID) {
+		configlog(startup, LOG_WARN, "Error loading config: No 'default' line found.\n");
+		goto fail;
 	}
+
+	free(line);
+	memcpy(timeouts, newtimeouts, sizeof(timeouts));
+	loglevel = newloglevel;
+	circuitfails = newcircuitfails;
+	__atomic_store_n(&maxconns, newmaxconns, __ATOMIC_RELAXED);
+	__atomic_store_n(&maxperclient, newmaxperclient, __ATOMIC_RELAXED);
+	__atomic_store_n(&shedqueue, newshedqueue, __ATOMIC_RELAXED);
+	__atomic_store_n(&sheddelay, newsheddelay, __ATOMIC_RELAXED);
+	return r;
+
+fail:
+	if (fp) fclose(fp);
+	free(line);
+	routesput(r);
+	return NULL;
 }
 
 
-const struct Mapping* findserver(const char* host) {
+/* Takes a reference on the current routing table, for threads other than
+ * the main one. There's no lock: a reader counts itself in the current
+ * epoch for as long as it's between loading the table and taking its
+ * reference, and routesswap() waits for everyone counted in the epoch it
+ * ends before it drops the old table. */
+struct Routes* routesget() {
+	struct Routes* r;
+	int e;
+
+	while (1) {
+		e = __atomic_load_n(&routesepoch, __ATOMIC_SEQ_CST) & 1;
+		__atomic_fetch_add(&routesreaders[e], 1, __ATOMIC_SEQ_CST);
+		/* Counted before the epoch moved on, or routesswap() might not wait for us. */
+		if ((__atomic_load_n(&routesepoch, __ATOMIC_SEQ_CST) & 1) == e) break;
+		__atomic_fetch_sub(&routesreaders[e], 1, __ATOMIC_RELEASE);
+	}
+	r = __atomic_load_n(&routes, __ATOMIC_SEQ_CST);
+	__atomic_fetch_add(&r->refs, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&routesreaders[e], 1, __ATOMIC_RELEASE);
+	return r;
+}
+
+void routesput(struct Routes* r) {
 	int x;
-	for (x = 0; x < mappingcount; x++) {
-		if (!fnmatch(mappings[x]->pattern, host, 0)) {
-			return mappings[x];
+
+	if (__atomic_sub_fetch(&r->refs, 1, __ATOMIC_ACQ_REL)) return;
+	for (x = 0; x < r->mappingcount; x++) {
+		free((char*)r->mappings[x]->pattern);
+		free(r->mappings[x]->bucket);
+		free(r->mappings[x]);
+	}
+	free(r->defmap.bucket);
+	free(r->mappings);
+	for (x = 0; x < r->poolcount; x++) poolfree(r->pools[x]);
+	free(r->pools);
+	for (x = 0; x < r->profilecount; x++) {
+		free(r->profiles[x]->name);
+		free(r->profiles[x]);
+	}
+	free(r->profiles);
+	free(r);
+}
+
+/* Publishes a new routing table. Connections that already hold the old
+ * one keep using it; it is freed when the last of them closes. Main
+ * thread only, so there's never more than one swap going on. */
+void routesswap(struct Routes* r) {
+	struct Routes* old;
+	int e;
+
+	old = routes;
+	r->generation = old ? old->generation + 1 : 1;
+	if (old) poolcarry(r, old);
+	__atomic_store_n(&routes, r, __ATOMIC_SEQ_CST);
+	/* Whoever comes in from here sees r; wait out those who may have loaded old without a reference yet. */
+	e = __atomic_fetch_add(&routesepoch, 1, __ATOMIC_SEQ_CST) & 1;
+	while (__atomic_load_n(&routesreaders[e], __ATOMIC_ACQUIRE)) sched_yield();
+	if (old) routesput(old);
+}
+
+void reloadconfig() {
+	struct sockaddr_in laddr;
+	struct sockaddr_in ssladdr;
+	struct sockaddr_in udpaddr;
+	struct Routes* r;
+	unsigned long start = ustime();
+
+	log("Reloading configuration.\n");
+	r = readconfig(&laddr, &ssladdr, &udpaddr, 0);
+	if (!r) {
+		statadd(STAT_RELOADFAILS, 1);
+		warn("Configuration reload failed, keeping generation %lu.\n", routes->generation);
+		return;
+	}
+	routesswap(r);
+	lastreloadus = ustime() - start;
+	statadd(STAT_RELOADS, 1);
+	log("Configuration generation %lu loaded in %.2fms: %d mapping%s.\n", r->generation,
+		lastreloadus / 1000.0, r->mappingcount, r->mappingcount == 1 ? "" : "s");
+}
+
+
+const struct Mapping* findserver(struct Routes* r, const char* host) {
+	struct Mapping* map = (struct Mapping*)findmapping(r, host);
+	__atomic_fetch_add(&map->hits, 1, __ATOMIC_RELAXED);
+	return map;
+}
+
+/* Same, without counting it as a hit. */
+const struct Mapping* findmapping(struct Routes* r, const char* host) {
+	int x;
+	for (x = 0; x < r->mappingcount; x++) {
+		if (!fnmatch(r->mappings[x]->pattern, host, 0)) return r->mappings[x];
+	}
+	return &r->defmap;
+}
+
+static int conntimeout(struct Timer* t) {
+	struct Conn* c = (struct Conn*)((char*)t - offsetof(struct Conn, timer));
+	unsigned long idle;
+	int sock;
+
+	/* Relay activity only touches lastactive; push the deadline back lazily from here. */
+	if (c->phase == PHASE_RELAY) {
+		idle = mstime() - c->lastactive;
+		if (idle < timeouts[PHASE_RELAY] * 1000UL) return timeouts[PHASE_RELAY] * 1000 - idle;
+	}
+
+	/* Wakes up whatever the connection thread is blocked in. The lock keeps
+	 * an upstream socket from being pooled or closed (and its number reused)
+	 * while we're at it. */
+	c->expired = 1;
+	pthread_mutex_lock(&c->fdlock);
+	sock = __atomic_load_n(&c->csock, __ATOMIC_ACQUIRE);
+	if (sock > 0) shutdown(sock, SHUT_RDWR);
+	sock = __atomic_load_n(&c->ssock, __ATOMIC_ACQUIRE);
+	if (sock > 0) shutdown(sock, SHUT_RDWR);
+	pthread_mutex_unlock(&c->fdlock);
+	return 0;
+}
+
+/* Gives c the upstream socket sock, for a timeout to shut down along with the client. */
+void connattach(struct Conn* c, int sock) {
+	__atomic_store_n(&c->ssock, sock, __ATOMIC_RELEASE);
+}
+
+/* Takes c's upstream socket back before it goes to the idle pool or gets
+ * closed, so that a timeout firing on c can't shut it down once it's
+ * another connection's. Returns it, or 0 if there wasn't one. */
+int conndetach(struct Conn* c) {
+	int sock;
+
+	pthread_mutex_lock(&c->fdlock);
+	sock = __atomic_exchange_n(&c->ssock, 0, __ATOMIC_ACQ_REL);
+	pthread_mutex_unlock(&c->fdlock);
+	return sock;
+}
+
+struct Conn* connnew(int csock, const struct sockaddr_in* caddr) {
+	struct Conn* c = (struct Conn*)calloc(1, sizeof(struct Conn));
+	c->csock = csock;
+	c->caddr = *caddr;
+	c->start = ustime();
+	c->timer.shard = -1;
+	c->timer.func = conntimeout;
+	pthread_mutex_init(&c->fdlock, NULL);
+	/* Only the main thread swaps tables, so the current one can't go away under it; accept workers go through routesget(). */
+	if (workerid >= 0) {
+		c->routes = routesget();
+	} else {
+		c->routes = __atomic_load_n(&routes, __ATOMIC_ACQUIRE);
+		__atomic_fetch_add(&c->routes->refs, 1, __ATOMIC_RELAXED);
+	}
+	c->node = -1;
+	shapeclient(c);
+	capturenew(c);
+	connregister(c);
+	return c;
+}
+
+/* A connection with no client, for probing destinations from other threads. */
+struct Conn* connprobe() {
+	struct Conn* c = (struct Conn*)calloc(1, sizeof(struct Conn));
+	c->csock = -1;
+	c->probe = 1;
+	c->node = -1;
+	c->start = ustime();
+	c->timer.shard = -1;
+	c->timer.func = conntimeout;
+	pthread_mutex_init(&c->fdlock, NULL);
+	c->routes = routesget();
+	return c;
+}
+
+void connphase(struct Conn* c, enum Phase phase) {
+	unsigned long now = ustime();
+
+	/* Histograms line up with phases, so the one we're leaving gets timed;
+	 * relay has none (its slot is HIST_FIRSTBYTE). Probes aren't clients. */
+	if (c->phasestart && c->phase != phase) {
+		if (!c->probe && c->phase != PHASE_RELAY) stathist(c->phase, now - c->phasestart);
+		c->timings[c->phase] += now - c->phasestart;
+	}
+	c->phasestart = now;
+	c->phase = phase;
+	if (phase == PHASE_RELAY) c->lastactive = mstime();
+	timerset(&c->timer, timeouts[phase] * 1000);
+}
+
+void conntraffic(struct Conn* c, int up, int bytes) {
+	if (up) {
+		statadd(STAT_BYTESUP, bytes);
+		c->bytesup += bytes;
+	} else {
+		statadd(STAT_BYTESDOWN, bytes);
+		c->bytesdown += bytes;
+		if (!c->firstbyte) {
+			c->firstbyte = 1;
+			stathist(HIST_FIRSTBYTE, ustime() - c->phasestart);
 		}
 	}
-	return &defmap;
+	c->lastactive = mstime();
+	if (c->capture) capturetraffic(c, up, bytes);
+	if (c->clientbucket || (c->map && c->map->bucket)) shape(c, bytes);
+}
+
+void connfree(struct Conn* c) {
+	timerdel(&c->timer);
+	if (!c->probe) {
+		connunregister(c);
+		admitrelease(c);
+		statadd(STAT_CLOSED, 1);
+		if (c->blocked) statadd(c->blocked == REJECT ? STAT_REJECTED : STAT_BLOCKED, 1);
+		else if (c->expired) statadd(STAT_TIMEOUTS + c->phase, 1);
+		else if (c->failed || c->phase != PHASE_RELAY) statadd(STAT_ERRORS + c->phase, 1);
+		if (c->expired) warn("[%d] Timed out in %s phase.\n", c->csock, phasenames[c->phase]);
+		logaccess(c);
+		capturedone(c);
+	}
+	if (c->csock > 0) close(c->csock);
+	if (c->ssock > 0) close(c->ssock);
+	if (c->host) free(c->host);
+	if (c->via) poolrelease(c->via);
+	shaperelease(c);
+	routesput(c->routes);
+	pthread_mutex_destroy(&c->fdlock);
+	free(c);
+}
+
+/* If c's mapping blocks or rejects it, marks it so and returns 1. A rejected
+ * client is reset rather than closed. */
+int connblocked(struct Conn* c) {
+	struct linger lg = { 1, 0 };
+
+	if (c->map->proto != BLOCK && c->map->proto != REJECT) return 0;
+	c->blocked = c->map->proto;
+	if (c->blocked == REJECT && c->csock > 0) setsockopt(c->csock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+	log("[%d] %s %s.\n", c->csock, c->blocked == REJECT ? "Rejecting" : "Blocking", c->host ? c->host : "connection");
+	return 1;
+}
+
+/* Writes the canned response to a blocked HTTP request into out. Returns its length, or 0 if there's none to send. */
+int blockresponse(char* out, int size, const struct Mapping* map) {
+	if (map->proto != BLOCK) return 0;
+	/* A 204 mustn't have a Content-Length. */
+	if (map->status == 204) return snprintf(out, size, "HTTP/1.1 204 No Content\r\nConnection: close\r\n\r\n");
+	return snprintf(out, size, "HTTP/1.1 403 Forbidden\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
+}
+
+/* Connects to a SOCKS proxy and has it connect on to host. */
+static int proxyconnect(struct Conn* c, enum Proto proto, const struct sockaddr_in* proxy, char* host, unsigned short defport) {
+	connphase(c, PHASE_CONNECT);
+	c->upstream = *proxy;
+	if (connect(c->ssock, (struct sockaddr*)proxy, sizeof(*proxy))) {
+		warn("[%d] Could not connect to proxy: %m\n", c->csock);
+		return 0;
+	}
+
+	connphase(c, PHASE_SOCKS);
+	if (proto == SOCKS4) return socks4connect(c, host, defport);
+	if (proto == SOCKS4A) return socks4aconnect(c, host, defport);
+	return socks5connect(c, host, defport);
+}
+
+/* Connects to host through map, unless its circuit is open. */
+int upstreamconnect(struct Conn* c, const struct Mapping* map, char* host, unsigned short defport) {
+	char key[CIRCUITKEYSIZE];
+	int rc;
+
+	circuitkey(key, host, defport);
+	if (circuitopen(key)) {
+		log("[%d] Circuit for %s is open, not connecting.\n", c->csock, key);
+		c->shortcircuit = 1;
+		connphase(c, PHASE_CONNECT);
+		return 0;
+	}
+	rc = upstreamdial(c, map, host, defport);
+	if (rc) statadd(STAT_UPSTREAMCONNECTS, 1);
+	/* A pool upstream that failed by itself has been dealt with by the pool; the destination may be fine. */
+	if (rc || !c->via || c->rejected) circuitresult(key, rc);
+	return rc;
+}
+
+int upstreamdial(struct Conn* c, const struct Mapping* map, char* host, unsigned short defport) {
+	unsigned long start;
+	int sock;
+	int rc;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		warn("[%d] Could not create socket: %m\n", c->csock);
+		return 0;
+	}
+	connattach(c, sock);
+	sockprofile(c->ssock, map->profile);
+
+	switch (map->proto) {
+	case INVALID:
+	case BLOCK:
+	case REJECT:
+		return 0;
+
+	case DIRECT:
+		return directconnect(c, host, defport, map);
+
+	case SOCKS4:
+	case SOCKS4A:
+	case SOCKS5:
+		return proxyconnect(c, map->proto, &map->proxy, host, defport);
+
+	case POOL:
+		c->via = poolpick(map->pool);
+		start = ustime();
+		rc = proxyconnect(c, c->via->proto, &c->via->addr, host, defport);
+		/* A proxy that turned the destination down is still working fine. */
+		poolresult(c->via, rc || c->rejected, ustime() - start);
+		return rc;
+	}
+	return 0;
 }
 
-int directconnect(int csock, int ssock, char* host, const char* defport, const struct Mapping* map) {
+int directconnect(struct Conn* c, char* host, unsigned short defport, const struct Mapping* map) {
 	struct ifreq ifr;
 	struct sockaddr_in addr;
+	struct addrinfo hints;
 	struct addrinfo* hostinfo;
 	struct addrinfo* hostcur;
-	const char* port;
+	char port[8];
+	int ssock = c->ssock;
 	int rc;
 
-	log("[%d] Establishing direct connection to %s.\n", csock, host);
+	log("[%d] Establishing direct connection to %s.\n", c->csock, host);
 	
 	if (map->iface[0]) {
 		ifr.ifr_addr.sa_family = AF_INET;
@@ -340,7 +1219,7 @@ int directconnect(int csock, int ssock, char* host, const char* defport, const s
 		#ifdef SO_BINDTODEVICE
 		rc = setsockopt(ssock, SOL_SOCKET, SO_BINDTODEVICE, &ifr, sizeof(ifr));
 		if (rc == 0) {
-			log("[%d] Bound to %s\n", csock, map->iface);
+			log("[%d] Bound to %s\n", c->csock, map->iface);
 		} else
 		#endif
 		{
@@ -351,163 +1230,215 @@ int directconnect(int csock, int ssock, char* host, const char* defport, const s
 			addr.sin_port = 0;
 		
 			rc = bind(ssock, (struct sockaddr*)&addr, sizeof(addr));
-			if (rc) warn("[%d] Could not bind outgoing socket: %m\n", csock);
-			else log("[%d] Bound to %s\n", csock, inet_ntoa(addr.sin_addr));
+			if (rc) warn("[%d] Could not bind outgoing socket: %m\n", c->csock);
+			else log("[%d] Bound to %s\n", c->csock, inet_ntoa(addr.sin_addr));
 		}
 	}
 	
-	host = strtok(host, ":");
-	port = strtok(NULL, "\r\n");
-	if (port == NULL || !port[0]) port = defport;
+	snprintf(port, sizeof(port), "%hu", hostport(host, defport));
 	
-	rc = getaddrinfo(host, port, NULL, &hostinfo);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+
+	connphase(c, PHASE_RESOLVE);
+	rc = getaddrinfo(host, port, &hints, &hostinfo);
 	 
 	if (rc) {
-		warn("[%d] Could not resolve host %s.\n", csock, host);
+		warn("[%d] Could not resolve host %s.\n", c->csock, host);
+		return 0;
+	}
+	if (c->expired) {
+		freeaddrinfo(hostinfo);
 		return 0;
 	}
 
+	connphase(c, PHASE_CONNECT);
 	for (hostcur = hostinfo; hostcur; hostcur = hostcur->ai_next) {
 		rc = connect(ssock, hostcur->ai_addr, hostcur->ai_addrlen);
 		if (rc == 0) {
+			c->upstream = *(struct sockaddr_in*)hostcur->ai_addr;
 			freeaddrinfo(hostinfo);
 			return 1;
 		}
-		warn("[%d] Could not connect to server: %m\n", csock);
+		warn("[%d] Could not connect to server: %m\n", c->csock);
 	}
 	
 	freeaddrinfo(hostinfo);
-	warn("[%d] No server reached.\n", csock);
+	warn("[%d] No server reached.\n", c->csock);
 	return 0;
 }
 
-int socks4connect(int csock, int ssock, char* host, unsigned short defport) {
-	unsigned char buffer[1024];
-	struct hostent* hostinfo;
-	char* portstr;
-	short port;
+/* Splits "host:port" in place. Returns the port, or defport if there isn't a usable one. */
+unsigned short hostport(char* host, unsigned short defport) {
+	char* colon = strchr(host, ':');
+	int port;
+
+	if (!colon) return defport;
+	*colon = 0;
+	port = atoi(colon + 1);
+	if (port <= 0 || port > 65535) return defport;
+	return port;
+}
 
-	log("[%d] Establishing SOCKS4 proxy connection to %s.\n", csock, host);
+/* The SOCKS request encoders fill in buffer and return the request length, or 0 if it won't fit. */
+int socks4request(unsigned char* buffer, const struct in_addr* addr, unsigned short port) {
+	port = htons(port);
 	memcpy(buffer, socks4a, sizeof(socks4a));
+	memcpy(buffer + 2, &port, 2);
+	memcpy(buffer + 4, addr, 4);
+	return sizeof(socks4a);
+}
 
-	host = strtok(host, ":");
-	hostinfo = gethostbyname(host);
-	if (hostinfo == NULL) {
-		warn("[%d] Could not resolve host %s.\n", csock, host);
+int socks4arequest(unsigned char* buffer, int size, const char* host, unsigned short port) {
+	int len = strlen(host) + 1;
+
+	if (sizeof(socks4a) + len > size) return 0;
+	port = htons(port);
+	memcpy(buffer, socks4a, sizeof(socks4a));
+	memcpy(buffer + 2, &port, 2);
+	memcpy(buffer + sizeof(socks4a), host, len);
+	return sizeof(socks4a) + len;
+}
+
+int socks5request(unsigned char* buffer, int size, const char* host, unsigned short port) {
+	int len = strlen(host);
+
+	if (len > 255 || sizeof(socks5b) + 1 + len + 2 > size) return 0;
+	port = htons(port);
+	memcpy(buffer, socks5b, sizeof(socks5b));
+	buffer[sizeof(socks5b)] = (unsigned char)len;
+	memcpy(buffer + sizeof(socks5b) + 1, host, len);
+	memcpy(buffer + sizeof(socks5b) + 1 + len, &port, 2);
+	return sizeof(socks5b) + 1 + len + 2;
+}
+
+int socks4connect(struct Conn* c, char* host, unsigned short defport) {
+	unsigned char buffer[1024];
+	struct addrinfo hints;
+	struct addrinfo* hostinfo;
+	unsigned short port;
+	int len;
+	int ssock = c->ssock;
+
+	log("[%d] Establishing SOCKS4 proxy connection to %s.\n", c->csock, host);
+
+	port = hostport(host, defport);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, NULL, &hints, &hostinfo)) {
+		warn("[%d] Could not resolve host %s.\n", c->csock, host);
 		return 0;
 	}
-	memcpy(buffer + 4, hostinfo->h_addr, 4);
-	
-	portstr = strtok(NULL, "\r\n");
-	if (portstr != NULL) {
-		port = htons(atoi(portstr));
-	} else {
-		port = htons(defport);
-	}
-	memcpy(buffer + 2, &port, 2);
+	len = socks4request(buffer, &((struct sockaddr_in*)hostinfo->ai_addr)->sin_addr, port);
+	freeaddrinfo(hostinfo);
 
-	write(ssock, buffer, sizeof(socks4a));
+	write(ssock, buffer, len);
 
-	read(ssock, buffer, 8);
+	if (read(ssock, buffer, 8) != 8) {
+		warn("[%d] SOCKS proxy closed the connection during handshake.\n", c->csock);
+		return 0;
+	}
 	if (buffer[1] != 0x5a) {
-		warn("[%d] SOCKS proxy rejected request.\n", csock);
+		warn("[%d] SOCKS proxy rejected request.\n", c->csock);
+		c->rejected = 1;
 		return 0;
 	}
 	return 1;
 }
 
-int socks4aconnect(int csock, int ssock, char* host, unsigned short defport) {
+int socks4aconnect(struct Conn* c, char* host, unsigned short defport) {
 	unsigned char buffer[1024];
-	char* portstr;
-	short port;
+	unsigned short port;
+	int len;
+	int ssock = c->ssock;
 
-	log("[%d] Establishing SOCKS4a proxy connection to %s.\n", csock, host);
-	memcpy(buffer, socks4a, sizeof(socks4a));
+	log("[%d] Establishing SOCKS4a proxy connection to %s.\n", c->csock, host);
 
-	host = strtok(host, ":");
-	portstr = strtok(NULL, "\r\n");
-	if (portstr != NULL) {
-		port = htons(atoi(portstr));
-	} else {
-		port = htons(defport);
+	port = hostport(host, defport);
+	len = socks4arequest(buffer, sizeof(buffer), host, port);
+	if (!len) {
+		warn("[%d] Host name %s is too long.\n", c->csock, host);
+		return 0;
 	}
-	memcpy(buffer + 2, &port, 2);
-
-	strcpy(buffer + sizeof(socks4a), host);
-	write(ssock, buffer, sizeof(socks4a) + strlen(host) + 1);
+	write(ssock, buffer, len);
 
-	read(ssock, buffer, 8);
+	if (read(ssock, buffer, 8) != 8) {
+		warn("[%d] SOCKS proxy closed the connection during handshake.\n", c->csock);
+		return 0;
+	}
 	if (buffer[1] != 0x5a) {
-		warn("[%d] SOCKS proxy rejected request.\n", csock);
+		warn("[%d] SOCKS proxy rejected request.\n", c->csock);
+		c->rejected = 1;
 		return 0;
 	}
 	return 1;
 }
 
-int socks5connect(int csock, int ssock, char* host, unsigned short defport) {
+int socks5connect(struct Conn* c, char* host, unsigned short defport) {
 	unsigned char buffer[1024];
-	char* portstr;
-	short port;
+	unsigned short port;
 	int rc;
 	int pos;
+	int len;
+	int ssock = c->ssock;
 	/*int x;*/
 
-	log("[%d] Establishing SOCKS5 proxy connection to %s.\n", csock, host);
+	log("[%d] Establishing SOCKS5 proxy connection to %s.\n", c->csock, host);
 	
 	write(ssock, socks5a, sizeof(socks5a));
 	rc = read(ssock, buffer, 2);
 	
 	if (rc != 2 || buffer[0] != 0x05 || buffer[1] == 0xFF) {
-		warn("[%d] SOCKS5 proxy requires authentication, this is unsupported.\n", csock);
+		warn("[%d] SOCKS5 proxy requires authentication, this is unsupported.\n", c->csock);
 		return 0;
 	}
 
-	memcpy(buffer, socks5b, sizeof(socks5b));
-
-	host = strtok(host, ":");
-	buffer[sizeof(socks5b)] = (unsigned char)strlen(host);
-	memcpy(buffer + sizeof(socks5b) + 1, host, strlen(host));
-
-	portstr = strtok(NULL, "\r\n");
-	if (portstr != NULL) {
-		port = htons(atoi(portstr));
-	} else {
-		port = htons(defport);
+	port = hostport(host, defport);
+	len = socks5request(buffer, sizeof(buffer), host, port);
+	if (!len) {
+		warn("[%d] Host name %s is too long.\n", c->csock, host);
+		return 0;
 	}
-	memcpy(buffer + sizeof(socks5b) + 1 + strlen(host), &port, 2);
-	
-	write(ssock, buffer, sizeof(socks5b) + strlen(host) + 3);
+	write(ssock, buffer, len);
 	rc = read(ssock, buffer, 4);
 	pos = rc;
-	if (rc != 4 || buffer[1] != 0) {
-		warn("[%d] SOCKS5 proxy rejected request, code %hhu.\n", csock, buffer[1]);
+	if (rc != 4) {
+		warn("[%d] Expected 4 bytes, got %d, during handshake.\n", c->csock, rc);
+		return 0;
+	}
+	if (buffer[1] != 0) {
+		warn("[%d] SOCKS5 proxy rejected request, code %hhu.\n", c->csock, buffer[1]);
+		c->rejected = 1;
+		return 0;
 	}
 	switch (buffer[3]) {
 	case 1: // IPv4 address
 		rc = read(ssock, buffer + 4, 6);
 		pos += rc;
-		if (rc != 6) { warn("[%d] Expected 6 bytes, got %d, during handshake.\n", csock, rc); return 0; }
+		if (rc != 6) { warn("[%d] Expected 6 bytes, got %d, during handshake.\n", c->csock, rc); return 0; }
 		break;
 	case 3: // Domain name
 		rc = read(ssock, buffer + 4, 1);
 		pos += rc;
-		if (rc != 1) { warn("[%d] Expected 1 byte, got %d, during handshake.\n", csock, rc); return 0; }
+		if (rc != 1) { warn("[%d] Expected 1 byte, got %d, during handshake.\n", c->csock, rc); return 0; }
 
 		rc = read(ssock, buffer + 5, buffer[4]+2);
 		pos += rc;
-		if (rc != 6) { warn("[%d] Expected %d bytes, got %d, during handshake.\n", csock, buffer[4]+2, rc); return 0; }
+		if (rc != buffer[4]+2) { warn("[%d] Expected %d bytes, got %d, during handshake.\n", c->csock, buffer[4]+2, rc); return 0; }
 		break;
 	case 4: // IPv6 address
 		rc = read(ssock, buffer + 4, 18);
 		pos += rc;
-		if (rc != 6) { warn("[%d] Expected 18 bytes, got %d, during handshake.\n", csock, rc); return 0; }
+		if (rc != 18) { warn("[%d] Expected 18 bytes, got %d, during handshake.\n", c->csock, rc); return 0; }
 		break;
 	default:
-		warn("[%d] SOCKS5 response address is unexpected type %hhu.\n", csock, buffer[3]);
+		warn("[%d] SOCKS5 response address is unexpected type %hhu.\n", c->csock, buffer[3]);
 		return 0;
 	}
 	
-	/*log("[%d] socks5:", csock);
+	/*log("[%d] socks5:", c->csock);
 	for (x = 0; x < pos; x++) {
 		log(" %hhx", buffer[x]);
 	}
@@ -516,8 +1447,74 @@ int socks5connect(int csock, int ssock, char* host, unsigned short defport) {
 	return 1;
 }	
 
+/* Asks a SOCKS5 proxy for a UDP association, leaving where to send the
+ * datagrams in relay. The association lasts as long as c->ssock stays open. */
+int socks5associate(struct Conn* c, const struct sockaddr_in* proxy, struct sockaddr_in* relay) {
+	/* UDP ASSOCIATE, from whatever address the datagrams turn up from. */
+	static const unsigned char request[] = {
+		0x05, 0x03, 0x00, 0x01,
+		0x00, 0x00, 0x00, 0x00,
+		0x00, 0x00
+		};
+	unsigned char buffer[16];
+	int sock;
+	int rc;
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		warn("[udp] Could not create socket: %m\n");
+		return 0;
+	}
+	connattach(c, sock);
+	connphase(c, PHASE_CONNECT);
+	c->upstream = *proxy;
+	if (connect(c->ssock, (struct sockaddr*)proxy, sizeof(*proxy))) {
+		warn("[udp] Could not connect to proxy: %m\n");
+		return 0;
+	}
+
+	connphase(c, PHASE_SOCKS);
+	log("[udp] Establishing SOCKS5 UDP association for %s.\n", c->host);
+	write(c->ssock, socks5a, sizeof(socks5a));
+	rc = read(c->ssock, buffer, 2);
+	if (rc != 2 || buffer[0] != 0x05 || buffer[1] == 0xFF) {
+		warn("[udp] SOCKS5 proxy requires authentication, this is unsupported.\n");
+		return 0;
+	}
+
+	write(c->ssock, request, sizeof(request));
+	rc = read(c->ssock, buffer, 4);
+	if (rc != 4) {
+		warn("[udp] Expected 4 bytes, got %d, during handshake.\n", rc);
+		return 0;
+	}
+	if (buffer[1] != 0) {
+		warn("[udp] SOCKS5 proxy rejected UDP association, code %hhu.\n", buffer[1]);
+		c->rejected = 1;
+		return 0;
+	}
+	if (buffer[3] != 1) {
+		warn("[udp] SOCKS5 relay address is unsupported type %hhu.\n", buffer[3]);
+		return 0;
+	}
+	rc = read(c->ssock, buffer + 4, 6);
+	if (rc != 6) { warn("[udp] Expected 6 bytes, got %d, during handshake.\n", rc); return 0; }
+
+	memset(relay, 0, sizeof(*relay));
+	relay->sin_family = AF_INET;
+	memcpy(&relay->sin_addr, buffer + 4, 4);
+	memcpy(&relay->sin_port, buffer + 8, 2);
+	/* A proxy that doesn't say which address means its own. */
+	if (!relay->sin_addr.s_addr) relay->sin_addr = proxy->sin_addr;
+	connphase(c, PHASE_RELAY);
+	return 1;
+}
+
 void sighandle(int sig) {
-	exitflag++;
+	if (sig == SIGHUP) reloadflag = 1;
+	else if (sig == SIGUSR2) upgradeflag = 1;
+	else if (sig == SIGUSR1) dumpflag = 1;
+	else exitflag++;
 }
 
 
@@ -28,64 +28,628 @@
 #include <strings.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stddef.h>
 
 #ifdef GNUTLS
 #include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
 #endif
 
 /* This must be at least enough to hold HTTP headers. */
 #define BUFFERSIZE 8192
 
+/* Timer wheel resolution in milliseconds, and how many wheels (each with its own thread) to spread connections over. */
+#define TIMERTICK 100
+#define TIMERSHARDS 4
+
+/* Number of cache-line aligned shards the statistics are spread over. */
+#define STATSHARDS 16
+
+/* Number of locked lists the open connections are spread over, for GET /connections. */
+#define CONNSHARDS 16
+
+/* Capture: exchanges kept per connection (later ones add to the last), and bytes of each request head. */
+#define CAPTUREEXCHANGES 1024
+#define CAPTUREHEAD 1024
+
+/* A pool upstream that fails this many handshakes in a row is skipped for POOLEJECTMS milliseconds. */
+#define POOLEJECTFAILS 3
+#define POOLEJECTMS 10000
+
+/* Upper bound on how long a health check waits, in milliseconds. */
+#define HEALTHTIMEOUT 2000
+
+/* Circuit breaker: failures further apart than CIRCUITWINDOW ms don't add up, and
+ * open circuits are probed after CIRCUITPROBEMS, doubling up to CIRCUITPROBEMAX. */
+#define CIRCUITFAILS 3
+#define CIRCUITWINDOW 30000
+#define CIRCUITPROBEMS 1000
+#define CIRCUITPROBEMAX 60000
+#define CIRCUITSHARDS 16
+#define CIRCUITKEYSIZE 272
+
+/* HTTP-aware mode keeps up to IDLEPERHOST idle upstream connections per destination, for IDLETIMEOUT ms,
+ * and won't believe a chunk in a chunked body is bigger than CHUNKMAX bytes. */
+#define IDLEPERHOST 64
+#define IDLETIMEOUT 30000
+#define IDLESHARDS 16
+#define CHUNKMAX (1L << 40)
+
+/* The response cache holds CACHESIZE MB unless told otherwise, and a client waits
+ * up to CACHEWAIT ms for another's fetch of the same URL before going upstream itself. */
+#define CACHESIZE 256
+#define CACHEWAIT 30000
+
+/* Streams an HTTP/2 client may have open at once, each with its own thread,
+ * and how many of them may have a request upstream at a time; the rest wait
+ * their turn, so one page load can't fan out into a hundred upstream connections. */
+#define H2MAXSTREAMS 100
+#define H2UPSTREAMS 8
+
+/* UDP flows are forgotten after UDPIDLE ms without a datagram either way.
+ * Datagrams are moved UDPBATCH at a time, and larger than UDPMAXSIZE dropped. */
+#define UDPIDLE 30000
+#define UDPBATCH 16
+#define UDPMAXSIZE 4096
+#define UDPSHARDS 16
+
+/* Shaping: connections that moved more than SHAPEINTERACTIVE bytes in roughly the last
+ * few SHAPEDECAY ms count as bulk, and can't use the last quarter of a bucket. */
+#define SHAPEINTERACTIVE 65536
+#define SHAPEDECAY 100
+#define SHAPESHARDS 16
+
+/* Accept workers (the workers line): at most MAXWORKERS, each with its own
+ * listeners. Connection buffers are pooled per NUMA node, for up to MAXNODES
+ * nodes and MAXCPUS CPUs, and carved BUFSLAB at a time. */
+#define MAXWORKERS 64
+#define MAXNODES 8
+#define MAXCPUS 1024
+#define BUFSLAB 32
+
+/* Admission control: clients are counted per address on ADMITSHARDS
+ * lists. Listeners are opened with a backlog of LISTENBACKLOG, unless the
+ * backlog line says otherwise. */
+#define ADMITSHARDS 64
+#define LISTENBACKLOG 32
+
+/* After accept() runs out of fds or memory, the listener is left alone for ACCEPTBACKOFF ms. */
+#define ACCEPTBACKOFF 10
+
+/* Upstream certificate checks are remembered (up to VERIFYCACHE of them) for VERIFYTTL
+ * seconds, or VERIFYFAILTTL for failures, and never past the certificate's expiry. */
+#define VERIFYCACHE 4096
+#define VERIFYTTL 3600
+#define VERIFYFAILTTL 60
+#define VERIFYSHARDS 16
+
+/* The TLS relay reads up to this much before flushing it on as full-size records. */
+#define TLSCORKSIZE 65536
+
+/* Stack reserved for each fiber; only the pages a TLS handshake actually touches are backed. */
+#define FIBERSTACK 262144
+
+#define IDLEKEYSIZE (CIRCUITKEYSIZE + IFNAMSIZ + 5)
+
 enum Proto {
 	INVALID,
 	DIRECT,
 	SOCKS4,
 	SOCKS4A,
-	SOCKS5
+	SOCKS5,
+	POOL,
+	BLOCK,		/* Answered at once: a canned HTTP status, or a TLS alert. */
+	REJECT		/* Reset at once. */
+};
+
+enum Balance {
+	BALANCE_ROUNDROBIN,
+	BALANCE_LEASTCONN,
+	BALANCE_EWMA
+};
+
+/* One proxy in a pool. Everything after name is updated with relaxed atomics
+ * by connection threads and the health check thread. */
+struct Upstream {
+	enum Proto proto;
+	struct sockaddr_in addr;
+	char name[32];
+	int outstanding;
+	int fails;		/* Failed handshakes in a row. */
+	int healthy;		/* Result of the last health check. */
+	unsigned long ejecteduntil;	/* mstime() until which it's skipped. */
+	unsigned long ewma;	/* Handshake latency in microseconds, see poolsample(). */
+	unsigned long conns;
+	unsigned long failures;
+	unsigned long ejections;
+};
+
+struct Pool {
+	char* name;
+	enum Balance balance;
+	unsigned int next;
+	struct Upstream* upstreams;
+	int count;
+};
+
+/* A token bucket, in bytes. Updated with relaxed atomics by every relay using it. */
+struct Bucket {
+	unsigned long rate;	/* Per second */
+	long burst;
+	long tokens;		/* Negative while relays wait for it to refill. */
+	unsigned long last;	/* ustime() tokens were last added for. */
+};
+
+/* Socket options from a sockprofile line, for both legs of connections
+ * through the mappings naming it. -1 leaves the system's default alone. */
+struct SockProfile {
+	char* name;
+	int rcvbuf;
+	int sndbuf;
+	int nodelay;
+	int notsentlowat;
+	int keepidle;		/* Seconds; keepalive is turned on if set. */
+	int keepintvl;
+	int keepcnt;
+	int usertimeout;	/* Milliseconds */
+	char congestion[16];	/* Empty for the default */
 };
 
 struct Mapping {
 	const char* pattern;
 	enum Proto proto;
+	unsigned long hits;
+	struct Bucket* bucket;	/* Rate limit for everything through this mapping, or NULL. */
+	const struct SockProfile* profile;	/* Or NULL */
 	union {
 		struct sockaddr_in proxy;
 		char iface[sizeof(struct sockaddr_in)];
+		struct Pool* pool;
+		int status;	/* BLOCK's HTTP status */
 	};
 };
 
+/* An immutable routing table. Each connection holds a reference to the one
+ * that was current when it was accepted, so a reload never changes its route. */
+struct Routes {
+	struct Mapping defmap;
+	struct Mapping** mappings;
+	int mappingcount;
+	struct Pool** pools;
+	int poolcount;
+	struct SockProfile** profiles;
+	int profilecount;
+	int healthcheck;
+	int httpaware;
+	int http2;
+	unsigned long clientrate;	/* Per-client rate limit, 0 for none. */
+	long clientburst;
+	unsigned long generation;
+	int refs;
+};
+
+enum Phase {
+	PHASE_HEADER,
+	PHASE_RESOLVE,
+	PHASE_CONNECT,
+	PHASE_SOCKS,
+	PHASE_TLS,
+	PHASE_RELAY,
+	PHASES
+};
+
+/* Why admit() turned a new client away, if it did. */
+enum Refusal {
+	ADMITTED,
+	REFUSE_MAXCONNS,
+	REFUSE_MAXPERCLIENT,
+	REFUSE_QUEUE,
+	REFUSE_DELAY,
+	REFUSE_THREADS,
+	REFUSALS
+};
+
+/* What admit() counted a connection against. */
+#define ADMIT_COUNTED 1
+#define ADMIT_CLIENT 2
+
+enum Stat {
+	STAT_ACCEPTS,
+	STAT_CLOSED,
+	STAT_BYTESUP,
+	STAT_BYTESDOWN,
+	STAT_LOGDROPS,
+	STAT_CAPTUREDROPS,
+	STAT_RELOADS,
+	STAT_RELOADFAILS,
+	STAT_CIRCUITOPENS,
+	STAT_CIRCUITSKIPS,
+	STAT_CIRCUITPROBES,
+	STAT_CIRCUITPROBEFAILS,
+	STAT_UPSTREAMCONNECTS,
+	STAT_UPSTREAMREUSES,
+	STAT_HTTPREQUESTS,
+	STAT_CACHEHITS,
+	STAT_CACHECOLLAPSED,
+	STAT_CACHEMISSES,
+	STAT_CACHEREVALIDATED,
+	STAT_TLSACCEPTS,
+	STAT_TLSCONNECTS,
+	STAT_H2CONNS,
+	STAT_H2STREAMS,
+	STAT_UDPFLOWS,
+	STAT_UDPUP,
+	STAT_UDPDOWN,
+	STAT_UDPDROPS,
+	STAT_SHAPEWAITS,
+	STAT_SHAPEWAITUS,
+	STAT_BLOCKED,
+	STAT_REJECTED,
+	STAT_VERIFYCACHED,
+	STAT_VERIFYCACHEDUS,
+	STAT_VERIFYCHECKED,
+	STAT_VERIFYCHECKEDUS,
+	STAT_VERIFYFAILS,
+	STAT_OFFCPU,
+	STAT_OFFNODE,
+	STAT_ACCEPTERRORS,
+	STAT_REFUSED,
+	STAT_ERRORS = STAT_REFUSED + REFUSALS,
+	STAT_TIMEOUTS = STAT_ERRORS + PHASES,
+	STATS = STAT_TIMEOUTS + PHASES
+};
+
+/* These line up with the phases they time, except the last. */
+enum Hist {
+	HIST_HEADER,
+	HIST_DNS,
+	HIST_CONNECT,
+	HIST_SOCKS,
+	HIST_TLS,
+	HIST_FIRSTBYTE,
+	HISTS
+};
+
+struct Timer {
+	struct Timer* next;
+	struct Timer** pprev;
+	unsigned long expires;
+	int shard;
+	/* Called from the timer thread with the wheel locked. Returns milliseconds to re-arm, or 0. */
+	int (*func)(struct Timer*);
+};
+
+struct Conn {
+	int csock;
+	int ssock;
+	pthread_mutex_t fdlock;	/* Held by a timeout shutting the sockets down, see conndetach(). */
+	int ssl;
+	struct sockaddr_in caddr;
+	struct sockaddr_in upstream;
+	char* host;
+	struct Routes* routes;
+	const struct Mapping* map;
+	struct Upstream* via;
+	volatile int phase;
+	volatile int expired;
+	volatile unsigned long lastactive;
+	unsigned long start;
+	unsigned long phasestart;
+	unsigned long timings[PHASES];
+	unsigned long bytesup;
+	unsigned long bytesdown;
+	int firstbyte;
+	int failed;
+	int rejected;
+	int shortcircuit;
+	int blocked;		/* BLOCK or REJECT, if its mapping turned it away. */
+	int probe;
+	struct ClientBucket* clientbucket;
+	unsigned long shapebytes;
+	unsigned long shapelast;
+	int node;		/* NUMA node its buffers come from, -1 without workers. */
+	struct Timer timer;
+	struct Capture* capture;	/* Traffic so far, with a capture file. */
+	struct Conn* regnext;	/* On its connection registry shard, see registry.c. */
+	struct Conn* regprev;
+	int regshard;
+	int admitted;		/* ADMIT_ flags, for admitrelease(). */
+};
+
+/* HTTP/1.x reading, shared by the HTTP-aware relay and the HTTP/2 front end. */
+struct HttpBuf {
+	int fd;
+	void* session;	/* Read through TLS instead, if set */
+	int len;
+	int pos;
+	char data[BUFFERSIZE + 1];
+};
+
+struct HttpHead {
+	int len;
+	int version;	/* Minor version, HTTP/1.x */
+	int status;
+	int head;
+	int connect;
+	long length;	/* Content-Length, or -1 */
+	int badlength;	/* Content-Length not a number, or more than one */
+	int chunked;
+	int close;
+	int keepalive;
+	int upgrade;
+	int expect;
+};
+
+/* An HPACK header table, as a ring of entries with the newest at first. */
+struct HpackEntry {
+	char* name;
+	char* value;
+	int nlen;
+	int vlen;
+};
+
+struct Hpack {
+	struct HpackEntry* entries;
+	int slots;
+	int first;
+	int count;
+	int size;
+	int maxsize;	/* What the encoder has set it to */
+	int limit;	/* What we allow it to be set to */
+};
+
+enum CacheState {
+	CACHE_PASS,
+	CACHE_HIT,
+	CACHE_FILL,
+	CACHE_REVALIDATE
+};
+
+/* One request's use of the cache, from cachefind() to cachedone(). */
+struct CacheRef {
+	enum CacheState state;
+	char* key;
+	void* entry;
+	char* conditions;	/* Headers to add to a revalidation */
+	/* The stored copy, for a hit or a revalidation */
+	int fd;
+	char* head;
+	int headlen;
+	long size;
+	long age;
+	/* What's being fetched to replace it */
+	int drop;
+	int tmpfd;
+	unsigned long id;
+	char* newhead;
+	int newheadlen;
+	long newage;
+	long lifetime;
+	long length;
+	long written;
+	char* etag;
+	char* lastmod;
+};
+
 extern volatile sig_atomic_t exitflag;
-extern volatile sig_atomic_t running;
-extern enum Proto defproto;
-extern struct sockaddr_in defaddr;
-extern struct Mapping** mappings;
-extern int mappingcount;
+extern volatile sig_atomic_t reloadflag;
+extern volatile sig_atomic_t upgradeflag;
+extern volatile sig_atomic_t dumpflag;
+extern struct Routes* routes;
+extern unsigned long lastreloadus;
+extern int timeouts[PHASES];
+extern const char* phasenames[PHASES];
+extern char* statsaddr;
+extern int statscontrol;
+extern int loglevel;
+extern char* accesslog;
+extern char* errorlog;
+extern char* capturefile;
+extern int capturepayload;
+extern const char* protonames[];
+extern const char* balancenames[];
+extern int circuitfails;
+extern int maxconns;
+extern int maxperclient;
+extern int shedqueue;
+extern int sheddelay;
+extern int listenbacklog;
+extern const char* refusalnames[REFUSALS];
+extern char* cachedir;
+extern unsigned long cachesize;
+extern char* udpdest;
 
 #ifdef GNUTLS
 extern char* certfile;
 extern char* keyfile;
+extern int sslverify;
+extern char* ssltrust;
+extern int verifycachesize;
 #endif
 
 
 void gnutlsinit();
 void gnutlspostinit();
+#ifdef GNUTLS
+int gnutlsgetticketkey(unsigned char* buffer, int size);
+void gnutlssetticketkey(const unsigned char* key, int size);
+int verifycert(gnutls_session_t session);
+int verifyinit(gnutls_certificate_credentials_t cred);
+gnutls_x509_crt_t makecert(const char* hostname, gnutls_x509_privkey_t key, gnutls_x509_crt_t ca, gnutls_x509_privkey_t cakey);
+int gnutlswriteall(gnutls_session_t fd, const char* buffer, int size);
+int gnutlsdial(struct Conn* c, gnutls_session_t* session, const char* host);
+void h2serve(struct Conn* c, gnutls_session_t session);
+#endif
 
-void readconfig(struct sockaddr_in* laddr, struct sockaddr_in* ssladdr);
+struct Routes* readconfig(struct sockaddr_in* laddr, struct sockaddr_in* ssladdr, struct sockaddr_in* udpaddr, int startup);
+struct Routes* routesget();
+void routesput(struct Routes* r);
+void routesswap(struct Routes* r);
+void reloadconfig();
 void* connthread(void* arg);
 void* gnutlsthread(void* arg);
+void* httpthread(void* arg);
+void httpstart();
+int httpidlecount();
+int hastoken(const char* value, int len, const char* token);
+long contentlength(const char* p, const char* end);
+long chunksize(const char* p, int len);
+int buffill(struct HttpBuf* b);
+int readhead(struct HttpBuf* b);
+int readline(struct HttpBuf* b);
+void parsehead(const char* p, int len, struct HttpHead* h, int request);
+void idlekey(char* key, const struct Mapping* map, const char* host, int tls);
+int idleget(const char* key, struct sockaddr_in* addr, void** session);
+void idleput(const char* key, int sock, const struct sockaddr_in* addr, void* session);
 int writeall(int fd, const char* buffer, int size);
 void sighandle(int sig);
-const struct Mapping* findserver(const char* host);
-
-int directconnect(int csock, int ssock, char* host, const char* defport, const struct Mapping* map);
-int socks4connect(int csock, int ssock, char* host, unsigned short defport);
-int socks4aconnect(int csock, int ssock, char* host, unsigned short defport);
-int socks5connect(int csock, int ssock, char* host, unsigned short defport);
-
-#ifdef DAEMON
-#define log(a...)
-#define warn(a...)
-#else
-#define log(a...) printf(a)
-#define warn(a...) fprintf(stderr, a)
-#endif
+const struct Mapping* findserver(struct Routes* r, const char* host);
+const struct Mapping* findmapping(struct Routes* r, const char* host);
+
+struct Conn* connnew(int csock, const struct sockaddr_in* caddr);
+struct Conn* connprobe();
+void connphase(struct Conn* c, enum Phase phase);
+void conntraffic(struct Conn* c, int up, int bytes);
+void connattach(struct Conn* c, int sock);
+int conndetach(struct Conn* c);
+void connfree(struct Conn* c);
+
+int connblocked(struct Conn* c);
+int blockresponse(char* out, int size, const struct Mapping* map);
+int upstreamconnect(struct Conn* c, const struct Mapping* map, char* host, unsigned short defport);
+int upstreamdial(struct Conn* c, const struct Mapping* map, char* host, unsigned short defport);
+int directconnect(struct Conn* c, char* host, unsigned short defport, const struct Mapping* map);
+int socks4connect(struct Conn* c, char* host, unsigned short defport);
+int socks4aconnect(struct Conn* c, char* host, unsigned short defport);
+int socks5connect(struct Conn* c, char* host, unsigned short defport);
+int socks5associate(struct Conn* c, const struct sockaddr_in* proxy, struct sockaddr_in* relay);
+unsigned short hostport(char* host, unsigned short defport);
+int socks4request(unsigned char* buffer, const struct in_addr* addr, unsigned short port);
+int socks4arequest(unsigned char* buffer, int size, const char* host, unsigned short port);
+int socks5request(unsigned char* buffer, int size, const char* host, unsigned short port);
+char* findhost(const char* buffer);
+
+unsigned long mstime();
+unsigned long ustime();
+int statsinit(int sock);
+void statsstart();
+void statsstop();
+void statadd(enum Stat stat, unsigned long n);
+void stathist(enum Hist hist, unsigned long us);
+unsigned long statget(enum Stat stat);
+
+void loginit();
+void logstart();
+void logflush();
+void logmsg(int level, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+void logaccess(const struct Conn* c);
+void logcapture(unsigned char* data, int len);
+int loglevelbyname(const char* name);
+
+struct Upstream* poolpick(struct Pool* p);
+void poolresult(struct Upstream* u, int ok, unsigned long us);
+void poolrelease(struct Upstream* u);
+int upstreamup(const struct Upstream* u, unsigned long now);
+void poolcarry(struct Routes* r, const struct Routes* old);
+void poolfree(struct Pool* p);
+void poolstart();
+
+unsigned int keyhash(const char* key);
+void circuitkey(char* key, const char* host, unsigned short defport);
+int circuitopen(const char* key);
+void circuitresult(const char* key, int ok);
+int circuitcount();
+void circuitstart();
+
+void cachefind(struct CacheRef* ref, const char* head, int len, const char* host);
+int cachestore(struct CacheRef* ref, const char* head, int len, int status, long length);
+void cachewrite(struct CacheRef* ref, const char* data, int len);
+int cacherefresh(struct CacheRef* ref, const char* head, int len);
+int cacheserve(struct CacheRef* ref, struct Conn* c, int sock, int keepalive);
+void cachedone(struct CacheRef* ref, int ok);
+void cacheusage(unsigned long* bytes, int* entries);
+int cacheinit();
+void cacheclear();
+
+void upgradeinit(char** argv);
+int upgradeinherit(int* lsock, int* sslsock, int* statssock, int* udpsock, int* extra, int* nextra);
+void upgradeready();
+int upgradestart(int lsock, int sslsock, int statssock, int udpsock, const int* extra, int nextra);
+int upgradefinish(int fd);
+
+void hpackinit(struct Hpack* t, int maxsize);
+void hpackfree(struct Hpack* t);
+int hpackdecode(struct Hpack* t, const unsigned char* p, int len,
+	void (*func)(void*, const char*, int, const char*, int), void* arg);
+int hpackencode(unsigned char* out, int size, const char* name, int nlen, const char* value, int vlen);
+int hpackstatus(unsigned char* out, int size, int status);
+
+void bucketinit(struct Bucket* b, unsigned long rate, long burst);
+void shape(struct Conn* c, int bytes);
+void shapeclient(struct Conn* c);
+void shaperelease(struct Conn* c);
+void shapestart();
+
+void capturenew(struct Conn* c);
+void capturetraffic(struct Conn* c, int up, int bytes);
+void capturerequest(struct Conn* c, const char* head, int len);
+void capturedone(struct Conn* c);
+
+void registryinit();
+void connregister(struct Conn* c);
+void connunregister(struct Conn* c);
+void connhost(struct Conn* c, char* host);
+int conncount();
+int conndump(FILE* fp, int bytes);
+void connlogdump();
+
+void admitinit();
+int admit(int lsock, int csock, const struct sockaddr_in* caddr, int* counted);
+void admitrelease(struct Conn* c);
+void refuse(int csock, int ssl, const struct sockaddr_in* caddr, int reason);
+
+void sockprofile(int sock, const struct SockProfile* p);
+void socknodelay(int sock, const struct SockProfile* p);
+
+int udpinit(const struct sockaddr_in* addr, int sock);
+void udpstart();
+void udpstop();
+int udpflowcount();
+
+extern int workerthreads;
+extern char* workercpus;
+extern __thread int workerid;
+int workerinit(int lsock, int sslsock, const struct sockaddr_in* laddr, const struct sockaddr_in* ssladdr, int* extra, int nextra);
+void workerstart();
+void workerstop();
+void workerpin(int id);
+int workernode(int id);
+int workersockets(int* out, int max);
+int workercount();
+int cpunode(int cpu);
+char* bufget(int node);
+void bufput(int node, char* buf);
+int acceptconn(int sock, int ssl);
+
+struct pollfd;
+extern int fiberworkers;
+int fiberspawn(void* (*func)(void*), void* arg);
+int fiberpoll(struct pollfd* fds, int n);
+void fiberblocking(void (*func)(void*), void* arg);
+void fibersleep(unsigned long us);
+int fibered();
+int fibercount();
+void fiberstart();
+
+void timerinit();
+void timerset(struct Timer* t, int ms);
+void timerdel(struct Timer* t);
+
+#define LOG_NONE 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+
+/* Formatted into a per-thread ring and written out by the log thread. */
+#define log(a...) do { if (loglevel >= LOG_INFO) logmsg(LOG_INFO, a); } while (0)
+#define warn(a...) do { if (loglevel >= LOG_WARN) logmsg(LOG_WARN, a); } while (0)
 
@@ -0,0 +1,533 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* UDP relay, for QUIC and DNS. Datagrams arriving on the udp listener are
+ * grouped into flows by client and original destination (from TPROXY, or
+ * the listener's fixed destination). Each flow gets its own upstream
+ * socket, straight to the destination or through a SOCKS5 UDP association,
+ * picked by findserver() like any connection, and a thread that sends the
+ * replies back and retires the flow once it has been quiet for UDPIDLE ms.
+ * Both directions move up to UDPBATCH datagrams per system call. */
+
+/* For recvmmsg() and sendmmsg(). */
+#define _GNU_SOURCE
+#include "transockproxy.h"
+#include <errno.h>
+#include <poll.h>
+
+/* A datagram that arrived while its flow was still being set up. */
+struct UdpPending {
+	struct UdpPending* next;
+	int len;
+	char data[];
+};
+
+struct UdpFlow {
+	struct UdpFlow* next;
+	struct sockaddr_in client;
+	struct sockaddr_in dest;
+	int refs;
+	struct Conn* c;		/* Route and activity, and the SOCKS5 association's TCP connection */
+	int sock;		/* Upstream, or -1 if there's no way through */
+	int reply;		/* What replies to the client are sent from */
+	unsigned char hdr[10];	/* SOCKS5 UDP request header */
+	int hdrlen;
+	/* Guarded by the shard lock */
+	int ready;
+	struct UdpPending* pending;
+	int npending;
+};
+
+struct UdpShard {
+	pthread_mutex_t lock;
+	struct UdpFlow* head;
+} __attribute__((aligned(64)));
+
+char* udpdest;
+
+static struct sockaddr_in fixeddest;
+static int udpsock = -1;
+static struct UdpShard shards[UDPSHARDS];
+static int flowcount = 0;
+static volatile int udpstopped = 0;
+
+static struct UdpShard* flowshard(const struct sockaddr_in* client, const struct sockaddr_in* dest) {
+	unsigned int hash = 2166136261U;
+	const unsigned char* p;
+	int x;
+
+	p = (const unsigned char*)&client->sin_addr;
+	for (x = 0; x < 4; x++) hash = (hash ^ p[x]) * 16777619U;
+	p = (const unsigned char*)&client->sin_port;
+	for (x = 0; x < 2; x++) hash = (hash ^ p[x]) * 16777619U;
+	p = (const unsigned char*)&dest->sin_addr;
+	for (x = 0; x < 4; x++) hash = (hash ^ p[x]) * 16777619U;
+	p = (const unsigned char*)&dest->sin_port;
+	for (x = 0; x < 2; x++) hash = (hash ^ p[x]) * 16777619U;
+	return &shards[hash % UDPSHARDS];
+}
+
+static int sameaddr(const struct sockaddr_in* a, const struct sockaddr_in* b) {
+	return a->sin_addr.s_addr == b->sin_addr.s_addr && a->sin_port == b->sin_port;
+}
+
+static void flowput(struct UdpFlow* f) {
+	struct UdpPending* p;
+
+	if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL)) return;
+	if (f->sock >= 0) close(f->sock);
+	if (f->reply >= 0 && f->reply != udpsock) close(f->reply);
+	while ((p = f->pending)) {
+		f->pending = p->next;
+		free(p);
+	}
+	connfree(f->c);
+	free(f);
+}
+
+/* Sets up the flow's way upstream. Leaves f->sock at -1 if there isn't one. */
+static void flowsetup(struct UdpFlow* f) {
+	struct Conn* c = f->c;
+	struct sockaddr_in relay;
+	const struct sockaddr_in* proxy = NULL;
+	unsigned long start = 0;
+	int rc;
+	#ifdef SO_BINDTODEVICE
+	struct ifreq ifr;
+	#endif
+
+	/* Replies must seem to come from where the client sent to; with TPROXY that takes a socket of our own bound there. */
+	f->reply = udpsock;
+	if (!fixeddest.sin_port) {
+		f->reply = socket(AF_INET, SOCK_DGRAM, 0);
+		rc = 1;
+		setsockopt(f->reply, SOL_IP, IP_TRANSPARENT, &rc, sizeof(rc));
+		setsockopt(f->reply, SOL_SOCKET, SO_REUSEADDR, &rc, sizeof(rc));
+		if (bind(f->reply, (struct sockaddr*)&f->dest, sizeof(f->dest))) {
+			warn("[udp] Could not bind to %s for replies: %m\n", c->host);
+			close(f->reply);
+			f->reply = udpsock;
+		}
+	}
+
+	switch (c->map->proto) {
+	case DIRECT:
+		f->sock = socket(AF_INET, SOCK_DGRAM, 0);
+		#ifdef SO_BINDTODEVICE
+		if (c->map->iface[0]) {
+			memset(&ifr, 0, sizeof(ifr));
+			strncpy(ifr.ifr_name, c->map->iface, IFNAMSIZ-1);
+			if (setsockopt(f->sock, SOL_SOCKET, SO_BINDTODEVICE, &ifr, sizeof(ifr))) {
+				warn("[udp] Could not bind to interface %s: %m\n", c->map->iface);
+			}
+		}
+		#endif
+		c->upstream = f->dest;
+		if (connect(f->sock, (struct sockaddr*)&f->dest, sizeof(f->dest))) {
+			warn("[udp] Could not connect to %s: %m\n", c->host);
+			close(f->sock);
+			f->sock = -1;
+		}
+		return;
+
+	case SOCKS5:
+		proxy = &c->map->proxy;
+		break;
+
+	case POOL:
+		c->via = poolpick(c->map->pool);
+		if (c->via->proto == SOCKS5) proxy = &c->via->addr;
+		break;
+
+	default:
+		break;
+	}
+	if (!proxy) {
+		log("[udp] No UDP through %s for %s, dropping its datagrams.\n", protonames[c->via ? c->via->proto : c->map->proto], c->host);
+		return;
+	}
+
+	start = ustime();
+	rc = socks5associate(c, proxy, &relay);
+	if (c->via) poolresult(c->via, rc || c->rejected, ustime() - start);
+	if (!rc) return;
+
+	f->sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (connect(f->sock, (struct sockaddr*)&relay, sizeof(relay))) {
+		warn("[udp] Could not connect to SOCKS5 relay for %s: %m\n", c->host);
+		close(f->sock);
+		f->sock = -1;
+		return;
+	}
+	/* RSV, FRAG, ATYP IPv4, then the destination. */
+	memset(f->hdr, 0, 3);
+	f->hdr[3] = 0x01;
+	memcpy(f->hdr + 4, &f->dest.sin_addr, 4);
+	memcpy(f->hdr + 8, &f->dest.sin_port, 2);
+	f->hdrlen = sizeof(f->hdr);
+}
+
+/* Relays replies back to the client until the flow goes quiet or its association drops. */
+static void* flowthread(void* arg) {
+	struct UdpFlow* f = (struct UdpFlow*)arg;
+	struct UdpShard* s = flowshard(&f->client, &f->dest);
+	struct UdpFlow** pf;
+	struct UdpPending* p;
+	struct UdpPending* pending;
+	struct mmsghdr in[UDPBATCH];
+	struct mmsghdr out[UDPBATCH];
+	struct iovec iniov[UDPBATCH];
+	struct iovec outiov[UDPBATCH][2];
+	struct pollfd fds[2];
+	char* bufs = (char*)malloc(UDPBATCH * UDPMAXSIZE);
+	unsigned long idle;
+	int nfds, n, m, x, off;
+
+	flowsetup(f);
+	pthread_mutex_lock(&s->lock);
+	f->ready = 1;
+	pending = f->pending;
+	f->pending = NULL;
+	f->npending = 0;
+	pthread_mutex_unlock(&s->lock);
+	while ((p = pending)) {
+		pending = p->next;
+		outiov[0][0].iov_base = f->hdr;
+		outiov[0][0].iov_len = f->hdrlen;
+		outiov[0][1].iov_base = p->data;
+		outiov[0][1].iov_len = p->len;
+		memset(&out[0], 0, sizeof(out[0]));
+		out[0].msg_hdr.msg_iov = outiov[0];
+		out[0].msg_hdr.msg_iovlen = 2;
+		if (f->sock < 0 || sendmsg(f->sock, &out[0].msg_hdr, 0) < 0) statadd(STAT_UDPDROPS, 1);
+		else statadd(STAT_UDPUP, 1);
+		free(p);
+	}
+
+	memset(in, 0, sizeof(in));
+	for (x = 0; x < UDPBATCH; x++) {
+		iniov[x].iov_base = bufs + x * UDPMAXSIZE;
+		iniov[x].iov_len = UDPMAXSIZE;
+		in[x].msg_hdr.msg_iov = &iniov[x];
+		in[x].msg_hdr.msg_iovlen = 1;
+	}
+	nfds = 0;
+	if (f->sock >= 0) {
+		fds[nfds].fd = f->sock;
+		fds[nfds++].events = POLLIN;
+	}
+	if (f->hdrlen) {
+		/* The association only lasts as long as its TCP connection. */
+		fds[nfds].fd = f->c->ssock;
+		fds[nfds++].events = POLLIN;
+	}
+
+	while (!udpstopped) {
+		idle = mstime() - f->c->lastactive;
+		if (idle >= UDPIDLE) break;
+		if (poll(fds, nfds, UDPIDLE - idle) <= 0) continue;
+		if (nfds > 1 && fds[1].revents) {
+			log("[udp] SOCKS5 association for %s closed.\n", f->c->host);
+			break;
+		}
+		if (!(fds[0].revents & POLLIN)) continue;
+
+		n = recvmmsg(f->sock, in, UDPBATCH, MSG_DONTWAIT, NULL);
+		if (n <= 0) continue;
+		for (x = 0, m = 0; x < n; x++) {
+			off = 0;
+			if (f->hdrlen) {
+				/* Only whole IPv4-addressed datagrams come back the way we sent them. */
+				if (in[x].msg_len < 10 || ((unsigned char*)iniov[x].iov_base)[2] || ((unsigned char*)iniov[x].iov_base)[3] != 0x01) {
+					statadd(STAT_UDPDROPS, 1);
+					continue;
+				}
+				off = 10;
+			}
+			memset(&out[m], 0, sizeof(out[m]));
+			outiov[m][0].iov_base = (char*)iniov[x].iov_base + off;
+			outiov[m][0].iov_len = in[x].msg_len - off;
+			out[m].msg_hdr.msg_iov = outiov[m];
+			out[m].msg_hdr.msg_iovlen = 1;
+			out[m].msg_hdr.msg_name = &f->client;
+			out[m].msg_hdr.msg_namelen = sizeof(f->client);
+			m++;
+		}
+		if (m) {
+			m = sendmmsg(f->reply, out, m, 0);
+			if (m > 0) statadd(STAT_UDPDOWN, m);
+		}
+		f->c->lastactive = mstime();
+	}
+
+	pthread_mutex_lock(&s->lock);
+	for (pf = &s->head; *pf != f; pf = &(*pf)->next);
+	*pf = f->next;
+	pthread_mutex_unlock(&s->lock);
+	__atomic_fetch_sub(&flowcount, 1, __ATOMIC_RELAXED);
+	log("[udp] Flow from %s:%hu to %s finished.\n", inet_ntoa(f->client.sin_addr), ntohs(f->client.sin_port), f->c->host);
+	flowput(f);
+	free(bufs);
+	return NULL;
+}
+
+/* Finds the flow for client and dest, starting one if there isn't one. Returns it with a reference held. */
+static struct UdpFlow* flowget(const struct sockaddr_in* client, const struct sockaddr_in* dest) {
+	struct UdpShard* s = flowshard(client, dest);
+	struct UdpFlow* f;
+	struct Conn* c;
+	pthread_t tid;
+	char host[32];
+
+	pthread_mutex_lock(&s->lock);
+	for (f = s->head; f; f = f->next) {
+		if (sameaddr(&f->client, client) && sameaddr(&f->dest, dest)) {
+			__atomic_fetch_add(&f->refs, 1, __ATOMIC_RELAXED);
+			pthread_mutex_unlock(&s->lock);
+			return f;
+		}
+	}
+
+	f = (struct UdpFlow*)calloc(1, sizeof(struct UdpFlow));
+	f->client = *client;
+	f->dest = *dest;
+	f->sock = f->reply = -1;
+	/* One for the table (given up by the flow's thread), one for the caller. */
+	f->refs = 2;
+	f->c = c = connprobe();
+	c->caddr = *client;
+	snprintf(host, sizeof(host), "%s", inet_ntoa(dest->sin_addr));
+	c->map = findserver(c->routes, host);
+	snprintf(host + strlen(host), sizeof(host) - strlen(host), ":%hu", ntohs(dest->sin_port));
+	c->host = strdup(host);
+	c->lastactive = mstime();
+	f->next = s->head;
+	s->head = f;
+	pthread_mutex_unlock(&s->lock);
+
+	__atomic_fetch_add(&flowcount, 1, __ATOMIC_RELAXED);
+	statadd(STAT_UDPFLOWS, 1);
+	log("[udp] New flow from %s:%hu to %s.\n", inet_ntoa(client->sin_addr), ntohs(client->sin_port), c->host);
+	pthread_create(&tid, NULL, flowthread, f);
+	pthread_detach(tid);
+	return f;
+}
+
+/* Sends a run of datagrams for one flow upstream, or holds on to them if it isn't set up yet. */
+static void flowsend(struct UdpFlow* f, struct mmsghdr* out, int n) {
+	struct UdpShard* s;
+	struct UdpPending** pp;
+	struct UdpPending* p;
+	int x, sent;
+
+	if (!__atomic_load_n(&f->ready, __ATOMIC_ACQUIRE)) {
+		s = flowshard(&f->client, &f->dest);
+		pthread_mutex_lock(&s->lock);
+		if (!f->ready) {
+			/* Onto the tail, so they go out in the order they came in. */
+			for (pp = &f->pending; *pp; pp = &(*pp)->next);
+			for (x = 0; x < n; x++) {
+				if (f->npending >= UDPBATCH) {
+					statadd(STAT_UDPDROPS, 1);
+					continue;
+				}
+				p = (struct UdpPending*)malloc(sizeof(struct UdpPending) + out[x].msg_hdr.msg_iov[1].iov_len);
+				p->len = out[x].msg_hdr.msg_iov[1].iov_len;
+				memcpy(p->data, out[x].msg_hdr.msg_iov[1].iov_base, p->len);
+				p->next = NULL;
+				*pp = p;
+				pp = &p->next;
+				f->npending++;
+			}
+			pthread_mutex_unlock(&s->lock);
+			return;
+		}
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	if (f->sock < 0) {
+		statadd(STAT_UDPDROPS, n);
+		return;
+	}
+	for (x = 0; x < n; x++) out[x].msg_hdr.msg_iov[0].iov_len = f->hdrlen;
+	for (x = 0; x < n; x += sent) {
+		sent = sendmmsg(f->sock, out + x, n - x, 0);
+		if (sent <= 0) {
+			statadd(STAT_UDPDROPS, n - x);
+			break;
+		}
+		statadd(STAT_UDPUP, sent);
+	}
+	f->c->lastactive = mstime();
+}
+
+/* Where the datagram was headed before TPROXY redirected it, or the fixed destination. Returns 0, or -1 if neither. */
+static int origdest(struct msghdr* mh, struct sockaddr_in* dest) {
+	struct cmsghdr* cmsg;
+
+	if (fixeddest.sin_port) {
+		*dest = fixeddest;
+		return 0;
+	}
+	for (cmsg = CMSG_FIRSTHDR(mh); cmsg; cmsg = CMSG_NXTHDR(mh, cmsg)) {
+		if (cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_ORIGDSTADDR) {
+			memcpy(dest, CMSG_DATA(cmsg), sizeof(*dest));
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void* udpthread(void* arg) {
+	struct mmsghdr in[UDPBATCH];
+	struct mmsghdr out[UDPBATCH];
+	struct iovec iniov[UDPBATCH];
+	struct iovec outiov[UDPBATCH][2];
+	struct sockaddr_in from[UDPBATCH];
+	struct sockaddr_in dest;
+	struct sockaddr_in local;
+	char control[UDPBATCH][CMSG_SPACE(sizeof(struct sockaddr_in))];
+	char* bufs = (char*)malloc(UDPBATCH * UDPMAXSIZE);
+	struct UdpFlow* cur = NULL;
+	struct pollfd pfd;
+	socklen_t len = sizeof(local);
+	int n, m, x;
+
+	getsockname(udpsock, (struct sockaddr*)&local, &len);
+	memset(in, 0, sizeof(in));
+	for (x = 0; x < UDPBATCH; x++) {
+		iniov[x].iov_base = bufs + x * UDPMAXSIZE;
+		iniov[x].iov_len = UDPMAXSIZE;
+		in[x].msg_hdr.msg_iov = &iniov[x];
+		in[x].msg_hdr.msg_iovlen = 1;
+		in[x].msg_hdr.msg_name = &from[x];
+		in[x].msg_hdr.msg_control = control[x];
+	}
+	pfd.fd = udpsock;
+	pfd.events = POLLIN;
+
+	while (!udpstopped) {
+		/* The socket may be shared with an upgraded process, so nothing here blocks for long. */
+		if (poll(&pfd, 1, 1000) <= 0) continue;
+		for (x = 0; x < UDPBATCH; x++) {
+			in[x].msg_hdr.msg_namelen = sizeof(from[x]);
+			in[x].msg_hdr.msg_controllen = sizeof(control[x]);
+		}
+		n = recvmmsg(udpsock, in, UDPBATCH, MSG_DONTWAIT, NULL);
+		if (n <= 0) continue;
+
+		/* Consecutive datagrams of the same flow go out in one sendmmsg(). */
+		for (x = 0, m = 0; x < n; x++) {
+			if ((in[x].msg_hdr.msg_flags & MSG_TRUNC) || origdest(&in[x].msg_hdr, &dest)
+				|| (sameaddr(&dest, &local) || (dest.sin_port == local.sin_port && !local.sin_addr.s_addr))) {
+				/* Too big, or sent to us without TPROXY: nowhere to send it but back here. */
+				statadd(STAT_UDPDROPS, 1);
+				continue;
+			}
+			if (cur && (!sameaddr(&cur->client, &from[x]) || !sameaddr(&cur->dest, &dest))) {
+				flowsend(cur, out, m);
+				flowput(cur);
+				cur = NULL;
+				m = 0;
+			}
+			if (!cur) cur = flowget(&from[x], &dest);
+			memset(&out[m], 0, sizeof(out[m]));
+			outiov[m][0].iov_base = cur->hdr;
+			outiov[m][1].iov_base = iniov[x].iov_base;
+			outiov[m][1].iov_len = in[x].msg_len;
+			out[m].msg_hdr.msg_iov = outiov[m];
+			out[m].msg_hdr.msg_iovlen = 2;
+			m++;
+		}
+		if (cur) {
+			flowsend(cur, out, m);
+			flowput(cur);
+			cur = NULL;
+		}
+	}
+	free(bufs);
+	return NULL;
+}
+
+/* Opens the UDP listener on addr, unless sock was inherited from an upgrade.
+ * Returns the socket, or -1. */
+int udpinit(const struct sockaddr_in* addr, int sock) {
+	struct addrinfo hints;
+	struct addrinfo* info;
+	char* host;
+	unsigned short port;
+	int rc, x;
+
+	if (udpdest) {
+		host = strdup(udpdest);
+		port = hostport(host, 0);
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+		rc = getaddrinfo(host, NULL, &hints, &info);
+		if (rc || !port) {
+			fprintf(stderr, "Could not resolve UDP destination %s: %s\n", udpdest, rc ? gai_strerror(rc) : "no port");
+			free(host);
+			return -1;
+		}
+		fixeddest = *(struct sockaddr_in*)info->ai_addr;
+		fixeddest.sin_port = htons(port);
+		freeaddrinfo(info);
+		free(host);
+	}
+
+	for (x = 0; x < UDPSHARDS; x++) pthread_mutex_init(&shards[x].lock, NULL);
+
+	if (sock <= 0) {
+		sock = socket(AF_INET, SOCK_DGRAM, 0);
+		if (sock < 0) {
+			perror("Could not open UDP socket");
+			return -1;
+		}
+		rc = 1;
+		setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &rc, sizeof(rc));
+		/* TPROXY needs this, and it needs CAP_NET_ADMIN; a fixed destination needs neither. */
+		if (setsockopt(sock, SOL_IP, IP_TRANSPARENT, &rc, sizeof(rc)) && !udpdest) {
+			fprintf(stderr, "Could not make UDP socket transparent (%m); only TPROXY'd datagrams can be relayed without a fixed destination.\n");
+		}
+		setsockopt(sock, SOL_IP, IP_RECVORIGDSTADDR, &rc, sizeof(rc));
+		if (bind(sock, (struct sockaddr*)addr, sizeof(*addr))) {
+			perror("Could not bind to UDP port");
+			close(sock);
+			return -1;
+		}
+	}
+	udpsock = sock;
+	return sock;
+}
+
+void udpstart() {
+	pthread_t tid;
+
+	pthread_create(&tid, NULL, udpthread, NULL);
+	pthread_detach(tid);
+}
+
+/* Stops taking new datagrams, after an upgrade. Flows carry on until they go quiet. */
+void udpstop() {
+	udpstopped = 1;
+}
+
+int udpflowcount() {
+	return __atomic_load_n(&flowcount, __ATOMIC_RELAXED);
+}
+
+
+
+/* EOF */
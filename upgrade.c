@@ -0,0 +1,252 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Binary upgrade. On SIGUSR2 the running process execs whatever binary is
+ * now at its own path, with one end of a socketpair as fd 3 and its number
+ * in the environment. The listening sockets (and the TLS ticket key) go
+ * over that socket with SCM_RIGHTS, so the new process accepts on the very
+ * same sockets and nothing is ever refused. Accept workers' own listeners
+ * follow the main ones, listen then SSL for each worker after the first.
+ * Once it says it's ready, the old process stops accepting and drains its relays. */
+
+#include "transockproxy.h"
+#include <errno.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define UPGRADEENV "TSPROXY_UPGRADE_FD"
+#define UPGRADEFDS 4
+#define UPGRADEEXTRA (2 * (MAXWORKERS - 1))
+
+struct UpgradeMsg {
+	int socks[UPGRADEFDS];	/* Which of lsock, sslsock, the stats socket and the UDP socket were sent, in that order. */
+	int extra[UPGRADEEXTRA];	/* Which workers' listeners were sent after them. */
+	int nextra;
+	int keysize;
+	unsigned char key[128];
+};
+
+extern char** environ;
+
+static char upgradepath[PATH_MAX];
+static char** upgradeargv;
+static pid_t upgradepid;
+static int upgradefd = -1;
+
+/* Remembers how we were started, while the working directory still means what it did. */
+void upgradeinit(char** argv) {
+	ssize_t len = readlink("/proc/self/exe", upgradepath, sizeof(upgradepath)-1);
+
+	upgradeargv = argv;
+	if (strchr(argv[0], '/') && realpath(argv[0], upgradepath)) return;
+	/* Found through $PATH, or no realpath(): the running binary is the best we have. */
+	upgradepath[len > 0 ? len : 0] = 0;
+}
+
+/* Called at startup. If we were exec'd by an upgrade, takes over the old
+ * process's sockets and returns 1; otherwise the caller binds its own. */
+int upgradeinherit(int* lsock, int* sslsock, int* statssock, int* udpsock, int* extra, int* nextra) {
+	struct UpgradeMsg msg;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr* cmsg;
+	char control[CMSG_SPACE((UPGRADEFDS + UPGRADEEXTRA) * sizeof(int))];
+	int fds[UPGRADEFDS + UPGRADEEXTRA];
+	int* socks[UPGRADEFDS] = { lsock, sslsock, statssock, udpsock };
+	const char* env = getenv(UPGRADEENV);
+	int fd, nfds, x, n;
+
+	*nextra = 0;
+	if (!env) return 0;
+	fd = atoi(env);
+	unsetenv(UPGRADEENV);
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+
+	if (recvmsg(fd, &mh, 0) != sizeof(msg)) {
+		fprintf(stderr, "Could not receive sockets from the old process: %m\n");
+		exit(2);
+	}
+	cmsg = CMSG_FIRSTHDR(&mh);
+	nfds = 0;
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+		nfds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		memcpy(fds, CMSG_DATA(cmsg), nfds * sizeof(int));
+	}
+
+	for (x = 0, n = 0; x < UPGRADEFDS; x++) {
+		if (!msg.socks[x]) continue;
+		if (n >= nfds) {
+			fprintf(stderr, "Old process sent fewer sockets than it said.\n");
+			exit(2);
+		}
+		*socks[x] = fds[n++];
+	}
+	*nextra = msg.nextra < UPGRADEEXTRA ? msg.nextra : UPGRADEEXTRA;
+	for (x = 0; x < *nextra; x++) {
+		if (!msg.extra[x]) {
+			extra[x] = 0;
+			continue;
+		}
+		if (n >= nfds) {
+			fprintf(stderr, "Old process sent fewer sockets than it said.\n");
+			exit(2);
+		}
+		extra[x] = fds[n++];
+	}
+
+	#ifdef GNUTLS
+	if (msg.keysize) gnutlssetticketkey(msg.key, msg.keysize);
+	#endif
+
+	/* Keep the channel open: upgradeready() reports back over it. */
+	upgradefd = fd;
+	printf("Took over %d listening socket%s from the old process.\n", nfds, nfds == 1 ? "" : "s");
+	return 1;
+}
+
+/* Tells the old process we're accepting, so it can stop. */
+void upgradeready() {
+	if (upgradefd < 0) return;
+	write(upgradefd, "R", 1);
+	close(upgradefd);
+	upgradefd = -1;
+}
+
+/* Starts the new binary and hands it our sockets. Returns the descriptor
+ * the new process will report back on, or -1 if the upgrade didn't start.
+ * The caller keeps accepting until that becomes readable. */
+int upgradestart(int lsock, int sslsock, int statssock, int udpsock, const int* extra, int nextra) {
+	struct UpgradeMsg msg;
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr* cmsg;
+	char control[CMSG_SPACE((UPGRADEFDS + UPGRADEEXTRA) * sizeof(int))];
+	int socks[UPGRADEFDS] = { lsock, sslsock, statssock, udpsock };
+	int fds[UPGRADEFDS + UPGRADEEXTRA];
+	char** envp;
+	char envfd[32];
+	int sv[2];
+	int x, n, nfds;
+
+	if (upgradepid > 0) {
+		warn("Upgrade already in progress.\n");
+		return -1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		warn("Could not create upgrade socket: %m\n");
+		return -1;
+	}
+
+	/* Only async-signal-safe calls are allowed after fork(), so the environment is built here. */
+	for (n = 0; environ[n]; n++);
+	envp = (char**)calloc(n + 2, sizeof(char*));
+	for (x = 0, n = 0; environ[x]; x++) {
+		if (strncmp(environ[x], UPGRADEENV "=", sizeof(UPGRADEENV))) envp[n++] = environ[x];
+	}
+	snprintf(envfd, sizeof(envfd), UPGRADEENV "=3");
+	envp[n] = envfd;
+
+	log("Upgrading to %s.\n", upgradepath);
+	logflush();
+	upgradepid = fork();
+	if (upgradepid < 0) {
+		warn("Could not fork for upgrade: %m\n");
+		free(envp);
+		close(sv[0]);
+		close(sv[1]);
+		upgradepid = 0;
+		return -1;
+	}
+	if (upgradepid == 0) {
+		/* Nothing but the channel (and stdio) may leak into the new process, or
+		 * it would hold our client sockets open after we close them. */
+		dup2(sv[1], 3);
+		if (syscall(SYS_close_range, 4, ~0U, 0)) {
+			for (x = 4; x < sysconf(_SC_OPEN_MAX); x++) close(x);
+		}
+		execve(upgradepath, upgradeargv, envp);
+		_exit(127);
+	}
+	free(envp);
+	close(sv[1]);
+
+	memset(&msg, 0, sizeof(msg));
+	for (x = 0, nfds = 0; x < UPGRADEFDS; x++) {
+		if (socks[x] <= 0) continue;
+		msg.socks[x] = 1;
+		fds[nfds++] = socks[x];
+	}
+	msg.nextra = nextra < UPGRADEEXTRA ? nextra : UPGRADEEXTRA;
+	for (x = 0; x < msg.nextra; x++) {
+		if (extra[x] <= 0) continue;
+		msg.extra[x] = 1;
+		fds[nfds++] = extra[x];
+	}
+	#ifdef GNUTLS
+	msg.keysize = gnutlsgetticketkey(msg.key, sizeof(msg.key));
+	#endif
+
+	memset(&mh, 0, sizeof(mh));
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (nfds) {
+		mh.msg_control = control;
+		mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg = CMSG_FIRSTHDR(&mh);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+		memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+	if (sendmsg(sv[0], &mh, MSG_NOSIGNAL) != sizeof(msg)) {
+		warn("Could not hand sockets to new process %d: %m\n", upgradepid);
+		upgradefinish(sv[0]);
+		return -1;
+	}
+	return sv[0];
+}
+
+/* Called once the descriptor from upgradestart() is readable. Returns 1
+ * if the new process is up and we should stop accepting. */
+int upgradefinish(int fd) {
+	char c = 0;
+	int rc;
+
+	do {
+		rc = read(fd, &c, 1);
+	} while (rc < 0 && errno == EINTR);
+	close(fd);
+
+	if (rc == 1 && c == 'R') {
+		log("New process %d is accepting, draining connections.\n", upgradepid);
+		return 1;
+	}
+	warn("Upgrade failed, new process %d exited before it was ready. Still running.\n", upgradepid);
+	waitpid(upgradepid, NULL, WNOHANG);
+	upgradepid = 0;
+	return 0;
+}
+
+
+
+/* EOF */
@@ -0,0 +1,192 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Upstream certificate verification. Every TLS connection we make upstream
+ * has its chain checked against the trust store (ssltrust, or the system's)
+ * and its name against the host we meant to reach. Chain building and the
+ * signature checks are most of a handshake's cost on our side, and most
+ * connections go to origins we've just checked, so results are remembered
+ * by the leaf's SHA-256 and the host name: until the leaf expires or
+ * VERIFYTTL seconds pass for a good result, VERIFYFAILTTL for a bad one. */
+
+#include "transockproxy.h"
+#include <time.h>
+#include <gnutls/crypto.h>
+
+struct VerifyEntry {
+	struct VerifyEntry* next;
+	unsigned char fp[32];
+	char* host;
+	unsigned int status;
+	time_t expires;
+};
+
+struct VerifyShard {
+	pthread_mutex_t lock;
+	struct VerifyEntry* head;
+} __attribute__((aligned(64)));
+
+int sslverify = 1;
+char* ssltrust = NULL;
+int verifycachesize = VERIFYCACHE;
+
+static struct VerifyShard shards[VERIFYSHARDS];
+
+static struct VerifyShard* verifyshard(const unsigned char* fp, const char* host) {
+	unsigned int h = 2166136261u;
+	int x;
+
+	for (x = 0; x < 32; x++) h = (h ^ fp[x]) * 16777619u;
+	for (; *host; host++) h = (h ^ (unsigned char)*host) * 16777619u;
+	return &shards[h % VERIFYSHARDS];
+}
+
+static void verifyentryfree(struct VerifyEntry* e) {
+	free(e->host);
+	free(e);
+}
+
+/* Returns 1 with the remembered status, or 0 if fp and host haven't been checked lately. */
+static int verifylookup(const unsigned char* fp, const char* host, unsigned int* status) {
+	struct VerifyShard* s = verifyshard(fp, host);
+	struct VerifyEntry* e;
+	time_t now = time(NULL);
+	int found = 0;
+
+	pthread_mutex_lock(&s->lock);
+	for (e = s->head; e; e = e->next) {
+		if (memcmp(e->fp, fp, 32) || strcmp(e->host, host)) continue;
+		if (e->expires > now) {
+			*status = e->status;
+			found = 1;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&s->lock);
+	return found;
+}
+
+static void verifystore(const unsigned char* fp, const char* host, unsigned int status, const gnutls_datum_t* der) {
+	struct VerifyShard* s = verifyshard(fp, host);
+	struct VerifyEntry* e;
+	struct VerifyEntry** pe;
+	gnutls_x509_crt_t crt;
+	time_t now = time(NULL);
+	time_t expires = now + (status ? VERIFYFAILTTL : VERIFYTTL);
+	time_t notafter;
+	int max = verifycachesize / VERIFYSHARDS;
+	int x;
+
+	if (max < 1) return;
+	if (!gnutls_x509_crt_init(&crt)) {
+		if (!gnutls_x509_crt_import(crt, der, GNUTLS_X509_FMT_DER)) {
+			notafter = gnutls_x509_crt_get_expiration_time(crt);
+			if (notafter != (time_t)-1 && notafter < expires) expires = notafter;
+		}
+		gnutls_x509_crt_deinit(crt);
+	}
+	if (expires <= now) return;
+
+	e = (struct VerifyEntry*)malloc(sizeof(struct VerifyEntry));
+	memcpy(e->fp, fp, 32);
+	e->host = strdup(host);
+	e->status = status;
+	e->expires = expires;
+
+	pthread_mutex_lock(&s->lock);
+	/* Drops the old result for the same pair, anything expired, and past max the oldest. */
+	e->next = s->head;
+	s->head = e;
+	for (pe = &e->next, x = 1; *pe; ) {
+		struct VerifyEntry* old = *pe;
+		if (x >= max || old->expires <= now || (!memcmp(old->fp, fp, 32) && !strcmp(old->host, host))) {
+			*pe = old->next;
+			verifyentryfree(old);
+			continue;
+		}
+		pe = &old->next;
+		x++;
+	}
+	pthread_mutex_unlock(&s->lock);
+}
+
+/* GnuTLS's verify callback for upstream sessions; gnutlsdial() leaves the host in the session's ptr. */
+int verifycert(gnutls_session_t session) {
+	const char* host = (const char*)gnutls_session_get_ptr(session);
+	const gnutls_datum_t* certs;
+	unsigned int ncerts = 0;
+	unsigned int status;
+	unsigned char fp[32];
+	unsigned long start;
+	gnutls_datum_t out;
+	int rc;
+
+	if (!sslverify) return 0;
+	if (!host) host = "";
+	certs = gnutls_certificate_get_peers(session, &ncerts);
+	if (!certs || !ncerts) {
+		warn("[GnuTLS] %s sent no certificate.\n", host);
+		statadd(STAT_VERIFYFAILS, 1);
+		return GNUTLS_E_CERTIFICATE_ERROR;
+	}
+
+	start = ustime();
+	gnutls_hash_fast(GNUTLS_DIG_SHA256, certs[0].data, certs[0].size, fp);
+	if (verifylookup(fp, host, &status)) {
+		statadd(STAT_VERIFYCACHED, 1);
+		statadd(STAT_VERIFYCACHEDUS, ustime() - start);
+	} else {
+		rc = gnutls_certificate_verify_peers3(session, *host ? host : NULL, &status);
+		if (rc < 0) status = GNUTLS_CERT_INVALID;
+		verifystore(fp, host, status, &certs[0]);
+		statadd(STAT_VERIFYCHECKED, 1);
+		statadd(STAT_VERIFYCHECKEDUS, ustime() - start);
+	}
+	if (!status) return 0;
+
+	statadd(STAT_VERIFYFAILS, 1);
+	if (loglevel >= LOG_WARN && !gnutls_certificate_verification_status_print(status, GNUTLS_CRT_X509, &out, 0)) {
+		warn("[GnuTLS] Certificate for %s not trusted: %s\n", host, out.data);
+		gnutls_free(out.data);
+	}
+	return GNUTLS_E_CERTIFICATE_VERIFICATION_ERROR;
+}
+
+/* Loads the trust store. Returns 0, or -1 if ssltrust couldn't be read. */
+int verifyinit(gnutls_certificate_credentials_t cred) {
+	int rc;
+	int x;
+
+	for (x = 0; x < VERIFYSHARDS; x++) pthread_mutex_init(&shards[x].lock, NULL);
+	if (!sslverify) {
+		warn("[GnuTLS] Upstream certificates are not being verified.\n");
+		return 0;
+	}
+	if (ssltrust) {
+		rc = gnutls_certificate_set_x509_trust_file(cred, ssltrust, GNUTLS_X509_FMT_PEM);
+		if (rc <= 0) {
+			warn("[GnuTLS] Error loading trusted certificates from %s: %s\n", ssltrust, rc ? gnutls_strerror(rc) : "none found");
+			return -1;
+		}
+	} else {
+		rc = gnutls_certificate_set_x509_system_trust(cred);
+		if (rc <= 0) warn("[GnuTLS] No system trusted certificates found; every upstream certificate will be refused.\n");
+	}
+	log("[GnuTLS] Verifying upstream certificates against %d trusted certificates.\n", rc);
+	return 0;
+}
+
+
+
+/* EOF */
@@ -0,0 +1,326 @@
+/*
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, version 2 of the License only.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <http://www.gnu.org/licenses/>.
+    */
+
+/* Accept workers, one per CPU (the workers and cpus config lines). Each is
+ * pinned to its CPU and accepts on listeners of its own, all SO_REUSEPORT
+ * on the same ports, and a reuseport BPF program hands each new connection
+ * to the listener of the CPU its packets arrived on. Connection threads
+ * inherit the worker's affinity, and take their buffers from a pool kept
+ * per NUMA node, first touched on that node, so a connection's packets,
+ * thread and buffers all stay in one place.
+ *
+ * Worker 0 uses the main listeners; the others' are handed over on an
+ * upgrade like them. Without workers, the main thread accepts as before. */
+
+#define _GNU_SOURCE
+#include "transockproxy.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/filter.h>
+
+struct Worker {
+	int cpu;
+	int node;
+	int lsock;
+	int sslsock;
+	pthread_t tid;
+};
+
+/* Free buffers of one node, and where they came from. */
+struct BufPool {
+	pthread_mutex_t lock;
+	void* head;
+} __attribute__((aligned(64)));
+
+int workerthreads = 0;
+char* workercpus = NULL;
+__thread int workerid = -1;
+
+static struct Worker* workerlist;
+static int nworkers = 0;
+static int stopfd = -1;
+static struct BufPool pools[MAXNODES];
+
+/* The NUMA node cpu is on, from sysfs the first time (0 if it doesn't say). */
+int cpunode(int cpu) {
+	static int nodes[MAXCPUS];	/* node + 1, or 0 if not looked up yet */
+	char path[64];
+	struct dirent* de;
+	DIR* dir;
+	int node = 0;
+
+	if (cpu < 0 || cpu >= MAXCPUS) return 0;
+	if (nodes[cpu]) return nodes[cpu] - 1;
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	dir = opendir(path);
+	if (dir) {
+		while ((de = readdir(dir))) {
+			if (!strncmp(de->d_name, "node", 4) && de->d_name[4] >= '0' && de->d_name[4] <= '9') {
+				node = atoi(de->d_name + 4) % MAXNODES;
+				break;
+			}
+		}
+		closedir(dir);
+	}
+	__atomic_store_n(&nodes[cpu], node + 1, __ATOMIC_RELAXED);
+	return node;
+}
+
+/* Fills cpus from the cpus line ("0-7,16-23"), or the CPUs we may run on. Returns how many. */
+static int parsecpus(int* cpus, int max) {
+	cpu_set_t set;
+	char* list;
+	char* tok;
+	char* save;
+	int n = 0;
+	int x, lo, hi;
+
+	if (!workercpus) {
+		CPU_ZERO(&set);
+		if (sched_getaffinity(0, sizeof(set), &set)) return 0;
+		for (x = 0; x < CPU_SETSIZE && n < max; x++) if (CPU_ISSET(x, &set)) cpus[n++] = x;
+		return n;
+	}
+	list = strdup(workercpus);
+	for (tok = strtok_r(list, ", \t", &save); tok && n < max; tok = strtok_r(NULL, ", \t", &save)) {
+		lo = hi = atoi(tok);
+		if (strchr(tok, '-')) hi = atoi(strchr(tok, '-') + 1);
+		for (x = lo; x <= hi && n < max; x++) cpus[n++] = x;
+	}
+	free(list);
+	return n;
+}
+
+static int workerlisten(const struct sockaddr_in* addr) {
+	int sock = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+
+	if (sock < 0) return -1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+	if (bind(sock, (const struct sockaddr*)addr, sizeof(*addr)) || listen(sock, listenbacklog)) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* Steers each connection to the listener at the index of the CPU it arrived
+ * on, the order the listeners joined the group in; other CPUs go by modulo. */
+static void workersteer(int sock) {
+	struct sock_filter code[2 * MAXWORKERS + 3];
+	struct sock_fprog prog;
+	int n = 0;
+	int x;
+
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+	for (x = 0; x < nworkers; x++) {
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, workerlist[x].cpu, 0, 1);
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, x);
+	}
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, nworkers);
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+	prog.len = n;
+	prog.filter = code;
+	if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)))
+		fprintf(stderr, "Could not attach reuseport program, connections will be spread by hash: %m\n");
+}
+
+/* Sets up the workers' listeners. lsock and sslsock are the main ones, extra
+ * what an upgrade handed over besides them (listen then SSL, per worker after
+ * the first). Returns 0, or -1 if there are to be no workers after all. */
+int workerinit(int lsock, int sslsock, const struct sockaddr_in* laddr, const struct sockaddr_in* ssladdr, int* extra, int nextra) {
+	int cpus[MAXWORKERS];
+	int ncpus, x, e = 0;
+	int* socks[2];
+	int* sock;
+	int y;
+
+	ncpus = workerthreads ? parsecpus(cpus, MAXWORKERS) : 0;
+	if (workerthreads && ncpus <= 0) fprintf(stderr, "No CPUs to put workers on, accepting on one thread.\n");
+	if (ncpus <= 0) {
+		/* Any listeners the old process's workers had are left to the main ones. */
+		for (; e < nextra; e++) if (extra[e] > 0) close(extra[e]);
+		workerthreads = 0;
+		return -1;
+	}
+	for (x = 0; x < MAXNODES; x++) pthread_mutex_init(&pools[x].lock, NULL);
+	nworkers = workerthreads < 0 || workerthreads > ncpus ? ncpus : workerthreads;
+	workerlist = (struct Worker*)calloc(nworkers, sizeof(struct Worker));
+	for (x = 0; x < nworkers; x++) {
+		workerlist[x].cpu = cpus[x];
+		workerlist[x].node = cpunode(cpus[x]);
+		socks[0] = &workerlist[x].lsock;
+		socks[1] = &workerlist[x].sslsock;
+		if (!x) {
+			workerlist[x].lsock = lsock;
+			workerlist[x].sslsock = sslsock;
+			continue;
+		}
+		for (y = 0; y < 2; y++) {
+			sock = socks[y];
+			if (e < nextra) *sock = extra[e++];
+			else if (y == 0 && lsock) *sock = workerlisten(laddr);
+			else if (y == 1 && sslsock) *sock = workerlisten(ssladdr);
+			/* Taken over from a process without workers: share the main listener. */
+			if (*sock <= 0) *sock = y ? sslsock : lsock;
+			else if (*sock) fcntl(*sock, F_SETFL, fcntl(*sock, F_GETFL) | O_NONBLOCK);
+		}
+	}
+	/* Listeners an upgrade handed over that there's no worker for any more. */
+	for (; e < nextra; e++) if (extra[e] > 0) close(extra[e]);
+
+	for (x = 0; x < nworkers; x++) {
+		if (workerlist[x].lsock) setsockopt(workerlist[x].lsock, SOL_SOCKET, SO_INCOMING_CPU, &workerlist[x].cpu, sizeof(int));
+		if (workerlist[x].sslsock) setsockopt(workerlist[x].sslsock, SOL_SOCKET, SO_INCOMING_CPU, &workerlist[x].cpu, sizeof(int));
+	}
+	if (lsock) workersteer(lsock);
+	if (sslsock) workersteer(sslsock);
+	printf("Accepting on %d worker%s, pinned to CPUs", nworkers, nworkers == 1 ? "" : "s");
+	for (x = 0; x < nworkers; x++) printf("%s%d", x ? "," : " ", workerlist[x].cpu);
+	printf(".\n");
+	return 0;
+}
+
+/* Pins the calling thread to worker id's CPU. */
+void workerpin(int id) {
+	cpu_set_t set;
+
+	if (!nworkers) return;
+	id %= nworkers;
+	CPU_ZERO(&set);
+	CPU_SET(workerlist[id].cpu, &set);
+	pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+	workerid = id;
+}
+
+/* The node worker id is on, or -1. */
+int workernode(int id) {
+	return id >= 0 && id < nworkers ? workerlist[id].node : -1;
+}
+
+static void* workerthread(void* arg) {
+	struct Worker* w = (struct Worker*)arg;
+	fd_set fds;
+	fd_set rfds;
+	int rc;
+
+	workerpin(w - workerlist);
+	FD_ZERO(&fds);
+	FD_SET(stopfd, &fds);
+	if (w->lsock) FD_SET(w->lsock, &fds);
+	if (w->sslsock) FD_SET(w->sslsock, &fds);
+	while (1) {
+		rfds = fds;
+		rc = select(FD_SETSIZE, &rfds, NULL, NULL, NULL);
+		if (rc < 0 && errno == EINTR) continue;
+		if (rc < 0 || FD_ISSET(stopfd, &rfds)) break;
+		/* Out of descriptors, most likely; the main thread would give up, a worker waits for some to close. */
+		if (w->lsock && FD_ISSET(w->lsock, &rfds) && acceptconn(w->lsock, 0)) usleep(100000);
+		if (w->sslsock && FD_ISSET(w->sslsock, &rfds) && acceptconn(w->sslsock, 1)) usleep(100000);
+	}
+	return NULL;
+}
+
+void workerstart() {
+	int x;
+
+	if (!nworkers) return;
+	stopfd = eventfd(0, EFD_CLOEXEC);
+	for (x = 0; x < nworkers; x++) pthread_create(&workerlist[x].tid, NULL, workerthread, &workerlist[x]);
+}
+
+/* Stops accepting, and closes the listeners that aren't the main ones. */
+void workerstop() {
+	unsigned long one = 1;
+	int x;
+
+	if (!nworkers || stopfd < 0) return;
+	write(stopfd, &one, sizeof(one));
+	for (x = 0; x < nworkers; x++) pthread_join(workerlist[x].tid, NULL);
+	for (x = 1; x < nworkers; x++) {
+		if (workerlist[x].lsock && workerlist[x].lsock != workerlist[0].lsock) close(workerlist[x].lsock);
+		if (workerlist[x].sslsock && workerlist[x].sslsock != workerlist[0].sslsock) close(workerlist[x].sslsock);
+	}
+	close(stopfd);
+	stopfd = -1;
+}
+
+/* The listeners besides the main ones, in the order workerinit() takes them back. */
+int workersockets(int* out, int max) {
+	int n = 0;
+	int x;
+
+	for (x = 1; x < nworkers && n + 2 <= max; x++) {
+		out[n++] = workerlist[x].lsock != workerlist[0].lsock ? workerlist[x].lsock : 0;
+		out[n++] = workerlist[x].sslsock != workerlist[0].sslsock ? workerlist[x].sslsock : 0;
+	}
+	return n;
+}
+
+int workercount() {
+	return nworkers;
+}
+
+/* A BUFFERSIZE buffer for a connection on node (-1 without workers). Pooled
+ * buffers are carved out of slabs first touched by a thread pinned to the
+ * node, so their pages are the node's own, and only ever go back to it. */
+char* bufget(int node) {
+	struct BufPool* p;
+	char* buf;
+	char* slab;
+	int x;
+
+	if (node < 0) return (char*)malloc(BUFFERSIZE);
+	p = &pools[node];
+	pthread_mutex_lock(&p->lock);
+	if (!p->head) {
+		slab = (char*)mmap(NULL, BUFFERSIZE * BUFSLAB, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (slab == MAP_FAILED) {
+			pthread_mutex_unlock(&p->lock);
+			return (char*)malloc(BUFFERSIZE);
+		}
+		memset(slab, 0, BUFFERSIZE * BUFSLAB);
+		for (x = 0; x < BUFSLAB; x++) {
+			*(void**)(slab + x * BUFFERSIZE) = p->head;
+			p->head = slab + x * BUFFERSIZE;
+		}
+	}
+	buf = (char*)p->head;
+	p->head = *(void**)buf;
+	pthread_mutex_unlock(&p->lock);
+	return buf;
+}
+
+void bufput(int node, char* buf) {
+	struct BufPool* p;
+
+	if (!buf) return;
+	if (node < 0) {
+		free(buf);
+		return;
+	}
+	p = &pools[node];
+	pthread_mutex_lock(&p->lock);
+	*(void**)buf = p->head;
+	p->head = buf;
+	pthread_mutex_unlock(&p->lock);
+}
+
+
+/* EOF */